@@ -0,0 +1,102 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+// Shared by the microbenchmarks. Include it from the benchmark's only
+// translation unit: it replaces the global operator new to count heap
+// allocations.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+inline std::atomic<size_t> g_allocations{0};
+
+void *operator new(size_t n) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(n)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// keeps the optimizer from dropping a computation whose result is unused
+template <class T> inline void bench_keep(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct bench_result {
+  std::string m_name;
+  size_t m_iterations;
+  double m_ns_per_op;
+  double m_allocs_per_op;
+};
+
+// Results of one benchmark program, printed as a table or, with -j, as one
+// JSON object per line: {"bench":..,"name":..,"iterations":..,
+// "ns_per_op":..,"allocs_per_op":..}, which bench/run.sh collects.
+struct bench_report {
+  std::string_view m_bench;
+  size_t m_iterations;
+  bool m_json = false;
+
+  // bench_xxx [-j] [iterations]
+  bench_report(std::string_view bench, size_t iterations, int argc,
+               char **argv)
+      : m_bench(bench), m_iterations(iterations) {
+    int opt;
+    while ((opt = getopt(argc, argv, "j")) != -1) {
+      if (opt != 'j') {
+        fmt::print(stderr, "usage: {} [-j] [iterations]\n", argv[0]);
+        std::exit(1);
+      }
+      m_json = true;
+    }
+    if (optind < argc) {
+      m_iterations = std::strtoul(argv[optind], nullptr, 10);
+    }
+  }
+
+  // times `iterations` calls of op(i)
+  template <class Op> void run(std::string_view name, Op &&op) {
+    run(name, m_iterations, op);
+  }
+
+  template <class Op>
+  void run(std::string_view name, size_t iterations, Op &&op) {
+    size_t allocs_before = g_allocations.load();
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+      op(i);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    size_t allocs = g_allocations.load() - allocs_before;
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    print({std::string(name), iterations, ns / double(iterations),
+           double(allocs) / double(iterations)});
+  }
+
+  void print(const bench_result &r) const {
+    if (m_json) {
+      fmt::print("{{\"bench\":\"{}\",\"name\":\"{}\",\"iterations\":{},"
+                 "\"ns_per_op\":{:.2f},\"allocs_per_op\":{:.3f}}}\n",
+                 m_bench, r.m_name, r.m_iterations, r.m_ns_per_op,
+                 r.m_allocs_per_op);
+    } else {
+      fmt::print("{:<44} {:>9.1f} ns/op {:>7.2f} allocs/op\n", r.m_name,
+                 r.m_ns_per_op, r.m_allocs_per_op);
+    }
+  }
+};
+
+#endif // BENCH_HPP
@@ -0,0 +1,303 @@
+// Closed-loop load against a running server. Reports requests/s and the
+// p50/p99/p99.9 latency of requests sent after the warm-up, in one of
+// three modes:
+//
+//   keepalive  one request in flight per connection
+//   pipeline   -p requests in flight per connection
+//   close      a new connection per request, latency includes connect
+//
+//   bench_loopback [-m mode] [-p depth] [-t threads] [-c connections]
+//                  [-d seconds] [-w warmup] [-u target] [-j] [host] [port]
+//
+// Without -u the request is a small POST to the echo route. -j prints one
+// JSON object instead of text.
+
+#include "io_context.hpp"
+#include "metrics.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+enum class bench_mode { keepalive, pipeline, close };
+
+struct bench_options {
+  bench_mode m_mode = bench_mode::keepalive;
+  std::string_view m_mode_name = "keepalive";
+  int m_depth = 1;
+  int m_threads = 1;
+  int m_conns = 64;
+  int m_seconds = 5;
+  int m_warmup = 1;
+  std::string m_request;
+  bool m_json = false;
+  std::string m_host = "127.0.0.1";
+  std::string m_port = "8080";
+};
+
+struct bench_conn {
+  int m_fd = -1;
+  std::string m_in;
+  // send times of the requests in flight, oldest at m_head
+  std::vector<bench_clock::time_point> m_sent;
+  size_t m_head = 0;
+  size_t m_inflight = 0;
+};
+
+// what one thread measured; counts only after the warm-up
+struct bench_totals {
+  size_t m_completed = 0;
+  log_histogram m_latency;
+};
+
+// returns the length of the first complete response in `in`, or 0
+static size_t response_length(std::string_view in) {
+  size_t header_end = in.find("\r\n\r\n");
+  if (header_end == std::string_view::npos) {
+    return 0;
+  }
+  size_t body_len = 0;
+  for (std::string_view key : {"Content-length: ", "Content-Length: "}) {
+    size_t pos = in.find(key);
+    if (pos != std::string_view::npos && pos < header_end) {
+      body_len = std::strtoul(in.data() + pos + key.size(), nullptr, 10);
+      break;
+    }
+  }
+  size_t total = header_end + 4 + body_len;
+  return in.size() >= total ? total : 0;
+}
+
+struct bench_thread {
+  const bench_options &m_opts;
+  address_resolver::address_info m_entry;
+  int m_epfd;
+  std::vector<bench_conn> m_conns;
+
+  bench_thread(const bench_options &opts, address_resolver::address_info entry,
+               int nconns)
+      : m_opts(opts), m_entry(entry),
+        m_epfd(CHECK_CALL(epoll_create1, 0)), m_conns(nconns) {
+    for (auto &conn : m_conns) {
+      conn.m_sent.resize(opts.m_depth);
+    }
+  }
+
+  ~bench_thread() {
+    for (auto &conn : m_conns) {
+      if (conn.m_fd != -1) {
+        close(conn.m_fd);
+      }
+    }
+    close(m_epfd);
+  }
+
+  void send(bench_conn &conn) {
+    size_t slot = (conn.m_head + conn.m_inflight) % conn.m_sent.size();
+    conn.m_sent[slot] = bench_clock::now();
+    conn.m_inflight++;
+    CHECK_CALL(write, conn.m_fd, m_opts.m_request.data(),
+               m_opts.m_request.size());
+  }
+
+  // for pipelining, the first `depth` requests go out in one write
+  void open(bench_conn &conn) {
+    auto start = bench_clock::now();
+    conn.m_fd = m_entry.create_socket();
+    if (m_opts.m_mode == bench_mode::close) {
+      // reset on close: a long run would otherwise fill the ephemeral port
+      // range with TIME_WAIT sockets
+      struct linger lg = {1, 0};
+      setsockopt(conn.m_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    auto addr = m_entry.get_address();
+    CHECK_CALL(connect, conn.m_fd, addr.m_addr, addr.m_addrlen);
+    int on = 1;
+    setsockopt(conn.m_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &conn;
+    CHECK_CALL(epoll_ctl, m_epfd, EPOLL_CTL_ADD, conn.m_fd, &event);
+    conn.m_in.clear();
+    conn.m_head = 0;
+    conn.m_inflight = 0;
+    std::string burst;
+    for (int i = 0; i < m_opts.m_depth; i++) {
+      burst += m_opts.m_request;
+      conn.m_sent[static_cast<size_t>(i)] = start;
+    }
+    conn.m_inflight = static_cast<size_t>(m_opts.m_depth);
+    CHECK_CALL(write, conn.m_fd, burst.data(), burst.size());
+  }
+
+  void reopen(bench_conn &conn) {
+    close(conn.m_fd); // also removes it from the epoll set
+    open(conn);
+  }
+
+  void run(std::atomic<bool> &measuring, std::atomic<bool> &stop,
+           bench_totals &totals) {
+    for (auto &conn : m_conns) {
+      open(conn);
+    }
+    char buf[16384];
+    struct epoll_event events[64];
+    while (!stop.load(std::memory_order_relaxed)) {
+      int n = CHECK_CALL_EXCEPT(EINTR, epoll_wait, m_epfd, events, 64, 100);
+      bool counting = measuring.load(std::memory_order_relaxed);
+      for (int i = 0; i < n; i++) {
+        auto &conn = *static_cast<bench_conn *>(events[i].data.ptr);
+        ssize_t len = read(conn.m_fd, buf, sizeof(buf));
+        if (len <= 0) {
+          fmt::print(stderr, "connection closed by server\n");
+          stop = true;
+          break;
+        }
+        conn.m_in.append(buf, static_cast<size_t>(len));
+        size_t consumed = 0;
+        while (size_t total = response_length(
+                   std::string_view(conn.m_in).substr(consumed))) {
+          consumed += total;
+          auto now = bench_clock::now();
+          if (counting) {
+            totals.m_completed++;
+            totals.m_latency.record(now - conn.m_sent[conn.m_head]);
+          }
+          conn.m_head = (conn.m_head + 1) % conn.m_sent.size();
+          conn.m_inflight--;
+          if (m_opts.m_mode == bench_mode::close) {
+            break;
+          }
+          send(conn);
+        }
+        if (m_opts.m_mode == bench_mode::close && conn.m_inflight == 0) {
+          reopen(conn);
+          continue;
+        }
+        conn.m_in.erase(0, consumed);
+      }
+    }
+  }
+};
+
+static void print_usage(const char *argv0) {
+  fmt::print(stderr,
+             "usage: {} [-m keepalive|pipeline|close] [-p depth] "
+             "[-t threads] [-c connections] [-d seconds] [-w warmup] "
+             "[-u target] [-j] [host] [port]\n",
+             argv0);
+}
+
+int main(int argc, char **argv) {
+  bench_options opts;
+  std::string target;
+  int depth = 16;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:p:t:c:d:w:u:j")) != -1) {
+    switch (opt) {
+    case 'm':
+      opts.m_mode_name = optarg;
+      if (opts.m_mode_name == "keepalive") {
+        opts.m_mode = bench_mode::keepalive;
+      } else if (opts.m_mode_name == "pipeline") {
+        opts.m_mode = bench_mode::pipeline;
+      } else if (opts.m_mode_name == "close") {
+        opts.m_mode = bench_mode::close;
+      } else {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'p': depth = std::atoi(optarg); break;
+    case 't': opts.m_threads = std::atoi(optarg); break;
+    case 'c': opts.m_conns = std::atoi(optarg); break;
+    case 'd': opts.m_seconds = std::atoi(optarg); break;
+    case 'w': opts.m_warmup = std::atoi(optarg); break;
+    case 'u': target = optarg; break;
+    case 'j': opts.m_json = true; break;
+    default: print_usage(argv[0]); return 1;
+    }
+  }
+  if (optind < argc) {
+    opts.m_host = argv[optind++];
+  }
+  if (optind < argc) {
+    opts.m_port = argv[optind++];
+  }
+  opts.m_depth = opts.m_mode == bench_mode::pipeline ? std::max(depth, 1) : 1;
+  if (target.empty()) {
+    opts.m_request = "POST / HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                     "Content-Length: 5\r\n";
+  } else {
+    opts.m_request = fmt::format("GET {} HTTP/1.1\r\nHost: 127.0.0.1\r\n",
+                                 target);
+  }
+  if (opts.m_mode == bench_mode::close) {
+    opts.m_request += "Connection: close\r\n";
+  }
+  opts.m_request += target.empty() ? "\r\nhello" : "\r\n";
+
+  address_resolver resolver;
+  auto entry = resolver.resolve(opts.m_host, opts.m_port);
+  std::atomic<bool> measuring{false};
+  std::atomic<bool> stop{false};
+  std::vector<bench_totals> totals(static_cast<size_t>(opts.m_threads));
+  std::vector<std::thread> threads;
+  for (int i = 0; i < opts.m_threads; i++) {
+    int share = opts.m_conns / opts.m_threads +
+                (i < opts.m_conns % opts.m_threads ? 1 : 0);
+    threads.emplace_back([&, share, i] {
+      bench_thread thread(opts, entry, share);
+      thread.run(measuring, stop, totals[static_cast<size_t>(i)]);
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(opts.m_warmup));
+  measuring = true;
+  auto t0 = bench_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(opts.m_seconds));
+  measuring = false;
+  double elapsed =
+      std::chrono::duration<double>(bench_clock::now() - t0).count();
+  stop = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  size_t completed = 0;
+  log_histogram latency;
+  for (auto &t : totals) {
+    completed += t.m_completed;
+    latency.merge(t.m_latency);
+  }
+  // bucket upper bounds, within 12.5% of the true value
+  double p50 = double(latency.quantile(0.5)) * 1e-3;
+  double p99 = double(latency.quantile(0.99)) * 1e-3;
+  double p999 = double(latency.quantile(0.999)) * 1e-3;
+  double rate = double(completed) / elapsed;
+  if (opts.m_json) {
+    fmt::print("{{\"bench\":\"loopback\",\"name\":\"{}\",\"depth\":{},"
+               "\"threads\":{},\"connections\":{},\"seconds\":{:.2f},"
+               "\"requests\":{},\"req_per_s\":{:.0f},\"p50_us\":{:.1f},"
+               "\"p99_us\":{:.1f},\"p999_us\":{:.1f}}}\n",
+               opts.m_mode_name, opts.m_depth, opts.m_threads, opts.m_conns,
+               elapsed, completed, rate, p50, p99, p999);
+  } else {
+    fmt::print("{}: {} requests in {:.2f}s, {:.0f} req/s, "
+               "p50 {:.1f}us p99 {:.1f}us p99.9 {:.1f}us\n",
+               opts.m_mode_name, completed, elapsed, rate, p50, p99, p999);
+  }
+  return 0;
+}
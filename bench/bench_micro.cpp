@@ -0,0 +1,166 @@
+// Microbenchmarks of the pieces every request goes through besides the
+// parser: response header serialization, callback construction and
+// dispatch, bytes_buffer appends, and WebSocket payload unmasking.
+//
+//   bench_micro [-j] [iterations]
+
+#include "bench.hpp"
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#include "http_writer.hpp"
+#include "loop_allocator.hpp"
+#include "websocket.hpp"
+#include <array>
+#include <cstring>
+#include <functional>
+#include <string_view>
+
+static constexpr std::string_view k_body = "{\"status\":\"ok\",\"uptime\":42}";
+
+static void bench_writer(bench_report &report) {
+  http_date date;
+  http_response_writer writer;
+  writer.m_date = &date;
+  // as a connection does: the buffer keeps its capacity between responses
+  report.run("writer 200 json", [&](size_t) {
+    writer.m_buffer.clear();
+    writer.begin_header(200);
+    writer.write_header("Server", "co_http");
+    writer.write_header("Content-Type", "application/json");
+    writer.write_header("Content-Length", k_body.size());
+    writer.end_header();
+    writer.m_buffer.append(k_body);
+    bench_keep(writer.m_buffer.size());
+  });
+  report.run("writer 404 close", [&](size_t) {
+    writer.m_buffer.clear();
+    writer.begin_header(404);
+    writer.write_header("Content-Length", 0);
+    writer.write_header("Connection", "close");
+    writer.end_header();
+    bench_keep(writer.m_buffer.size());
+  });
+  report.run("writer chunked 4x16", [&](size_t) {
+    writer.m_buffer.clear();
+    writer.begin_header(200);
+    writer.write_header("Transfer-Encoding", "chunked");
+    writer.end_header();
+    for (int i = 0; i < 4; i++) {
+      writer.write_chunk("0123456789abcdef");
+    }
+    writer.end_chunks();
+    bench_keep(writer.m_buffer.size());
+  });
+  report.run("writer fresh buffer", [&](size_t) {
+    http_response_writer fresh;
+    fresh.m_date = &date;
+    fresh.begin_header(200);
+    fresh.write_header("Content-Length", k_body.size());
+    fresh.end_header();
+    bench_keep(fresh.m_buffer.size());
+  });
+}
+
+static void bench_callback(bench_report &report) {
+  size_t sum = 0;
+  void *self = &sum;
+  // the common shape: a `this` pointer and a value or two. bench_keep()
+  // hides the callable from the optimizer, as an event loop would.
+  report.run("callback inline construct+call", [&](size_t i) {
+    callback<size_t> cb([self, i](size_t n) {
+      *static_cast<size_t *>(self) += n + i;
+    });
+    bench_keep(cb);
+    cb(1);
+  });
+  report.run("std::function construct+call", [&](size_t i) {
+    std::function<void(size_t)> fn([self, i](size_t n) {
+      *static_cast<size_t *>(self) += n + i;
+    });
+    bench_keep(fn);
+    fn(1);
+  });
+  callback<size_t> repeated([&sum](size_t n) { sum += n; });
+  report.run("callback multishot call", [&](size_t i) {
+    bench_keep(repeated);
+    repeated(multishot_call, i);
+  });
+  std::array<size_t, 16> big{};
+  report.run("callback spilled, global heap", [&](size_t i) {
+    callback<size_t> cb([&sum, big](size_t n) { sum += n + big[0]; });
+    bench_keep(cb);
+    cb(i);
+  });
+  loop_allocator alloc;
+  loop_allocator::current() = &alloc;
+  report.run("callback spilled, loop_allocator", [&](size_t i) {
+    callback<size_t> cb([&sum, big](size_t n) { sum += n + big[0]; });
+    bench_keep(cb);
+    cb(i);
+  });
+  loop_allocator::current() = nullptr;
+  bench_keep(sum);
+}
+
+static void bench_buffer(bench_report &report) {
+  bytes_buffer reused;
+  report.run("buffer append 8x16, reused", [&](size_t) {
+    reused.clear();
+    for (int i = 0; i < 8; i++) {
+      reused.append(std::string_view("0123456789abcdef"));
+    }
+    bench_keep(reused.size());
+  });
+  report.run("buffer append 8x16, fresh", [&](size_t) {
+    bytes_buffer fresh;
+    for (int i = 0; i < 8; i++) {
+      fresh.append(std::string_view("0123456789abcdef"));
+    }
+    bench_keep(fresh.size());
+  });
+  report.run("buffer append_literal 8x16, reused", [&](size_t) {
+    reused.clear();
+    for (int i = 0; i < 8; i++) {
+      reused.append_literal("0123456789abcdef");
+    }
+    bench_keep(reused.size());
+  });
+  bytes_buffer big;
+  std::array<char, 4096> page{};
+  report.run("buffer append 4 KiB, reused", [&](size_t) {
+    big.clear();
+    big.append(std::string_view(page.data(), page.size()));
+    bench_keep(big.size());
+  });
+}
+
+static void bench_ws_mask(bench_report &report) {
+  std::array<char, 4096> page{};
+  std::array<char, 4096> out{};
+  const unsigned char key[4] = {0x37, 0xfa, 0x21, 0x3d};
+  uint32_t packed;
+  std::memcpy(&packed, key, 4);
+  report.run("ws unmask 4 KiB, bytewise", [&](size_t) {
+    for (size_t i = 0; i < page.size(); i++) {
+      out[i] = static_cast<char>(page[i] ^ key[i % 4]);
+    }
+    bench_keep(out);
+  });
+  report.run("ws unmask 4 KiB, words", [&](size_t) {
+    ws_mask_scalar(out.data(), page.data(), page.size(), packed);
+    bench_keep(out);
+  });
+  report.run("ws unmask 4 KiB, dispatched", [&](size_t i) {
+    ws_mask(out.data(), page.data(), page.size(), key, i);
+    bench_keep(out);
+  });
+}
+
+int main(int argc, char **argv) {
+  bench_report report("micro", 2000000, argc, argv);
+  bench_writer(report);
+  bench_callback(report);
+  bench_buffer(report);
+  bench_ws_mask(report);
+  return 0;
+}
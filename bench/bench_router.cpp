@@ -0,0 +1,70 @@
+// Route lookup microbenchmark: the radix tree with 10 to 1000 registered
+// routes, and the constexpr table for fixed routes. The lookup cost should
+// stay flat as routes are added, without heap allocations.
+//
+//   bench_router [-j] [iterations]
+
+#include "bench.hpp"
+#include "router.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+
+using handler = int;
+
+static constexpr auto k_fixed = make_static_routes<handler>({
+    {http_method::get, "/health", 1},
+    {http_method::get, "/metrics", 2},
+    {http_method::get, "/api/v1/status", 3},
+    {http_method::post, "/api/v1/login", 4},
+});
+
+static_assert(*k_fixed.find(http_method::get, "/metrics") == 2);
+static_assert(k_fixed.find(http_method::post, "/metrics") == nullptr);
+
+// `resources` REST resources with five routes each, plus a wildcard
+static void add_routes(router<handler> &routes, size_t resources) {
+  for (size_t i = 0; i < resources; i++) {
+    std::string base = fmt::format("/api/v1/resource{}", i);
+    int id = static_cast<int>(i * 5);
+    routes.add(http_method::get, base, id);
+    routes.add(http_method::post, base, id + 1);
+    routes.add(http_method::get, base + "/:id", id + 2);
+    routes.add(http_method::del, base + "/:id", id + 3);
+    routes.add(http_method::get, base + "/:id/items/:item", id + 4);
+  }
+  routes.add(http_method::get, "/static/*path", -1);
+}
+
+static void run(bench_report &report, std::string_view name,
+                const router<handler> &routes,
+                const std::vector<std::string> &paths) {
+  route_params params;
+  report.run(name, [&](size_t i) {
+    const std::string &path = paths[i % paths.size()];
+    auto match = routes.find(http_method::get, path, params);
+    bench_keep(match.m_handler ? *match.m_handler : 0);
+    bench_keep(params.size());
+  });
+}
+
+int main(int argc, char **argv) {
+  bench_report report("router", 2000000, argc, argv);
+  for (size_t resources : {2, 20, 200}) {
+    router<handler> routes;
+    routes.set_static_routes(k_fixed);
+    add_routes(routes, resources);
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < resources; i++) {
+      paths.push_back(fmt::format("/api/v1/resource{}/{}/items/{}", i,
+                                  1000 + i, i % 7));
+      paths.push_back(fmt::format("/api/v1/resource{}/{}", i, 42));
+    }
+    paths.push_back("/static/css/site.css");
+    run(report, fmt::format("radix, {} routes", resources * 5 + 1), routes,
+        paths);
+    run(report, fmt::format("fixed, {} routes", resources * 5 + 1), routes,
+        {"/health", "/metrics", "/api/v1/status"});
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+"""Compares two bench/run.sh results, benchmark by benchmark.
+
+    bench/compare.py <before.json> <after.json> [threshold-percent]
+
+Prints the change of ns_per_op (microbenchmarks) or req_per_s and p99_us
+(load tests) and exits with 1 if anything got worse by more than the
+threshold, 5% by default.
+"""
+
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        doc = json.load(f)
+    return {(r["bench"], r["name"]): r for r in doc["results"]}
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__)
+    before, after = load(sys.argv[1]), load(sys.argv[2])
+    threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 5.0
+    worse = 0
+    for key, new in after.items():
+        old = before.get(key)
+        if old is None:
+            continue
+        # (field, True if higher is better)
+        fields = [("req_per_s", True), ("p99_us", False)] \
+            if "req_per_s" in new else [("ns_per_op", False)]
+        for field, higher_is_better in fields:
+            if not old[field]:
+                continue
+            change = (new[field] - old[field]) / old[field] * 100
+            regressed = -change if higher_is_better else change
+            mark = "  WORSE" if regressed > threshold else ""
+            worse += bool(mark)
+            print(f"{key[0]:<9} {key[1]:<44} {field:<10} "
+                  f"{old[field]:>12.1f} -> {new[field]:>12.1f} "
+                  f"{change:>+7.1f}%{mark}")
+    sys.exit(1 if worse else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,557 @@
+// HTTP load generator on the server's own reactor and response parser.
+// Every thread runs an io_context with its share of keep-alive
+// connections, each keeping up to --pipeline requests in flight.
+//
+// Closed loop (default): a connection sends its next request as soon as a
+// response comes back; latency is measured from the actual send.
+//
+// Open loop (--rate): requests are due at a fixed rate, spread evenly over
+// the connections, and released by a timerfd when due. Latency is measured
+// from the time a request was due, not from when it could be sent, so a
+// stalled server shows up in the percentiles instead of just slowing the
+// client down (coordinated omission).
+//
+//   loadgen [options] [host] [port]
+
+#include "async_file.hpp"
+#include "http_parser.hpp"
+#include "io_context.hpp"
+#include "metrics.hpp"
+#include "task.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <fstream>
+#include <getopt.h>
+#include <iterator>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <vector>
+
+using loadgen_clock = std::chrono::steady_clock;
+
+struct loadgen_options {
+  unsigned m_threads = 1;
+  unsigned m_conns = 100;
+  unsigned m_depth = 1;
+  double m_rate = 0; // requests/s over all threads, 0: closed loop
+  std::chrono::seconds m_duration{10};
+  std::chrono::seconds m_warmup{1};
+  io_backend m_backend = io_backend::epoll;
+  std::string m_method = "GET";
+  std::vector<std::string> m_targets;
+  std::vector<std::string> m_headers;
+  std::string m_body;
+  std::vector<std::string> m_template_files;
+  bool m_json = false;
+  std::string m_host = "127.0.0.1";
+  std::string m_port = "8080";
+};
+
+// What one thread measured. Only requests sent (or due) after the warm-up
+// and answered before the end count.
+struct loadgen_stats {
+  log_histogram m_latency;
+  size_t m_completed = 0;
+  size_t m_non_2xx = 0;
+  size_t m_errors = 0;   // failed connects and lost connections
+  size_t m_unsent = 0;   // open loop: due but not sent when the run ended
+};
+
+struct loadgen_worker;
+
+struct loadgen_conn {
+  loadgen_worker *m_worker = nullptr;
+  size_t m_index = 0; // within the worker
+  async_file m_conn;
+  http_response_parser<> m_parser;
+  bool m_connected = false;
+  uint64_t m_sent = 0;
+  uint64_t m_received = 0;
+  uint64_t m_due = 0; // open loop: requests whose time has come
+  // closed loop: send times of the requests in flight, by number % depth
+  std::vector<loadgen_clock::time_point> m_send_times;
+
+  task<void> run();
+  task<void> receive();
+  void fill();
+  void on_response(int status);
+  loadgen_clock::time_point started(uint64_t request) const;
+};
+
+struct loadgen_worker {
+  const loadgen_options &m_opts;
+  // request templates on the wire, shared by all threads
+  const std::vector<std::string> &m_requests;
+  address_resolver::address_info m_entry;
+  loadgen_stats &m_stats;
+  io_context m_ctx;
+  std::vector<loadgen_conn> m_conns;
+  size_t m_live = 0;
+  bool m_stopping = false;
+  loadgen_clock::time_point m_begin;   // the schedule starts here
+  loadgen_clock::time_point m_measure; // end of the warm-up
+  loadgen_clock::time_point m_end;
+  callback_timer m_end_timer;
+  // open loop: the worker's k-th request is due at m_begin + k * m_interval
+  // on connection k % m_conns.size()
+  double m_interval_ns = 0;
+  uint64_t m_next_due = 0;
+  async_file m_tick;
+  uint64_t m_expirations = 0; // read from the timerfd
+
+  loadgen_worker(const loadgen_options &opts,
+                 const std::vector<std::string> &requests,
+                 address_resolver::address_info entry, loadgen_stats &stats,
+                 size_t nconns)
+      : m_opts(opts), m_requests(requests), m_entry(entry), m_stats(stats),
+        m_ctx(opts.m_backend), m_conns(nconns) {}
+
+  ~loadgen_worker() {
+    if (m_tick.m_fd != -1) {
+      close(m_tick.m_fd);
+    }
+  }
+
+  [[nodiscard]] bool open_loop() const { return m_opts.m_rate > 0; }
+
+  loadgen_clock::time_point due_time(uint64_t k) const {
+    return m_begin + std::chrono::nanoseconds(static_cast<int64_t>(
+                         static_cast<double>(k) * m_interval_ns));
+  }
+
+  void run(loadgen_clock::time_point begin, size_t first_index,
+           size_t total_conns) {
+    m_begin = begin;
+    m_measure = begin + m_opts.m_warmup;
+    m_end = m_measure + m_opts.m_duration;
+    if (open_loop()) {
+      m_interval_ns = 1e9 * static_cast<double>(m_conns.size()) /
+                      (m_opts.m_rate * static_cast<double>(total_conns));
+      int fd = CHECK_CALL(timerfd_create, CLOCK_MONOTONIC,
+                          TFD_NONBLOCK | TFD_CLOEXEC);
+      m_tick = async_file::async_warp_nonblocking(m_ctx, fd);
+      release_due();
+    }
+    for (size_t i = 0; i < m_conns.size(); i++) {
+      loadgen_conn &conn = m_conns[i];
+      conn.m_worker = this;
+      conn.m_index = first_index + i;
+      conn.m_send_times.resize(m_opts.m_depth);
+      m_live++;
+      co_spawn(conn.run());
+    }
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        m_end - loadgen_clock::now());
+    m_ctx.run_after(m_end_timer, std::max(left, std::chrono::milliseconds(0)),
+                    [this] { stop(); });
+    m_ctx.run();
+    if (open_loop()) {
+      for (loadgen_conn &conn : m_conns) {
+        m_stats.m_unsent += conn.m_due - conn.m_sent;
+      }
+    }
+  }
+
+  // Hands every request that is due to its connection, then sleeps on the
+  // timerfd until the next one is.
+  void release_due() {
+    auto now = loadgen_clock::now();
+    size_t n = m_conns.size();
+    while (due_time(m_next_due) <= now) {
+      loadgen_conn &conn = m_conns[m_next_due % n];
+      conn.m_due++;
+      conn.fill();
+      m_next_due++;
+    }
+    auto next = due_time(m_next_due).time_since_epoch();
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = static_cast<time_t>(
+        std::chrono::duration_cast<std::chrono::seconds>(next).count());
+    spec.it_value.tv_nsec = static_cast<long>((next % std::chrono::seconds(1))
+                                                  .count());
+    // steady_clock is CLOCK_MONOTONIC
+    CHECK_CALL(timerfd_settime, m_tick.m_fd, TFD_TIMER_ABSTIME, &spec,
+               nullptr);
+    m_tick.async_read(bytes_view{reinterpret_cast<char *>(&m_expirations),
+                                 sizeof(m_expirations)},
+                      [this](ssize_t) {
+                        if (!m_stopping) {
+                          release_due();
+                        }
+                      });
+  }
+
+  // Connections see EOF and finish; the loop stops with the last one.
+  void stop() {
+    m_stopping = true;
+    if (open_loop()) {
+      struct itimerspec disarm = {};
+      timerfd_settime(m_tick.m_fd, 0, &disarm, nullptr);
+    }
+    for (loadgen_conn &conn : m_conns) {
+      if (conn.m_connected) {
+        shutdown(conn.m_conn.m_fd, SHUT_RDWR);
+      }
+    }
+  }
+
+  void on_conn_done() {
+    if (--m_live == 0) {
+      m_ctx.stop();
+    }
+  }
+};
+
+loadgen_clock::time_point loadgen_conn::started(uint64_t request) const {
+  const loadgen_worker &worker = *m_worker;
+  if (!worker.open_loop()) {
+    return m_send_times[request % m_send_times.size()];
+  }
+  uint64_t local = m_index - worker.m_conns.front().m_index;
+  return worker.due_time(local + request * worker.m_conns.size());
+}
+
+// Queues as many requests as the pipeline depth (and, in the open loop,
+// the schedule) allows and sends them in one write.
+void loadgen_conn::fill() {
+  if (!m_connected || m_worker->m_stopping) {
+    return;
+  }
+  const loadgen_options &opts = m_worker->m_opts;
+  const auto &requests = m_worker->m_requests;
+  uint64_t limit = m_worker->open_loop() ? m_due : UINT64_MAX;
+  bool queued = false;
+  while (m_sent - m_received < opts.m_depth && m_sent < limit) {
+    if (!m_worker->open_loop()) {
+      m_send_times[m_sent % m_send_times.size()] = loadgen_clock::now();
+    }
+    const std::string &request = requests[(m_index + m_sent) % requests.size()];
+    m_conn.queue_write(bytes_const_view{request.data(), request.size()});
+    m_sent++;
+    queued = true;
+  }
+  if (queued) {
+    m_conn.send_queued();
+  }
+}
+
+void loadgen_conn::on_response(int status) {
+  auto now = loadgen_clock::now();
+  auto start = started(m_received++);
+  loadgen_worker &worker = *m_worker;
+  if (start < worker.m_measure || now >= worker.m_end) {
+    return;
+  }
+  loadgen_stats &stats = worker.m_stats;
+  stats.m_completed++;
+  stats.m_latency.record(now - start);
+  if (status < 200 || status >= 300) {
+    stats.m_non_2xx++;
+  }
+}
+
+// until the connection ends
+task<void> loadgen_conn::receive() {
+  auto discard = [](std::string_view) {}; // bodies are not kept
+  m_parser.set_body_sink(discard);
+  while (true) {
+    auto chunk = co_await m_conn.recv();
+    if (chunk.size() <= 0) {
+      co_return;
+    }
+    std::string_view data = chunk;
+    while (!data.empty()) {
+      data.remove_prefix(m_parser.push_chunk(data));
+      if (m_parser.failed()) {
+        co_return;
+      }
+      if (!m_parser.request_finished()) {
+        break;
+      }
+      on_response(m_parser.status());
+      m_parser.reset();
+      m_parser.set_body_sink(discard);
+    }
+    fill();
+  }
+}
+
+// Connects, and reconnects after a failure, until the run ends.
+task<void> loadgen_conn::run() {
+  loadgen_worker &worker = *m_worker;
+  while (!worker.m_stopping) {
+    int fd = worker.m_entry.create_socket(SOCK_NONBLOCK | SOCK_CLOEXEC);
+    m_conn = async_file::async_warp_nonblocking(worker.m_ctx, fd);
+    int err = co_await m_conn.connect(worker.m_entry.get_address());
+    if (err == 0 && !worker.m_stopping) {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      m_connected = true;
+      fill();
+      co_await receive();
+      m_connected = false;
+      if (!worker.m_stopping) {
+        worker.m_stats.m_errors++;
+      }
+      m_received = m_sent; // in flight, lost with the connection
+      m_parser.reset();
+      co_await m_conn.flush();
+    } else if (err != 0) {
+      worker.m_stats.m_errors++;
+    }
+    m_conn.close_file();
+    if (err != 0 && !worker.m_stopping) {
+      using namespace std::chrono_literals;
+      co_await worker.m_ctx.sleep_for(100ms); // e.g. refused: do not spin
+    }
+  }
+  worker.on_conn_done();
+}
+
+static std::string read_template(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("cannot read " + path);
+  }
+  std::string text((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  if (text.find("\r\n") != std::string::npos) {
+    return text;
+  }
+  std::string wire; // written with plain newlines
+  for (char c : text) {
+    if (c == '\n') {
+      wire += '\r';
+    }
+    wire += c;
+  }
+  return wire;
+}
+
+static std::vector<std::string> make_requests(const loadgen_options &opts) {
+  std::vector<std::string> requests;
+  for (const std::string &path : opts.m_template_files) {
+    requests.push_back(read_template(path));
+  }
+  if (!requests.empty()) {
+    return requests;
+  }
+  for (const std::string &target : opts.m_targets) {
+    std::string request = fmt::format("{} {} HTTP/1.1\r\nHost: {}:{}\r\n",
+                                      opts.m_method, target, opts.m_host,
+                                      opts.m_port);
+    for (const std::string &header : opts.m_headers) {
+      request += header;
+      request += "\r\n";
+    }
+    if (!opts.m_body.empty()) {
+      request += fmt::format("Content-Length: {}\r\n", opts.m_body.size());
+    }
+    request += "\r\n";
+    request += opts.m_body;
+    requests.push_back(std::move(request));
+  }
+  return requests;
+}
+
+static void raise_fd_limit(size_t need) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < need) {
+    limit.rlim_cur = std::min<rlim_t>(need, limit.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+static void report(const loadgen_options &opts, const loadgen_stats &total,
+                   double seconds) {
+  const log_histogram &h = total.m_latency;
+  double rate = static_cast<double>(total.m_completed) / seconds;
+  auto us = [&h](double q) { return double(h.quantile(q)) * 1e-3; };
+  std::string_view name = opts.m_rate > 0 ? "open" : "closed";
+  // counts per power-of-two bucket, as in the /metrics histograms
+  std::vector<std::pair<double, uint64_t>> buckets;
+  size_t bucket = 0;
+  for (uint64_t bound = 1024; bucket < log_histogram::k_buckets; bound <<= 1) {
+    uint64_t count = 0;
+    while (bucket < log_histogram::k_buckets &&
+           log_histogram::lower_bound(bucket) < bound) {
+      count += h.m_counts[bucket++].get();
+    }
+    buckets.emplace_back(double(bound) * 1e-3, count);
+  }
+  while (!buckets.empty() && buckets.back().second == 0) {
+    buckets.pop_back();
+  }
+  size_t skip = 0;
+  while (skip < buckets.size() && buckets[skip].second == 0) {
+    skip++;
+  }
+  if (opts.m_json) {
+    std::string histogram;
+    for (size_t i = skip; i < buckets.size(); i++) {
+      histogram += fmt::format("{}[{},{}]", i > skip ? "," : "",
+                               buckets[i].first, buckets[i].second);
+    }
+    fmt::print("{{\"bench\":\"loadgen\",\"name\":\"{}\",\"rate\":{},"
+               "\"threads\":{},\"connections\":{},\"depth\":{},"
+               "\"seconds\":{},\"requests\":{},\"req_per_s\":{:.0f},"
+               "\"errors\":{},\"non_2xx\":{},\"unsent\":{},\"p50_us\":{:.1f},"
+               "\"p90_us\":{:.1f},\"p99_us\":{:.1f},\"p999_us\":{:.1f},"
+               "\"p9999_us\":{:.1f},\"max_us\":{:.1f},\"histogram\":[{}]}}\n",
+               name, opts.m_rate, opts.m_threads, opts.m_conns, opts.m_depth,
+               seconds, total.m_completed, rate, total.m_errors,
+               total.m_non_2xx, total.m_unsent, us(0.5), us(0.9), us(0.99),
+               us(0.999), us(0.9999), us(1.0), histogram);
+    return;
+  }
+  fmt::print("{} loop, {} threads, {} connections, pipeline {}", name,
+             opts.m_threads, opts.m_conns, opts.m_depth);
+  if (opts.m_rate > 0) {
+    fmt::print(", target {:.0f} req/s", opts.m_rate);
+  }
+  fmt::print("\n  {} requests in {:.2f}s, {:.0f} req/s, {} errors, {} "
+             "non-2xx",
+             total.m_completed, seconds, rate, total.m_errors,
+             total.m_non_2xx);
+  if (opts.m_rate > 0) {
+    fmt::print(", {} due but unsent", total.m_unsent);
+  }
+  fmt::print("\n  latency p50 {:.1f}us p90 {:.1f}us p99 {:.1f}us p99.9 "
+             "{:.1f}us p99.99 {:.1f}us max {:.1f}us\n",
+             us(0.5), us(0.9), us(0.99), us(0.999), us(0.9999), us(1.0));
+  uint64_t cumulative = 0;
+  for (size_t i = skip; i < buckets.size(); i++) {
+    cumulative += buckets[i].second;
+    fmt::print("  <= {:>10.0f}us {:>10} {:>7.3f}%\n", buckets[i].first,
+               buckets[i].second,
+               100.0 * double(cumulative) / double(h.m_count.get()));
+  }
+}
+
+static void print_usage(const char *argv0) {
+  fmt::print(
+      stderr,
+      "usage: {} [options] [host] [port]\n"
+      "  -t, --threads N       reactor threads (1)\n"
+      "  -c, --connections N   keep-alive connections over all threads "
+      "(100)\n"
+      "  -d, --duration S      measured seconds (10)\n"
+      "  -w, --warmup S        seconds before measuring (1)\n"
+      "  -p, --pipeline N      requests in flight per connection (1)\n"
+      "  -R, --rate N          open loop at N requests/s; closed loop "
+      "without\n"
+      "  -X, --method M        request method (GET)\n"
+      "  -T, --target PATH     request target, repeat to rotate (/)\n"
+      "  -H, --header 'K: V'   extra request header, repeatable\n"
+      "  -b, --body DATA       request body, sets Content-Length\n"
+      "  -f, --template FILE   raw request to send instead, repeat to "
+      "rotate\n"
+      "  -u, --io-uring        use the io_uring backend\n"
+      "  -j, --json            print one JSON object\n",
+      argv0);
+}
+
+int main(int argc, char **argv) {
+  loadgen_options opts;
+  static const struct option long_opts[] = {
+      {"threads", required_argument, nullptr, 't'},
+      {"connections", required_argument, nullptr, 'c'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"warmup", required_argument, nullptr, 'w'},
+      {"pipeline", required_argument, nullptr, 'p'},
+      {"rate", required_argument, nullptr, 'R'},
+      {"method", required_argument, nullptr, 'X'},
+      {"target", required_argument, nullptr, 'T'},
+      {"header", required_argument, nullptr, 'H'},
+      {"body", required_argument, nullptr, 'b'},
+      {"template", required_argument, nullptr, 'f'},
+      {"io-uring", no_argument, nullptr, 'u'},
+      {"json", no_argument, nullptr, 'j'},
+      {nullptr, 0, nullptr, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "t:c:d:w:p:R:X:T:H:b:f:uj", long_opts,
+                            nullptr)) != -1) {
+    switch (opt) {
+    case 't': opts.m_threads = std::max(1ul, std::stoul(optarg)); break;
+    case 'c': opts.m_conns = std::stoul(optarg); break;
+    case 'd': opts.m_duration = std::chrono::seconds(std::stol(optarg)); break;
+    case 'w': opts.m_warmup = std::chrono::seconds(std::stol(optarg)); break;
+    case 'p': opts.m_depth = std::max(1ul, std::stoul(optarg)); break;
+    case 'R': opts.m_rate = std::stod(optarg); break;
+    case 'X': opts.m_method = optarg; break;
+    case 'T': opts.m_targets.push_back(optarg); break;
+    case 'H': opts.m_headers.push_back(optarg); break;
+    case 'b': opts.m_body = optarg; break;
+    case 'f': opts.m_template_files.push_back(optarg); break;
+    case 'u': opts.m_backend = io_backend::io_uring; break;
+    case 'j': opts.m_json = true; break;
+    default: print_usage(argv[0]); return 1;
+    }
+  }
+  if (optind < argc) {
+    opts.m_host = argv[optind++];
+  }
+  if (optind < argc) {
+    opts.m_port = argv[optind++];
+  }
+  if (opts.m_targets.empty()) {
+    opts.m_targets.push_back("/");
+  }
+  if (opts.m_method == "HEAD") { // the parser would wait for the body
+    fmt::print(stderr, "HEAD requests are not supported\n");
+    return 1;
+  }
+  opts.m_threads = std::min(opts.m_threads, std::max(opts.m_conns, 1u));
+
+  signal(SIGPIPE, SIG_IGN);
+  raise_fd_limit(opts.m_conns + 64);
+  std::vector<std::string> requests;
+  address_resolver resolver;
+  address_resolver::address_info entry;
+  try {
+    requests = make_requests(opts);
+    entry = resolver.resolve(opts.m_host, opts.m_port);
+  } catch (const std::exception &e) {
+    fmt::print(stderr, "{}\n", e.what());
+    return 1;
+  }
+
+  std::vector<loadgen_stats> stats(opts.m_threads);
+  std::vector<std::thread> threads;
+  auto begin = loadgen_clock::now();
+  size_t first_index = 0;
+  for (unsigned i = 0; i < opts.m_threads; i++) {
+    size_t share = opts.m_conns / opts.m_threads +
+                   (i < opts.m_conns % opts.m_threads ? 1 : 0);
+    threads.emplace_back([&, i, share, first_index] {
+      loadgen_worker worker(opts, requests, entry, stats[i], share);
+      worker.run(begin, first_index, opts.m_conns);
+    });
+    first_index += share;
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  loadgen_stats total;
+  for (const loadgen_stats &s : stats) {
+    total.m_latency.merge(s.m_latency);
+    total.m_completed += s.m_completed;
+    total.m_non_2xx += s.m_non_2xx;
+    total.m_errors += s.m_errors;
+    total.m_unsent += s.m_unsent;
+  }
+  report(opts, total,
+         std::chrono::duration<double>(opts.m_duration).count());
+  return 0;
+}
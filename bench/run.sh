@@ -0,0 +1,36 @@
+#!/bin/sh
+# Runs every benchmark and writes one JSON document: the microbenchmarks,
+# then bench_loopback against a fresh server in keepalive, pipeline and
+# close modes. Compare two runs with bench/compare.py.
+#   bench/run.sh <build-dir> [output.json] [seconds]
+set -e
+
+BUILD=${1:-build}
+OUT=${2:-bench.json}
+SECONDS_PER_RUN=${3:-5}
+PORT=18080
+LINES=$(mktemp)
+trap 'rm -f "$LINES"' EXIT
+
+for bench in bench_parser bench_router bench_micro; do
+  "$BUILD/$bench" -j >>"$LINES"
+done
+
+"$BUILD/server" -t 1 -a 127.0.0.1 "$PORT" >/dev/null 2>&1 &
+pid=$!
+sleep 0.5
+for mode in keepalive pipeline close; do
+  "$BUILD/bench_loopback" -j -m "$mode" -c 64 -d "$SECONDS_PER_RUN" \
+    127.0.0.1 "$PORT" >>"$LINES"
+done
+kill "$pid"
+wait "$pid" 2>/dev/null || true
+
+{
+  printf '{"commit":"%s","date":"%s","host":"%s","results":[\n' \
+    "$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null)" \
+    "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -n)"
+  sed '$!s/$/,/' "$LINES"
+  printf ']}\n'
+} >"$OUT"
+echo "wrote $OUT"
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs bench_loopback against the server with 1..N reactors.
+#   bench/scaling.sh <build-dir> [max-reactors] [seconds]
+set -e
+
+BUILD=${1:-build}
+MAX=${2:-$(nproc)}
+SECONDS_PER_RUN=${3:-5}
+PORT=18080
+
+n=1
+while [ "$n" -le "$MAX" ]; do
+  "$BUILD/server" -t "$n" -a 127.0.0.1 "$PORT" >/dev/null 2>&1 &
+  pid=$!
+  sleep 0.5
+  printf 'reactors=%d: ' "$n"
+  "$BUILD/bench_loopback" -t "$n" -c $((64 * n)) -d "$SECONDS_PER_RUN" \
+    127.0.0.1 "$PORT"
+  kill "$pid"
+  wait "$pid" 2>/dev/null || true
+  n=$((n * 2))
+done
@@ -0,0 +1,1093 @@
+#ifndef ASYNC_FILE_HPP
+#define ASYNC_FILE_HPP
+
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#include "io_context.hpp"
+#include "logger.hpp"
+#include "utils.hpp"
+#include "write_queue.hpp"
+#include <cerrno>
+#include <coroutine>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <memory>
+#include <poll.h>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+
+struct async_file {
+  // Under epoll the fd's data.ptr is m_events, which hands readiness to the
+  // parked reader and/or writer. The callback-style calls park the callback
+  // waiters below, so nothing is leaked to the kernel and a file must not
+  // move while something is parked on it.
+  struct _event_waiter : io_waiter {
+    async_file *m_file = nullptr;
+  };
+
+  int m_fd = -1;
+  io_context *m_ctx = nullptr;
+  _event_waiter m_events{{&_on_events}};
+  io_waiter *m_reader = nullptr;
+  io_waiter *m_writer = nullptr;
+  callback_waiter m_read_cb;
+  callback_waiter m_write_cb;
+
+  // background writes of m_out, see queue_write
+  struct _flush_waiter : io_waiter {
+    async_file *m_file = nullptr;
+  };
+
+  static constexpr int k_max_iov = 16;
+  // per sendfile call, so one large file does not hog the loop
+  static constexpr size_t k_max_sendfile = 512 * 1024;
+
+  write_queue m_out;
+  _flush_waiter m_flush{{&_on_flush}};
+  io_waiter *m_drainer = nullptr;
+  size_t m_drain_target = 0;
+  bool m_flushing = false;
+  bool m_flush_polling = false; // io_uring: waiting for POLLOUT, see below
+  bool m_write_failed = false;
+  bool *m_dispatch_closed = nullptr; // see _on_events
+  // epoll backend: what recv reads into instead of the loop's scratch
+  // buffer, for a file that may be read while another file's chunk is
+  // still being consumed
+  bytes_buffer *m_recv_buffer = nullptr;
+  // listeners, see async_accept_multishot
+  bool m_exclusive = false;
+  bool m_accept_paused = true;
+  bool m_accept_armed = false; // io_uring: the multishot sqe is live
+  // io_uring: one accept sqe per connection instead of a multishot one,
+  // which may deliver a whole burst before a pause takes effect
+  bool m_accept_single = false;
+#if CO_HTTP_IO_URING
+  // must stay put until the next submit, which copies them
+  struct msghdr m_write_msg;
+  struct iovec m_write_iov[k_max_iov];
+  struct msghdr m_flush_msg;
+  struct iovec m_flush_iov[k_max_iov];
+#endif
+
+  async_file() = default;
+
+  async_file(int fd, io_context *ctx) : m_fd(fd), m_ctx(ctx) {
+    m_out.m_pool = &ctx->m_buffers;
+  }
+
+  async_file(async_file &&) = default;
+  async_file &operator=(async_file &&) = default;
+
+  static async_file async_warp(io_context &ctx, int fd) {
+    int flags = CHECK_CALL(fcntl, fd, F_GETFL);
+    flags |= O_NONBLOCK; // set file to non-block
+    CHECK_CALL(fcntl, fd, F_SETFL, flags);
+    return async_warp_nonblocking(ctx, fd);
+  }
+
+  // For fds that are already non-blocking, e.g. from accept4(SOCK_NONBLOCK):
+  // saves the two fcntl calls.
+  static async_file async_warp_nonblocking(io_context &ctx, int fd) {
+    if (ctx.uses_uring()) { // nothing to register, ops carry their own fd
+      return async_file{fd, &ctx};
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLET;
+    event.data.ptr = nullptr;
+    CHECK_CALL(epoll_ctl, ctx.m_epfd, EPOLL_CTL_ADD, fd, &event);
+
+    return async_file{fd, &ctx};
+  }
+
+  // A listener shared by several reactors. Under epoll it is registered
+  // level-triggered with EPOLLEXCLUSIVE by async_accept_multishot, so only
+  // one of the waiting loops is woken per connection.
+  static async_file async_warp_exclusive(io_context &ctx, int fd) {
+    int flags = CHECK_CALL(fcntl, fd, F_GETFL);
+    flags |= O_NONBLOCK;
+    CHECK_CALL(fcntl, fd, F_SETFL, flags);
+    async_file file{fd, &ctx};
+    file.m_exclusive = !ctx.uses_uring();
+    return file;
+  }
+
+  void _arm() {
+    struct epoll_event event;
+    event.events = EPOLLET | EPOLLONESHOT;
+    if (m_reader) {
+      event.events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (m_writer) {
+      event.events |= EPOLLOUT;
+    }
+    m_events.m_file = this;
+    event.data.ptr = &m_events;
+    CHECK_CALL(epoll_ctl, m_ctx->m_epfd, EPOLL_CTL_MOD, m_fd, &event);
+  }
+
+  void _park_reader(io_waiter *waiter) {
+    m_ctx->m_metrics.m_rearms.add();
+    m_reader = waiter;
+    _arm();
+  }
+
+  void _park_writer(io_waiter *waiter) {
+    m_ctx->m_metrics.m_rearms.add();
+    m_writer = waiter;
+    _arm();
+  }
+
+  static void _on_events(io_waiter *self, int, uint32_t events) {
+    async_file *file = static_cast<_event_waiter *>(self)->m_file;
+    constexpr uint32_t k_failed = EPOLLERR | EPOLLHUP;
+    io_waiter *reader = nullptr;
+    io_waiter *writer = nullptr;
+    if (events & (EPOLLIN | EPOLLRDHUP | k_failed)) {
+      reader = std::exchange(file->m_reader, nullptr);
+    }
+    if (events & (EPOLLOUT | k_failed)) {
+      writer = std::exchange(file->m_writer, nullptr);
+    }
+    if (file->m_reader || file->m_writer) { // the other side keeps waiting
+      file->_arm();
+    }
+    // the reader runs first and may close the file; the writer then stays
+    // unfired
+    bool closed = false;
+    file->m_dispatch_closed = &closed;
+    if (reader) {
+      reader->m_fire(reader, 0, events);
+    }
+    if (closed) {
+      return;
+    }
+    file->m_dispatch_closed = nullptr;
+    if (writer) {
+      writer->m_fire(writer, 0, events);
+    }
+  }
+
+  ssize_t sync_read(bytes_view buf) {
+    ssize_t ret;
+    do {
+      ret = CHECK_CALL_EXCEPT(EAGAIN, ::read, m_fd, buf.data(), buf.size());
+    } while (ret == -1);
+    return ret;
+  }
+
+  void async_read(bytes_view buf, callback<ssize_t> cb) {
+#if CO_HTTP_IO_URING
+    if (m_ctx->uses_uring()) {
+      m_read_cb.set([cb = std::move(cb)](int res, uint32_t) mutable {
+        cb(res < 0 ? -1 : res);
+      });
+      auto sqe = m_ctx->_prep_waiter(&m_read_cb);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = m_fd;
+      sqe->addr = reinterpret_cast<uint64_t>(buf.data());
+      sqe->len = static_cast<uint32_t>(buf.size());
+      sqe->off = static_cast<uint64_t>(-1); // current position
+      return;
+    }
+#endif
+    ssize_t ret;
+    ret = CHECK_CALL_EXCEPT(EAGAIN, ::read, m_fd, buf.data(), buf.size());
+    if (ret != -1) { // EAGAIN
+      cb(ret);
+      return;
+    }
+
+    m_read_cb.set([this, buf, cb = std::move(cb)](int, uint32_t) mutable {
+      async_read(buf, std::move(cb));
+    });
+    _park_reader(&m_read_cb);
+  }
+
+  // Receives into memory owned by the reactor rather than the connection:
+  // a provided buffer ring under io_uring, a shared scratch buffer under
+  // epoll. `chunk` is only valid until `cb` returns; n == 0 means EOF and
+  // n == -1 an error.
+  void async_recv(callback<ssize_t, bytes_const_view> cb) {
+#if CO_HTTP_IO_URING
+    if (m_ctx->uses_uring()) {
+      m_read_cb.set([this, cb = std::move(cb)](int res,
+                                               uint32_t flags) mutable {
+        if (res == -ENOBUFS) { // every buffer in flight, try again
+          async_recv(std::move(cb));
+          return;
+        }
+        if (res <= 0 || !(flags & IORING_CQE_F_BUFFER)) {
+          cb(res < 0 ? -1 : res, bytes_const_view{nullptr, 0});
+          return;
+        }
+        auto bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+        auto &buffers = m_ctx->m_recv_buffers;
+        cb(res, bytes_const_view{buffers.buffer(bid),
+                                 static_cast<size_t>(res)});
+        buffers.recycle(bid);
+      });
+      auto sqe = m_ctx->_prep_waiter(&m_read_cb);
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = m_fd;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = io_context::k_recv_group;
+      return;
+    }
+#endif
+    bytes_buffer &target = _recv_target();
+    ssize_t ret =
+        CHECK_CALL_EXCEPT(EAGAIN, ::read, m_fd, target.data(), target.size());
+    if (ret != -1) { // EAGAIN
+      cb(ret, target.subspan(0, ret));
+      return;
+    }
+
+    m_read_cb.set([this, cb = std::move(cb)](int, uint32_t) mutable {
+      async_recv(std::move(cb));
+    });
+    _park_reader(&m_read_cb);
+  }
+
+  // Writes every buffer in order with as few writev calls as possible and
+  // resumes on EPOLLOUT after short writes; `cb` gets the total bytes
+  // written or -1. The buffers must stay alive until `cb` runs. Under
+  // io_uring each round is a single sendmsg.
+  template <size_t N>
+  void async_writev(const bytes_const_view (&bufs)[N], callback<ssize_t> cb) {
+    _writev_op<N> op;
+    for (size_t i = 0; i < N; i++) {
+      op.m_bufs[i] = bufs[i];
+    }
+    op.m_cb = std::move(cb);
+    _async_writev(std::move(op));
+  }
+
+  void async_write(bytes_const_view buf, callback<ssize_t> cb) {
+    async_writev<1>({buf}, std::move(cb));
+  }
+
+  template <size_t N> struct _writev_op {
+    bytes_const_view m_bufs[N];
+    size_t m_index = 0;
+    size_t m_offset = 0;
+    ssize_t m_total = 0;
+    callback<ssize_t> m_cb;
+
+    iov_cursor _cursor() const noexcept {
+      return {m_bufs, N, m_index, m_offset};
+    }
+
+    [[nodiscard]] bool done() const noexcept { return m_index == N; }
+
+    void advance(size_t n) noexcept {
+      iov_cursor cursor = _cursor();
+      cursor.advance(n);
+      m_index = cursor.m_index;
+      m_offset = cursor.m_offset;
+      m_total += static_cast<ssize_t>(n);
+    }
+  };
+
+  template <size_t N> void _async_writev(_writev_op<N> op) {
+#if CO_HTTP_IO_URING
+    if (m_ctx->uses_uring()) {
+      m_write_msg = {};
+      m_write_msg.msg_iov = m_write_iov;
+      m_write_msg.msg_iovlen = op._cursor().gather(m_write_iov, k_max_iov);
+      m_write_cb.set([this, op = std::move(op)](int res, uint32_t) mutable {
+        if (res < 0) {
+          op.m_cb(-1);
+          return;
+        }
+        op.advance(static_cast<size_t>(res));
+        if (op.done()) {
+          _count_sent(op.m_total);
+          op.m_cb(op.m_total);
+          return;
+        }
+        _async_writev(std::move(op)); // short send
+      });
+      _prep_sendmsg(&m_write_cb, &m_write_msg);
+      return;
+    }
+#endif
+    while (!op.done()) {
+      struct iovec iov[k_max_iov];
+      int n = op._cursor().gather(iov, k_max_iov);
+      ssize_t ret = ::writev(m_fd, iov, n);
+      if (ret == -1) {
+        if (errno == EAGAIN) {
+          m_write_cb.set([this, op = std::move(op)](int, uint32_t) mutable {
+            _async_writev(std::move(op));
+          });
+          _park_writer(&m_write_cb);
+          return;
+        }
+        op.m_cb(-1);
+        return;
+      }
+      op.advance(static_cast<size_t>(ret));
+    }
+    _count_sent(op.m_total);
+    op.m_cb(op.m_total);
+  }
+
+#if CO_HTTP_IO_URING
+  void _prep_sendmsg(io_waiter *waiter, struct msghdr *msg) {
+    // msghdr and iovecs are copied at submission, the data is not
+    auto sqe = m_ctx->_prep_waiter(waiter);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = m_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+#endif
+
+  ssize_t sync_write(bytes_const_view buf) {
+    return CHECK_CALL_EXCEPT(EPIPE, ::write, m_fd, buf.data(), buf.size());
+  }
+
+  ssize_t sync_write(bytes_view buf) {
+    return CHECK_CALL_EXCEPT(EPIPE, ::write, m_fd, buf.data(), buf.size());
+  }
+
+  size_t sync_write(std::string_view buf) {
+    return CHECK_CALL_EXCEPT(EPIPE, ::write, m_fd, buf.data(), buf.size());
+  }
+
+  int sync_accept(struct sockaddr *addr, socklen_t *addrlen) {
+    int connid = CHECK_CALL(::accept, m_fd, addr, addrlen);
+    LOG_DEBUG("Accepted a connection: {}", connid);
+    return connid;
+  }
+
+  static constexpr int k_accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+
+  void async_accept(address_resolver::address &addr, callback<int> cb) {
+    addr.m_addrlen = sizeof(addr.m_addr_storage);
+#if CO_HTTP_IO_URING
+    if (m_ctx->uses_uring()) {
+      m_read_cb.set([cb = std::move(cb)](int res, uint32_t) mutable {
+        cb(res < 0 ? -1 : res);
+      });
+      auto sqe = m_ctx->_prep_waiter(&m_read_cb);
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = m_fd;
+      sqe->addr = reinterpret_cast<uint64_t>(&addr.m_addr);
+      sqe->addr2 = reinterpret_cast<uint64_t>(&addr.m_addrlen);
+      sqe->accept_flags = k_accept_flags;
+      return;
+    }
+#endif
+    int ret = CHECK_CALL_EXCEPT(EAGAIN, ::accept4, m_fd, &addr.m_addr,
+                                &addr.m_addrlen, k_accept_flags);
+    if (ret != -1) { // EAGAIN
+      cb(ret);
+      return;
+    }
+
+    m_read_cb.set([this, &addr, cb = std::move(cb)](int, uint32_t) mutable {
+      async_accept(addr, std::move(cb));
+    });
+    _park_reader(&m_read_cb);
+  }
+
+  // at most this many accept4 calls per wakeup, so a connection storm
+  // cannot starve the connections the loop already serves
+  static constexpr int k_accept_batch = 64;
+
+  // Calls `cb` with every accepted fd, already non-blocking and
+  // close-on-exec. Under io_uring one multishot accept sqe serves all of
+  // them (or one sqe per connection with m_accept_single, for exact
+  // limits). Under epoll each wakeup drains the backlog in batches of
+  // k_accept_batch; re-arming the oneshot registration reports what is
+  // left. On an error such as EMFILE, `cb` gets -1 with errno set and the
+  // listener pauses until resume_accepting(). `cb` stays in m_read_cb for
+  // the lifetime of the listener.
+  void async_accept_multishot(callback<int> cb) {
+    m_read_cb.set_multishot([this, cb = std::move(cb)](int res,
+                                                       uint32_t flags) {
+#if CO_HTTP_IO_URING
+      if (m_ctx->uses_uring()) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+          m_accept_armed = false;
+        }
+        if (res >= 0) {
+          cb(multishot_call, res);
+        } else if (res != -ECANCELED && res != -EINTR &&
+                   res != -ECONNABORTED) {
+          pause_accepting();
+          errno = -res;
+          cb(multishot_call, -1);
+        }
+        if (!m_accept_armed && !m_accept_paused) { // terminated, arm again
+          _submit_multishot_accept();
+        }
+        return;
+      }
+#endif
+      (void)res, (void)flags;
+      for (int i = 0; i < k_accept_batch && !m_accept_paused; i++) {
+        int fd = ::accept4(m_fd, nullptr, nullptr, k_accept_flags);
+        if (fd == -1) {
+          if (errno == EAGAIN) {
+            break;
+          }
+          if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+          }
+          int err = errno;
+          pause_accepting();
+          errno = err;
+          cb(multishot_call, -1);
+          return;
+        }
+        cb(multishot_call, fd);
+      }
+      if (!m_exclusive && !m_accept_paused) {
+        _park_reader(&m_read_cb);
+      }
+    });
+    resume_accepting();
+  }
+
+  // Stops taking connections off the backlog, e.g. at a connection limit.
+  // The kernel keeps queueing them.
+  void pause_accepting() {
+    if (m_accept_paused) {
+      return;
+    }
+    m_accept_paused = true;
+#if CO_HTTP_IO_URING
+    if (m_ctx->uses_uring()) {
+      if (m_accept_armed) { // its last cqe comes with -ECANCELED
+        auto sqe = m_ctx->m_uring->get_sqe(); // user_data 0: ignored
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&m_read_cb);
+      }
+      return;
+    }
+#endif
+    if (m_exclusive) { // EPOLLEXCLUSIVE registrations cannot be modified
+      CHECK_CALL(epoll_ctl, m_ctx->m_epfd, EPOLL_CTL_DEL, m_fd, nullptr);
+      return;
+    }
+    if (m_reader) {
+      m_reader = nullptr;
+      _arm();
+    }
+  }
+
+  void resume_accepting() {
+    if (!m_accept_paused) {
+      return;
+    }
+    m_accept_paused = false;
+#if CO_HTTP_IO_URING
+    if (m_ctx->uses_uring()) {
+      if (!m_accept_armed) { // otherwise rearmed when the cancel lands
+        _submit_multishot_accept();
+      }
+      return;
+    }
+#endif
+    if (m_exclusive) { // level-triggered: reports a non-empty backlog
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLEXCLUSIVE;
+      event.data.ptr = &m_read_cb;
+      CHECK_CALL(epoll_ctl, m_ctx->m_epfd, EPOLL_CTL_ADD, m_fd, &event);
+      return;
+    }
+    m_read_cb.m_fire(&m_read_cb, 0, 0); // drain what is already queued
+  }
+
+  [[nodiscard]] bool accept_paused() const noexcept {
+    return m_accept_paused;
+  }
+
+#if CO_HTTP_IO_URING
+  void _submit_multishot_accept() {
+    auto sqe = m_ctx->_prep_waiter(&m_read_cb);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_fd;
+    sqe->ioprio = m_accept_single ? 0 : IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = k_accept_flags;
+    m_accept_armed = true;
+  }
+#endif
+
+  // Awaitable counterparts of the async_* calls. Each awaiter is its own
+  // io_waiter: it lives in the suspended coroutine's frame and is resumed
+  // directly by the loop. Results follow read(2): n, 0 on EOF, -1 on error.
+
+  struct _read_awaiter : io_waiter {
+    async_file *m_file;
+    bytes_view m_buf;
+    ssize_t m_result = -1;
+    std::coroutine_handle<> m_caller;
+
+    [[nodiscard]] bool _try() { // false if it would block
+      m_result = ::read(m_file->m_fd, m_buf.data(), m_buf.size());
+      return !(m_result == -1 && errno == EAGAIN);
+    }
+
+    bool await_ready() { return !m_file->m_ctx->uses_uring() && _try(); }
+
+    void await_suspend(std::coroutine_handle<> caller) {
+      m_caller = caller;
+      m_fire = &_fire;
+#if CO_HTTP_IO_URING
+      if (m_file->m_ctx->uses_uring()) {
+        auto sqe = m_file->m_ctx->_prep_waiter(this);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = m_file->m_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(m_buf.data());
+        sqe->len = static_cast<uint32_t>(m_buf.size());
+        return;
+      }
+#endif
+      m_file->_park_reader(this);
+    }
+
+    static void _fire(io_waiter *waiter, int res, uint32_t) {
+      auto self = static_cast<_read_awaiter *>(waiter);
+      if (self->m_file->m_ctx->uses_uring()) {
+        self->m_result = res < 0 ? -1 : res;
+      } else if (!self->_try()) {
+        self->m_file->_park_reader(self);
+        return;
+      }
+      self->m_caller.resume();
+    }
+
+    ssize_t await_resume() const noexcept { return m_result; }
+  };
+
+  _read_awaiter read(bytes_view buf) { return {{nullptr}, this, buf}; }
+
+  bytes_buffer &_recv_target() noexcept {
+    return m_recv_buffer ? *m_recv_buffer : m_ctx->m_recv_scratch;
+  }
+
+  // Bytes received into reactor-owned memory, see async_recv. Under epoll
+  // the data lives in the loop's scratch buffer: consume it before the next
+  // suspension. Under io_uring the ring buffer is recycled on destruction.
+  struct recv_chunk {
+    ssize_t m_size = -1;
+    const char *m_data = nullptr;
+    io_context *m_ctx = nullptr;
+    int m_bid = -1;
+
+    recv_chunk() = default;
+    recv_chunk(recv_chunk &&that) noexcept
+        : m_size(that.m_size), m_data(that.m_data), m_ctx(that.m_ctx),
+          m_bid(std::exchange(that.m_bid, -1)) {}
+    recv_chunk &operator=(recv_chunk &&) = delete;
+
+    ~recv_chunk() {
+#if CO_HTTP_IO_URING
+      if (m_bid != -1) {
+        m_ctx->m_recv_buffers.recycle(static_cast<uint16_t>(m_bid));
+      }
+#endif
+    }
+
+    ssize_t size() const noexcept { return m_size; }
+
+    operator bytes_const_view() const noexcept {
+      return {m_data, m_size > 0 ? static_cast<size_t>(m_size) : 0};
+    }
+
+    operator std::string_view() const noexcept {
+      return operator bytes_const_view();
+    }
+  };
+
+  struct _recv_awaiter : io_waiter {
+    async_file *m_file;
+    recv_chunk m_chunk;
+    std::coroutine_handle<> m_caller;
+
+    [[nodiscard]] bool _try() {
+      bytes_buffer &scratch = m_file->_recv_target();
+      m_chunk.m_size = ::read(m_file->m_fd, scratch.data(), scratch.size());
+      m_chunk.m_data = scratch.data();
+      return !(m_chunk.m_size == -1 && errno == EAGAIN);
+    }
+
+    bool await_ready() { return !m_file->m_ctx->uses_uring() && _try(); }
+
+    void await_suspend(std::coroutine_handle<> caller) {
+      m_caller = caller;
+      m_fire = &_fire;
+#if CO_HTTP_IO_URING
+      if (m_file->m_ctx->uses_uring()) {
+        _submit();
+        return;
+      }
+#endif
+      m_file->_park_reader(this);
+    }
+
+#if CO_HTTP_IO_URING
+    void _submit() {
+      auto sqe = m_file->m_ctx->_prep_waiter(this);
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = m_file->m_fd;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = io_context::k_recv_group;
+    }
+#endif
+
+    static void _fire(io_waiter *waiter, int res, uint32_t flags) {
+      auto self = static_cast<_recv_awaiter *>(waiter);
+#if CO_HTTP_IO_URING
+      if (self->m_file->m_ctx->uses_uring()) {
+        if (res == -ENOBUFS) { // every buffer in flight, try again
+          self->_submit();
+          return;
+        }
+        self->m_chunk.m_size = res < 0 ? -1 : res;
+        if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+          auto bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+          auto &buffers = self->m_file->m_ctx->m_recv_buffers;
+          self->m_chunk.m_bid = bid;
+          self->m_chunk.m_data = buffers.buffer(bid);
+        }
+        self->m_caller.resume();
+        return;
+      }
+#endif
+      (void)res, (void)flags;
+      if (!self->_try()) {
+        self->m_file->_park_reader(self);
+        return;
+      }
+      self->m_caller.resume();
+    }
+
+    recv_chunk await_resume() noexcept {
+      if (m_chunk.m_size > 0) {
+        m_file->m_ctx->m_metrics.m_bytes_in.add(
+            static_cast<uint64_t>(m_chunk.m_size));
+      }
+      return std::move(m_chunk);
+    }
+  };
+
+  _recv_awaiter recv() {
+    _recv_awaiter awaiter{{nullptr}, this, {}, {}};
+    awaiter.m_chunk.m_ctx = m_ctx;
+    return awaiter;
+  }
+
+  // Writes all buffers in order with writev (sendmsg under io_uring),
+  // resuming after short writes; the result is the total byte count or -1.
+  template <size_t N> struct _write_awaiter : io_waiter {
+    async_file *m_file;
+    bytes_const_view m_bufs[N];
+    iov_cursor m_cursor;
+    ssize_t m_total = 0;
+    ssize_t m_result = -1;
+    std::coroutine_handle<> m_caller;
+#if CO_HTTP_IO_URING
+    struct msghdr m_msg;
+    struct iovec m_iov[k_max_iov];
+#endif
+
+    [[nodiscard]] bool _try() {
+      while (!m_cursor.done()) {
+        struct iovec iov[k_max_iov];
+        int n = m_cursor.gather(iov, k_max_iov);
+        ssize_t ret = ::writev(m_file->m_fd, iov, n);
+        if (ret == -1) {
+          if (errno == EAGAIN) {
+            return false;
+          }
+          m_result = -1;
+          return true;
+        }
+        m_total += ret;
+        m_cursor.advance(static_cast<size_t>(ret));
+      }
+      m_result = m_total;
+      return true;
+    }
+
+    bool await_ready() {
+      m_cursor = {m_bufs, N}; // the awaiter may have moved since write()
+      return !m_file->m_ctx->uses_uring() && _try();
+    }
+
+    void await_suspend(std::coroutine_handle<> caller) {
+      m_caller = caller;
+      m_fire = &_fire;
+#if CO_HTTP_IO_URING
+      if (m_file->m_ctx->uses_uring()) {
+        _submit();
+        return;
+      }
+#endif
+      m_file->_park_writer(this);
+    }
+
+#if CO_HTTP_IO_URING
+    void _submit() {
+      m_msg = {};
+      m_msg.msg_iov = m_iov;
+      m_msg.msg_iovlen = m_cursor.gather(m_iov, k_max_iov);
+      m_file->_prep_sendmsg(this, &m_msg);
+    }
+#endif
+
+    static void _fire(io_waiter *waiter, int res, uint32_t) {
+      auto self = static_cast<_write_awaiter *>(waiter);
+#if CO_HTTP_IO_URING
+      if (self->m_file->m_ctx->uses_uring()) {
+        if (res < 0) {
+          self->m_result = -1;
+        } else {
+          self->m_total += res;
+          self->m_cursor.advance(static_cast<size_t>(res));
+          if (!self->m_cursor.done()) { // short send
+            self->_submit();
+            return;
+          }
+          self->m_result = self->m_total;
+        }
+        self->m_caller.resume();
+        return;
+      }
+#endif
+      (void)res;
+      if (!self->_try()) {
+        self->m_file->_park_writer(self);
+        return;
+      }
+      self->m_caller.resume();
+    }
+
+    ssize_t await_resume() noexcept {
+      m_file->_count_sent(m_result);
+      return m_result;
+    }
+  };
+
+  template <size_t N>
+  _write_awaiter<N> write(const bytes_const_view (&bufs)[N]) {
+    _write_awaiter<N> awaiter{{nullptr}, this};
+    for (size_t i = 0; i < N; i++) {
+      awaiter.m_bufs[i] = bufs[i];
+    }
+    return awaiter;
+  }
+
+  _write_awaiter<1> write(bytes_const_view buf) {
+    return write<1>({buf});
+  }
+
+  // Output queue. queue_write() only appends, so the responses to several
+  // pipelined requests can be batched; send_queued() then starts writing
+  // them with as few writev calls as possible. What the socket does not
+  // take right away is written in the background, on EPOLLOUT or by one
+  // sendmsg in flight at a time. drain() and flush() let a handler wait for
+  // it, e.g. to stop reading while a slow client has more than
+  // m_out.m_high_watermark pending.
+
+  void queue_write(bytes_buffer buf) { m_out.push(std::move(buf)); }
+
+  void queue_write(bytes_const_view buf) { m_out.push(buf); }
+
+  // no copy: `buf` is sent from where it is, `owner` keeps it alive
+  void queue_shared(bytes_const_view buf, std::shared_ptr<const void> owner) {
+    m_out.push(buf, std::move(owner));
+  }
+
+  // File ranges go out with sendfile, straight from the page cache. io_uring
+  // has no sendfile op, so there the range is sent inline as well and a
+  // POLLOUT poll stands in for EPOLLOUT.
+  void queue_file(file_range file) { m_out.push(std::move(file)); }
+
+  void send_queued() { _flush_queue(); }
+
+  void _count_sent(ssize_t n) noexcept {
+    if (n > 0) {
+      m_ctx->m_metrics.m_bytes_out.add(static_cast<uint64_t>(n));
+    }
+  }
+
+  void _consume_sent(size_t n) {
+    m_out.consume(n);
+    m_ctx->m_metrics.m_bytes_out.add(n);
+  }
+
+  void _flush_queue() {
+    if (m_write_failed) { // nobody will read it
+      m_out.clear();
+      return;
+    }
+    if (m_flushing) { // picked up when the pending write completes
+      return;
+    }
+    m_flush.m_file = this;
+#if CO_HTTP_IO_URING
+    if (m_ctx->uses_uring()) {
+      while (!m_out.empty()) {
+        ssize_t ret = _sendfile_front();
+        if (ret > 0) {
+          _consume_sent(static_cast<size_t>(ret));
+          continue;
+        }
+        if (ret == -1 && errno == EAGAIN) {
+          auto sqe = m_ctx->_prep_waiter(&m_flush);
+          sqe->opcode = IORING_OP_POLL_ADD;
+          sqe->fd = m_fd;
+          sqe->poll32_events = POLLOUT;
+          m_flush_polling = true;
+          m_ctx->m_metrics.m_rearms.add();
+        } else if (ret == -1) {
+          m_write_failed = true;
+          m_out.clear();
+          return;
+        } else { // buffers first
+          m_flush_msg = {};
+          m_flush_msg.msg_iov = m_flush_iov;
+          m_flush_msg.msg_iovlen = m_out.gather(m_flush_iov, k_max_iov);
+          _prep_sendmsg(&m_flush, &m_flush_msg);
+        }
+        m_flushing = true;
+        return;
+      }
+      return;
+    }
+#endif
+    while (!m_out.empty()) {
+      ssize_t ret = _sendfile_front();
+      if (ret == 0) { // buffers first
+        struct iovec iov[k_max_iov];
+        int n = m_out.gather(iov, k_max_iov);
+        ret = ::writev(m_fd, iov, n);
+      }
+      if (ret == -1) {
+        if (errno == EAGAIN) {
+          m_flushing = true;
+          _park_writer(&m_flush);
+          return;
+        }
+        m_write_failed = true;
+        m_out.clear();
+        return;
+      }
+      _consume_sent(static_cast<size_t>(ret));
+    }
+  }
+
+  // Sends from the file range at the front of the queue: bytes sent, -1
+  // with errno set, or 0 if a buffer comes first. A file that shrank under
+  // us fails with EIO, as the promised length can no longer be sent.
+  ssize_t _sendfile_front() {
+    int fd;
+    off_t offset;
+    size_t length;
+    if (!m_out.front_file(fd, offset, length)) {
+      return 0;
+    }
+    ssize_t ret = ::sendfile(m_fd, fd, &offset,
+                             length < k_max_sendfile ? length : k_max_sendfile);
+    if (ret == 0) {
+      errno = EIO;
+      return -1;
+    }
+    return ret;
+  }
+
+  static void _on_flush(io_waiter *self, int res, uint32_t) {
+    async_file *file = static_cast<_flush_waiter *>(self)->m_file;
+    file->m_flushing = false;
+    if (std::exchange(file->m_flush_polling, false)) {
+      // writable again, or an error the next sendfile will report
+    } else if (file->m_ctx->uses_uring()) {
+      if (res < 0) {
+        file->m_write_failed = true;
+        file->m_out.clear();
+      } else {
+        file->_consume_sent(static_cast<size_t>(res));
+      }
+    }
+    file->_flush_queue();
+    // last: the drainer may close and free the file
+    if (file->m_drainer && file->_drained(file->m_drain_target)) {
+      io_waiter *drainer = std::exchange(file->m_drainer, nullptr);
+      drainer->m_fire(drainer, 0, 0);
+    }
+  }
+
+  [[nodiscard]] bool _drained(size_t target) const noexcept {
+    if (m_write_failed) {
+      return !m_flushing;
+    }
+    // nothing may be in flight once the queue is meant to be empty
+    return m_out.size() <= target && !(target == 0 && m_flushing);
+  }
+
+  struct _drain_awaiter : io_waiter {
+    async_file *m_file;
+    size_t m_target;
+    std::coroutine_handle<> m_caller;
+
+    bool await_ready() const {
+      m_file->send_queued();
+      return m_file->_drained(m_target);
+    }
+
+    void await_suspend(std::coroutine_handle<> caller) noexcept {
+      m_caller = caller;
+      m_fire = &_fire;
+      m_file->m_drain_target = m_target;
+      m_file->m_drainer = this;
+    }
+
+    static void _fire(io_waiter *waiter, int, uint32_t) {
+      static_cast<_drain_awaiter *>(waiter)->m_caller.resume();
+    }
+
+    int await_resume() const noexcept {
+      return m_file->m_write_failed ? -1 : 0;
+    }
+  };
+
+  // resumes once the queue is at or below its low watermark; -1 if writing
+  // failed and the queue was dropped
+  _drain_awaiter drain() { return {{nullptr}, this, m_out.m_low_watermark}; }
+
+  // resumes once everything queued has been written
+  _drain_awaiter flush() { return {{nullptr}, this, 0}; }
+
+  // the accepted fd, or -1
+  struct _accept_awaiter : io_waiter {
+    async_file *m_file;
+    address_resolver::address *m_addr;
+    int m_result = -1;
+    std::coroutine_handle<> m_caller;
+
+    [[nodiscard]] bool _try() {
+      m_addr->m_addrlen = sizeof(m_addr->m_addr_storage);
+      m_result = ::accept4(m_file->m_fd, &m_addr->m_addr, &m_addr->m_addrlen,
+                           k_accept_flags);
+      return !(m_result == -1 && errno == EAGAIN);
+    }
+
+    bool await_ready() { return !m_file->m_ctx->uses_uring() && _try(); }
+
+    void await_suspend(std::coroutine_handle<> caller) {
+      m_caller = caller;
+      m_fire = &_fire;
+#if CO_HTTP_IO_URING
+      if (m_file->m_ctx->uses_uring()) {
+        m_addr->m_addrlen = sizeof(m_addr->m_addr_storage);
+        auto sqe = m_file->m_ctx->_prep_waiter(this);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = m_file->m_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&m_addr->m_addr);
+        sqe->addr2 = reinterpret_cast<uint64_t>(&m_addr->m_addrlen);
+        sqe->accept_flags = k_accept_flags;
+        return;
+      }
+#endif
+      m_file->_park_reader(this);
+    }
+
+    static void _fire(io_waiter *waiter, int res, uint32_t) {
+      auto self = static_cast<_accept_awaiter *>(waiter);
+      if (self->m_file->m_ctx->uses_uring()) {
+        self->m_result = res < 0 ? -1 : res;
+      } else if (!self->_try()) {
+        self->m_file->_park_reader(self);
+        return;
+      }
+      self->m_caller.resume();
+    }
+
+    int await_resume() const noexcept { return m_result; }
+  };
+
+  _accept_awaiter accept(address_resolver::address &addr) {
+    return {{nullptr}, this, &addr};
+  }
+
+  // 0 once connected, or -errno. The file must wrap a non-blocking socket;
+  // `addr` must stay alive until the awaiter resumes.
+  struct _connect_awaiter : io_waiter {
+    async_file *m_file;
+    address_resolver::address_ref m_addr;
+    int m_result = 0;
+    std::coroutine_handle<> m_caller;
+
+    bool await_ready() {
+      if (m_file->m_ctx->uses_uring()) {
+        return false;
+      }
+      m_result = ::connect(m_file->m_fd, m_addr.m_addr, m_addr.m_addrlen) == 0
+                     ? 0
+                     : -errno;
+      return m_result != -EINPROGRESS;
+    }
+
+    void await_suspend(std::coroutine_handle<> caller) {
+      m_caller = caller;
+      m_fire = &_fire;
+#if CO_HTTP_IO_URING
+      if (m_file->m_ctx->uses_uring()) {
+        auto sqe = m_file->m_ctx->_prep_waiter(this);
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = m_file->m_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(m_addr.m_addr);
+        sqe->off = m_addr.m_addrlen;
+        return;
+      }
+#endif
+      m_file->_park_writer(this); // writable once the handshake is done
+    }
+
+    static void _fire(io_waiter *waiter, int res, uint32_t) {
+      auto self = static_cast<_connect_awaiter *>(waiter);
+      if (self->m_file->m_ctx->uses_uring()) {
+        self->m_result = res < 0 ? res : 0;
+      } else {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(self->m_file->m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        self->m_result = -err;
+      }
+      self->m_caller.resume();
+    }
+
+    int await_resume() const noexcept { return m_result; }
+  };
+
+  _connect_awaiter connect(address_resolver::address_ref addr) {
+    return {{nullptr}, this, addr};
+  }
+
+  // Under io_uring, flush() first: nothing may be in flight.
+  void close_file() {
+    m_reader = m_writer = m_drainer = nullptr;
+    if (m_dispatch_closed) {
+      *m_dispatch_closed = true;
+    }
+    if (m_ctx->m_epfd != -1) {
+      epoll_ctl(m_ctx->m_epfd, EPOLL_CTL_DEL, m_fd, nullptr);
+    }
+    close(m_fd);
+  }
+};
+
+#endif // ASYNC_FILE_HPP
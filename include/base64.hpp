@@ -0,0 +1,80 @@
+#ifndef BASE64_HPP
+#define BASE64_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Base64 (RFC 4648). Encoding uses the standard alphabet with padding, as
+// Sec-WebSocket-Accept does; decoding takes either alphabet, with or
+// without padding, e.g. the base64url HTTP2-Settings field.
+
+inline constexpr std::string_view k_base64_digits =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+inline constexpr std::array<int8_t, 256> k_base64_values = [] {
+  std::array<int8_t, 256> values{};
+  values.fill(-1);
+  for (size_t i = 0; i < k_base64_digits.size(); i++) {
+    values[static_cast<unsigned char>(k_base64_digits[i])] =
+        static_cast<int8_t>(i);
+  }
+  values['-'] = 62;
+  values['_'] = 63;
+  return values;
+}();
+
+inline std::string base64_encode(std::string_view in) {
+  std::string out;
+  out.reserve((in.size() + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 3 <= in.size(); i += 3) {
+    uint32_t bits = uint32_t(static_cast<unsigned char>(in[i])) << 16 |
+                    uint32_t(static_cast<unsigned char>(in[i + 1])) << 8 |
+                    static_cast<unsigned char>(in[i + 2]);
+    for (int shift = 18; shift >= 0; shift -= 6) {
+      out.push_back(k_base64_digits[bits >> shift & 63]);
+    }
+  }
+  if (size_t left = in.size() - i; left != 0) {
+    uint32_t bits = uint32_t(static_cast<unsigned char>(in[i])) << 16;
+    if (left == 2) {
+      bits |= uint32_t(static_cast<unsigned char>(in[i + 1])) << 8;
+    }
+    out.push_back(k_base64_digits[bits >> 18 & 63]);
+    out.push_back(k_base64_digits[bits >> 12 & 63]);
+    out.push_back(left == 2 ? k_base64_digits[bits >> 6 & 63] : '=');
+    out.push_back('=');
+  }
+  return out;
+}
+
+// false if `in` is not base64
+inline bool base64_decode(std::string_view in, std::string &out) {
+  while (!in.empty() && in.back() == '=') {
+    in.remove_suffix(1);
+  }
+  if (in.size() % 4 == 1) {
+    return false;
+  }
+  out.clear();
+  out.reserve(in.size() / 4 * 3 + 2);
+  uint32_t bits = 0;
+  int nbits = 0;
+  for (char c : in) {
+    int8_t value = k_base64_values[static_cast<unsigned char>(c)];
+    if (value < 0) {
+      return false;
+    }
+    bits = bits << 6 | static_cast<uint32_t>(value);
+    nbits += 6;
+    if (nbits >= 8) {
+      nbits -= 8;
+      out.push_back(static_cast<char>(bits >> nbits));
+    }
+  }
+  return true;
+}
+
+#endif // BASE64_HPP
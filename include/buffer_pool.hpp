@@ -0,0 +1,54 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include "bytes_buffer.hpp"
+#include "object_pool.hpp"
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Byte buffers of one event loop, recycled with their capacity, so a
+// connection only holds one while it has data in flight. Buffers that grew
+// past k_max_capacity are freed rather than pooled and at most m_max_pooled
+// are kept, so a traffic spike does not pin memory for good.
+struct buffer_pool {
+  static constexpr size_t k_capacity = 4096;
+  static constexpr size_t k_max_capacity = 64 * 1024;
+
+  std::vector<bytes_buffer> m_free;
+  size_t m_max_pooled = 4096;
+  pool_stats m_stats;
+
+  bytes_buffer acquire() {
+    m_stats.m_live++;
+    if (m_free.empty()) {
+      m_stats.m_misses++;
+      bytes_buffer buf;
+      buf.reserve(k_capacity);
+      return buf;
+    }
+    m_stats.m_hits++;
+    bytes_buffer buf = std::move(m_free.back());
+    m_free.pop_back();
+    m_stats.m_resident_bytes -= buf.m_data.capacity();
+    return buf;
+  }
+
+  void release(bytes_buffer buf) {
+    size_t capacity = buf.m_data.capacity();
+    if (capacity == 0) { // moved from, or never acquired
+      return;
+    }
+    if (m_stats.m_live > 0) {
+      m_stats.m_live--;
+    }
+    if (capacity > k_max_capacity || m_free.size() >= m_max_pooled) {
+      return;
+    }
+    buf.clear();
+    m_stats.m_resident_bytes += capacity;
+    m_free.push_back(std::move(buf));
+  }
+};
+
+#endif // BUFFER_POOL_HPP
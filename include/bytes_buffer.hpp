@@ -124,6 +124,8 @@ struct bytes_buffer {
     append(std::string_view{literal, N - 1}); // N - 1 to strip '\0'
   }
 
+  void push_back(char c) { m_data.push_back(c); }
+
   void clear() { m_data.clear(); }
 
   void resize(size_t n) { m_data.resize(n); }
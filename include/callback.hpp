@@ -1,8 +1,10 @@
 #ifndef CALLBACK_HPP
 #define CALLBACK_HPP
 
+#include "loop_allocator.hpp"
 #include <cassert>
-#include <memory>
+#include <cstddef>
+#include <new>
 #include <type_traits>
 #include <utility>
 
@@ -10,30 +12,89 @@ inline constexpr struct multishot_call_t {
   explicit multishot_call_t() = default;
 } multishot_call;
 
+// Move-only type-erased callable. Callables of up to k_inline_size bytes
+// are stored in place; bigger ones spill to the allocator of the current
+// loop. Dispatch goes through a static table of function pointers instead
+// of a vtable, so a callback costs no allocation in the common case.
 template <class... Args> struct callback {
-  struct _callback_base {
-    virtual void _call(Args... args) = 0;
-    virtual ~_callback_base() = default;
+  static constexpr size_t k_inline_size = 48;
+
+  struct _ops {
+    void (*m_call)(void *storage, Args... args);
+    // move-constructs into dst and destroys src
+    void (*m_relocate)(void *dst, void *src) noexcept;
+    void (*m_destroy)(void *storage) noexcept;
   };
 
-  template <class F> struct _callback_impl final : _callback_base {
-    F m_func;
+  template <class F>
+  static constexpr bool _is_inline =
+      sizeof(F) <= k_inline_size &&
+      alignof(F) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<F>;
+
+  template <class F> struct _inline_ops {
+    static void _call(void *storage, Args... args) {
+      (*static_cast<F *>(storage))(std::forward<Args>(args)...);
+    }
 
-    template <class... Ts,
-              class = std::enable_if_t<std::is_constructible_v<F, Ts...>>>
-    _callback_impl(Ts &&...ts) : m_func(std::forward<Ts>(ts)...) {}
+    static void _relocate(void *dst, void *src) noexcept {
+      F *from = static_cast<F *>(src);
+      ::new (dst) F(std::move(*from));
+      from->~F();
+    }
 
-    void _call(Args... args) override { m_func(std::forward<Args>(args)...); }
+    static void _destroy(void *storage) noexcept {
+      static_cast<F *>(storage)->~F();
+    }
+
+    static constexpr _ops k_ops = {&_call, &_relocate, &_destroy};
   };
 
-  std::unique_ptr<_callback_base> m_base;
+  template <class F> struct _spilled_ops {
+    static F *&_ptr(void *storage) noexcept {
+      return *static_cast<F **>(storage);
+    }
+
+    static void _call(void *storage, Args... args) {
+      (*_ptr(storage))(std::forward<Args>(args)...);
+    }
+
+    static void _relocate(void *dst, void *src) noexcept {
+      ::new (dst) F *(_ptr(src));
+    }
+
+    static void _destroy(void *storage) noexcept {
+      F *f = _ptr(storage);
+      f->~F();
+      loop_allocator::deallocate_here(f, sizeof(F));
+    }
+
+    static constexpr _ops k_ops = {&_call, &_relocate, &_destroy};
+  };
+
+  alignas(std::max_align_t) unsigned char m_storage[k_inline_size];
+  const _ops *m_ops = nullptr;
 
   template <class F, class = std::enable_if_t<
                          std::is_invocable_v<F, Args...> &&
                          !std::is_same_v<std::decay_t<F>, callback>>>
-  callback(F &&f)
-      : m_base(std::make_unique<_callback_impl<std::decay_t<F>>>(
-            std::forward<F>(f))) {}
+  callback(F &&f) {
+    using D = std::decay_t<F>;
+    if constexpr (_is_inline<D>) {
+      ::new (static_cast<void *>(m_storage)) D(std::forward<F>(f));
+      m_ops = &_inline_ops<D>::k_ops;
+    } else {
+      void *p = loop_allocator::allocate_here(sizeof(D));
+      try {
+        ::new (p) D(std::forward<F>(f));
+      } catch (...) {
+        loop_allocator::deallocate_here(p, sizeof(D));
+        throw;
+      }
+      ::new (static_cast<void *>(m_storage)) D *(static_cast<D *>(p));
+      m_ops = &_spilled_ops<D>::k_ops;
+    }
+  }
 
   callback() = default;
 
@@ -41,36 +102,48 @@ template <class... Args> struct callback {
 
   callback(const callback &) = delete;
   callback &operator=(const callback &) = delete;
-  callback(callback &&) = default;
-  callback &operator=(callback &&) = default;
 
-  void operator()(Args... args) {
-    assert(m_base);
-    m_base->_call(std::forward<Args>(args)...);
-    m_base = nullptr; // 所有回调，只能调用一次
+  callback(callback &&that) noexcept : m_ops(that.m_ops) {
+    if (m_ops) {
+      m_ops->m_relocate(m_storage, that.m_storage);
+      that.m_ops = nullptr;
+    }
   }
 
-  void operator()(multishot_call_t, Args... args) const {
-    assert(m_base);
-    m_base->_call(std::forward<Args>(args)...);
+  callback &operator=(callback &&that) noexcept {
+    if (this != &that) {
+      reset();
+      if (that.m_ops) {
+        that.m_ops->m_relocate(m_storage, that.m_storage);
+        m_ops = std::exchange(that.m_ops, nullptr);
+      }
+    }
+    return *this;
   }
 
-  void *get_address() const noexcept {
-    return static_cast<void *>(m_base.get());
+  ~callback() { reset(); }
+
+  void reset() noexcept {
+    if (m_ops) {
+      std::exchange(m_ops, nullptr)->m_destroy(m_storage);
+    }
   }
 
-  void *leak_address() noexcept {
-    return static_cast<void *>(m_base.release());
+  void operator()(Args... args) {
+    assert(m_ops);
+    // 所有回调，只能调用一次. Moved out first, so the call may safely
+    // store a new callback into this one.
+    callback self = std::move(*this);
+    self.m_ops->m_call(self.m_storage, std::forward<Args>(args)...);
   }
 
-  static callback from_address(void *addr) noexcept {
-    callback cb;
-    cb.m_base =
-        std::unique_ptr<_callback_base>(static_cast<_callback_base *>(addr));
-    return cb;
+  void operator()(multishot_call_t, Args... args) const {
+    assert(m_ops);
+    m_ops->m_call(const_cast<unsigned char *>(m_storage),
+                  std::forward<Args>(args)...);
   }
 
-  explicit operator bool() const noexcept { return m_base != nullptr; }
+  explicit operator bool() const noexcept { return m_ops != nullptr; }
 };
 
 #endif // CALLBACK_HPP
@@ -0,0 +1,473 @@
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include "bytes_buffer.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// HPACK (RFC 7541), the header compression of HTTP/2: a static table, a
+// dynamic table per direction, integers with an n-bit prefix and strings
+// that may be Huffman coded.
+
+struct hpack_field {
+  std::string_view m_name;
+  std::string_view m_value;
+};
+
+// Appendix A; index 1 is the first entry
+inline constexpr hpack_field k_hpack_static[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+inline constexpr size_t k_hpack_static_size =
+    sizeof(k_hpack_static) / sizeof(k_hpack_static[0]);
+
+// Appendix B, code lengths in bits by symbol; 256 is EOS. The code is
+// canonical, so the codes themselves follow from the lengths.
+inline constexpr uint8_t k_huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+struct _huffman_tables {
+  uint32_t m_codes[257] = {};
+  // canonical decoding: the codes of each length are consecutive, from
+  // m_first[len], and their symbols are m_sorted[m_offset[len]...]
+  uint32_t m_first[31] = {};
+  uint16_t m_count[31] = {};
+  uint16_t m_offset[31] = {};
+  uint16_t m_sorted[257] = {};
+};
+
+constexpr _huffman_tables _make_huffman_tables() {
+  _huffman_tables t;
+  uint32_t code = 0;
+  unsigned prev = 0;
+  uint16_t n = 0;
+  for (unsigned len = 1; len <= 30; len++) {
+    t.m_offset[len] = n;
+    for (unsigned sym = 0; sym < 257; sym++) {
+      if (k_huffman_lengths[sym] != len) {
+        continue;
+      }
+      if (n != 0) {
+        code = (code + 1) << (len - prev);
+      }
+      prev = len;
+      if (t.m_count[len]++ == 0) {
+        t.m_first[len] = code;
+      }
+      t.m_codes[sym] = code;
+      t.m_sorted[n++] = static_cast<uint16_t>(sym);
+    }
+  }
+  return t;
+}
+
+inline constexpr _huffman_tables k_huffman = _make_huffman_tables();
+
+static_assert(k_huffman.m_codes['0'] == 0x0 && k_huffman.m_codes['a'] == 0x3 &&
+              k_huffman.m_codes[' '] == 0x14 &&
+              k_huffman.m_codes[256] == 0x3fffffff);
+
+inline size_t huffman_encoded_size(std::string_view s) noexcept {
+  size_t bits = 0;
+  for (char c : s) {
+    bits += k_huffman_lengths[static_cast<uint8_t>(c)];
+  }
+  return (bits + 7) / 8;
+}
+
+inline void huffman_encode(std::string_view s, bytes_buffer &out) {
+  uint64_t bits = 0;
+  unsigned nbits = 0;
+  for (char c : s) {
+    auto sym = static_cast<uint8_t>(c);
+    bits = bits << k_huffman_lengths[sym] | k_huffman.m_codes[sym];
+    nbits += k_huffman_lengths[sym];
+    while (nbits >= 8) {
+      nbits -= 8;
+      out.push_back(static_cast<char>(bits >> nbits));
+    }
+  }
+  if (nbits != 0) { // padded with the most significant bits of EOS
+    out.push_back(static_cast<char>(bits << (8 - nbits) | 0xff >> nbits));
+  }
+}
+
+// False on invalid input: a code running into the padding, padding longer
+// than 7 bits or not all ones, or EOS.
+inline bool huffman_decode(std::string_view in, std::string &out) {
+  uint64_t bits = 0; // left-aligned
+  unsigned nbits = 0;
+  size_t i = 0;
+  while (true) {
+    while (nbits <= 56 && i < in.size()) {
+      bits |= uint64_t(static_cast<uint8_t>(in[i++])) << (56 - nbits);
+      nbits += 8;
+    }
+    if (nbits == 0) {
+      return true;
+    }
+    unsigned len = 5; // the shortest code
+    uint32_t code = 0;
+    for (; len <= 30 && len <= nbits; len++) {
+      code = static_cast<uint32_t>(bits >> (64 - len));
+      if (code - k_huffman.m_first[len] < k_huffman.m_count[len]) {
+        break;
+      }
+    }
+    if (len > 30) {
+      return false;
+    }
+    if (len > nbits) { // what is left must be padding
+      return i == in.size() && nbits < 8 &&
+             bits >> (64 - nbits) == (uint64_t(1) << nbits) - 1;
+    }
+    uint16_t sym =
+        k_huffman.m_sorted[k_huffman.m_offset[len] + code -
+                           k_huffman.m_first[len]];
+    if (sym == 256) {
+      return false;
+    }
+    out.push_back(static_cast<char>(sym));
+    bits <<= len;
+    nbits -= len;
+  }
+}
+
+// An integer with a `prefix`-bit prefix; `flags` fills the bits above it.
+inline void hpack_encode_int(bytes_buffer &out, uint8_t flags, unsigned prefix,
+                             uint64_t value) {
+  uint64_t max = (uint64_t(1) << prefix) - 1;
+  if (value < max) {
+    out.push_back(static_cast<char>(flags | value));
+    return;
+  }
+  out.push_back(static_cast<char>(flags | max));
+  value -= max;
+  while (value >= 128) {
+    out.push_back(static_cast<char>(0x80 | (value & 0x7f)));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+// Consumes an integer from `in`; false if it is cut short or too large.
+inline bool hpack_decode_int(std::string_view &in, unsigned prefix,
+                             uint64_t &value) {
+  if (in.empty()) {
+    return false;
+  }
+  uint64_t max = (uint64_t(1) << prefix) - 1;
+  value = static_cast<uint8_t>(in[0]) & max;
+  in.remove_prefix(1);
+  if (value < max) {
+    return true;
+  }
+  for (unsigned shift = 0; shift <= 28; shift += 7) {
+    if (in.empty()) {
+      return false;
+    }
+    auto b = static_cast<uint8_t>(in[0]);
+    in.remove_prefix(1);
+    value += uint64_t(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false; // beyond 2^32: nothing here is that large
+}
+
+// Huffman coded when that is shorter.
+inline void hpack_encode_string(bytes_buffer &out, std::string_view s) {
+  size_t huffman = huffman_encoded_size(s);
+  if (huffman < s.size()) {
+    hpack_encode_int(out, 0x80, 7, huffman);
+    huffman_encode(s, out);
+  } else {
+    hpack_encode_int(out, 0, 7, s.size());
+    out.append(s);
+  }
+}
+
+inline bool hpack_decode_string(std::string_view &in, std::string &out) {
+  bool huffman = !in.empty() && (in[0] & 0x80);
+  uint64_t len;
+  if (!hpack_decode_int(in, 7, len) || len > in.size()) {
+    return false;
+  }
+  std::string_view s = in.substr(0, len);
+  in.remove_prefix(len);
+  out.clear();
+  if (huffman) {
+    return huffman_decode(s, out);
+  }
+  out.assign(s);
+  return true;
+}
+
+// The dynamic table of one direction, newest entry first. Each entry
+// counts its name and value plus 32 bytes against m_max_size.
+struct hpack_table {
+  std::deque<std::pair<std::string, std::string>> m_entries;
+  size_t m_size = 0;
+  size_t m_max_size = 4096;
+
+  static size_t entry_size(std::string_view name, std::string_view value) {
+    return name.size() + value.size() + 32;
+  }
+
+  void set_max_size(size_t max) {
+    m_max_size = max;
+    _evict(0);
+  }
+
+  // An entry larger than the whole table just empties it.
+  void insert(std::string_view name, std::string_view value) {
+    size_t size = entry_size(name, value);
+    _evict(size);
+    if (size > m_max_size) {
+      return;
+    }
+    m_entries.emplace_front(name, value);
+    m_size += size;
+  }
+
+  // 1-based over the static table, then this one; false if out of range
+  bool get(uint64_t index, std::string_view &name,
+           std::string_view &value) const {
+    if (index == 0) {
+      return false;
+    }
+    if (index <= k_hpack_static_size) {
+      name = k_hpack_static[index - 1].m_name;
+      value = k_hpack_static[index - 1].m_value;
+      return true;
+    }
+    index -= k_hpack_static_size + 1;
+    if (index >= m_entries.size()) {
+      return false;
+    }
+    name = m_entries[index].first;
+    value = m_entries[index].second;
+    return true;
+  }
+
+  void _evict(size_t room) {
+    while (!m_entries.empty() && m_size + room > m_max_size) {
+      auto &last = m_entries.back();
+      m_size -= entry_size(last.first, last.second);
+      m_entries.pop_back();
+    }
+  }
+};
+
+struct hpack_decoder {
+  hpack_table m_table;
+  // SETTINGS_HEADER_TABLE_SIZE as we announce it (the default)
+  size_t m_max_table_size = 4096;
+  std::string m_name; // scratch
+  std::string m_value;
+
+  // Decodes a header block, calling emit(name, value) for each field in
+  // order; the views die with the call. False on a compression error, after
+  // which the table is out of step and the connection has to go.
+  template <class Emit> bool decode(std::string_view in, Emit &&emit) {
+    bool fields = false;
+    while (!in.empty()) {
+      auto b = static_cast<uint8_t>(in[0]);
+      uint64_t index;
+      if (b & 0x80) { // indexed field
+        std::string_view name, value;
+        if (!hpack_decode_int(in, 7, index) ||
+            !m_table.get(index, name, value)) {
+          return false;
+        }
+        emit(name, value);
+        fields = true;
+        continue;
+      }
+      if ((b & 0xe0) == 0x20) { // table size update, before any field
+        if (fields || !hpack_decode_int(in, 5, index) ||
+            index > m_max_table_size) {
+          return false;
+        }
+        m_table.set_max_size(index);
+        continue;
+      }
+      // literal, with incremental indexing (01) or without (0000, 0001)
+      bool indexing = b & 0x40;
+      if (!hpack_decode_int(in, indexing ? 6 : 4, index)) {
+        return false;
+      }
+      if (index != 0) {
+        std::string_view name, value;
+        if (!m_table.get(index, name, value)) {
+          return false;
+        }
+        m_name.assign(name); // an insert may evict the entry it came from
+      } else if (!hpack_decode_string(in, m_name)) {
+        return false;
+      }
+      if (!hpack_decode_string(in, m_value)) {
+        return false;
+      }
+      emit(std::string_view(m_name), std::string_view(m_value));
+      fields = true;
+      if (indexing) {
+        m_table.insert(m_name, m_value);
+      }
+    }
+    return true;
+  }
+};
+
+// Response headers repeat from one response to the next (server, content
+// type, often the date), so fields are added to the dynamic table and sent
+// as a one-byte index afterwards. Fields that change every time are not
+// indexed, so they do not push the useful ones out.
+struct hpack_encoder {
+  hpack_table m_table;
+  bool m_size_update = false; // owed at the start of the next block
+
+  // the peer's SETTINGS_HEADER_TABLE_SIZE; we never use more than 4096
+  void set_max_table_size(size_t peer_max) {
+    size_t max = peer_max < 4096 ? peer_max : 4096;
+    if (max != m_table.m_max_size) {
+      m_table.set_max_size(max);
+      m_size_update = true;
+    }
+  }
+
+  void begin_block(bytes_buffer &out) {
+    if (m_size_update) {
+      hpack_encode_int(out, 0x20, 5, m_table.m_max_size);
+      m_size_update = false;
+    }
+  }
+
+  // `name` in lower case
+  void encode(bytes_buffer &out, std::string_view name,
+              std::string_view value, bool index = true) {
+    size_t name_index = 0;
+    for (size_t i = 0; i < k_hpack_static_size; i++) {
+      const hpack_field &field = k_hpack_static[i];
+      if (field.m_name.size() == name.size() && field.m_name == name) {
+        if (field.m_value == value) {
+          hpack_encode_int(out, 0x80, 7, i + 1);
+          return;
+        }
+        if (name_index == 0) {
+          name_index = i + 1;
+        }
+      }
+    }
+    for (size_t i = 0; i < m_table.m_entries.size(); i++) {
+      const auto &[entry_name, entry_value] = m_table.m_entries[i];
+      if (entry_name == name) {
+        size_t at = k_hpack_static_size + 1 + i;
+        if (entry_value == value) {
+          hpack_encode_int(out, 0x80, 7, at);
+          return;
+        }
+        if (name_index == 0) {
+          name_index = at;
+        }
+      }
+    }
+    if (index) {
+      hpack_encode_int(out, 0x40, 6, name_index);
+    } else {
+      hpack_encode_int(out, 0, 4, name_index);
+    }
+    if (name_index == 0) {
+      hpack_encode_string(out, name);
+    }
+    hpack_encode_string(out, value);
+    if (index) {
+      m_table.insert(name, value);
+    }
+  }
+};
+
+#endif // HPACK_HPP
@@ -0,0 +1,1024 @@
+#ifndef HTTP2_HPP
+#define HTTP2_HPP
+
+#include "buffer_pool.hpp"
+#include "bytes_buffer.hpp"
+#include "hpack.hpp"
+#include "http_parser.hpp"
+#include "logger.hpp"
+#include "write_queue.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// HTTP/2 over cleartext (RFC 9113), server side. h2_session turns the
+// bytes of a connection into requests and responses into frames; it does
+// no I/O of its own. Requests come out re-encoded as HTTP/1.1, so the
+// same parser and handlers serve both protocols, and the HTTP/1.1
+// responses the handlers queue are re-framed as HEADERS and DATA.
+
+inline constexpr std::string_view k_h2_preface =
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+enum class h2_frame : uint8_t {
+  data,
+  headers,
+  priority,
+  rst_stream,
+  settings,
+  push_promise,
+  ping,
+  goaway,
+  window_update,
+  continuation,
+};
+
+enum class h2_error : uint32_t {
+  no_error,
+  protocol_error,
+  internal_error,
+  flow_control_error,
+  settings_timeout,
+  stream_closed,
+  frame_size_error,
+  refused_stream,
+  cancel,
+  compression_error,
+  connect_error,
+  enhance_your_calm,
+};
+
+inline constexpr uint8_t k_h2_end_stream = 0x1;
+inline constexpr uint8_t k_h2_ack = 0x1;
+inline constexpr uint8_t k_h2_end_headers = 0x4;
+inline constexpr uint8_t k_h2_padded = 0x8;
+inline constexpr uint8_t k_h2_priority = 0x20;
+
+enum class h2_setting : uint16_t {
+  header_table_size = 1,
+  enable_push,
+  max_concurrent_streams,
+  initial_window_size,
+  max_frame_size,
+  max_header_list_size,
+};
+
+struct h2_stream {
+  uint32_t m_id = 0;
+  std::chrono::steady_clock::time_point m_start; // HEADERS received
+  std::string m_head; // request line and fields, as HTTP/1.1
+  std::string m_body;
+  int64_t m_send_window = 0;
+  int64_t m_recv_window = 0;
+  // response body not sent yet for lack of flow-control window
+  std::deque<write_queue::_chunk> m_pending;
+  size_t m_pending_offset = 0; // into m_pending.front()
+  bool m_remote_closed = false; // END_STREAM received
+  bool m_local_closed = false;  // END_STREAM sent
+  bool m_responded = false;
+  bool m_handed_out = false; // by next_request(), with its body
+};
+
+// One HTTP/2 connection. consume() takes what the socket delivered and
+// queues whatever it answers by itself (SETTINGS and PING acks, window
+// updates, resets, GOAWAY) in m_out; next_request() hands out the streams
+// whose request is complete; respond() frames a response. Response bodies
+// are sent as far as flow control allows and the rest when the client
+// grants more window, one frame per stream in turn.
+struct h2_session {
+  static constexpr uint32_t k_max_streams = 100;
+  // receive window of the connection and of each stream
+  static constexpr int64_t k_window = 1 << 20;
+  static constexpr int64_t k_default_window = 65535;
+  static constexpr int64_t k_max_window = 0x7fffffff;
+  static constexpr size_t k_max_frame = 16384; // what we accept
+  // the request head is replayed through the HTTP/1 parser
+  static constexpr size_t k_max_header_list =
+      http11_zero_copy_parser::k_max_header_bytes;
+  // the limit of HTTP/1.1 bodies; larger gets a 413
+  static constexpr size_t k_max_body = http_request_parser<>::k_max_body;
+  // request bodies held over all streams; see _refill_window()
+  static constexpr size_t k_max_buffered = 2 * k_max_body;
+  // DATA is produced until m_out holds this much; see flush_pending()
+  static constexpr size_t k_max_out = 64 * 1024;
+
+  buffer_pool *m_pool = nullptr;
+  bytes_buffer m_out; // frames to send
+  std::string m_in;   // a partial frame
+  size_t m_preface_left = k_h2_preface.size();
+  bool m_settings_seen = false;
+  hpack_decoder m_decoder;
+  hpack_encoder m_encoder;
+  std::vector<std::unique_ptr<h2_stream>> m_streams;
+  std::deque<uint32_t> m_ready; // streams with a whole request, in order
+  uint32_t m_last_stream = 0;  // highest stream the client opened
+  // a header block arriving in CONTINUATION frames
+  uint32_t m_continuation = 0;
+  bool m_continuation_end_stream = false;
+  std::string m_block;
+  int64_t m_peer_initial_window = k_default_window;
+  size_t m_peer_max_frame = 16384;
+  int64_t m_send_window = k_default_window;
+  int64_t m_recv_window = k_window;
+  size_t m_buffered = 0; // request bodies not handed out yet
+  bool m_goaway_sent = false; // after a connection error: close
+  bool m_peer_goaway = false; // close once the open streams are done
+  http_response_parser<> m_response; // reads the handlers' responses
+  bytes_buffer m_header_block;       // scratch
+  std::string m_name;                // scratch
+
+  explicit h2_session(buffer_pool *pool) : m_pool(pool) {
+    m_out = _take_buffer();
+    // our preface: SETTINGS, then the connection window raised to ours
+    _frame_header(18, h2_frame::settings, 0, 0);
+    _setting(h2_setting::max_concurrent_streams, k_max_streams);
+    _setting(h2_setting::initial_window_size, k_window);
+    _setting(h2_setting::max_header_list_size, k_max_header_list);
+    _window_update(0, k_window - k_default_window);
+  }
+
+  h2_session(const h2_session &) = delete;
+  h2_session &operator=(const h2_session &) = delete;
+
+  // After a 101 for "Upgrade: h2c": `settings` is the decoded
+  // HTTP2-Settings field, applied without an ack, and stream 1 is the
+  // upgraded request, answered with respond() as usual. False if the
+  // settings are invalid.
+  bool upgrade(std::string_view settings) {
+    if (settings.size() % 6 != 0 || !_apply_settings(settings)) {
+      return false;
+    }
+    auto stream = _open(1);
+    stream->m_remote_closed = true;
+    m_settings_seen = true; // the upgrade carried them
+    return true;
+  }
+
+  // The connection has to be closed once m_out is sent.
+  [[nodiscard]] bool done() const noexcept {
+    return m_goaway_sent ||
+           (m_peer_goaway && m_streams.empty() && m_ready.empty());
+  }
+
+  // the frames queued so far; m_out starts over with a pooled buffer
+  bytes_buffer take_output() {
+    return std::exchange(m_out, _take_buffer());
+  }
+
+  void consume(std::string_view data) {
+    if (m_goaway_sent) {
+      return;
+    }
+    if (m_preface_left != 0) {
+      size_t n = std::min(m_preface_left, data.size());
+      size_t at = k_h2_preface.size() - m_preface_left;
+      if (data.substr(0, n) != k_h2_preface.substr(at, n)) {
+        _connection_error(h2_error::protocol_error, "bad preface");
+        return;
+      }
+      m_preface_left -= n;
+      data.remove_prefix(n);
+    }
+    if (!m_in.empty()) {
+      m_in.append(data);
+      size_t used = _consume_frames(m_in);
+      m_in.erase(0, used);
+      return;
+    }
+    size_t used = _consume_frames(data);
+    m_in.assign(data.substr(used));
+  }
+
+  // the next stream whose request is complete, or nullptr
+  h2_stream *next_request() {
+    while (!m_ready.empty()) {
+      uint32_t id = m_ready.front();
+      m_ready.pop_front();
+      if (h2_stream *stream = _find(id)) {
+        stream->m_handed_out = true;
+        m_buffered -= stream->m_body.size();
+        _refill_window();
+        return stream;
+      }
+    }
+    _refill_window();
+    return nullptr;
+  }
+
+  // Answers stream `id` with a response queued for HTTP/1.1: `chunks`
+  // from the status line on, possibly ending in file ranges. Fields that
+  // only make sense for one HTTP/1.1 connection are dropped.
+  void respond(uint32_t id, std::vector<write_queue::_chunk> chunks,
+               bool head) {
+    h2_stream *stream = _find(id);
+    if (stream == nullptr || stream->m_responded) { // reset meanwhile
+      _recycle(chunks);
+      return;
+    }
+    http_response_parser<> &res = m_response;
+    res.reset();
+    if (head) {
+      res.set_no_body();
+    }
+    std::deque<write_queue::_chunk> &pending = stream->m_pending;
+    res.set_body_sink([&](std::string_view piece) {
+      if (pending.empty() || pending.back().is_file()) {
+        pending.push_back({_take_buffer(), {nullptr, 0}, {}});
+      }
+      pending.back().m_buf.append(piece);
+    });
+    for (write_queue::_chunk &chunk : chunks) {
+      if (chunk.is_file()) {
+        if (!head) { // its length is in the header already
+          pending.push_back(std::move(chunk));
+        }
+        continue;
+      }
+      std::string_view data = chunk.bytes();
+      while (!data.empty() && !res.failed()) {
+        data.remove_prefix(res.push_chunk(data));
+        if (res.request_finished()) {
+          break;
+        }
+      }
+    }
+    if (res.failed() || !res.header_finished()) {
+      LOG_ERROR("h2: stream {}: malformed response", id);
+      _recycle(chunks);
+      reset_stream(id, h2_error::internal_error);
+      return;
+    }
+    stream->m_responded = true;
+    _send_headers(*stream, res);
+    _recycle(chunks);
+    res.reset(); // drops the sink, which refers to the stream
+    _reap();
+  }
+
+  // Sends pending response data, one frame per stream in turn, while
+  // windows and k_max_out allow. Call again once m_out has gone out.
+  void flush_pending() {
+    bool progress = true;
+    while (progress && m_send_window > 0 && m_out.size() < k_max_out) {
+      progress = false;
+      for (auto &stream : m_streams) {
+        progress = _send_data_frame(*stream) || progress;
+      }
+    }
+    _reap();
+  }
+
+  // frames
+
+  size_t _consume_frames(std::string_view data) {
+    size_t used = 0;
+    while (!m_goaway_sent && data.size() - used >= 9) {
+      auto p = reinterpret_cast<const uint8_t *>(data.data() + used);
+      size_t length = size_t(p[0]) << 16 | size_t(p[1]) << 8 | p[2];
+      auto type = static_cast<h2_frame>(p[3]);
+      uint8_t flags = p[4];
+      uint32_t stream = _read32(p + 5) & 0x7fffffff;
+      if (length > k_max_frame) {
+        _connection_error(h2_error::frame_size_error, "frame too large");
+        break;
+      }
+      if (data.size() - used - 9 < length) {
+        break;
+      }
+      _on_frame(type, flags, stream, data.substr(used + 9, length));
+      used += 9 + length;
+    }
+    return used;
+  }
+
+  void _on_frame(h2_frame type, uint8_t flags, uint32_t stream,
+                 std::string_view payload) {
+    if (!m_settings_seen && type != h2_frame::settings) {
+      _connection_error(h2_error::protocol_error, "no SETTINGS first");
+      return;
+    }
+    if (m_continuation != 0 && (type != h2_frame::continuation ||
+                                stream != m_continuation)) {
+      _connection_error(h2_error::protocol_error, "expected CONTINUATION");
+      return;
+    }
+    switch (type) {
+    case h2_frame::data:
+      _on_data(flags, stream, payload);
+      break;
+    case h2_frame::headers:
+      _on_headers(flags, stream, payload);
+      break;
+    case h2_frame::priority:
+      if (stream == 0) {
+        _connection_error(h2_error::protocol_error, "PRIORITY on 0");
+      } else if (payload.size() != 5) {
+        reset_stream(stream, h2_error::frame_size_error);
+      }
+      break;
+    case h2_frame::rst_stream:
+      _on_rst_stream(stream, payload);
+      break;
+    case h2_frame::settings:
+      _on_settings(flags, stream, payload);
+      break;
+    case h2_frame::push_promise:
+      _connection_error(h2_error::protocol_error, "PUSH_PROMISE");
+      break;
+    case h2_frame::ping:
+      _on_ping(flags, stream, payload);
+      break;
+    case h2_frame::goaway:
+      if (stream != 0) {
+        _connection_error(h2_error::protocol_error, "GOAWAY on a stream");
+      } else {
+        m_peer_goaway = true;
+      }
+      break;
+    case h2_frame::window_update:
+      _on_window_update(stream, payload);
+      break;
+    case h2_frame::continuation:
+      _on_continuation(flags, stream, payload);
+      break;
+    default: // unknown types are ignored
+      break;
+    }
+  }
+
+  // strips the padding of a DATA or HEADERS payload
+  bool _unpad(uint8_t flags, std::string_view &payload) {
+    if ((flags & k_h2_padded) == 0) {
+      return true;
+    }
+    if (payload.empty() ||
+        static_cast<uint8_t>(payload[0]) >= payload.size()) {
+      _connection_error(h2_error::protocol_error, "bad padding");
+      return false;
+    }
+    size_t pad = static_cast<uint8_t>(payload[0]);
+    payload = payload.substr(1, payload.size() - 1 - pad);
+    return true;
+  }
+
+  void _on_data(uint8_t flags, uint32_t id, std::string_view payload) {
+    if (id == 0) {
+      _connection_error(h2_error::protocol_error, "DATA on 0");
+      return;
+    }
+    int64_t length = static_cast<int64_t>(payload.size());
+    m_recv_window -= length; // padding included
+    if (m_recv_window < 0) {
+      _connection_error(h2_error::flow_control_error, "window exceeded");
+      return;
+    }
+    if (!_unpad(flags, payload)) {
+      return;
+    }
+    _on_stream_data(flags, id, payload, length);
+    _refill_window();
+  }
+
+  void _on_stream_data(uint8_t flags, uint32_t id, std::string_view payload,
+                       int64_t length) {
+    h2_stream *stream = _find(id);
+    if (stream == nullptr || stream->m_remote_closed) {
+      if (id > m_last_stream) {
+        _connection_error(h2_error::protocol_error, "DATA on idle stream");
+      } else {
+        reset_stream(id, h2_error::stream_closed);
+      }
+      return;
+    }
+    stream->m_recv_window -= length;
+    if (stream->m_recv_window < 0) {
+      reset_stream(id, h2_error::flow_control_error);
+      return;
+    }
+    if (stream->m_body.size() + payload.size() > k_max_body) {
+      _refuse(*stream, 413);
+      return;
+    }
+    stream->m_body.append(payload);
+    m_buffered += payload.size();
+    if (flags & k_h2_end_stream) {
+      _end_request(*stream);
+    } else if (stream->m_recv_window <= k_window / 2) {
+      _window_update(id, k_window - stream->m_recv_window);
+      stream->m_recv_window = k_window;
+    }
+  }
+
+  // Gives the connection window back once half of it is used, as long as
+  // the bodies held leave room for a whole window more. Otherwise it waits
+  // for next_request() to hand some out; with no request complete, none
+  // would be, so the largest uploads are refused rather than stalling
+  // every stream.
+  void _refill_window() {
+    if (m_recv_window > k_window / 2) {
+      return;
+    }
+    while (m_buffered > k_max_buffered - k_window && m_ready.empty()) {
+      h2_stream *largest = nullptr;
+      for (auto &s : m_streams) {
+        if (!s->m_remote_closed &&
+            (largest == nullptr ||
+             s->m_body.size() > largest->m_body.size())) {
+          largest = s.get();
+        }
+      }
+      if (largest == nullptr) {
+        break;
+      }
+      _refuse(*largest, 413);
+    }
+    if (m_buffered > k_max_buffered - k_window) {
+      return;
+    }
+    _window_update(0, k_window - m_recv_window);
+    m_recv_window = k_window;
+  }
+
+  void _on_headers(uint8_t flags, uint32_t id, std::string_view payload) {
+    if (id == 0) {
+      _connection_error(h2_error::protocol_error, "HEADERS on 0");
+      return;
+    }
+    if (!_unpad(flags, payload)) {
+      return;
+    }
+    if (flags & k_h2_priority) {
+      if (payload.size() < 5) {
+        _connection_error(h2_error::frame_size_error, "short HEADERS");
+        return;
+      }
+      payload.remove_prefix(5);
+    }
+    m_block.assign(payload);
+    bool end_stream = flags & k_h2_end_stream;
+    if (flags & k_h2_end_headers) {
+      _end_headers(id, end_stream);
+    } else {
+      m_continuation = id;
+      m_continuation_end_stream = end_stream;
+    }
+  }
+
+  void _on_continuation(uint8_t flags, uint32_t id,
+                        std::string_view payload) {
+    if (m_continuation == 0 || id != m_continuation) {
+      _connection_error(h2_error::protocol_error, "stray CONTINUATION");
+      return;
+    }
+    if (m_block.size() + payload.size() > k_max_header_list) {
+      _connection_error(h2_error::enhance_your_calm, "header block too large");
+      return;
+    }
+    m_block.append(payload);
+    if (flags & k_h2_end_headers) {
+      m_continuation = 0;
+      _end_headers(id, m_continuation_end_stream);
+    }
+  }
+
+  // A whole header block: a new request, or the trailers of one.
+  void _end_headers(uint32_t id, bool end_stream) {
+    if (h2_stream *stream = _find(id)) {
+      if (stream->m_remote_closed || !end_stream) {
+        _connection_error(h2_error::protocol_error, "unexpected HEADERS");
+        return;
+      }
+      if (!m_decoder.decode(m_block, [](std::string_view, std::string_view) {
+          })) { // trailers are dropped
+        _connection_error(h2_error::compression_error, "bad header block");
+        return;
+      }
+      _end_request(*stream);
+      return;
+    }
+    if (id % 2 == 0 || id <= m_last_stream) {
+      _connection_error(h2_error::protocol_error, "bad stream id");
+      return;
+    }
+    m_last_stream = id;
+    auto stream = std::make_unique<h2_stream>();
+    bool valid = _decode_request(*stream);
+    if (m_goaway_sent) {
+      return;
+    }
+    if (!valid) {
+      reset_stream(id, h2_error::protocol_error);
+      return;
+    }
+    if (m_streams.size() >= k_max_streams || m_peer_goaway) {
+      reset_stream(id, h2_error::refused_stream);
+      return;
+    }
+    h2_stream *s = _open(id, std::move(stream));
+    if (end_stream) {
+      _end_request(*s);
+    }
+  }
+
+  // The request line and fields as HTTP/1.1, into m_head. Content-Length
+  // is left out: _end_request() adds the length of the body received.
+  // False if the request is malformed.
+  bool _decode_request(h2_stream &stream) {
+    std::string method, scheme, path, authority, cookie;
+    std::string &fields = stream.m_head;
+    bool valid = true, regular = false, host = false;
+    size_t list_size = 0;
+    bool ok = m_decoder.decode(m_block, [&](std::string_view name,
+                                            std::string_view value) {
+      list_size += name.size() + value.size() + 32;
+      if (!valid || list_size > k_max_header_list) {
+        valid = false;
+        return;
+      }
+      if (!name.empty() && name[0] == ':') {
+        std::string *slot = name == ":method"      ? &method
+                            : name == ":scheme"    ? &scheme
+                            : name == ":path"      ? &path
+                            : name == ":authority" ? &authority
+                                                   : nullptr;
+        valid = !regular && slot != nullptr && slot->empty() &&
+                !value.empty() && _valid_value(value);
+        if (valid) {
+          slot->assign(value);
+        }
+        return;
+      }
+      regular = true;
+      if (!_valid_field(name, value)) {
+        valid = false;
+        return;
+      }
+      switch (classify_field(name)) {
+      case http_field::connection:
+      case http_field::transfer_encoding:
+      case http_field::upgrade:
+        valid = false;
+        return;
+      case http_field::content_length:
+        return;
+      case http_field::host:
+        host = true;
+        break;
+      case http_field::cookie: // may come split, RFC 9113 8.2.3
+        if (!cookie.empty()) {
+          cookie.append("; ");
+        }
+        cookie.append(value);
+        return;
+      case http_field::unknown:
+        if (name == "keep-alive" || name == "proxy-connection" ||
+            (name == "te" && value != "trailers")) {
+          valid = false;
+          return;
+        }
+        break;
+      default:
+        break;
+      }
+      fields.append(name);
+      fields.append(": ");
+      fields.append(value);
+      fields.append("\r\n");
+    });
+    if (!ok) {
+      _connection_error(h2_error::compression_error, "bad header block");
+      return false;
+    }
+    if (!valid || method.empty() || scheme.empty() || path.empty()) {
+      return false;
+    }
+    std::string head = method + " " + path + " HTTP/1.1\r\n";
+    if (!host && !authority.empty()) {
+      head.append("host: ").append(authority).append("\r\n");
+    }
+    head.append(fields);
+    if (!cookie.empty()) {
+      head.append("cookie: ").append(cookie).append("\r\n");
+    }
+    stream.m_head = std::move(head);
+    return true;
+  }
+
+  static bool _valid_value(std::string_view value) {
+    for (char c : value) {
+      if (c == '\0' || c == '\r' || c == '\n') {
+        return false;
+      }
+    }
+    return value.empty() ||
+           (value.front() != ' ' && value.front() != '\t' &&
+            value.back() != ' ' && value.back() != '\t');
+  }
+
+  // lower case tokens only, RFC 9113 8.2.1
+  static bool _valid_field(std::string_view name, std::string_view value) {
+    if (name.empty()) {
+      return false;
+    }
+    for (char c : name) {
+      auto u = static_cast<unsigned char>(c);
+      if (u <= 0x20 || u >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z')) {
+        return false;
+      }
+    }
+    return _valid_value(value);
+  }
+
+  void _end_request(h2_stream &stream) {
+    stream.m_remote_closed = true;
+    if (!stream.m_body.empty()) {
+      char digits[24];
+      auto end = std::to_chars(digits, digits + sizeof(digits),
+                               stream.m_body.size())
+                     .ptr;
+      stream.m_head.append("content-length: ");
+      stream.m_head.append(digits, end);
+      stream.m_head.append("\r\n");
+    }
+    stream.m_head.append("\r\n");
+    m_ready.push_back(stream.m_id);
+  }
+
+  void _on_rst_stream(uint32_t id, std::string_view payload) {
+    if (payload.size() != 4) {
+      _connection_error(h2_error::frame_size_error, "bad RST_STREAM");
+      return;
+    }
+    if (id == 0 || id > m_last_stream) {
+      _connection_error(h2_error::protocol_error, "RST_STREAM on idle");
+      return;
+    }
+    _close(id);
+  }
+
+  void _on_settings(uint8_t flags, uint32_t id, std::string_view payload) {
+    if (id != 0) {
+      _connection_error(h2_error::protocol_error, "SETTINGS on a stream");
+      return;
+    }
+    if (flags & k_h2_ack) {
+      if (!payload.empty()) {
+        _connection_error(h2_error::frame_size_error, "SETTINGS ack");
+      }
+      return;
+    }
+    if (payload.size() % 6 != 0) {
+      _connection_error(h2_error::frame_size_error, "SETTINGS length");
+      return;
+    }
+    m_settings_seen = true;
+    if (!_apply_settings(payload)) {
+      return;
+    }
+    _frame_header(0, h2_frame::settings, k_h2_ack, 0);
+    flush_pending(); // the windows may have grown
+  }
+
+  bool _apply_settings(std::string_view payload) {
+    for (size_t i = 0; i < payload.size(); i += 6) {
+      auto p = reinterpret_cast<const uint8_t *>(payload.data() + i);
+      auto id = static_cast<h2_setting>(p[0] << 8 | p[1]);
+      uint32_t value = _read32(p + 2);
+      switch (id) {
+      case h2_setting::header_table_size:
+        m_encoder.set_max_table_size(value);
+        break;
+      case h2_setting::enable_push:
+        if (value > 1) {
+          _connection_error(h2_error::protocol_error, "ENABLE_PUSH");
+          return false;
+        }
+        break;
+      case h2_setting::initial_window_size: {
+        if (value > k_max_window) {
+          _connection_error(h2_error::flow_control_error, "window size");
+          return false;
+        }
+        int64_t delta = int64_t(value) - m_peer_initial_window;
+        m_peer_initial_window = value;
+        for (auto &stream : m_streams) {
+          stream->m_send_window += delta;
+          if (stream->m_send_window > k_max_window) {
+            _connection_error(h2_error::flow_control_error, "window size");
+            return false;
+          }
+        }
+        break;
+      }
+      case h2_setting::max_frame_size:
+        if (value < 16384 || value > 16777215) {
+          _connection_error(h2_error::protocol_error, "MAX_FRAME_SIZE");
+          return false;
+        }
+        m_peer_max_frame = value;
+        break;
+      default:
+        break;
+      }
+    }
+    return true;
+  }
+
+  void _on_ping(uint8_t flags, uint32_t id, std::string_view payload) {
+    if (id != 0) {
+      _connection_error(h2_error::protocol_error, "PING on a stream");
+      return;
+    }
+    if (payload.size() != 8) {
+      _connection_error(h2_error::frame_size_error, "PING length");
+      return;
+    }
+    if ((flags & k_h2_ack) == 0) {
+      _frame_header(8, h2_frame::ping, k_h2_ack, 0);
+      m_out.append(payload);
+    }
+  }
+
+  void _on_window_update(uint32_t id, std::string_view payload) {
+    if (payload.size() != 4) {
+      _connection_error(h2_error::frame_size_error, "WINDOW_UPDATE length");
+      return;
+    }
+    uint32_t increment =
+        _read32(reinterpret_cast<const uint8_t *>(payload.data())) &
+        0x7fffffff;
+    if (id == 0) {
+      if (increment == 0) {
+        _connection_error(h2_error::protocol_error, "zero WINDOW_UPDATE");
+        return;
+      }
+      m_send_window += increment;
+      if (m_send_window > k_max_window) {
+        _connection_error(h2_error::flow_control_error, "window overflow");
+        return;
+      }
+      flush_pending();
+      return;
+    }
+    h2_stream *stream = _find(id);
+    if (stream == nullptr) {
+      if (id > m_last_stream) {
+        _connection_error(h2_error::protocol_error, "WINDOW_UPDATE on idle");
+      }
+      return; // closed meanwhile
+    }
+    if (increment == 0) {
+      reset_stream(id, h2_error::protocol_error);
+      return;
+    }
+    stream->m_send_window += increment;
+    if (stream->m_send_window > k_max_window) {
+      reset_stream(id, h2_error::flow_control_error);
+      return;
+    }
+    while (_send_data_frame(*stream)) {
+    }
+    _reap();
+  }
+
+  // responses
+
+  void _send_headers(h2_stream &stream, http_response_parser<> &res) {
+    bytes_buffer &block = m_header_block;
+    block.clear();
+    m_encoder.begin_block(block);
+    char status[4];
+    auto end = std::to_chars(status, status + sizeof(status), res.status()).ptr;
+    m_encoder.encode(block, ":status",
+                     std::string_view(status, size_t(end - status)));
+    for (const auto &[key, value] : res.headers()) {
+      http_field field = classify_field(key);
+      if (field == http_field::connection ||
+          field == http_field::transfer_encoding ||
+          field == http_field::upgrade || iequals_lower(key, "keep-alive") ||
+          iequals_lower(key, "proxy-connection")) {
+        continue;
+      }
+      m_name.assign(key);
+      std::transform(m_name.begin(), m_name.end(), m_name.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      // these change from one response to the next
+      bool index = field != http_field::content_length &&
+                   m_name != "etag" && m_name != "last-modified" &&
+                   m_name != "content-range" && value.size() < 256;
+      m_encoder.encode(block, m_name, value, index);
+    }
+    bool end_stream = stream.m_pending.empty();
+    std::string_view rest(block);
+    h2_frame type = h2_frame::headers;
+    do {
+      size_t n = std::min(rest.size(), m_peer_max_frame);
+      uint8_t flags = n == rest.size() ? k_h2_end_headers : 0;
+      if (type == h2_frame::headers && end_stream) {
+        flags |= k_h2_end_stream;
+      }
+      _frame_header(n, type, flags, stream.m_id);
+      m_out.append(rest.substr(0, n));
+      rest.remove_prefix(n);
+      type = h2_frame::continuation;
+    } while (!rest.empty());
+    stream.m_local_closed = end_stream;
+    while (_send_data_frame(stream)) {
+    }
+  }
+
+  // One DATA frame of the pending response body, if flow control and
+  // k_max_out allow; the last one ends the stream.
+  bool _send_data_frame(h2_stream &stream) {
+    if (stream.m_pending.empty() || m_out.size() >= k_max_out) {
+      return false;
+    }
+    int64_t window = std::min(m_send_window, stream.m_send_window);
+    if (window <= 0) {
+      return false;
+    }
+    write_queue::_chunk &chunk = stream.m_pending.front();
+    size_t left = chunk.size() - stream.m_pending_offset;
+    size_t n = std::min({left, size_t(window), m_peer_max_frame});
+    bool last = n == left && stream.m_pending.size() == 1;
+    size_t at = m_out.size();
+    m_out.resize(at + 9 + n);
+    if (chunk.is_file()) {
+      const file_range &file = chunk.m_file;
+      off_t offset = file.m_offset + off_t(stream.m_pending_offset);
+      if (pread(file.m_fd, m_out.data() + at + 9, n, offset) != ssize_t(n)) {
+        LOG_ERROR("h2: stream {}: file read failed", stream.m_id);
+        m_out.resize(at);
+        reset_stream(stream.m_id, h2_error::internal_error);
+        return false;
+      }
+    } else {
+      std::memcpy(m_out.data() + at + 9,
+                  chunk.bytes().data() + stream.m_pending_offset, n);
+    }
+    _write_frame_header(m_out.data() + at, n, h2_frame::data,
+                        last ? k_h2_end_stream : 0, stream.m_id);
+    m_send_window -= int64_t(n);
+    stream.m_send_window -= int64_t(n);
+    stream.m_pending_offset += n;
+    if (n == left) {
+      _release(std::move(chunk.m_buf));
+      stream.m_pending.pop_front();
+      stream.m_pending_offset = 0;
+    }
+    stream.m_local_closed = last;
+    return !last;
+  }
+
+  // A request refused before it was read whole: the response, then a
+  // reset so that the client stops sending (RFC 9113 8.1).
+  void _refuse(h2_stream &stream, int status) {
+    bytes_buffer &block = m_header_block;
+    block.clear();
+    m_encoder.begin_block(block);
+    char digits[4];
+    auto end = std::to_chars(digits, digits + sizeof(digits), status).ptr;
+    m_encoder.encode(block, ":status",
+                     std::string_view(digits, size_t(end - digits)));
+    _frame_header(block.size(), h2_frame::headers,
+                  k_h2_end_headers | k_h2_end_stream, stream.m_id);
+    m_out.append(std::string_view(block));
+    reset_stream(stream.m_id, h2_error::no_error);
+  }
+
+  // streams
+
+  h2_stream *_find(uint32_t id) {
+    for (auto &stream : m_streams) {
+      if (stream->m_id == id) {
+        return stream.get();
+      }
+    }
+    return nullptr;
+  }
+
+  h2_stream *_open(uint32_t id,
+                   std::unique_ptr<h2_stream> stream = nullptr) {
+    if (!stream) {
+      stream = std::make_unique<h2_stream>();
+    }
+    stream->m_id = id;
+    stream->m_start = std::chrono::steady_clock::now();
+    stream->m_send_window = m_peer_initial_window;
+    stream->m_recv_window = k_window;
+    m_last_stream = std::max(m_last_stream, id);
+    m_streams.push_back(std::move(stream));
+    return m_streams.back().get();
+  }
+
+  void _close(uint32_t id) {
+    std::erase_if(m_streams, [&](const std::unique_ptr<h2_stream> &s) {
+      if (s->m_id != id) {
+        return false;
+      }
+      if (!s->m_handed_out) {
+        m_buffered -= s->m_body.size();
+      }
+      for (auto &chunk : s->m_pending) {
+        _release(std::move(chunk.m_buf));
+      }
+      return true;
+    });
+  }
+
+  // forgets the streams that are over in both directions
+  void _reap() {
+    std::erase_if(m_streams, [](const std::unique_ptr<h2_stream> &s) {
+      return s->m_remote_closed && s->m_local_closed;
+    });
+  }
+
+  // ends stream `id` abnormally, e.g. when its request cannot be parsed
+  void reset_stream(uint32_t id, h2_error code) {
+    _frame_header(4, h2_frame::rst_stream, 0, id);
+    _append32(static_cast<uint32_t>(code));
+    _close(id);
+  }
+
+  void _connection_error(h2_error code, std::string_view why) {
+    LOG_DEBUG("h2: connection error {}: {}", static_cast<uint32_t>(code),
+              why);
+    _frame_header(8, h2_frame::goaway, 0, 0);
+    _append32(m_last_stream);
+    _append32(static_cast<uint32_t>(code));
+    m_goaway_sent = true;
+  }
+
+  void _window_update(uint32_t id, int64_t increment) {
+    _frame_header(4, h2_frame::window_update, 0, id);
+    _append32(static_cast<uint32_t>(increment));
+  }
+
+  void _setting(h2_setting id, uint32_t value) {
+    auto n = static_cast<uint16_t>(id);
+    m_out.push_back(static_cast<char>(n >> 8));
+    m_out.push_back(static_cast<char>(n));
+    _append32(value);
+  }
+
+  void _frame_header(size_t length, h2_frame type, uint8_t flags,
+                     uint32_t stream) {
+    char header[9];
+    _write_frame_header(header, length, type, flags, stream);
+    m_out.append(std::string_view(header, sizeof(header)));
+  }
+
+  static void _write_frame_header(char *p, size_t length, h2_frame type,
+                                  uint8_t flags, uint32_t stream) {
+    p[0] = static_cast<char>(length >> 16);
+    p[1] = static_cast<char>(length >> 8);
+    p[2] = static_cast<char>(length);
+    p[3] = static_cast<char>(type);
+    p[4] = static_cast<char>(flags);
+    p[5] = static_cast<char>(stream >> 24);
+    p[6] = static_cast<char>(stream >> 16);
+    p[7] = static_cast<char>(stream >> 8);
+    p[8] = static_cast<char>(stream);
+  }
+
+  void _append32(uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      m_out.push_back(static_cast<char>(value >> shift));
+    }
+  }
+
+  static uint32_t _read32(const uint8_t *p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 |
+           p[3];
+  }
+
+  bytes_buffer _take_buffer() {
+    return m_pool ? m_pool->acquire() : bytes_buffer{};
+  }
+
+  void _release(bytes_buffer buf) {
+    if (m_pool) {
+      m_pool->release(std::move(buf));
+    }
+  }
+
+  void _recycle(std::vector<write_queue::_chunk> &chunks) {
+    for (auto &chunk : chunks) {
+      _release(std::move(chunk.m_buf));
+    }
+    chunks.clear();
+  }
+};
+
+#endif // HTTP2_HPP
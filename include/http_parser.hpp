@@ -1,21 +1,31 @@
 #ifndef HTTP_PARSER_HPP
 #define HTTP_PARSER_HPP
 
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#include "simd_scan.hpp"
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
+#include <cstdint>
 #include <map>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 
 using string_map = std::map<std::string, std::string>;
 
+// The original copying parser: lower-cased std::string keys in a std::map.
+// Kept as the baseline for bench_parser; the server and the default
+// template arguments below use http11_zero_copy_parser.
 struct http11_header_parser {
   std::string
       m_header; // "GET / HTTP/1.1\r\nHost: 127.0.0.1:8080\r\nUser-Agent:
                 // curl/7.81.0\r\nAccept: */*"
   std::string m_headline;   // "GET / HTTP/1.1"
   string_map m_header_keys; // {"Host": "127.0.0.1:8080", "Accept": "*/*", ...}
-  std::string m_body;       // The over-reading body (if exists)
   size_t content_length;
   bool m_header_finished;
   bool m_body_finished;
@@ -47,43 +57,628 @@ struct http11_header_parser {
     }
   }
 
-  void push_chunk(std::string_view chunk) {
+  // returns how many bytes of `chunk` belong to the header
+  size_t push_chunk(std::string_view chunk) {
     assert(!m_header_finished);
     size_t old_size = m_header.size();
     m_header.append(chunk);
     std::string_view header = m_header;
-    if (old_size < 4) {
-      old_size = 4;
-    }
-    old_size -= 4; // strip "\r\n\r\n"
-    size_t header_len = header.find("\r\n\r\n", old_size, 4);
-    if (header_len != std::string::npos) {
-      m_header_finished = true;
-      m_body = m_header.substr(header_len + 4);
-      m_header.resize(header_len);
-      _parse_header();
+    size_t from = old_size < 4 ? 0 : old_size - 4; // "\r\n\r\n" may straddle
+    size_t header_len = header.find("\r\n\r\n", from, 4);
+    if (header_len == std::string::npos) {
+      return chunk.size();
     }
+    m_header_finished = true;
+    m_header.resize(header_len);
+    _parse_header();
+    return header_len + 4 - old_size;
   }
 
   [[nodiscard]] bool header_finished() const { return m_header_finished; }
 
+  [[nodiscard]] bool started() const { return !m_header.empty(); }
+
   std::string &headline() { return m_headline; }
 
   std::string &headers_raw() { return m_header; }
 
   string_map &headers() { return m_header_keys; }
 
-  std::string &extra_body() { return m_body; }
+  void reset() {
+    m_header.clear();
+    m_headline.clear();
+    m_header_keys.clear();
+    m_header_finished = false;
+    m_body_finished = false;
+  }
+};
+
+constexpr bool iequals_lower(std::string_view s,
+                             std::string_view lower) noexcept {
+  // `lower` must already be lower case
+  if (s.size() != lower.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < s.size(); i++) {
+    char c = s[i];
+    if ('A' <= c && c <= 'Z')
+      c += 'a' - 'A';
+    if (c != lower[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// whether a comma-separated field value such as "keep-alive, Upgrade"
+// lists `lower`, ignoring case
+constexpr bool has_token_lower(std::string_view list,
+                               std::string_view lower) noexcept {
+  while (!list.empty()) {
+    size_t comma = list.find(',');
+    std::string_view token = list.substr(0, comma);
+    while (!token.empty() && (token.front() == ' ' || token.front() == '\t'))
+      token.remove_prefix(1);
+    while (!token.empty() && (token.back() == ' ' || token.back() == '\t'))
+      token.remove_suffix(1);
+    if (iequals_lower(token, lower)) {
+      return true;
+    }
+    if (comma == std::string_view::npos) {
+      break;
+    }
+    list.remove_prefix(comma + 1);
+  }
+  return false;
+}
+
+// tchar of RFC 9110 5.6.2: what a field name may be made of
+inline constexpr std::array<bool, 256> k_token_chars = [] {
+  std::array<bool, 256> chars{};
+  for (int c = '0'; c <= '9'; c++)
+    chars[c] = true;
+  for (int c = 'a'; c <= 'z'; c++)
+    chars[c] = chars[c - 'a' + 'A'] = true;
+  for (char c : std::string_view("!#$%&'*+-.^_`|~"))
+    chars[static_cast<unsigned char>(c)] = true;
+  return chars;
+}();
+
+constexpr bool is_token(std::string_view s) noexcept {
+  if (s.empty()) {
+    return false;
+  }
+  for (char c : s) {
+    if (!k_token_chars[static_cast<unsigned char>(c)]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static_assert(is_token("Content-Length") && !is_token("Content-Length ") &&
+              !is_token("") && !is_token("a:b"));
+
+// Fields the server itself looks at. The parser tags them as it reads
+// them, so finding one is an array access instead of a scan.
+enum class http_field : uint8_t {
+  host,
+  connection,
+  content_length,
+  content_type,
+  transfer_encoding,
+  expect,
+  upgrade,
+  accept,
+  accept_encoding,
+  user_agent,
+  cookie,
+  authorization,
+  cache_control,
+  range,
+  if_range,
+  if_none_match,
+  if_modified_since,
+  x_forwarded_for,
+  http2_settings,
+  sec_websocket_key,
+  sec_websocket_version,
+  unknown,
+};
+
+inline constexpr size_t k_known_fields =
+    static_cast<size_t>(http_field::unknown);
+
+// lower case, in http_field order
+inline constexpr std::string_view k_field_names[k_known_fields] = {
+    "host",           "connection",        "content-length",
+    "content-type",   "transfer-encoding", "expect",
+    "upgrade",        "accept",            "accept-encoding",
+    "user-agent",     "cookie",            "authorization",
+    "cache-control",  "range",             "if-range",
+    "if-none-match",  "if-modified-since", "x-forwarded-for",
+    "http2-settings", "sec-websocket-key", "sec-websocket-version",
+};
+
+// A switch on the length and the first letter leaves at most one name to
+// compare, case-insensitively and in place.
+constexpr http_field classify_field(std::string_view key) noexcept {
+  using enum http_field;
+  if (key.empty()) {
+    return unknown;
+  }
+  char first = key.front();
+  if ('A' <= first && first <= 'Z') {
+    first += 'a' - 'A';
+  }
+  http_field guess = unknown;
+  switch (key.size()) {
+  case 4: guess = host; break;
+  case 5: guess = range; break;
+  case 6:
+    guess = first == 'a' ? accept : first == 'c' ? cookie : expect;
+    break;
+  case 7: guess = upgrade; break;
+  case 8: guess = if_range; break;
+  case 10: guess = first == 'c' ? connection : user_agent; break;
+  case 12: guess = content_type; break;
+  case 13:
+    guess = first == 'a'   ? authorization
+            : first == 'c' ? cache_control
+                           : if_none_match;
+    break;
+  case 14: guess = first == 'c' ? content_length : http2_settings; break;
+  case 15: guess = first == 'a' ? accept_encoding : x_forwarded_for; break;
+  case 17:
+    guess = first == 't'   ? transfer_encoding
+            : first == 'i' ? if_modified_since
+                           : sec_websocket_key;
+    break;
+  case 21: guess = sec_websocket_version; break;
+  default: return unknown;
+  }
+  return iequals_lower(key, k_field_names[static_cast<size_t>(guess)])
+             ? guess
+             : unknown;
+}
+
+static_assert([] {
+  for (size_t i = 0; i < k_known_fields; i++) {
+    if (classify_field(k_field_names[i]) != static_cast<http_field>(i)) {
+      return false;
+    }
+  }
+  return classify_field("Content-Length") == http_field::content_length &&
+         classify_field("x-custom") == http_field::unknown;
+}());
+
+// Header fields as views into the parser's buffer, in arrival order. Keys
+// keep their original case. Well-known fields also get a slot holding the
+// position of their first occurrence; other keys are compared
+// case-insensitively in place.
+struct header_view_table {
+  using value_type = std::pair<std::string_view, std::string_view>;
+  static constexpr size_t k_max_headers = 64;
+
+  std::array<value_type, k_max_headers> m_entries;
+  size_t m_size = 0;
+  std::array<uint8_t, k_known_fields> m_known{}; // position + 1, 0: absent
+
+  void push_back(const value_type &entry, http_field field) noexcept {
+    if (field != http_field::unknown) {
+      uint8_t &slot = m_known[static_cast<size_t>(field)];
+      if (slot == 0) {
+        slot = static_cast<uint8_t>(m_size + 1);
+      }
+    }
+    m_entries[m_size++] = entry;
+  }
+
+  const value_type *begin() const noexcept { return m_entries.data(); }
+
+  const value_type *end() const noexcept { return m_entries.data() + m_size; }
+
+  size_t size() const noexcept { return m_size; }
+
+  const value_type *find(http_field field) const noexcept {
+    uint8_t slot = m_known[static_cast<size_t>(field)];
+    return slot ? &m_entries[slot - 1] : end();
+  }
+
+  const value_type *find(std::string_view lower_key) const noexcept {
+    if (http_field field = classify_field(lower_key);
+        field != http_field::unknown) {
+      return find(field);
+    }
+    for (const value_type &entry : *this) {
+      if (iequals_lower(entry.first, lower_key)) {
+        return &entry;
+      }
+    }
+    return end();
+  }
+
+  void clear() noexcept {
+    m_size = 0;
+    m_known.fill(0);
+  }
+};
+
+// Allocation-free HTTP/1.1 header parser. Only the header is copied, into
+// one buffer that keeps its capacity: each chunk is scanned in place for
+// line ends with SIMD, and the body and anything pipelined after it stay
+// with the caller. Every accessor returns views into the buffer. Drop-in
+// HeaderParser for _http_parser_base.
+struct http11_zero_copy_parser {
+  struct _field {
+    uint32_t m_key_begin, m_key_len;
+    uint32_t m_value_begin, m_value_len;
+    http_field m_id;
+  };
+
+  bytes_buffer m_buffer;
+  size_t m_line_begin = 0; // start of the line being scanned
+  size_t m_headline_begin = 0;
+  size_t m_headline_len = 0;
+  size_t m_header_len = 0; // headers_raw(): up to the last field's "\r\n"
+  bool m_has_headline = false;
+  bool m_header_finished = false;
+  bool m_too_large = false; // see too_large()
+  bool m_invalid = false;   // a line that is not a valid field
+  std::array<_field, header_view_table::k_max_headers> m_fields;
+  size_t m_nfields = 0;
+  header_view_table m_headers;
+
+  static bool _is_ows(char c) noexcept { return c == ' ' || c == '\t'; }
+
+  // `line` holds the bytes found at `begin` in the buffer. Anything two
+  // parties could read differently fails the message (RFC 9112 5): a name
+  // that is not a token, including whitespace before the colon, obs-fold,
+  // and CR or NUL in the value.
+  void _parse_field(const char *line, size_t begin, size_t len) {
+    const char *colon = scan_char(line, line + len, ':');
+    if (colon == line + len || !is_token({line, size_t(colon - line)})) {
+      m_invalid = true; // also a folded line, which starts with whitespace
+      return;
+    }
+    if (scan_char(colon, line + len, '\r') != line + len ||
+        scan_char(colon, line + len, '\0') != line + len) {
+      m_invalid = true;
+      return;
+    }
+    if (m_nfields == m_fields.size()) {
+      // dropping a field could hide Content-Length or Transfer-Encoding
+      m_too_large = true;
+      return;
+    }
+    size_t key_len = static_cast<size_t>(colon - line);
+    size_t value_begin = key_len + 1;
+    size_t value_end = len;
+    while (value_begin < value_end && _is_ows(line[value_begin]))
+      value_begin++;
+    while (value_end > value_begin && _is_ows(line[value_end - 1]))
+      value_end--;
+    m_fields[m_nfields++] = {static_cast<uint32_t>(begin),
+                             static_cast<uint32_t>(key_len),
+                             static_cast<uint32_t>(begin + value_begin),
+                             static_cast<uint32_t>(value_end - value_begin),
+                             classify_field({line, key_len})};
+  }
+
+  void _finish() {
+    m_header_finished = true;
+    // the buffer stops growing here, so the views stay valid
+    const char *base = m_buffer.data();
+    m_headers.clear();
+    for (size_t i = 0; i < m_nfields; i++) {
+      const _field &f = m_fields[i];
+      m_headers.push_back({{base + f.m_key_begin, f.m_key_len},
+                           {base + f.m_value_begin, f.m_value_len}},
+                          f.m_id);
+    }
+  }
+
+  static constexpr size_t k_initial_capacity = 2048;
+  // the longest header accepted, from the headline to the empty line
+  static constexpr size_t k_max_header_bytes = 16 * 1024;
+
+  // Returns how many bytes of `chunk` belong to the header: all of them
+  // until the empty line ending it has arrived. A line is parsed where it
+  // lies, in `chunk` or, if it began in an earlier chunk, in the buffer.
+  // Stops at once when failed().
+  size_t push_chunk(std::string_view chunk) {
+    assert(!m_header_finished);
+    if (m_buffer.m_data.capacity() == 0) {
+      m_buffer.reserve(k_initial_capacity);
+    }
+    const char *begin = chunk.data();
+    const char *end = begin + chunk.size();
+    size_t old_size = m_buffer.size(); // chunk[i] is at old_size + i
+    size_t copied = 0;                 // bytes of chunk in the buffer
+    const char *scan = begin;
+    while (true) {
+      const char *nl = scan_char(scan, end, '\n');
+      if (nl == end) {
+        m_buffer.append(chunk.substr(copied));
+        m_too_large = m_buffer.size() > k_max_header_bytes;
+        return chunk.size();
+      }
+      size_t used = static_cast<size_t>(nl + 1 - begin);
+      if (old_size + used > k_max_header_bytes) {
+        m_too_large = true;
+        return used;
+      }
+      if (m_line_begin < old_size + copied) {
+        m_buffer.append(chunk.substr(copied, used - copied));
+        copied = used;
+      }
+      const char *line = m_line_begin < old_size + copied
+                             ? m_buffer.data() + m_line_begin
+                             : begin + (m_line_begin - old_size);
+      size_t line_end = old_size + used - 1;
+      size_t len = line_end - m_line_begin;
+      if (len > 0 && line[len - 1] == '\r') {
+        len--;
+      }
+      scan = nl + 1;
+      if (len == 0) {
+        if (m_has_headline) { // the empty line ending the header
+          m_buffer.append(chunk.substr(copied, used - copied));
+          _finish();
+          return used;
+        }
+        m_line_begin = line_end + 1; // tolerate CRLFs before the headline
+        m_headline_begin = m_line_begin;
+        continue;
+      }
+      if (!m_has_headline) {
+        m_has_headline = true;
+        m_headline_len = len;
+      } else {
+        _parse_field(line, m_line_begin, len);
+        if (failed()) {
+          return used;
+        }
+      }
+      m_header_len = m_line_begin + len;
+      m_line_begin = line_end + 1;
+    }
+  }
+
+  [[nodiscard]] bool header_finished() const { return m_header_finished; }
+
+  // more than k_max_headers fields or k_max_header_bytes: the message
+  // cannot be parsed, answer 431
+  [[nodiscard]] bool too_large() const { return m_too_large; }
+
+  // too_large(), or a malformed field line: answer 400
+  [[nodiscard]] bool failed() const { return m_too_large || m_invalid; }
+
+  [[nodiscard]] bool started() const { return m_buffer.size() != 0; }
+
+  std::string_view headline() const {
+    return {m_buffer.data() + m_headline_begin, m_headline_len};
+  }
+
+  std::string_view headers_raw() const {
+    return {m_buffer.data() + m_headline_begin,
+            m_header_len - m_headline_begin};
+  }
+
+  const header_view_table &headers() const { return m_headers; }
+
+  static constexpr size_t k_max_retained = 64 * 1024;
+
+  // ready for the next request; the buffer keeps its capacity unless one
+  // big request grew it past k_max_retained
+  void reset() noexcept {
+    if (m_buffer.m_data.capacity() > k_max_retained) {
+      m_buffer = bytes_buffer{};
+    }
+    m_buffer.clear();
+    m_line_begin = 0;
+    m_headline_begin = 0;
+    m_headline_len = 0;
+    m_header_len = 0;
+    m_has_headline = false;
+    m_header_finished = false;
+    m_too_large = false;
+    m_invalid = false;
+    m_nfields = 0;
+    m_headers.clear();
+  }
+};
+
+// Incremental decoder for Transfer-Encoding: chunked. It takes the stream
+// split anywhere, hands out chunk data as views into the input and stops
+// right after the trailer, so whatever follows (a pipelined request) is
+// left unconsumed. Chunk extensions and trailer fields are skipped.
+struct chunked_decoder {
+  enum class state : uint8_t {
+    size,
+    extension,
+    size_lf,
+    data,
+    data_cr,
+    data_lf,
+    trailer_start, // at the start of a trailer line
+    trailer_line,
+    final_lf,
+    done,
+    failed,
+  };
+
+  static constexpr uint64_t k_max_chunk = uint64_t{1} << 40;
+  static constexpr size_t k_max_trailer = 8192;
+
+  state m_state = state::size;
+  uint64_t m_remaining = 0; // chunk size being read, then bytes left of it
+  bool m_has_digits = false;
+  size_t m_trailer_bytes = 0;
+
+  [[nodiscard]] bool done() const noexcept { return m_state == state::done; }
+
+  [[nodiscard]] bool failed() const noexcept {
+    return m_state == state::failed;
+  }
+
+  void reset() noexcept { *this = chunked_decoder{}; }
+
+  static int _hex(char c) noexcept {
+    if ('0' <= c && c <= '9')
+      return c - '0';
+    if ('a' <= c && c <= 'f')
+      return c - 'a' + 10;
+    if ('A' <= c && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  }
+
+  void _end_size_line() noexcept {
+    if (m_remaining == 0) {
+      m_state = state::trailer_start;
+    } else {
+      m_state = state::data;
+    }
+  }
+
+  // Feeds bytes and calls sink(std::string_view) for each piece of chunk
+  // data; returns how many bytes were consumed.
+  template <class Sink> size_t decode(std::string_view in, Sink &&sink) {
+    size_t i = 0;
+    while (i < in.size()) {
+      char c = in[i];
+      switch (m_state) {
+      case state::size:
+        if (int digit = _hex(c); digit >= 0) {
+          m_remaining = m_remaining * 16 + static_cast<uint64_t>(digit);
+          m_has_digits = true;
+          if (m_remaining > k_max_chunk) {
+            m_state = state::failed;
+            return i;
+          }
+        } else if (m_has_digits && c == ';') {
+          m_state = state::extension;
+        } else if (m_has_digits && c == '\r') {
+          m_state = state::size_lf;
+        } else if (m_has_digits && c == '\n') {
+          _end_size_line();
+        } else {
+          m_state = state::failed;
+          return i;
+        }
+        i++;
+        break;
+      case state::extension:
+        if (c == '\r') {
+          m_state = state::size_lf;
+        } else if (c == '\n') {
+          _end_size_line();
+        }
+        i++;
+        break;
+      case state::size_lf:
+        if (c != '\n') {
+          m_state = state::failed;
+          return i;
+        }
+        _end_size_line();
+        i++;
+        break;
+      case state::data: {
+        size_t n = in.size() - i;
+        if (n > m_remaining) {
+          n = static_cast<size_t>(m_remaining);
+        }
+        sink(in.substr(i, n));
+        m_remaining -= n;
+        i += n;
+        if (m_remaining == 0) {
+          m_state = state::data_cr;
+        }
+        break;
+      }
+      case state::data_cr:
+        if (c == '\r') {
+          m_state = state::data_lf;
+        } else if (c == '\n') {
+          m_state = state::size;
+          m_has_digits = false;
+        } else {
+          m_state = state::failed;
+          return i;
+        }
+        i++;
+        break;
+      case state::data_lf:
+        if (c != '\n') {
+          m_state = state::failed;
+          return i;
+        }
+        m_state = state::size;
+        m_has_digits = false;
+        i++;
+        break;
+      case state::trailer_start:
+        if (c == '\r') {
+          m_state = state::final_lf;
+        } else if (c == '\n') {
+          m_state = state::done;
+          return i + 1;
+        } else {
+          m_state = state::trailer_line;
+        }
+        i++;
+        break;
+      case state::trailer_line:
+        if (++m_trailer_bytes > k_max_trailer) {
+          m_state = state::failed;
+          return i;
+        }
+        if (c == '\n') {
+          m_state = state::trailer_start;
+        }
+        i++;
+        break;
+      case state::final_lf:
+        if (c != '\n') {
+          m_state = state::failed;
+          return i;
+        }
+        m_state = state::done;
+        return i + 1;
+      case state::done:
+      case state::failed:
+        return i;
+      }
+    }
+    return i;
+  }
 };
 
-template <typename HeaderParser = http11_header_parser>
+template <typename HeaderParser = http11_zero_copy_parser>
 struct _http_parser_base {
   HeaderParser m_header_parser;
   std::string m_header;
   std::string m_body;
-  size_t m_content_length;
-  bool m_header_finished;
-  bool m_body_finished;
+  size_t m_content_length = 0;
+  size_t m_body_received = 0;
+  bool m_body_finished = false;
+  bool m_chunked = false;
+  bool m_failed = false; // malformed framing: answer 400 and close
+  // responses only, see http_response_parser
+  bool m_response = false;
+  bool m_no_body = false;     // the response to a HEAD request
+  bool m_until_close = false; // no length given: the body ends at EOF
+  chunked_decoder m_chunked_decoder;
+  // when set, body bytes go here as they arrive instead of into m_body
+  callback<std::string_view> m_body_sink;
+
+  // a body buffer grown past this by one big request is not kept
+  static constexpr size_t k_max_retained = 64 * 1024;
+  // a request body buffered whole may not grow past this; the server
+  // answers a larger one with a 413
+  static constexpr size_t k_max_body = 16 << 20;
 
   [[nodiscard]] bool header_finished() const {
     return m_header_parser.header_finished();
@@ -91,16 +686,60 @@ struct _http_parser_base {
 
   [[nodiscard]] bool request_finished() const { return m_body_finished; }
 
-  std::string &headers_raw() { return m_header_parser.headers_raw(); }
+  [[nodiscard]] bool failed() const { return m_failed; }
 
-  string_map &headers() { return m_header_parser.headers(); }
+  // the header parser gave up on the message
+  [[nodiscard]] bool _header_failed() const {
+    if constexpr (requires { m_header_parser.failed(); }) {
+      return m_header_parser.failed();
+    } else {
+      return false;
+    }
+  }
+
+  // failed() because the header is too large: 431 rather than 400
+  [[nodiscard]] bool header_too_large() const {
+    if constexpr (requires { m_header_parser.too_large(); }) {
+      return m_header_parser.too_large();
+    } else {
+      return false;
+    }
+  }
+
+  // Transfer-Encoding: chunked, so the body length is not known up front
+  [[nodiscard]] bool chunked() const { return m_chunked; }
 
-  std::string headline() { return m_header_parser.headline(); }
+  // body bytes announced by Content-Length, 0 if chunked
+  size_t content_length() const { return m_content_length; }
+
+  // Streams the body: what has arrived so far is passed to `sink` right
+  // away, the rest as it comes, and body() stays empty. Typically set once
+  // header_finished() for a large or chunked upload; reset() drops it.
+  void set_body_sink(callback<std::string_view> sink) {
+    m_body_sink = std::move(sink);
+    if (!m_body.empty()) {
+      m_body_sink(multishot_call, std::string_view(m_body));
+      m_body.clear();
+    }
+  }
+
+  // some bytes of the next message have arrived
+  [[nodiscard]] bool request_started() const {
+    return m_header_parser.started();
+  }
 
-  std::string _headline_first() {
+  // std::string references for http11_header_parser, views into the
+  // receive buffer for http11_zero_copy_parser
+  decltype(auto) headers_raw() { return m_header_parser.headers_raw(); }
+
+  decltype(auto) headers() { return m_header_parser.headers(); }
+
+  decltype(auto) headline() { return m_header_parser.headline(); }
+
+  std::string_view _headline_first() {
     // headline (request): "GET / HTTP/1.1"
     // headline (response): "HTTP/1.1 200 OK"
-    std::string &line = headline();
+    std::string_view line = headline();
     size_t space = line.find(" ");
     if (space == std::string::npos) {
       return "";
@@ -108,94 +747,238 @@ struct _http_parser_base {
     return line.substr(0, space);
   }
 
-  std::string _headline_second() {
+  std::string_view _headline_second() {
     // headline (request): "GET / HTTP/1.1"
     // headline (response): "HTTP/1.1 200 OK"
-    std::string &headline = m_header_parser.headline();
+    std::string_view headline = m_header_parser.headline();
     size_t space1 = headline.find(" ");
     if (space1 == std::string::npos) {
       return "";
     }
-    size_t space2 = headline.find(" ", space1);
-    if (space2 == std::string::npos) {
-      return "";
+    size_t space2 = headline.find(" ", space1 + 1);
+    if (space2 == std::string::npos) { // e.g. a status line without reason
+      return headline.substr(space1 + 1);
     }
-    return headline.substr(space1, space2);
+    return headline.substr(space1 + 1, space2 - space1 - 1);
   }
 
-  std::string _headline_third() {
+  std::string_view _headline_third() {
     // headline (request): "GET / HTTP/1.1"
     // headline (response): "HTTP/1.1 200 OK"
-    std::string &headline = m_header_parser.headline();
+    std::string_view headline = m_header_parser.headline();
     size_t space1 = headline.find(" ");
     if (space1 == std::string::npos) {
       return "";
     }
-    size_t space2 = headline.find(" ", space1);
+    size_t space2 = headline.find(" ", space1 + 1);
     if (space2 == std::string::npos) {
       return "";
     }
-    return headline.substr(space2);
+    return headline.substr(space2 + 1);
   }
 
-  std::string &body() { return m_header_parser.extra_body(); }
+  std::string &body() { return m_body; }
 
-  size_t _extract_content_length() {
-    string_map &headers = m_header_parser.headers();
-    auto it = headers.find("content-length");
-    if (it == headers.end()) { // not found
-      return 0;
+  // a fixed slot with http11_zero_copy_parser, a map lookup otherwise
+  auto _find_field(http_field field) {
+    auto &headers = m_header_parser.headers();
+    if constexpr (requires { headers.find(field); }) {
+      return headers.find(field);
+    } else {
+      std::string key(k_field_names[static_cast<size_t>(field)]);
+      return headers.find(key);
+    }
+  }
+
+  // Content-Length into `length`, 0 if absent. False if it is not all
+  // digits or if repeated fields disagree: the body's end is unknown.
+  bool _extract_content_length(size_t &length) {
+    length = 0;
+    auto &headers = m_header_parser.headers();
+    if (_find_field(http_field::content_length) == headers.end()) {
+      return true;
+    }
+    bool found = false;
+    for (const auto &[key, value] : headers) {
+      if (!iequals_lower(key, "content-length")) {
+        continue;
+      }
+      std::string_view digits = value;
+      const char *end = digits.data() + digits.size();
+      size_t n = 0;
+      auto [ptr, ec] = std::from_chars(digits.data(), end, n);
+      if (ec != std::errc() || ptr != end || (found && n != length)) {
+        return false;
+      }
+      length = n;
+      found = true;
+    }
+    return true;
+  }
+
+  // Transfer-Encoding wins over Content-Length. A request with any other
+  // final coding, or a malformed Content-Length, has no knowable length
+  // and fails. A response without either runs until the connection
+  // closes, and some never have a body.
+  void _begin_body() {
+    auto &headers = m_header_parser.headers();
+    if (m_response) {
+      int status = -1;
+      std::string_view code = _headline_second();
+      std::from_chars(code.data(), code.data() + code.size(), status);
+      if (m_no_body || (100 <= status && status < 200) || status == 204 ||
+          status == 304) {
+        m_body_finished = true;
+        return;
+      }
     }
-    try {
-      return std::stoi(it->second);
-    } catch (std::invalid_argument &e) {
+    auto it = _find_field(http_field::transfer_encoding);
+    if (it != headers.end()) {
+      std::string_view codings = it->second;
+      std::string_view last = codings.substr(codings.rfind(',') + 1);
+      while (!last.empty() && (last.front() == ' ' || last.front() == '\t'))
+        last.remove_prefix(1);
+      while (!last.empty() && (last.back() == ' ' || last.back() == '\t'))
+        last.remove_suffix(1);
+      m_chunked = iequals_lower(last, "chunked");
+      m_failed = !m_chunked;
+      m_body_finished = m_failed;
+      return;
+    }
+    if (m_response &&
+        _find_field(http_field::content_length) == headers.end()) {
+      m_until_close = true;
+      return;
+    }
+    if (!_extract_content_length(m_content_length)) {
+      m_failed = true;
+      m_body_finished = true;
+      return;
+    }
+    m_body_finished = m_content_length == 0;
+  }
+
+  void _on_body(std::string_view piece) {
+    if (piece.empty()) {
+      return;
+    }
+    if (m_body_sink) {
+      m_body_sink(multishot_call, piece);
+    } else {
+      m_body.append(piece);
+    }
+  }
+
+  size_t _push_body(std::string_view data) {
+    if (m_body_finished) {
       return 0;
     }
+    if (m_until_close) {
+      _on_body(data);
+      return data.size();
+    }
+    if (m_chunked) {
+      size_t n = m_chunked_decoder.decode(
+          data, [this](std::string_view piece) { _on_body(piece); });
+      m_failed = m_chunked_decoder.failed();
+      m_body_finished = m_chunked_decoder.done() || m_failed;
+      return n;
+    }
+    size_t n = std::min(data.size(), m_content_length - m_body_received);
+    _on_body(data.substr(0, n));
+    m_body_received += n;
+    m_body_finished = m_body_received == m_content_length;
+    return n;
   }
 
-  void push_chunk(std::string_view chunk) {
+  // Feeds the next bytes of the stream and returns how many of them belong
+  // to the current message. Once request_finished(), the rest of `chunk`
+  // starts the next message: reset() and push it again.
+  size_t push_chunk(std::string_view chunk) {
+    if (m_body_finished) {
+      return 0;
+    }
     if (!m_header_parser.header_finished()) {
-      m_header_parser.push_chunk(chunk);
-      if (m_header_parser.header_finished()) {
-        m_content_length = _extract_content_length();
-        m_body = m_header_parser.extra_body();
-        if (m_body.size() == m_content_length) {
-          m_body_finished = true;
-        }
-      }
-    } else if (!m_body_finished) {
-      m_body.append(chunk);
-      if (m_body.size() == m_content_length) {
+      size_t used = m_header_parser.push_chunk(chunk);
+      if (_header_failed()) {
+        m_failed = true;
         m_body_finished = true;
+        return used;
+      }
+      if (!m_header_parser.header_finished()) {
+        return used;
       }
+      _begin_body();
+      return used + _push_body(chunk.substr(used));
     }
+    return _push_body(chunk);
+  }
+
+  // The connection closed: ends a body that runs until then.
+  void push_eof() {
+    if (m_until_close) {
+      m_body_finished = true;
+    }
+  }
+
+  // Forgets the current message but keeps every buffer's capacity (up to
+  // k_max_retained), so a keep-alive connection parses its next request
+  // without allocating.
+  void reset() {
+    m_header_parser.reset();
+    m_header.clear();
+    if (m_body.capacity() > k_max_retained) {
+      m_body = std::string();
+    }
+    m_body.clear();
+    m_content_length = 0;
+    m_body_received = 0;
+    m_body_finished = false;
+    m_chunked = false;
+    m_failed = false;
+    m_no_body = false;
+    m_until_close = false;
+    m_chunked_decoder.reset();
+    m_body_sink.reset();
   }
 };
 
-template <typename HeaderParser = http11_header_parser>
+template <typename HeaderParser = http11_zero_copy_parser>
 struct http_request_parser : public _http_parser_base<HeaderParser> {
-  std::string method() { return this->_headline_first(); }
+  std::string_view method() { return this->_headline_first(); }
 
-  std::string url() { return this->_headline_second(); }
+  std::string_view url() { return this->_headline_second(); }
 
-  std::string http_version() { return this->_headline_third(); }
+  std::string_view http_version() { return this->_headline_third(); }
 };
 
-template <typename HeaderParser = http11_header_parser>
+template <typename HeaderParser = http11_zero_copy_parser>
 struct http_response_parser : public _http_parser_base<HeaderParser> {
-  std::string http_version() { return this->_headline_first(); }
+  http_response_parser() { this->m_response = true; }
+
+  // The next response answers a HEAD request: it has no body, whatever
+  // its header says. Until reset().
+  void set_no_body() { this->m_no_body = true; }
+
+  // the body ends when the connection does, see push_eof()
+  [[nodiscard]] bool until_close() const { return this->m_until_close; }
+
+  std::string_view http_version() { return this->_headline_first(); }
 
   int status() {
-    std::string s = this->_headline_second();
-    try {
-      return std::stoi(s);
-    } catch (
-        std::logic_error &e) { // std::out_of_range and std::invalid_argument
+    std::string_view s = this->_headline_second();
+    while (!s.empty() && s.front() == ' ') {
+      s.remove_prefix(1);
+    }
+    int status = -1;
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), status);
+    if (ec != std::errc()) {
       return -1;
     }
+    return status;
   }
 
-  std::string status_string() { return this->_headline_second(); }
+  std::string_view status_string() { return this->_headline_second(); }
 };
 
 #endif // HTTP_PARSER_HPP
@@ -2,22 +2,159 @@
 #define HTTP_WRITER_HPP
 
 #include "bytes_buffer.hpp"
-#include <string>
+#include <array>
+#include <charconv>
+#include <concepts>
+#include <cstring>
+#include <ctime>
+#include <string_view>
 
+struct _status_line {
+  int m_status;
+  std::string_view m_line;
+};
+
+inline constexpr _status_line k_status_lines[] = {
+    {100, "HTTP/1.1 100 Continue\r\n"},
+    {101, "HTTP/1.1 101 Switching Protocols\r\n"},
+    {200, "HTTP/1.1 200 OK\r\n"},
+    {201, "HTTP/1.1 201 Created\r\n"},
+    {202, "HTTP/1.1 202 Accepted\r\n"},
+    {204, "HTTP/1.1 204 No Content\r\n"},
+    {206, "HTTP/1.1 206 Partial Content\r\n"},
+    {301, "HTTP/1.1 301 Moved Permanently\r\n"},
+    {302, "HTTP/1.1 302 Found\r\n"},
+    {303, "HTTP/1.1 303 See Other\r\n"},
+    {304, "HTTP/1.1 304 Not Modified\r\n"},
+    {307, "HTTP/1.1 307 Temporary Redirect\r\n"},
+    {308, "HTTP/1.1 308 Permanent Redirect\r\n"},
+    {400, "HTTP/1.1 400 Bad Request\r\n"},
+    {401, "HTTP/1.1 401 Unauthorized\r\n"},
+    {403, "HTTP/1.1 403 Forbidden\r\n"},
+    {404, "HTTP/1.1 404 Not Found\r\n"},
+    {405, "HTTP/1.1 405 Method Not Allowed\r\n"},
+    {408, "HTTP/1.1 408 Request Timeout\r\n"},
+    {411, "HTTP/1.1 411 Length Required\r\n"},
+    {413, "HTTP/1.1 413 Content Too Large\r\n"},
+    {414, "HTTP/1.1 414 URI Too Long\r\n"},
+    {416, "HTTP/1.1 416 Range Not Satisfiable\r\n"},
+    {426, "HTTP/1.1 426 Upgrade Required\r\n"},
+    {429, "HTTP/1.1 429 Too Many Requests\r\n"},
+    {431, "HTTP/1.1 431 Request Header Fields Too Large\r\n"},
+    {500, "HTTP/1.1 500 Internal Server Error\r\n"},
+    {501, "HTTP/1.1 501 Not Implemented\r\n"},
+    {502, "HTTP/1.1 502 Bad Gateway\r\n"},
+    {503, "HTTP/1.1 503 Service Unavailable\r\n"},
+    {504, "HTTP/1.1 504 Gateway Timeout\r\n"},
+    {505, "HTTP/1.1 505 HTTP Version Not Supported\r\n"},
+};
+
+// Status code -> complete status line, indexed directly; empty for codes
+// without a known reason phrase.
+inline constexpr auto k_status_line_index = [] {
+  std::array<std::string_view, 500> index{};
+  for (const _status_line &entry : k_status_lines) {
+    index[static_cast<size_t>(entry.m_status - 100)] = entry.m_line;
+  }
+  return index;
+}();
+
+constexpr std::string_view status_line(int status) noexcept {
+  if (status < 100 || status >= 600) {
+    return {};
+  }
+  return k_status_line_index[static_cast<size_t>(status - 100)];
+}
+
+static_assert(status_line(404) == "HTTP/1.1 404 Not Found\r\n");
+
+// The "Date: ...\r\n" line of one reactor. Formatting an IMF-fixdate takes
+// gmtime and strftime, so it is done when the second changes, from a
+// timer, and every response copies the cached bytes.
+struct http_date {
+  char m_line[48];
+  size_t m_size = 0;
+  time_t m_second = -1;
+
+  http_date() { refresh(); }
+
+  void refresh(time_t now = time(nullptr)) noexcept {
+    if (now == m_second) {
+      return;
+    }
+    m_second = now;
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    m_size = strftime(m_line, sizeof(m_line),
+                      "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+  }
+
+  std::string_view line() const noexcept { return {m_line, m_size}; }
+};
+
+// Serializes a response header into m_buffer, which the connection hands
+// over (usually from its buffer_pool) and takes back. Every field is
+// appended in place: one resize and a few memcpys, no temporaries.
 struct http_response_writer {
   bytes_buffer m_buffer;
+  const http_date *m_date = nullptr; // null: no Date field
+
+  template <class... Parts> void _append(Parts... parts) {
+    auto &data = m_buffer.m_data;
+    size_t at = data.size();
+    data.resize(at + (parts.size() + ...));
+    char *out = data.data() + at;
+    ((std::memcpy(out, parts.data(), parts.size()), out += parts.size()), ...);
+  }
 
+  // status line and, if set, Date
   void begin_header(int status) {
-    // headline (response): "HTTP/1.1 200 OK"
-    // TODO: change "OK" according to status code
-    m_buffer.append("HTTP/1.1 " + std::to_string(status) + " OK\r\n");
+    std::string_view line = status_line(status);
+    std::string_view date = m_date ? m_date->line() : std::string_view();
+    if (!line.empty()) {
+      _append(line, date);
+      return;
+    }
+    // unknown code: the reason phrase may be empty
+    char code[12];
+    auto [end, ec] = std::to_chars(code, code + sizeof(code), status);
+    _append(std::string_view("HTTP/1.1 "),
+            std::string_view(code, static_cast<size_t>(end - code)),
+            std::string_view(" \r\n"), date);
   }
 
-  void write_header(std::string key, std::string value) {
-    m_buffer.append(key + ": " + value + "\r\n");
+  void write_header(std::string_view key, std::string_view value) {
+    _append(key, std::string_view(": "), value, std::string_view("\r\n"));
+  }
+
+  // e.g. Content-Length
+  template <std::integral Int> void write_header(std::string_view key,
+                                                 Int value) {
+    char digits[24];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    write_header(key,
+                 std::string_view(digits, static_cast<size_t>(end - digits)));
+  }
+
+  void end_header() { m_buffer.append_literal("\r\n"); }
+
+  // Transfer-Encoding: chunked, for bodies of unknown length: after a
+  // header with that field, every write_chunk() frames one piece and
+  // end_chunks() terminates the body. Pieces may go out in separate
+  // buffers as they are produced.
+  void write_chunk(std::string_view data) {
+    if (data.empty()) { // would read as the last chunk
+      return;
+    }
+    char size[2 * sizeof(size_t) + 2];
+    auto [end, ec] = std::to_chars(size, size + sizeof(size), data.size(), 16);
+    *end++ = '\r';
+    *end++ = '\n';
+    _append(std::string_view(size, static_cast<size_t>(end - size)), data,
+            std::string_view("\r\n"));
   }
 
-  void end_header() { m_buffer.append("\r\n"); }
+  void end_chunks() { m_buffer.append_literal("0\r\n\r\n"); }
 
   bytes_buffer &buffer() { return m_buffer; }
 };
@@ -1,10 +1,31 @@
 #ifndef IO_CONTEXT_HPP
 #define IO_CONTEXT_HPP
 
+#include "buffer_pool.hpp"
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "task.hpp"
+#include "timer_wheel.hpp"
 #include "utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <memory>
 #include <netdb.h>
+#include <optional>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+#if CO_HTTP_IO_URING
+#include "io_uring.hpp"
+#endif
 
 struct address_resolver {
   struct address_ref {
@@ -30,14 +51,23 @@ struct address_resolver {
       return {m_curr->ai_addr, m_curr->ai_addrlen};
     }
 
-    int create_socket() const {
-      int sockfd = CHECK_CALL(socket, m_curr->ai_family, m_curr->ai_socktype,
-                              m_curr->ai_protocol);
+    // `flags`: SOCK_NONBLOCK, SOCK_CLOEXEC
+    int create_socket(int flags = 0) const {
+      int sockfd = CHECK_CALL(socket, m_curr->ai_family,
+                              m_curr->ai_socktype | flags, m_curr->ai_protocol);
       return sockfd;
     }
 
-    int create_socket_and_bind() const {
+    int create_socket_and_bind(bool reuse_port = false) const {
       int sockfd = create_socket();
+      int on = 1;
+      CHECK_CALL(setsockopt, sockfd, SOL_SOCKET, SO_REUSEADDR, &on,
+                 sizeof(on));
+      if (reuse_port) {
+        // every reactor binds its own socket, the kernel balances between
+        CHECK_CALL(setsockopt, sockfd, SOL_SOCKET, SO_REUSEPORT, &on,
+                   sizeof(on));
+      }
       address_ref serve_addr = get_address();
       CHECK_CALL(bind, sockfd, serve_addr.m_addr, serve_addr.m_addrlen);
       return sockfd;
@@ -78,4 +108,442 @@ struct address_resolver {
   }
 };
 
+enum class io_backend {
+  epoll,
+  io_uring,
+};
+
+// Something parked on the loop: an awaiter in a coroutine frame, or a
+// callback slot inside a connection. epoll data.ptr and io_uring user_data
+// point at it directly, so waiting costs neither an allocation nor a
+// virtual call: the loop calls m_fire with the epoll events (res == 0) or
+// the cqe res and flags.
+struct io_waiter {
+  void (*m_fire)(io_waiter *self, int res, uint32_t flags);
+};
+
+// An io_waiter forwarding to a callback stored in it. One-shot callbacks
+// are consumed when fired; multishot ones stay until replaced.
+struct callback_waiter : io_waiter {
+  callback<int, uint32_t> m_cb;
+
+  callback_waiter() : io_waiter{nullptr} {}
+
+  void set(callback<int, uint32_t> cb) {
+    m_cb = std::move(cb);
+    m_fire = &_fire_once;
+  }
+
+  void set_multishot(callback<int, uint32_t> cb) {
+    m_cb = std::move(cb);
+    m_fire = &_fire_multishot;
+  }
+
+  static void _fire_once(io_waiter *self, int res, uint32_t flags) {
+    static_cast<callback_waiter *>(self)->m_cb(res, flags);
+  }
+
+  static void _fire_multishot(io_waiter *self, int res, uint32_t flags) {
+    static_cast<callback_waiter *>(self)->m_cb(multishot_call, res, flags);
+  }
+};
+
+// A timer running a callback, for io_context::run_after and run_every.
+struct callback_timer : timer {
+  callback<> m_cb;
+  timer_wheel *m_repeat_on = nullptr; // set for run_every
+  std::chrono::milliseconds m_period{0};
+
+  callback_timer() : timer(&_fire) {}
+
+  static void _fire(timer *self) {
+    auto t = static_cast<callback_timer *>(self);
+    if (t->m_repeat_on) { // rearmed first, so the callback may cancel it
+      t->m_repeat_on->schedule(*t, t->m_period);
+      t->m_cb(multishot_call);
+      return;
+    }
+    t->m_cb();
+  }
+};
+
+// How an io_context waits for events.
+struct loop_options {
+  // Cap on the events one epoll_wait returns. The batch starts small,
+  // doubles while waits fill it and halves while they leave it mostly
+  // empty, so a busy loop makes few syscalls and a quiet one gets back to
+  // its timers quickly.
+  unsigned m_max_events = 512;
+  // Poll without blocking for up to this long before a blocking wait,
+  // trading a core's idle time for wakeup latency. 0: off.
+  std::chrono::microseconds m_busy_poll{0};
+};
+
+// Work handed to a loop from another thread, see io_context::post_remote.
+// The poster owns the object until m_run is called on the loop thread.
+struct remote_work {
+  remote_work *m_next = nullptr;
+  void (*m_run)(remote_work *self) = nullptr;
+};
+
+struct io_context {
+  int m_epfd = -1;
+  bool m_stopped = false;
+  timer_wheel m_timers;
+  bytes_buffer m_recv_scratch{16384}; // epoll backend: target of async_recv
+  loop_allocator m_allocator; // coroutine frames, spilled callbacks
+  buffer_pool m_buffers;      // response buffers, see write_queue
+  loop_metrics m_metrics;
+  loop_options m_options;
+  // epoll backend: the adaptive batch, see loop_options::m_max_events
+  std::unique_ptr<struct epoll_event[]> m_events;
+  unsigned m_batch = 0;
+  static constexpr unsigned k_min_batch = 16;
+#if CO_HTTP_IO_URING
+  std::unique_ptr<io_uring_ring> m_uring;
+  io_uring_ring::buffer_ring m_recv_buffers;
+  static constexpr uint16_t k_recv_group = 0;
+#endif
+
+  // Other threads push remote_work onto a lock-free stack; the push that
+  // finds it empty writes the eventfd, which wakes the loop to take the
+  // whole stack at once.
+  struct _remote_waiter : io_waiter {
+    io_context *m_ctx = nullptr;
+    uint64_t m_value = 0; // eventfd counter, read into here
+  };
+
+  std::atomic<remote_work *> m_remote_head{nullptr};
+  int m_remote_fd = -1;
+  _remote_waiter m_remote_waiter{{&_on_remote}};
+
+  explicit io_context(io_backend backend = io_backend::epoll,
+                      loop_options options = {})
+      : m_options(options) {
+    loop_allocator::current() = &m_allocator;
+    m_options.m_max_events = std::max(m_options.m_max_events, 1u);
+    m_remote_fd = CHECK_CALL(eventfd, 0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_remote_waiter.m_ctx = this;
+#if CO_HTTP_IO_URING
+    if (backend == io_backend::io_uring) {
+      try {
+        m_uring = std::make_unique<io_uring_ring>(1024);
+        m_uring->setup_buffer_ring(m_recv_buffers, k_recv_group, 512, 4096);
+        _submit_remote_read();
+        return;
+      } catch (const std::system_error &e) {
+        LOG_WARN("io_uring unavailable, using epoll: {}", e.what());
+        m_uring = nullptr;
+      }
+    }
+#else
+    if (backend == io_backend::io_uring) {
+      LOG_WARN("built without io_uring, using epoll");
+    }
+#endif
+    m_epfd = CHECK_CALL(epoll_create1, EPOLL_CLOEXEC);
+    m_events = std::make_unique<struct epoll_event[]>(m_options.m_max_events);
+    m_batch = std::min(k_min_batch, m_options.m_max_events);
+    struct epoll_event event;
+    event.events = EPOLLIN; // level-triggered, read in _on_remote
+    event.data.ptr = &m_remote_waiter;
+    CHECK_CALL(epoll_ctl, m_epfd, EPOLL_CTL_ADD, m_remote_fd, &event);
+  }
+
+  io_context(const io_context &) = delete;
+  io_context &operator=(const io_context &) = delete;
+
+  ~io_context() {
+    if (loop_allocator::current() == &m_allocator) {
+      loop_allocator::current() = nullptr;
+    }
+#if CO_HTTP_IO_URING
+    if (m_uring) {
+      m_uring->destroy_buffer_ring(m_recv_buffers);
+    }
+#endif
+    if (m_epfd != -1) {
+      close(m_epfd);
+    }
+    close(m_remote_fd);
+  }
+
+  [[nodiscard]] bool uses_uring() const noexcept {
+#if CO_HTTP_IO_URING
+    return m_uring != nullptr;
+#else
+    return false;
+#endif
+  }
+
+  // Runs `cb` once after `delay`. `t` is owned by the caller and may be
+  // reused or cancelled; rearming it drops the pending callback.
+  void run_after(callback_timer &t, std::chrono::milliseconds delay,
+                 callback<> cb) {
+    t.m_cb = std::move(cb);
+    t.m_repeat_on = nullptr;
+    m_timers.schedule(t, delay);
+  }
+
+  // Runs `cb` every `period` until cancel(t).
+  void run_every(callback_timer &t, std::chrono::milliseconds period,
+                 callback<> cb) {
+    t.m_cb = std::move(cb);
+    t.m_repeat_on = &m_timers;
+    t.m_period = period;
+    m_timers.schedule(t, period);
+  }
+
+  void cancel(timer &t) noexcept { m_timers.cancel(t); }
+
+  // Runs work->m_run(work) on the loop thread, in posting order per poster.
+  // Safe from any thread; this is the only such member.
+  void post_remote(remote_work *work) noexcept {
+    remote_work *head = m_remote_head.load(std::memory_order_relaxed);
+    do {
+      work->m_next = head;
+    } while (!m_remote_head.compare_exchange_weak(
+        head, work, std::memory_order_release, std::memory_order_relaxed));
+    if (head == nullptr) { // the loop may be asleep
+      uint64_t one = 1;
+      ssize_t n = write(m_remote_fd, &one, sizeof(one));
+      (void)n; // only fails if the counter is saturated, i.e. already set
+    }
+  }
+
+  static void _on_remote(io_waiter *self, int, uint32_t) {
+    io_context *ctx = static_cast<_remote_waiter *>(self)->m_ctx;
+    if (!ctx->uses_uring()) {
+      uint64_t value;
+      ssize_t n = read(ctx->m_remote_fd, &value, sizeof(value));
+      (void)n; // EAGAIN: a previous wakeup already took the stack
+    }
+    // a stack, newest first: reverse it to run in posting order
+    remote_work *work =
+        ctx->m_remote_head.exchange(nullptr, std::memory_order_acquire);
+    remote_work *fifo = nullptr;
+    while (work) {
+      remote_work *next = work->m_next;
+      work->m_next = fifo;
+      fifo = work;
+      work = next;
+    }
+    while (fifo) {
+      remote_work *next = fifo->m_next;
+      fifo->m_run(fifo);
+      fifo = next;
+    }
+#if CO_HTTP_IO_URING
+    if (ctx->uses_uring()) {
+      ctx->_submit_remote_read();
+    }
+#endif
+  }
+
+  struct _sleep_awaiter : timer {
+    io_context *m_ctx;
+    std::chrono::milliseconds m_delay;
+    std::coroutine_handle<> m_caller;
+
+    _sleep_awaiter(io_context *ctx, std::chrono::milliseconds delay)
+        : timer(&_fire), m_ctx(ctx), m_delay(delay) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> caller) {
+      m_caller = caller;
+      m_ctx->m_timers.schedule(*this, m_delay);
+    }
+
+    static void _fire(timer *self) {
+      static_cast<_sleep_awaiter *>(self)->m_caller.resume();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  // co_await ctx.sleep_for(100ms);
+  _sleep_awaiter sleep_for(std::chrono::milliseconds delay) {
+    return {this, delay};
+  }
+
+  void _dispatch(void *ptr, uint32_t events) {
+    if (ptr == nullptr) { // registered, nothing parked yet
+      return;
+    }
+    auto waiter = static_cast<io_waiter *>(ptr);
+    waiter->m_fire(waiter, 0, events);
+  }
+
+#if CO_HTTP_IO_URING
+  // Queues an sqe completing into `waiter`, which must stay put until the
+  // cqe arrives. Sqes are flushed in a single io_uring_enter at the top of
+  // the next loop iteration.
+  struct io_uring_sqe *_prep_waiter(io_waiter *waiter) {
+    struct io_uring_sqe *sqe = m_uring->get_sqe();
+    sqe->user_data = reinterpret_cast<uint64_t>(waiter);
+    return sqe;
+  }
+
+  void _submit_remote_read() {
+    auto sqe = _prep_waiter(&m_remote_waiter);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_remote_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&m_remote_waiter.m_value);
+    sqe->len = sizeof(m_remote_waiter.m_value);
+    sqe->off = static_cast<uint64_t>(-1); // not seekable
+  }
+
+  void _complete(uint64_t user_data, int res, uint32_t flags) {
+    if (user_data == 0) { // e.g. the head of a linked chain
+      return;
+    }
+    auto waiter = reinterpret_cast<io_waiter *>(user_data);
+    waiter->m_fire(waiter, res, flags);
+  }
+
+  // A timeout sqe with a count of 1 wakes the ring for the timer wheel; it
+  // also completes as soon as any other cqe arrives, so at most one is
+  // ever pending.
+  struct _timeout_waiter : io_waiter {
+    bool m_pending = false;
+    struct __kernel_timespec m_ts;
+  };
+
+  _timeout_waiter m_uring_timeout{{&_on_uring_timeout}};
+
+  static void _on_uring_timeout(io_waiter *self, int, uint32_t) {
+    static_cast<_timeout_waiter *>(self)->m_pending = false;
+  }
+
+  void _run_uring() {
+    auto complete = [this](uint64_t user_data, int res, uint32_t flags) {
+      _complete(user_data, res, flags);
+    };
+    while (!m_stopped) {
+      int timeout = m_timers.next_timeout();
+      if (m_options.m_busy_poll.count() != 0 && timeout != 0) {
+        // io_uring_enter without waiting still runs the completion work
+        // the kernel queued for this thread
+        auto woke = _spin(timeout, [&] {
+          m_uring->submit(0);
+          return m_uring->for_each_cqe(complete);
+        });
+        if (woke) {
+          m_timers.advance();
+          _count_iteration(woke->first, woke->second);
+          continue;
+        }
+        timeout = m_timers.next_timeout();
+      }
+      if (timeout > 0 && !m_uring_timeout.m_pending) {
+        m_uring_timeout.m_ts.tv_sec = timeout / 1000;
+        m_uring_timeout.m_ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        auto sqe = _prep_waiter(&m_uring_timeout);
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&m_uring_timeout.m_ts);
+        sqe->len = 1;
+        sqe->off = 1; // or after one completion
+        m_uring_timeout.m_pending = true;
+      }
+      m_uring->submit(timeout == 0 ? 0 : 1);
+      auto woke = std::chrono::steady_clock::now();
+      unsigned n = m_uring->for_each_cqe(complete);
+      m_timers.advance();
+      _count_iteration(n, woke);
+    }
+  }
+#endif
+
+  void run() {
+#if CO_HTTP_IO_URING
+    if (m_uring) {
+      _run_uring();
+      return;
+    }
+#endif
+    while (!m_stopped) {
+      int timeout = m_timers.next_timeout();
+      if (m_options.m_busy_poll.count() != 0 && timeout != 0) {
+        auto woke = _spin(timeout, [this] {
+          unsigned n = _wait_epoll(0);
+          _dispatch_events(n);
+          return n;
+        });
+        if (woke) {
+          m_timers.advance();
+          _count_iteration(woke->first, woke->second);
+          continue;
+        }
+        timeout = m_timers.next_timeout();
+      }
+      unsigned n = _wait_epoll(timeout);
+      auto woke = std::chrono::steady_clock::now();
+      _dispatch_events(n);
+      m_timers.advance();
+      _count_iteration(n, woke);
+    }
+  }
+
+  // One epoll_wait into the current batch, which it then resizes for the
+  // next call.
+  unsigned _wait_epoll(int timeout) {
+    int ret = CHECK_CALL_EXCEPT(EINTR, epoll_wait, m_epfd, m_events.get(),
+                                static_cast<int>(m_batch), timeout);
+    if (ret <= 0) {
+      return 0;
+    }
+    auto n = static_cast<unsigned>(ret);
+    if (n == m_batch) {
+      m_batch = std::min(m_batch * 2, m_options.m_max_events);
+    } else if (n * 4 < m_batch && m_batch > k_min_batch) {
+      m_batch /= 2;
+    }
+    m_metrics.m_batch.set(m_batch);
+    return n;
+  }
+
+  void _dispatch_events(unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+      _dispatch(m_events[i].data.ptr, m_events[i].events);
+    }
+  }
+
+  // Calls poll() until it handles something or the busy-poll budget, or
+  // `timeout` ms when the timer wheel is due sooner, runs out. Returns the
+  // events handled and when the first was seen, or nullopt to block.
+  template <class Poll>
+  std::optional<std::pair<unsigned, std::chrono::steady_clock::time_point>>
+  _spin(int timeout, Poll &&poll) {
+    auto start = std::chrono::steady_clock::now();
+    auto budget = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        m_options.m_busy_poll);
+    if (timeout > 0) {
+      budget = std::min<std::chrono::nanoseconds>(
+          budget, std::chrono::milliseconds(timeout));
+    }
+    m_metrics.m_spins.add();
+    auto now = start;
+    do {
+      m_metrics.m_polls.add();
+      if (unsigned n = poll()) {
+        m_metrics.m_spin_hits.add();
+        return std::pair{n, now};
+      }
+      now = std::chrono::steady_clock::now();
+    } while (now - start < budget);
+    return std::nullopt;
+  }
+
+  void _count_iteration(unsigned events,
+                        std::chrono::steady_clock::time_point woke) noexcept {
+    m_metrics.m_waits.add();
+    m_metrics.m_events.add(events);
+    m_metrics.m_iteration.record(std::chrono::steady_clock::now() - woke);
+  }
+
+  // only safe to call from the loop thread
+  void stop() noexcept { m_stopped = true; }
+};
+
 #endif // IO_CONTEXT_HPP
@@ -0,0 +1,231 @@
+#ifndef IO_URING_HPP
+#define IO_URING_HPP
+
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Minimal io_uring wrapper over the raw syscalls (no liburing dependency).
+// Not thread safe: a ring belongs to the reactor that created it.
+struct io_uring_ring {
+  int m_fd = -1;
+  struct io_uring_params m_params;
+
+  void *m_sq_ptr = nullptr;
+  size_t m_sq_size = 0;
+  void *m_cq_ptr = nullptr;
+  size_t m_cq_size = 0;
+  struct io_uring_sqe *m_sqes = nullptr;
+
+  unsigned *m_sq_head;
+  unsigned *m_sq_tail;
+  unsigned m_sq_mask;
+  unsigned *m_sq_array;
+  unsigned *m_cq_head;
+  unsigned *m_cq_tail;
+  unsigned m_cq_mask;
+  struct io_uring_cqe *m_cqes;
+
+  unsigned m_sqe_tail = 0;  // next sqe handed out by get_sqe()
+  unsigned m_submitted = 0; // sqes already passed to the kernel
+
+  static int _setup(unsigned entries, struct io_uring_params *p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+  }
+
+  static int _enter(int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+  }
+
+  int _register(unsigned opcode, void *arg, unsigned nr_args) {
+    return static_cast<int>(
+        syscall(__NR_io_uring_register, m_fd, opcode, arg, nr_args));
+  }
+
+  explicit io_uring_ring(unsigned entries) {
+    std::memset(&m_params, 0, sizeof(m_params));
+    m_params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    m_fd = _setup(entries, &m_params);
+    if (m_fd < 0 && errno == EINVAL) { // older kernel, retry without hints
+      std::memset(&m_params, 0, sizeof(m_params));
+      m_fd = _setup(entries, &m_params);
+    }
+    check_error(SOURCE_INFO() "io_uring_setup", m_fd);
+
+    m_sq_size = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+    m_cq_size = m_params.cq_off.cqes +
+                m_params.cq_entries * sizeof(struct io_uring_cqe);
+    if (m_params.features & IORING_FEAT_SINGLE_MMAP) {
+      m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    }
+    m_sq_ptr = _mmap(m_sq_size, IORING_OFF_SQ_RING);
+    m_cq_ptr = (m_params.features & IORING_FEAT_SINGLE_MMAP)
+                   ? m_sq_ptr
+                   : _mmap(m_cq_size, IORING_OFF_CQ_RING);
+    m_sqes = static_cast<struct io_uring_sqe *>(_mmap(
+        m_params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES));
+
+    char *sq = static_cast<char *>(m_sq_ptr);
+    m_sq_head = reinterpret_cast<unsigned *>(sq + m_params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned *>(sq + m_params.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned *>(sq + m_params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned *>(sq + m_params.sq_off.array);
+    for (unsigned i = 0; i < m_params.sq_entries; i++) {
+      m_sq_array[i] = i; // sqes are always consumed in order
+    }
+
+    char *cq = static_cast<char *>(m_cq_ptr);
+    m_cq_head = reinterpret_cast<unsigned *>(cq + m_params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned *>(cq + m_params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned *>(cq + m_params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + m_params.cq_off.cqes);
+  }
+
+  io_uring_ring(const io_uring_ring &) = delete;
+  io_uring_ring &operator=(const io_uring_ring &) = delete;
+
+  ~io_uring_ring() {
+    if (m_sqes) {
+      munmap(m_sqes, m_params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (m_cq_ptr && m_cq_ptr != m_sq_ptr) {
+      munmap(m_cq_ptr, m_cq_size);
+    }
+    if (m_sq_ptr) {
+      munmap(m_sq_ptr, m_sq_size);
+    }
+    if (m_fd != -1) {
+      close(m_fd);
+    }
+  }
+
+  void *_mmap(size_t size, off_t offset) {
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, m_fd, offset);
+    if (ptr == MAP_FAILED) {
+      check_error(SOURCE_INFO() "mmap", -1);
+    }
+    return ptr;
+  }
+
+  // The returned sqe is zeroed; it is handed to the kernel by the next
+  // submit(). Submits early if the SQ is full.
+  struct io_uring_sqe *get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sqe_tail - head >= m_params.sq_entries) {
+      submit(0);
+    }
+    struct io_uring_sqe *sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+    m_sqe_tail++;
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  // one io_uring_enter for everything queued since the last call
+  int submit(unsigned wait_nr) {
+    __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = m_sqe_tail - m_submitted;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret = _enter(m_fd, to_submit, wait_nr, flags);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        return 0;
+      }
+      check_error(SOURCE_INFO() "io_uring_enter", -1);
+    }
+    m_submitted += static_cast<unsigned>(ret);
+    return ret;
+  }
+
+  // Calls f(user_data, res, flags) for each ready cqe. The cqe is retired
+  // before f runs, so f may queue new sqes.
+  template <class F> unsigned for_each_cqe(F &&f) {
+    unsigned head = *m_cq_head;
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    unsigned n = tail - head;
+    for (; head != tail; head++) {
+      struct io_uring_cqe cqe = m_cqes[head & m_cq_mask];
+      __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+      f(cqe.user_data, cqe.res, cqe.flags);
+    }
+    return n;
+  }
+
+  // A ring of provided buffers (IORING_REGISTER_PBUF_RING): recvs tagged
+  // with IOSQE_BUFFER_SELECT pick a free buffer from the group when data
+  // arrives, so idle connections hold no receive memory.
+  struct buffer_ring {
+    struct io_uring_buf_ring *m_ring = nullptr;
+    char *m_buffers = nullptr;
+    unsigned m_count = 0;
+    unsigned m_buf_size = 0;
+    uint16_t m_group = 0;
+    uint16_t m_tail = 0;
+
+    char *buffer(uint16_t bid) const noexcept {
+      return m_buffers + static_cast<size_t>(bid) * m_buf_size;
+    }
+
+    // hands buffer `bid` back to the kernel
+    void recycle(uint16_t bid) noexcept {
+      // not m_ring->bufs: in C++ the empty struct in __DECLARE_FLEX_ARRAY
+      // takes a byte and shifts the array off the ring start
+      auto bufs = reinterpret_cast<struct io_uring_buf *>(m_ring);
+      struct io_uring_buf *buf = &bufs[m_tail & (m_count - 1)];
+      buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+      buf->len = m_buf_size;
+      buf->bid = bid;
+      m_tail++;
+      __atomic_store_n(&m_ring->tail, m_tail, __ATOMIC_RELEASE);
+    }
+  };
+
+  // count must be a power of two
+  void setup_buffer_ring(buffer_ring &br, uint16_t group, unsigned count,
+                         unsigned buf_size) {
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    void *ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+      check_error(SOURCE_INFO() "mmap", -1);
+    }
+    br.m_ring = static_cast<struct io_uring_buf_ring *>(ring);
+    br.m_buffers = new char[static_cast<size_t>(count) * buf_size];
+    br.m_count = count;
+    br.m_buf_size = buf_size;
+    br.m_group = group;
+    br.m_tail = 0;
+
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    CHECK_CALL(_register, IORING_REGISTER_PBUF_RING, &reg, 1);
+    for (unsigned i = 0; i < count; i++) {
+      br.recycle(static_cast<uint16_t>(i));
+    }
+  }
+
+  void destroy_buffer_ring(buffer_ring &br) {
+    if (!br.m_ring) {
+      return;
+    }
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.bgid = br.m_group;
+    _register(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br.m_ring, br.m_count * sizeof(struct io_uring_buf));
+    delete[] br.m_buffers;
+    br.m_ring = nullptr;
+  }
+};
+
+#endif // IO_URING_HPP
@@ -0,0 +1,460 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include "utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+enum class log_level : uint8_t {
+  trace,
+  debug,
+  info,
+  warn,
+  error,
+  off,
+};
+
+// Levels below this are compiled out, arguments included; see the
+// CO_HTTP_LOG_LEVEL cache variable in CMakeLists.txt.
+#ifndef CO_HTTP_LOG_LEVEL
+#define CO_HTTP_LOG_LEVEL 2 // info
+#endif
+
+// runtime threshold, at or above the compiled one
+inline std::atomic<log_level> g_log_level{log_level::info};
+
+inline constexpr std::string_view k_level_names[] = {
+    "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF",
+};
+
+inline bool parse_log_level(std::string_view name, log_level &level) {
+  for (size_t i = 0; i < std::size(k_level_names); i++) {
+    std::string_view known = k_level_names[i];
+    if (name.size() == known.size() &&
+        std::equal(name.begin(), name.end(), known.begin(), [](char a, char b) {
+          return (a >= 'a' && a <= 'z' ? a - 'a' + 'A' : a) == b;
+        })) {
+      level = static_cast<log_level>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// A string argument of an access log line, written with JSON escapes.
+struct log_json {
+  std::string_view m_value;
+};
+
+template <> struct fmt::formatter<log_json> : formatter<std::string_view> {
+  template <class Context> auto format(log_json s, Context &ctx) const {
+    auto out = ctx.out();
+    for (char c : s.m_value) {
+      if (c == '"' || c == '\\') {
+        *out++ = '\\';
+        *out++ = c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        out = fmt::format_to(out, "\\u{:04x}", static_cast<unsigned>(c));
+      } else {
+        *out++ = c;
+      }
+    }
+    return out;
+  }
+};
+
+// How one argument travels through a log_ring: the hot path copies its
+// bytes, the writer thread decodes and formats them. Strings are copied as
+// length and bytes and come back as views into the ring.
+template <class T> struct _log_codec {
+  static_assert(std::is_trivially_copyable_v<T> && !std::is_pointer_v<T>,
+                "log arguments must be values or strings");
+  using stored = T;
+
+  static size_t size(const T &) noexcept { return sizeof(T); }
+
+  static char *encode(char *out, const T &value) noexcept {
+    std::memcpy(out, &value, sizeof(T));
+    return out + sizeof(T);
+  }
+
+  static T decode(const char *&in) noexcept {
+    T value;
+    std::memcpy(&value, in, sizeof(T));
+    in += sizeof(T);
+    return value;
+  }
+};
+
+struct _log_string_codec {
+  using stored = std::string_view;
+
+  static size_t size(std::string_view s) noexcept {
+    return sizeof(size_t) + s.size();
+  }
+
+  static char *encode(char *out, std::string_view s) noexcept {
+    size_t n = s.size();
+    std::memcpy(out, &n, sizeof(n));
+    std::memcpy(out + sizeof(n), s.data(), n);
+    return out + sizeof(n) + n;
+  }
+
+  static std::string_view decode(const char *&in) noexcept {
+    size_t n;
+    std::memcpy(&n, in, sizeof(n));
+    std::string_view s(in + sizeof(n), n);
+    in += sizeof(n) + n;
+    return s;
+  }
+};
+
+template <> struct _log_codec<std::string_view> : _log_string_codec {};
+template <> struct _log_codec<std::string> : _log_string_codec {};
+template <> struct _log_codec<const char *> : _log_string_codec {};
+template <> struct _log_codec<char *> : _log_string_codec {};
+
+template <> struct _log_codec<log_json> {
+  using stored = log_json;
+
+  static size_t size(log_json s) noexcept {
+    return _log_string_codec::size(s.m_value);
+  }
+
+  static char *encode(char *out, log_json s) noexcept {
+    return _log_string_codec::encode(out, s.m_value);
+  }
+
+  static log_json decode(const char *&in) noexcept {
+    return {_log_string_codec::decode(in)};
+  }
+};
+
+template <class T> using _log_codec_t = _log_codec<std::decay_t<T>>;
+
+enum class log_channel : uint8_t {
+  log,    // "<time> <LEVEL> [thread] message"
+  access, // one JSON object per line, "time" prepended by the writer
+};
+
+struct _log_record {
+  uint32_t m_size; // header included, multiple of 8
+  log_level m_level;
+  log_channel m_channel;
+  uint32_t m_format_len;
+  int64_t m_time_ns; // system_clock
+  const char *m_format;
+  // null: padding up to the end of the ring
+  void (*m_render)(const _log_record &record, fmt::memory_buffer &out);
+
+  const char *payload() const noexcept {
+    return reinterpret_cast<const char *>(this + 1);
+  }
+};
+
+template <class... Stored>
+void _render_record(const _log_record &record, fmt::memory_buffer &out) {
+  // braced initialization runs the decoders left to right; a message
+  // without arguments reads nothing
+  [[maybe_unused]] const char *in = record.payload();
+  std::tuple<Stored...> args{_log_codec<Stored>::decode(in)...};
+  std::apply(
+      [&](const auto &...values) {
+        fmt::vformat_to(std::back_inserter(out),
+                        fmt::string_view(record.m_format, record.m_format_len),
+                        fmt::make_format_args(values...));
+      },
+      args);
+}
+
+// Single producer (the thread owning it), single consumer (the log
+// writer). Records are contiguous; one that does not fit before the end of
+// the buffer starts over at the beginning behind a padding record. A full
+// ring drops the record and counts it: the event loop never waits on the
+// log.
+struct log_ring {
+  static constexpr size_t k_capacity = 256 * 1024; // power of two
+  static constexpr size_t k_mask = k_capacity - 1;
+
+  std::unique_ptr<char[]> m_data{new char[k_capacity]};
+  unsigned m_id = 0;
+  alignas(64) std::atomic<size_t> m_head{0}; // consumer, monotonic
+  alignas(64) std::atomic<size_t> m_tail{0}; // producer, monotonic
+  size_t m_cached_head = 0;                  // producer's view of m_head
+  std::atomic<size_t> m_dropped{0};
+
+  // room for `size` bytes (a multiple of 8), or null if full
+  char *_reserve(size_t size, size_t &next_tail) noexcept {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t to_end = k_capacity - (tail & k_mask);
+    size_t skip = to_end < size ? to_end : 0;
+    if (tail + skip + size - m_cached_head > k_capacity) {
+      m_cached_head = m_head.load(std::memory_order_acquire);
+      if (tail + skip + size - m_cached_head > k_capacity) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      }
+    }
+    if (skip >= sizeof(_log_record)) {
+      auto pad = reinterpret_cast<_log_record *>(&m_data[tail & k_mask]);
+      pad->m_size = static_cast<uint32_t>(skip);
+      pad->m_render = nullptr;
+    } // shorter gaps are skipped by the reader without a record
+    next_tail = tail + skip + size;
+    return &m_data[(tail + skip) & k_mask];
+  }
+
+  void _commit(size_t next_tail) noexcept {
+    m_tail.store(next_tail, std::memory_order_release);
+  }
+
+  template <class Fn> void drain(Fn &&fn) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_acquire);
+    while (head != tail) {
+      size_t to_end = k_capacity - (head & k_mask);
+      if (to_end < sizeof(_log_record)) {
+        head += to_end;
+        continue;
+      }
+      auto record = reinterpret_cast<const _log_record *>(&m_data[head & k_mask]);
+      if (record->m_render != nullptr) {
+        fn(*record);
+      }
+      head += record->m_size;
+    }
+    m_head.store(head, std::memory_order_release);
+  }
+};
+
+// Owns the rings and the writer thread, which wakes every millisecond or
+// so while there is traffic, formats what the rings hold and writes each
+// channel with one write() per pass.
+struct log_backend {
+  std::mutex m_mutex; // guards m_rings; taken once per thread and per pass
+  std::vector<std::unique_ptr<log_ring>> m_rings;
+  int m_log_fd = STDERR_FILENO;
+  int m_access_fd = -1;
+  std::atomic<bool> m_access_enabled{false};
+  std::atomic<bool> m_stop{false};
+  size_t m_reported_drops = 0; // writer thread only
+  std::thread m_writer;        // last: starts in the constructor
+
+  static log_backend &instance() {
+    static log_backend backend;
+    return backend;
+  }
+
+  log_backend() : m_writer([this] { _run(); }) {}
+
+  log_backend(const log_backend &) = delete;
+  log_backend &operator=(const log_backend &) = delete;
+
+  // drains everything still queued
+  ~log_backend() {
+    m_stop.store(true, std::memory_order_release);
+    m_writer.join();
+    if (m_access_fd != -1) {
+      close(m_access_fd);
+    }
+  }
+
+  // JSON lines appended to `path`, "-" for stdout
+  void open_access_log(const std::string &path) {
+    m_access_fd =
+        path == "-" ? STDOUT_FILENO
+                    : CHECK_CALL(open, path.c_str(),
+                                 O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                                 0644);
+    m_access_enabled.store(true, std::memory_order_release);
+  }
+
+  log_ring &thread_ring() {
+    thread_local log_ring *ring = nullptr;
+    if (ring == nullptr) {
+      std::lock_guard guard(m_mutex);
+      m_rings.push_back(std::make_unique<log_ring>());
+      ring = m_rings.back().get();
+      ring->m_id = static_cast<unsigned>(m_rings.size() - 1);
+    }
+    return *ring;
+  }
+
+  template <class... Args>
+  void write(log_channel channel, log_level level,
+             fmt::format_string<Args...> format, const Args &...args) {
+    using clock = std::chrono::system_clock;
+    size_t size = sizeof(_log_record);
+    ((size += _log_codec_t<Args>::size(args)), ...);
+    size = (size + 7) & ~size_t(7);
+    log_ring &ring = thread_ring();
+    if (size > log_ring::k_capacity / 4) {
+      ring.m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    size_t next_tail;
+    char *out = ring._reserve(size, next_tail);
+    if (out == nullptr) {
+      return;
+    }
+    auto record = reinterpret_cast<_log_record *>(out);
+    fmt::string_view text = format;
+    record->m_size = static_cast<uint32_t>(size);
+    record->m_level = level;
+    record->m_channel = channel;
+    record->m_format_len = static_cast<uint32_t>(text.size());
+    record->m_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            clock::now().time_since_epoch())
+                            .count();
+    record->m_format = text.data(); // a literal, see fmt::format_string
+    record->m_render =
+        &_render_record<typename _log_codec_t<Args>::stored...>;
+    out = out + sizeof(_log_record);
+    ((out = _log_codec_t<Args>::encode(out, args)), ...);
+    ring._commit(next_tail);
+  }
+
+  struct _time_cache {
+    time_t m_second = -1;
+    char m_text[24]; // "2026-01-02T03:04:05"
+  };
+
+  static void _append_time(fmt::memory_buffer &out, int64_t ns,
+                           _time_cache &cache) {
+    time_t second = static_cast<time_t>(ns / 1000000000);
+    if (second != cache.m_second) {
+      struct tm tm;
+      gmtime_r(&second, &tm);
+      strftime(cache.m_text, sizeof(cache.m_text), "%Y-%m-%dT%H:%M:%S", &tm);
+      cache.m_second = second;
+    }
+    fmt::format_to(std::back_inserter(out), "{}.{:06}Z", cache.m_text,
+                   (ns % 1000000000) / 1000);
+  }
+
+  static void _write_all(int fd, fmt::memory_buffer &buf) {
+    const char *p = buf.data();
+    size_t left = buf.size();
+    while (left > 0) {
+      ssize_t n = ::write(fd, p, left);
+      if (n <= 0) {
+        if (n == -1 && errno == EINTR) {
+          continue;
+        }
+        break; // nowhere to report it
+      }
+      p += n;
+      left -= static_cast<size_t>(n);
+    }
+    buf.clear();
+  }
+
+  // one pass over every ring; false if there was nothing to write
+  bool _drain(fmt::memory_buffer &log, fmt::memory_buffer &access,
+              _time_cache &cache) {
+    size_t dropped = 0;
+    {
+      std::lock_guard guard(m_mutex);
+      for (auto &ring : m_rings) {
+        ring->drain([&](const _log_record &record) {
+          auto &out = record.m_channel == log_channel::access ? access : log;
+          if (record.m_channel == log_channel::access) {
+            out.append(std::string_view("{\"time\":\""));
+            _append_time(out, record.m_time_ns, cache);
+            out.append(std::string_view("\","));
+          } else {
+            _append_time(out, record.m_time_ns, cache);
+            fmt::format_to(std::back_inserter(out), " {:<5} [{}] ",
+                           k_level_names[static_cast<size_t>(record.m_level)],
+                           ring->m_id);
+          }
+          record.m_render(record, out);
+          out.append(std::string_view(
+              record.m_channel == log_channel::access ? "}\n" : "\n"));
+        });
+        dropped += ring->m_dropped.load(std::memory_order_relaxed);
+      }
+    }
+    if (dropped != m_reported_drops) {
+      fmt::format_to(std::back_inserter(log),
+                     "log: {} records dropped, the rings were full\n",
+                     dropped - m_reported_drops);
+      m_reported_drops = dropped;
+    }
+    bool any = log.size() != 0 || access.size() != 0;
+    if (log.size() != 0) {
+      _write_all(m_log_fd, log);
+    }
+    if (access.size() != 0) {
+      _write_all(m_access_fd, access);
+    }
+    return any;
+  }
+
+  void _run() {
+    fmt::memory_buffer log, access;
+    _time_cache cache;
+    auto idle = std::chrono::milliseconds(1);
+    while (!m_stop.load(std::memory_order_acquire)) {
+      if (_drain(log, access, cache)) {
+        idle = std::chrono::milliseconds(1);
+      } else {
+        idle = std::min(idle * 2, std::chrono::milliseconds(16));
+      }
+      std::this_thread::sleep_for(idle);
+    }
+    _drain(log, access, cache);
+  }
+};
+
+inline bool access_log_enabled() noexcept {
+  return log_backend::instance().m_access_enabled.load(
+      std::memory_order_relaxed);
+}
+
+// LOG_INFO("Listening {}:{}", host, port); arguments are only evaluated if
+// the level is compiled in and enabled.
+#define CO_HTTP_LOG(level, ...)                                                \
+  do {                                                                         \
+    if constexpr (static_cast<int>(level) >= CO_HTTP_LOG_LEVEL) {              \
+      if ((level) >= g_log_level.load(std::memory_order_relaxed)) {            \
+        log_backend::instance().write(log_channel::log, (level),               \
+                                      __VA_ARGS__);                            \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOG_TRACE(...) CO_HTTP_LOG(log_level::trace, __VA_ARGS__)
+#define LOG_DEBUG(...) CO_HTTP_LOG(log_level::debug, __VA_ARGS__)
+#define LOG_INFO(...) CO_HTTP_LOG(log_level::info, __VA_ARGS__)
+#define LOG_WARN(...) CO_HTTP_LOG(log_level::warn, __VA_ARGS__)
+#define LOG_ERROR(...) CO_HTTP_LOG(log_level::error, __VA_ARGS__)
+
+// the fields of one JSON object, without braces; see log_channel::access
+#define LOG_ACCESS(...)                                                        \
+  do {                                                                         \
+    if (access_log_enabled()) {                                                \
+      log_backend::instance().write(log_channel::access, log_level::info,      \
+                                    __VA_ARGS__);                              \
+    }                                                                          \
+  } while (0)
+
+#endif // LOGGER_HPP
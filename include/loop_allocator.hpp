@@ -0,0 +1,94 @@
+#ifndef LOOP_ALLOCATOR_HPP
+#define LOOP_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <new>
+
+// Size-class free lists, one allocator per event loop, for the small
+// short-lived objects of the loop (coroutine frames, spilled callbacks).
+// Everything is allocated and freed on the loop thread: no locking.
+struct loop_allocator {
+  static constexpr size_t k_granularity = 64;
+  static constexpr size_t k_classes = 32; // pooled up to 2 KiB
+
+  struct _free_node {
+    _free_node *m_next;
+  };
+
+  _free_node *m_free[k_classes] = {};
+  size_t m_live = 0;
+
+  loop_allocator() = default;
+  loop_allocator(const loop_allocator &) = delete;
+  loop_allocator &operator=(const loop_allocator &) = delete;
+
+  ~loop_allocator() {
+    for (auto &head : m_free) {
+      while (head) {
+        _free_node *next = head->m_next;
+        ::operator delete(head);
+        head = next;
+      }
+    }
+  }
+
+  static size_t _class_of(size_t n) noexcept {
+    return (n + k_granularity - 1) / k_granularity - 1;
+  }
+
+  void *allocate(size_t n) {
+    m_live++;
+    size_t c = _class_of(n);
+    if (c >= k_classes) {
+      return ::operator new(n);
+    }
+    if (_free_node *node = m_free[c]) {
+      m_free[c] = node->m_next;
+      return node;
+    }
+    return ::operator new((c + 1) * k_granularity);
+  }
+
+  void deallocate(void *p, size_t n) noexcept {
+    m_live--;
+    size_t c = _class_of(n);
+    if (c >= k_classes) {
+      ::operator delete(p);
+      return;
+    }
+    auto node = static_cast<_free_node *>(p);
+    node->m_next = m_free[c];
+    m_free[c] = node;
+  }
+
+  // the allocator of the loop running on this thread, if any
+  static loop_allocator *&current() noexcept {
+    thread_local loop_allocator *instance = nullptr;
+    return instance;
+  }
+
+  // Blocks remember their allocator in a header so they can be freed after
+  // the thread has switched allocators; without a loop they fall back to
+  // the global heap.
+  static constexpr size_t k_header = alignof(std::max_align_t);
+
+  static void *allocate_here(size_t n) {
+    loop_allocator *alloc = current();
+    void *p = alloc ? alloc->allocate(n + k_header)
+                    : ::operator new(n + k_header);
+    *static_cast<loop_allocator **>(p) = alloc;
+    return static_cast<char *>(p) + k_header;
+  }
+
+  static void deallocate_here(void *ptr, size_t n) noexcept {
+    void *p = static_cast<char *>(ptr) - k_header;
+    loop_allocator *alloc = *static_cast<loop_allocator **>(p);
+    if (alloc) {
+      alloc->deallocate(p, n + k_header);
+    } else {
+      ::operator delete(p);
+    }
+  }
+};
+
+#endif // LOOP_ALLOCATOR_HPP
@@ -0,0 +1,185 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "bytes_buffer.hpp"
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fmt/format.h>
+#include <iterator>
+#include <string_view>
+
+// A counter with a single writer, the reactor owning it. Updates are a
+// plain load and store, no locked instruction; other threads may read it
+// at any time and see a recent value.
+struct metric_counter {
+  std::atomic<uint64_t> m_value{0};
+
+  void add(uint64_t n = 1) noexcept {
+    m_value.store(m_value.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+  }
+
+  void set(uint64_t n) noexcept {
+    m_value.store(n, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const noexcept {
+    return m_value.load(std::memory_order_relaxed);
+  }
+};
+
+// Log-bucketed histogram of nanosecond values, HDR style: every power of
+// two is split into k_sub linear buckets, so any recorded value is known to
+// within 1/k_sub (12.5%) from 1 ns up to k_max_exponent. Single writer,
+// like metric_counter; merge() sums several into a plain copy.
+struct log_histogram {
+  static constexpr unsigned k_sub_bits = 3;
+  static constexpr uint64_t k_sub = 1 << k_sub_bits;
+  static constexpr unsigned k_max_exponent = 45; // ~9.8 hours
+  static constexpr size_t k_buckets =
+      (k_max_exponent - k_sub_bits + 2) * k_sub;
+
+  std::array<metric_counter, k_buckets> m_counts;
+  metric_counter m_count;
+  metric_counter m_sum;
+
+  static constexpr size_t bucket_of(uint64_t value) noexcept {
+    if (value < k_sub) {
+      return static_cast<size_t>(value);
+    }
+    unsigned exponent = static_cast<unsigned>(std::bit_width(value)) - 1;
+    if (exponent > k_max_exponent) {
+      return k_buckets - 1;
+    }
+    uint64_t sub = (value >> (exponent - k_sub_bits)) & (k_sub - 1);
+    return (exponent - k_sub_bits + 1) * k_sub + sub;
+  }
+
+  // smallest value of the bucket; the next bucket's is its upper bound
+  static constexpr uint64_t lower_bound(size_t bucket) noexcept {
+    if (bucket < k_sub) {
+      return bucket;
+    }
+    unsigned exponent = static_cast<unsigned>(bucket / k_sub) + k_sub_bits - 1;
+    return (k_sub + bucket % k_sub) << (exponent - k_sub_bits);
+  }
+
+  void record(uint64_t value) noexcept {
+    m_counts[bucket_of(value)].add();
+    m_count.add();
+    m_sum.add(value);
+  }
+
+  void record(std::chrono::nanoseconds value) noexcept {
+    record(static_cast<uint64_t>(value.count() < 0 ? 0 : value.count()));
+  }
+
+  void merge(const log_histogram &other) noexcept {
+    for (size_t i = 0; i < k_buckets; i++) {
+      m_counts[i].add(other.m_counts[i].get());
+    }
+    m_count.add(other.m_count.get());
+    m_sum.add(other.m_sum.get());
+  }
+
+  // upper bound of the bucket holding the q-quantile
+  uint64_t quantile(double q) const noexcept {
+    uint64_t total = m_count.get();
+    if (total == 0) {
+      return 0;
+    }
+    auto rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_buckets; i++) {
+      seen += m_counts[i].get();
+      if (seen >= rank) {
+        return i + 1 < k_buckets ? lower_bound(i + 1) : lower_bound(i);
+      }
+    }
+    return lower_bound(k_buckets - 1);
+  }
+};
+
+static_assert(log_histogram::bucket_of(7) == 7);
+static_assert(log_histogram::bucket_of(8) == 8);
+static_assert(log_histogram::lower_bound(log_histogram::bucket_of(1000)) <=
+                  1000 &&
+              log_histogram::lower_bound(log_histogram::bucket_of(1000) + 1) >
+                  1000);
+
+// What the event loop itself does, owned by its io_context. Aligned so
+// that no other reactor's data shares its cache lines.
+struct alignas(64) loop_metrics {
+  metric_counter m_waits;   // iterations: blocking waits and fruitful spins
+  metric_counter m_events;  // events or cqes they returned
+  metric_counter m_bytes_in;
+  metric_counter m_bytes_out;
+  metric_counter m_rearms;  // fds parked on EAGAIN, POLL_ADDs under io_uring
+  log_histogram m_iteration; // time from a wakeup to the next wait
+  // busy polling, see loop_options::m_busy_poll
+  metric_counter m_spins;     // times the loop spun instead of blocking
+  metric_counter m_spin_hits; // spins that found work before the budget
+  metric_counter m_polls;     // non-blocking waits while spinning
+  metric_counter m_batch;     // epoll backend: current batch size, a gauge
+};
+
+// Prometheus text exposition format, appended to a response body.
+struct prometheus_writer {
+  bytes_buffer &m_out;
+
+  template <class... Args>
+  void _format(fmt::format_string<Args...> format, Args &&...args) {
+    fmt::memory_buffer buf;
+    fmt::format_to(std::back_inserter(buf), format,
+                   std::forward<Args>(args)...);
+    m_out.append(std::string_view(buf.data(), buf.size()));
+  }
+
+  void header(std::string_view name, std::string_view type,
+              std::string_view help) {
+    _format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+  }
+
+  void counter(std::string_view name, std::string_view help, uint64_t value) {
+    header(name, "counter", help);
+    _format("{} {}\n", name, value);
+  }
+
+  void gauge(std::string_view name, std::string_view help, double value) {
+    header(name, "gauge", help);
+    _format("{} {}\n", name, value);
+  }
+
+  // Buckets at powers of two from 1024 ns, which fall on bucket edges of the
+  // log_histogram so the cumulative counts are exact, plus p50, p99 and
+  // p99.9 as a separate gauge family. Values are exposed in seconds.
+  void histogram(std::string_view name, std::string_view help,
+                 const log_histogram &h) {
+    header(name, "histogram", help);
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (uint64_t bound = 1024; bound <= (uint64_t(1) << 36); bound <<= 1) {
+      while (bucket < log_histogram::k_buckets &&
+             log_histogram::lower_bound(bucket) < bound) {
+        cumulative += h.m_counts[bucket++].get();
+      }
+      _format("{}_bucket{{le=\"{}\"}} {}\n", name, double(bound) * 1e-9,
+              cumulative);
+    }
+    _format("{}_bucket{{le=\"+Inf\"}} {}\n", name, h.m_count.get());
+    _format("{}_sum {}\n{}_count {}\n", name, double(h.m_sum.get()) * 1e-9,
+            name, h.m_count.get());
+    header(fmt::format("{}_quantile", name), "gauge",
+           "Upper bounds of the p50, p99 and p99.9 buckets");
+    for (double q : {0.5, 0.99, 0.999}) {
+      _format("{}_quantile{{quantile=\"{}\"}} {}\n", name, q,
+              double(h.quantile(q)) * 1e-9);
+    }
+  }
+};
+
+#endif // METRICS_HPP
@@ -0,0 +1,117 @@
+#ifndef OBJECT_POOL_HPP
+#define OBJECT_POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+struct pool_stats {
+  size_t m_hits = 0;   // served from memory the pool already had
+  size_t m_misses = 0; // needed fresh memory
+  size_t m_live = 0;   // handed out and not yet returned
+  size_t m_resident_bytes = 0;
+
+  double hit_rate() const noexcept {
+    size_t total = m_hits + m_misses;
+    return total ? static_cast<double>(m_hits) / static_cast<double>(total)
+                 : 0.0;
+  }
+};
+
+// Slab allocator for one type, owned by one event loop: no locking. Slots
+// are carved from slabs of SlabSize objects that live as long as the pool,
+// so connection churn costs no malloc and memory stays bounded by the peak.
+// create()/destroy() construct and destroy every time; acquire()/release()
+// keep up to m_max_warm released objects constructed, so whatever they own
+// (a buffer's capacity, say) is reused as well. Objects still live when the
+// pool dies are not destroyed.
+template <class T, size_t SlabSize = 64> struct object_pool {
+  union _slot {
+    _slot *m_next;
+    alignas(T) unsigned char m_storage[sizeof(T)];
+  };
+
+  std::vector<std::unique_ptr<_slot[]>> m_slabs;
+  size_t m_bump = SlabSize; // next unused slot of the newest slab
+  _slot *m_free = nullptr;  // slots of destroyed objects
+  std::vector<T *> m_warm;
+  size_t m_max_warm = 1024;
+  pool_stats m_stats;
+
+  object_pool() = default;
+  object_pool(const object_pool &) = delete;
+  object_pool &operator=(const object_pool &) = delete;
+
+  ~object_pool() {
+    for (T *p : m_warm) {
+      p->~T();
+    }
+  }
+
+  _slot *_take_slot() {
+    if (_slot *slot = m_free) {
+      m_free = slot->m_next;
+      m_stats.m_hits++;
+      return slot;
+    }
+    if (m_bump == SlabSize) {
+      m_slabs.push_back(std::make_unique<_slot[]>(SlabSize));
+      m_stats.m_resident_bytes += SlabSize * sizeof(_slot);
+      m_bump = 0;
+    }
+    m_stats.m_misses++;
+    return &m_slabs.back()[m_bump++];
+  }
+
+  void _put_slot(void *p) noexcept {
+    auto slot = static_cast<_slot *>(p);
+    slot->m_next = m_free;
+    m_free = slot;
+  }
+
+  template <class... Args> T *create(Args &&...args) {
+    _slot *slot = _take_slot();
+    T *p;
+    try {
+      p = ::new (static_cast<void *>(slot->m_storage))
+          T(std::forward<Args>(args)...);
+    } catch (...) {
+      _put_slot(slot);
+      throw;
+    }
+    m_stats.m_live++;
+    return p;
+  }
+
+  void destroy(T *p) noexcept {
+    p->~T();
+    _put_slot(p);
+    m_stats.m_live--;
+  }
+
+  // a released object as it was left, or a new one
+  T *acquire() {
+    if (m_warm.empty()) {
+      return create();
+    }
+    T *p = m_warm.back();
+    m_warm.pop_back();
+    m_stats.m_hits++;
+    m_stats.m_live++;
+    return p;
+  }
+
+  // the caller resets `p` to a reusable state first
+  void release(T *p) {
+    if (m_warm.size() >= m_max_warm) {
+      destroy(p);
+      return;
+    }
+    m_warm.push_back(p);
+    m_stats.m_live--;
+  }
+};
+
+#endif // OBJECT_POOL_HPP
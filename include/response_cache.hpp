@@ -0,0 +1,211 @@
+#ifndef RESPONSE_CACHE_HPP
+#define RESPONSE_CACHE_HPP
+
+#include "bytes_buffer.hpp"
+#include "http_parser.hpp"
+#include "write_queue.hpp"
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A complete response as it goes on the wire: status line, headers and
+// body in one buffer, sent with a single write.
+struct cached_response {
+  std::string m_key;
+  bytes_buffer m_wire;
+  std::chrono::steady_clock::time_point m_expires;
+  size_t m_slot = 0;         // in response_cache::m_ring
+  bool m_referenced = false; // CLOCK bit, set by hits
+
+  size_t footprint() const noexcept {
+    return sizeof(*this) + m_key.capacity() + m_wire.m_data.capacity();
+  }
+};
+
+struct response_cache_stats {
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+  size_t m_expired = 0;
+  size_t m_evictions = 0; // pushed out by the memory budget
+  size_t m_stores = 0;
+  size_t m_entries = 0;
+  size_t m_bytes = 0;
+};
+
+// Serialized responses of one reactor, keyed by method, target and the
+// request headers named in m_vary. Every reactor has its own cache, so
+// lookups take no lock. A hit is queued on the connection as shared bytes:
+// no handler, no writer and no copy. Entries expire after m_ttl. Once
+// m_budget bytes are used, a CLOCK hand evicts entries that were not hit
+// since it last passed them.
+struct response_cache {
+  using clock = std::chrono::steady_clock;
+
+  std::vector<std::shared_ptr<cached_response>> m_ring; // null: free slot
+  std::vector<size_t> m_free_slots;
+  size_t m_hand = 0;
+  // keys point into the entries' m_key
+  std::unordered_map<std::string_view, cached_response *> m_index;
+  size_t m_budget = 64 * 1024 * 1024;
+  size_t m_max_response = 1024 * 1024;
+  std::chrono::milliseconds m_ttl{1000};
+  std::vector<std::string> m_vary{"accept-encoding"}; // lower case
+  response_cache_stats m_stats;
+  std::string m_key; // scratch for make_key()
+
+  // GET and HEAD without a body, and nothing that makes the answer depend
+  // on more than the key
+  template <class Parser> [[nodiscard]] bool cacheable(Parser &req) const {
+    std::string_view method = req.method();
+    if ((method != "GET" && method != "HEAD") || req.chunked() ||
+        req.content_length() != 0) {
+      return false;
+    }
+    auto &headers = req.headers();
+    for (http_field field :
+         {http_field::range, http_field::if_none_match,
+          http_field::if_modified_since, http_field::if_range,
+          http_field::authorization, http_field::cookie,
+          http_field::upgrade}) {
+      if (headers.find(field) != headers.end()) {
+        return false;
+      }
+    }
+    auto it = headers.find(http_field::cache_control);
+    return it == headers.end() ||
+           std::string_view(it->second).find("no-cache") ==
+               std::string_view::npos;
+  }
+
+  // valid until the next call
+  template <class Parser> std::string_view make_key(Parser &req) {
+    m_key.clear();
+    m_key += req.method();
+    m_key += ' ';
+    m_key += req.url();
+    auto &headers = req.headers();
+    for (const std::string &name : m_vary) {
+      m_key += '\n';
+      if (auto it = headers.find(name); it != headers.end()) {
+        m_key += it->second;
+      }
+    }
+    return m_key;
+  }
+
+  std::shared_ptr<cached_response> find(std::string_view key) {
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+      m_stats.m_misses++;
+      return nullptr;
+    }
+    cached_response *entry = it->second;
+    if (clock::now() >= entry->m_expires) {
+      m_stats.m_expired++;
+      m_stats.m_misses++;
+      _remove(entry->m_slot);
+      return nullptr;
+    }
+    entry->m_referenced = true;
+    m_stats.m_hits++;
+    return m_ring[entry->m_slot];
+  }
+
+  // Caches the response queued on `out` from chunk `first` on if it is a
+  // 200, small enough and not marked no-store; file ranges are read in.
+  void store(std::string_view key, const write_queue &out, size_t first) {
+    size_t size = 0;
+    for (size_t i = first; i < out.m_chunks.size(); i++) {
+      size += out.m_chunks[i].size();
+    }
+    if (first >= out.m_chunks.size() || size > m_max_response ||
+        size > m_budget / 4) {
+      return;
+    }
+    std::string_view status = out.m_chunks[first].bytes();
+    if (out.m_chunks[first].is_file() || !status.starts_with("HTTP/1.1 200 ") ||
+        status.find("\r\nCache-Control: no-store\r\n") != status.npos) {
+      return;
+    }
+    auto entry = std::make_shared<cached_response>();
+    entry->m_key = key;
+    entry->m_wire.reserve(size);
+    for (size_t i = first; i < out.m_chunks.size(); i++) {
+      const write_queue::_chunk &chunk = out.m_chunks[i];
+      if (!chunk.is_file()) {
+        entry->m_wire.append(chunk.bytes());
+        continue;
+      }
+      const file_range &file = chunk.m_file;
+      size_t begin = entry->m_wire.size();
+      entry->m_wire.m_data.resize(begin + file.m_length);
+      ssize_t n = pread(file.m_fd, entry->m_wire.data() + begin,
+                        file.m_length, file.m_offset);
+      if (n != static_cast<ssize_t>(file.m_length)) {
+        return; // changed under us; a later request tries again
+      }
+    }
+    entry->m_expires = clock::now() + m_ttl;
+    if (auto it = m_index.find(key); it != m_index.end()) {
+      _remove(it->second->m_slot); // e.g. pipelined misses on one key
+    }
+    _make_room(entry->footprint());
+    _insert(std::move(entry));
+  }
+
+  void _insert(std::shared_ptr<cached_response> entry) {
+    size_t slot;
+    if (m_free_slots.empty()) {
+      slot = m_ring.size();
+      m_ring.emplace_back();
+    } else {
+      slot = m_free_slots.back();
+      m_free_slots.pop_back();
+    }
+    entry->m_slot = slot;
+    m_index.emplace(entry->m_key, entry.get());
+    m_stats.m_bytes += entry->footprint();
+    m_stats.m_entries++;
+    m_stats.m_stores++;
+    m_ring[slot] = std::move(entry);
+  }
+
+  // connections still sending the entry keep it alive
+  void _remove(size_t slot) {
+    cached_response *entry = m_ring[slot].get();
+    m_index.erase(entry->m_key);
+    m_stats.m_bytes -= entry->footprint();
+    m_stats.m_entries--;
+    m_ring[slot].reset();
+    m_free_slots.push_back(slot);
+  }
+
+  // second chance: a hit entry survives one pass of the hand, an expired
+  // one goes first
+  void _make_room(size_t need) {
+    auto now = clock::now();
+    while (m_stats.m_entries > 0 && m_stats.m_bytes + need > m_budget) {
+      m_hand = m_hand + 1 < m_ring.size() ? m_hand + 1 : 0;
+      cached_response *entry = m_ring[m_hand].get();
+      if (entry == nullptr) {
+        continue;
+      }
+      if (now >= entry->m_expires) {
+        m_stats.m_expired++;
+      } else if (std::exchange(entry->m_referenced, false)) {
+        continue;
+      } else {
+        m_stats.m_evictions++;
+      }
+      _remove(m_hand);
+    }
+  }
+};
+
+#endif // RESPONSE_CACHE_HPP
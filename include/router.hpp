@@ -0,0 +1,363 @@
+#ifndef ROUTER_HPP
+#define ROUTER_HPP
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum class http_method : uint8_t {
+  get,
+  head,
+  post,
+  put,
+  del,
+  patch,
+  options,
+  other,
+};
+
+constexpr http_method parse_http_method(std::string_view method) noexcept {
+  if (method == "GET")
+    return http_method::get;
+  if (method == "HEAD")
+    return http_method::head;
+  if (method == "POST")
+    return http_method::post;
+  if (method == "PUT")
+    return http_method::put;
+  if (method == "DELETE")
+    return http_method::del;
+  if (method == "PATCH")
+    return http_method::patch;
+  if (method == "OPTIONS")
+    return http_method::options;
+  return http_method::other;
+}
+
+// Values of the :param and *wildcard segments of a matched route, as views
+// into the request target.
+struct route_params {
+  static constexpr size_t k_max_params = 8;
+  using value_type = std::pair<std::string_view, std::string_view>;
+
+  std::array<value_type, k_max_params> m_entries;
+  size_t m_size = 0;
+
+  const value_type *begin() const noexcept { return m_entries.data(); }
+
+  const value_type *end() const noexcept { return m_entries.data() + m_size; }
+
+  size_t size() const noexcept { return m_size; }
+
+  // empty if there is no such parameter
+  std::string_view get(std::string_view name) const noexcept {
+    for (const value_type &entry : *this) {
+      if (entry.first == name) {
+        return entry.second;
+      }
+    }
+    return {};
+  }
+};
+
+constexpr uint64_t _fnv1a(std::string_view s,
+                          uint64_t hash = 14695981039346656037ull) noexcept {
+  for (char c : s) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+  }
+  return hash;
+}
+
+template <class Handler> struct static_route {
+  http_method m_method;
+  std::string_view m_path;
+  Handler m_handler;
+};
+
+// Exact-match routes known at compile time, in an open addressing hash
+// table that the constexpr constructor fills: finding a fixed route costs
+// one hash of the path and usually one probe, however many there are. A
+// duplicate route fails the constant evaluation.
+template <class Handler, size_t N> struct static_route_table {
+  static constexpr size_t k_slots = std::bit_ceil(N * 2);
+  static constexpr uint16_t k_empty = 0xffff;
+  static_assert(N < k_empty, "too many static routes");
+
+  std::array<static_route<Handler>, N> m_routes;
+  std::array<uint16_t, k_slots> m_slots{};
+
+  static constexpr uint64_t _hash(http_method method,
+                                  std::string_view path) noexcept {
+    return _fnv1a(path, 14695981039346656037ull ^
+                            static_cast<uint64_t>(method));
+  }
+
+  constexpr explicit static_route_table(
+      const std::array<static_route<Handler>, N> &routes)
+      : m_routes(routes) {
+    for (uint16_t &slot : m_slots) {
+      slot = k_empty;
+    }
+    for (size_t i = 0; i < N; i++) {
+      size_t pos = _hash(routes[i].m_method, routes[i].m_path) & (k_slots - 1);
+      while (m_slots[pos] != k_empty) {
+        const static_route<Handler> &other = m_routes[m_slots[pos]];
+        if (other.m_method == routes[i].m_method &&
+            other.m_path == routes[i].m_path) {
+          throw std::logic_error("duplicate static route");
+        }
+        pos = (pos + 1) & (k_slots - 1);
+      }
+      m_slots[pos] = static_cast<uint16_t>(i);
+    }
+  }
+
+  constexpr const Handler *find(http_method method,
+                                std::string_view path) const noexcept {
+    size_t pos = _hash(method, path) & (k_slots - 1);
+    while (m_slots[pos] != k_empty) {
+      const static_route<Handler> &route = m_routes[m_slots[pos]];
+      if (route.m_method == method && route.m_path == path) {
+        return &route.m_handler;
+      }
+      pos = (pos + 1) & (k_slots - 1);
+    }
+    return nullptr;
+  }
+};
+
+template <class Handler, size_t N>
+constexpr auto make_static_routes(const static_route<Handler> (&routes)[N]) {
+  std::array<static_route<Handler>, N> array{};
+  for (size_t i = 0; i < N; i++) {
+    array[i] = routes[i];
+  }
+  return static_route_table<Handler, N>(array);
+}
+
+// Dispatches on method and path. Exact routes may come from a
+// static_route_table; the others live in a compressed radix tree whose
+// edges are literal path fragments, with at most one ":param" child (up to
+// the next '/') and one "*wildcard" child (the rest of the path) per node.
+// Literal edges win over parameters and parameters over wildcards,
+// backtracking when a more specific branch fails further down. Lookup
+// walks the path once, so its cost does not grow with the number of
+// routes, and it never allocates.
+template <class Handler> struct router {
+  static constexpr size_t k_any = static_cast<size_t>(http_method::other) + 1;
+
+  struct _node {
+    std::string m_prefix; // literal edge from the parent
+    std::vector<std::unique_ptr<_node>> m_children; // distinct first bytes
+    std::unique_ptr<_node> m_param;
+    std::string m_param_name;
+    std::unique_ptr<_node> m_wildcard;
+    std::string m_wildcard_name;
+    // one per method, plus k_any for routes taking every method
+    std::array<std::optional<Handler>, k_any + 1> m_handlers;
+    bool m_has_handlers = false;
+
+    _node *_child(char first) const noexcept {
+      for (const auto &child : m_children) {
+        if (child->m_prefix.front() == first) {
+          return child.get();
+        }
+      }
+      return nullptr;
+    }
+  };
+
+  struct match {
+    const Handler *m_handler = nullptr;
+    bool m_path_found = false; // false: 404, else no handler means 405
+  };
+
+  _node m_root;
+  const void *m_static = nullptr;
+  const Handler *(*m_static_find)(const void *table, http_method method,
+                                  std::string_view path) = nullptr;
+
+  // `table` must outlive the router, e.g. a constexpr global
+  template <size_t N>
+  void set_static_routes(const static_route_table<Handler, N> &table) {
+    m_static = &table;
+    m_static_find = [](const void *table, http_method method,
+                       std::string_view path) {
+      return static_cast<const static_route_table<Handler, N> *>(table)->find(
+          method, path);
+    };
+  }
+
+  // "/users/:id/posts", "/static/*path"; throws std::invalid_argument for
+  // patterns the tree cannot hold
+  void add(http_method method, std::string_view pattern, Handler handler) {
+    _add(static_cast<size_t>(method), pattern, std::move(handler));
+  }
+
+  // for every method that has no route of its own
+  void add_any(std::string_view pattern, Handler handler) {
+    _add(k_any, pattern, std::move(handler));
+  }
+
+  void _add(size_t slot, std::string_view pattern, Handler handler) {
+    if (pattern.empty() || pattern.front() != '/') {
+      throw std::invalid_argument("route must start with '/'");
+    }
+    size_t nparams = 0;
+    _node *node = &m_root;
+    while (!pattern.empty()) {
+      if (pattern.front() == ':' || pattern.front() == '*') {
+        if (++nparams > route_params::k_max_params) {
+          throw std::invalid_argument("too many route parameters");
+        }
+      }
+      if (pattern.front() == ':') {
+        size_t end = pattern.find('/');
+        std::string_view name = pattern.substr(1, end == pattern.npos
+                                                      ? pattern.npos
+                                                      : end - 1);
+        if (!node->m_param) {
+          node->m_param = std::make_unique<_node>();
+          node->m_param_name = name;
+        } else if (node->m_param_name != name) {
+          throw std::invalid_argument("conflicting parameter names");
+        }
+        node = node->m_param.get();
+        pattern.remove_prefix(end == pattern.npos ? pattern.size() : end);
+        continue;
+      }
+      if (pattern.front() == '*') {
+        std::string_view name = pattern.substr(1);
+        if (name.find('/') != name.npos) {
+          throw std::invalid_argument("wildcard must be last");
+        }
+        if (!node->m_wildcard) {
+          node->m_wildcard = std::make_unique<_node>();
+          node->m_wildcard_name = name;
+        } else if (node->m_wildcard_name != name) {
+          throw std::invalid_argument("conflicting wildcard names");
+        }
+        node = node->m_wildcard.get();
+        break;
+      }
+      std::string_view literal = pattern.substr(0, pattern.find_first_of(":*"));
+      _node *child = node->_child(literal.front());
+      if (child == nullptr) {
+        auto fresh = std::make_unique<_node>();
+        fresh->m_prefix = literal;
+        child = fresh.get();
+        node->m_children.push_back(std::move(fresh));
+        node = child;
+        pattern.remove_prefix(literal.size());
+        continue;
+      }
+      size_t common = 0;
+      while (common < literal.size() && common < child->m_prefix.size() &&
+             literal[common] == child->m_prefix[common]) {
+        common++;
+      }
+      if (common < child->m_prefix.size()) {
+        _split(*node, child, common);
+        child = node->_child(literal.front());
+      }
+      node = child;
+      pattern.remove_prefix(common);
+    }
+    if (node->m_handlers[slot]) {
+      throw std::invalid_argument("duplicate route");
+    }
+    node->m_handlers[slot] = std::move(handler);
+    node->m_has_handlers = true;
+  }
+
+  // puts a node for the first `len` bytes of `child`'s edge above it
+  static void _split(_node &parent, _node *child, size_t len) {
+    for (auto &slot : parent.m_children) {
+      if (slot.get() != child) {
+        continue;
+      }
+      auto upper = std::make_unique<_node>();
+      upper->m_prefix = child->m_prefix.substr(0, len);
+      child->m_prefix.erase(0, len);
+      upper->m_children.push_back(std::move(slot));
+      slot = std::move(upper);
+      return;
+    }
+  }
+
+  // `path` without the query string; `params` views into it
+  match find(http_method method, std::string_view path,
+             route_params &params) const {
+    params.m_size = 0;
+    if (m_static_find) {
+      if (const Handler *handler = m_static_find(m_static, method, path)) {
+        return {handler, true};
+      }
+    }
+    match result;
+    result.m_handler = _find(m_root, path, static_cast<size_t>(method),
+                             params, result.m_path_found);
+    return result;
+  }
+
+  static const Handler *_handler(const _node &node, size_t slot) {
+    if (node.m_handlers[slot]) {
+      return &*node.m_handlers[slot];
+    }
+    if (node.m_handlers[k_any]) {
+      return &*node.m_handlers[k_any];
+    }
+    return nullptr;
+  }
+
+  static const Handler *_find(const _node &node, std::string_view path,
+                              size_t slot, route_params &params,
+                              bool &path_found) {
+    if (path.empty() && node.m_has_handlers) {
+      path_found = true;
+      if (const Handler *handler = _handler(node, slot)) {
+        return handler;
+      }
+    }
+    if (!path.empty()) {
+      const _node *child = node._child(path.front());
+      if (child && path.starts_with(child->m_prefix)) {
+        if (auto handler = _find(*child, path.substr(child->m_prefix.size()),
+                                 slot, params, path_found)) {
+          return handler;
+        }
+      }
+      if (node.m_param) {
+        size_t end = path.find('/');
+        std::string_view value = path.substr(0, end);
+        if (!value.empty()) {
+          size_t mark = params.m_size;
+          params.m_entries[params.m_size++] = {node.m_param_name, value};
+          if (auto handler = _find(*node.m_param, path.substr(value.size()),
+                                   slot, params, path_found)) {
+            return handler;
+          }
+          params.m_size = mark;
+        }
+      }
+    }
+    if (node.m_wildcard && node.m_wildcard->m_has_handlers) {
+      path_found = true;
+      if (const Handler *handler = _handler(*node.m_wildcard, slot)) {
+        params.m_entries[params.m_size++] = {node.m_wildcard_name, path};
+        return handler;
+      }
+    }
+    return nullptr;
+  }
+};
+
+#endif // ROUTER_HPP
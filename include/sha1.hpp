@@ -0,0 +1,117 @@
+#ifndef SHA1_HPP
+#define SHA1_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// SHA-1 (RFC 3174), streaming. Not for security: it backs content digests
+// and the WebSocket handshake.
+struct sha1 {
+  std::array<uint32_t, 5> m_state = {0x67452301, 0xefcdab89, 0x98badcfe,
+                                     0x10325476, 0xc3d2e1f0};
+  unsigned char m_block[64];
+  size_t m_used = 0; // bytes in m_block
+  uint64_t m_length = 0;
+
+  void update(std::string_view data) {
+    m_length += data.size();
+    if (m_used != 0) {
+      size_t n = std::min(data.size(), sizeof(m_block) - m_used);
+      std::memcpy(m_block + m_used, data.data(), n);
+      m_used += n;
+      data.remove_prefix(n);
+      if (m_used < sizeof(m_block)) {
+        return;
+      }
+      _compress(m_block);
+      m_used = 0;
+    }
+    while (data.size() >= sizeof(m_block)) {
+      _compress(reinterpret_cast<const unsigned char *>(data.data()));
+      data.remove_prefix(sizeof(m_block));
+    }
+    std::memcpy(m_block, data.data(), data.size());
+    m_used = data.size();
+  }
+
+  std::array<unsigned char, 20> finish() {
+    uint64_t bits = m_length * 8;
+    m_block[m_used++] = 0x80;
+    if (m_used > 56) {
+      std::memset(m_block + m_used, 0, sizeof(m_block) - m_used);
+      _compress(m_block);
+      m_used = 0;
+    }
+    std::memset(m_block + m_used, 0, 56 - m_used);
+    for (int i = 0; i < 8; i++) {
+      m_block[56 + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    }
+    _compress(m_block);
+    std::array<unsigned char, 20> digest;
+    for (size_t i = 0; i < 20; i++) {
+      digest[i] = static_cast<unsigned char>(m_state[i / 4] >>
+                                             (24 - 8 * (i % 4)));
+    }
+    return digest;
+  }
+
+  void _compress(const unsigned char *block) noexcept {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 |
+             uint32_t(block[4 * i + 2]) << 8 | uint32_t(block[4 * i + 3]);
+    }
+    for (int i = 16; i < 80; i++) {
+      w[i] = std::rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3],
+             e = m_state[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t t = std::rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = std::rotl(b, 30);
+      b = a;
+      a = t;
+    }
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+  }
+};
+
+inline std::string sha1_hex(std::string_view data) {
+  sha1 h;
+  h.update(data);
+  auto digest = h.finish();
+  static constexpr char k_hex[] = "0123456789abcdef";
+  std::string out(40, '\0');
+  for (size_t i = 0; i < digest.size(); i++) {
+    out[2 * i] = k_hex[digest[i] >> 4];
+    out[2 * i + 1] = k_hex[digest[i] & 15];
+  }
+  return out;
+}
+
+#endif // SHA1_HPP
@@ -0,0 +1,74 @@
+#ifndef SIMD_SCAN_HPP
+#define SIMD_SCAN_HPP
+
+#include <cstddef>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CO_HTTP_SIMD_X86 1
+#endif
+
+// Delimiter search used by the HTTP parsers. Each variant returns the
+// first occurrence of `c` in [p, end), or `end`.
+
+inline const char *scan_char_scalar(const char *p, const char *end, char c) {
+  for (; p != end; ++p) {
+    if (*p == c) {
+      return p;
+    }
+  }
+  return end;
+}
+
+#if CO_HTTP_SIMD_X86
+__attribute__((target("sse2"))) inline const char *
+scan_char_sse2(const char *p, const char *end, char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    unsigned mask = static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return scan_char_scalar(p, end, c);
+}
+
+__attribute__((target("avx2"))) inline const char *
+scan_char_avx2(const char *p, const char *end, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  for (; end - p >= 32; p += 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    unsigned mask = static_cast<unsigned>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return scan_char_sse2(p, end, c);
+}
+#endif
+
+using scan_char_fn = const char *(*)(const char *, const char *, char);
+
+// picked once from what the CPU supports
+inline scan_char_fn _resolve_scan_char() noexcept {
+#if CO_HTTP_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &scan_char_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &scan_char_sse2;
+  }
+#endif
+  return &scan_char_scalar;
+}
+
+inline const char *scan_char(const char *p, const char *end, char c) {
+  static const scan_char_fn fn = _resolve_scan_char();
+  return fn(p, end, c);
+}
+
+#endif // SIMD_SCAN_HPP
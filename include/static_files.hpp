@@ -0,0 +1,451 @@
+#ifndef STATIC_FILES_HPP
+#define STATIC_FILES_HPP
+
+#include "async_file.hpp"
+#include "http_parser.hpp"
+#include "http_writer.hpp"
+#include "write_queue.hpp"
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+// An open file and what fstat() said about it. Shared by the cache and the
+// write queues still sending from it; the fd closes with the last owner.
+struct cached_file {
+  int m_fd = -1;
+  struct stat m_stat {};
+  std::string m_etag;          // strong: inode, size and mtime
+  std::string m_last_modified; // IMF-fixdate
+  std::chrono::steady_clock::time_point m_checked;
+
+  cached_file() = default;
+  cached_file(const cached_file &) = delete;
+  cached_file &operator=(const cached_file &) = delete;
+
+  ~cached_file() {
+    if (m_fd != -1) {
+      close(m_fd);
+    }
+  }
+
+  size_t size() const noexcept { return static_cast<size_t>(m_stat.st_size); }
+};
+
+struct file_cache_stats {
+  size_t m_hits = 0;
+  size_t m_misses = 0; // open() + fstat()
+  size_t m_evictions = 0;
+  size_t m_revalidations = 0; // stat() of an entry older than the limit
+};
+
+// Per-reactor LRU of open files and their metadata, keyed by path. An entry
+// is trusted for m_revalidate_after, then stat()ed by path again and
+// reopened if the file was replaced or modified, so edits to the document
+// root show up within that delay without a syscall per request.
+struct file_cache {
+  using clock = std::chrono::steady_clock;
+  using _entry = std::pair<std::string, std::shared_ptr<cached_file>>;
+
+  std::list<_entry> m_lru; // most recently used first
+  // keys point into m_lru, whose nodes never move
+  std::unordered_map<std::string_view, std::list<_entry>::iterator> m_index;
+  size_t m_max_entries = 1024;
+  std::chrono::milliseconds m_revalidate_after{1000};
+  file_cache_stats m_stats;
+
+  static bool _same_file(const struct stat &a, const struct stat &b) {
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev &&
+           a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+           a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+  }
+
+  void _erase(std::list<_entry>::iterator pos) {
+    m_index.erase(pos->first);
+    m_lru.erase(pos);
+  }
+
+  // the regular file at `path`, or nullptr with errno set
+  std::shared_ptr<cached_file> open(const std::string &path) {
+    auto now = clock::now();
+    if (auto it = m_index.find(path); it != m_index.end()) {
+      auto pos = it->second;
+      m_lru.splice(m_lru.begin(), m_lru, pos);
+      cached_file &file = *pos->second;
+      if (now - file.m_checked < m_revalidate_after) {
+        m_stats.m_hits++;
+        return pos->second;
+      }
+      m_stats.m_revalidations++;
+      struct stat st;
+      if (::stat(path.c_str(), &st) == 0 && _same_file(st, file.m_stat)) {
+        file.m_checked = now;
+        m_stats.m_hits++;
+        return pos->second;
+      }
+      _erase(pos); // changed or gone; senders keep their copy
+    }
+    m_stats.m_misses++;
+    auto file = std::make_shared<cached_file>();
+    file->m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file->m_fd == -1 || fstat(file->m_fd, &file->m_stat) == -1) {
+      return nullptr;
+    }
+    if (!S_ISREG(file->m_stat.st_mode)) {
+      errno = EISDIR;
+      return nullptr;
+    }
+    const struct stat &st = file->m_stat;
+    file->m_etag = fmt::format(
+        "\"{:x}-{:x}-{:x}\"", static_cast<uint64_t>(st.st_ino),
+        static_cast<uint64_t>(st.st_size),
+        static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull +
+            static_cast<uint64_t>(st.st_mtim.tv_nsec));
+    file->m_last_modified = format_http_date(st.st_mtim.tv_sec);
+    file->m_checked = now;
+    m_lru.emplace_front(path, file);
+    m_index.emplace(m_lru.front().first, m_lru.begin());
+    if (m_lru.size() > m_max_entries) {
+      _erase(std::prev(m_lru.end()));
+      m_stats.m_evictions++;
+    }
+    return file;
+  }
+
+  static std::string format_http_date(time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char buf[40];
+    size_t n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buf, n);
+  }
+
+  // IMF-fixdate only, the one format HTTP/1.1 senders must use; -1 if
+  // `value` is something else
+  static time_t parse_http_date(std::string_view value) {
+    char buf[40];
+    if (value.size() >= sizeof(buf)) {
+      return -1;
+    }
+    value.copy(buf, value.size());
+    buf[value.size()] = '\0';
+    struct tm tm {};
+    const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0') {
+      return -1;
+    }
+    return timegm(&tm);
+  }
+};
+
+// Serves GET and HEAD requests from a document root. Headers are built in a
+// pooled buffer and the body is queued as a file_range, so file contents
+// never pass through user space. Supports single byte ranges (Range,
+// If-Range) and conditional requests (If-None-Match, If-Modified-Since).
+struct static_files {
+  std::string m_root; // without a trailing '/'
+  file_cache m_cache;
+  std::string m_path; // scratch, reused for every request
+
+  explicit static_files(std::string root) : m_root(std::move(root)) {
+    while (m_root.size() > 1 && m_root.back() == '/') {
+      m_root.pop_back();
+    }
+  }
+
+  static int _hex(char c) noexcept {
+    if ('0' <= c && c <= '9')
+      return c - '0';
+    if ('a' <= c && c <= 'f')
+      return c - 'a' + 10;
+    if ('A' <= c && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  }
+
+  // Maps a request target to m_root + its decoded path, in m_path. Fails
+  // for targets that are not a path or that could leave the root.
+  [[nodiscard]] bool _map_path(std::string_view target) {
+    target = target.substr(0, target.find_first_of("?#"));
+    if (target.empty() || target.front() != '/') {
+      return false;
+    }
+    m_path = m_root;
+    size_t segment = m_path.size(); // the '/' starting the last segment
+    for (size_t i = 0; i < target.size(); i++) {
+      char c = target[i];
+      if (c == '%') {
+        if (i + 2 >= target.size()) {
+          return false;
+        }
+        int hi = _hex(target[i + 1]);
+        int lo = _hex(target[i + 2]);
+        if (hi < 0 || lo < 0) {
+          return false;
+        }
+        c = static_cast<char>(hi * 16 + lo);
+        i += 2;
+        if (c == '\0' || c == '/') { // no smuggled separators
+          return false;
+        }
+      } else if (c == '/') {
+        if (std::string_view(m_path).substr(segment) == "/..") {
+          return false;
+        }
+        segment = m_path.size();
+      }
+      m_path.push_back(c);
+    }
+    if (std::string_view(m_path).substr(segment) == "/..") {
+      return false;
+    }
+    if (m_path.back() == '/') {
+      m_path += "index.html";
+    }
+    return true;
+  }
+
+  static std::string_view content_type(std::string_view path) {
+    static constexpr std::pair<std::string_view, std::string_view> k_types[] =
+        {
+            {".html", "text/html;charset=utf-8"},
+            {".htm", "text/html;charset=utf-8"},
+            {".css", "text/css;charset=utf-8"},
+            {".js", "text/javascript;charset=utf-8"},
+            {".json", "application/json"},
+            {".txt", "text/plain;charset=utf-8"},
+            {".svg", "image/svg+xml"},
+            {".png", "image/png"},
+            {".jpg", "image/jpeg"},
+            {".jpeg", "image/jpeg"},
+            {".gif", "image/gif"},
+            {".webp", "image/webp"},
+            {".ico", "image/x-icon"},
+            {".wasm", "application/wasm"},
+            {".pdf", "application/pdf"},
+            {".woff2", "font/woff2"},
+            {".mp4", "video/mp4"},
+        };
+    size_t dot = path.rfind('.');
+    if (dot != std::string_view::npos && path.find('/', dot) == path.npos) {
+      std::string_view ext = path.substr(dot);
+      for (auto &[suffix, type] : k_types) {
+        if (iequals_lower(ext, suffix)) {
+          return type;
+        }
+      }
+    }
+    return "application/octet-stream";
+  }
+
+  // weak comparison against a list of entity tags, or "*"
+  static bool _etag_matches(std::string_view list, std::string_view etag) {
+    while (!list.empty()) {
+      size_t comma = list.find(',');
+      std::string_view tag = list.substr(0, comma);
+      while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+        tag.remove_prefix(1);
+      while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+        tag.remove_suffix(1);
+      if (tag.starts_with("W/")) {
+        tag.remove_prefix(2);
+      }
+      if (tag == "*" || tag == etag) {
+        return true;
+      }
+      if (comma == std::string_view::npos) {
+        break;
+      }
+      list.remove_prefix(comma + 1);
+    }
+    return false;
+  }
+
+  enum class range_kind {
+    none,          // no usable Range: send everything
+    partial,       // [m_begin, m_begin + m_length)
+    unsatisfiable, // 416
+  };
+
+  struct byte_range {
+    range_kind m_kind = range_kind::none;
+    size_t m_begin = 0;
+    size_t m_length = 0;
+  };
+
+  static bool _parse_size(std::string_view s, size_t &out) {
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && ptr == s.data() + s.size() && !s.empty();
+  }
+
+  // "bytes=first-last", "bytes=first-" or "bytes=-suffix". Several ranges
+  // are answered with the whole file, which RFC 9110 allows.
+  static byte_range parse_range(std::string_view value, size_t size) {
+    byte_range range;
+    if (!value.starts_with("bytes=") ||
+        value.find(',') != std::string_view::npos) {
+      return range;
+    }
+    value.remove_prefix(6);
+    size_t dash = value.find('-');
+    if (dash == std::string_view::npos) {
+      return range;
+    }
+    std::string_view first = value.substr(0, dash);
+    std::string_view last = value.substr(dash + 1);
+    size_t a = 0, b = 0;
+    if (first.empty()) {
+      if (!_parse_size(last, b)) {
+        return range;
+      }
+      range.m_kind = range_kind::unsatisfiable;
+      if (b == 0 || size == 0) {
+        return range;
+      }
+      b = b < size ? b : size;
+      range = {range_kind::partial, size - b, b};
+      return range;
+    }
+    if (!_parse_size(first, a) || (!last.empty() && !_parse_size(last, b)) ||
+        (!last.empty() && b < a)) {
+      return range;
+    }
+    if (a >= size) {
+      range.m_kind = range_kind::unsatisfiable;
+      return range;
+    }
+    if (last.empty() || b >= size) {
+      b = size - 1;
+    }
+    range = {range_kind::partial, a, b - a + 1};
+    return range;
+  }
+
+  static std::string_view _header(const header_view_table &headers,
+                                  http_field field) {
+    auto it = headers.find(field);
+    return it == headers.end() ? std::string_view{} : it->second;
+  }
+
+  // If-Range holds an entity tag or a date; the range applies only while
+  // it still names the current file
+  static bool _if_range_holds(std::string_view value, const cached_file &f) {
+    if (value.empty()) {
+      return true;
+    }
+    if (value.starts_with("\"") || value.starts_with("W/")) {
+      return value == f.m_etag; // strong comparison
+    }
+    return file_cache::parse_http_date(value) == f.m_stat.st_mtim.tv_sec;
+  }
+
+  // Answers the request: queues a header and, for GET with a body, the file
+  // range on `conn`.
+  template <class Parser>
+  void respond(Parser &req, http_response_writer &writer, async_file &conn) {
+    std::string_view method = req.method();
+    const header_view_table &headers = req.headers();
+    writer.buffer() = conn.m_out.take_buffer();
+    bool head = method == "HEAD";
+    if (method != "GET" && !head) {
+      _respond_error(writer, conn, 405, "Allow", "GET, HEAD");
+      return;
+    }
+    if (!_map_path(req.url())) {
+      _respond_error(writer, conn, 400);
+      return;
+    }
+    std::shared_ptr<cached_file> file = m_cache.open(m_path);
+    if (!file) {
+      _respond_error(writer, conn, errno == EACCES ? 403 : 404);
+      return;
+    }
+
+    std::string_view if_none_match = _header(headers, http_field::if_none_match);
+    bool not_modified = false;
+    if (!if_none_match.empty()) {
+      not_modified = _etag_matches(if_none_match, file->m_etag);
+    } else if (auto since = _header(headers, http_field::if_modified_since);
+               !since.empty()) {
+      time_t t = file_cache::parse_http_date(since);
+      not_modified = t != -1 && file->m_stat.st_mtim.tv_sec <= t;
+    }
+    if (not_modified) {
+      writer.begin_header(304);
+      _write_validators(writer, *file);
+      writer.end_header();
+      conn.queue_write(std::move(writer.buffer()));
+      return;
+    }
+
+    size_t size = file->size();
+    byte_range range;
+    if (auto value = _header(headers, http_field::range);
+        !value.empty() && !head &&
+        _if_range_holds(_header(headers, http_field::if_range), *file)) {
+      range = parse_range(value, size);
+    }
+    if (range.m_kind == range_kind::unsatisfiable) {
+      _respond_error(writer, conn, 416, "Content-Range",
+                     fmt::format("bytes */{}", size));
+      return;
+    }
+    if (range.m_kind == range_kind::none) {
+      range.m_length = size;
+    }
+
+    bool partial = range.m_kind == range_kind::partial;
+    writer.begin_header(partial ? 206 : 200);
+    writer.write_header("Server", "cpp_http");
+    writer.write_header("Content-Type", content_type(m_path));
+    writer.write_header("Content-Length", range.m_length);
+    writer.write_header("Accept-Ranges", "bytes");
+    if (partial) {
+      char value[64];
+      auto result = fmt::format_to_n(value, sizeof(value), "bytes {}-{}/{}",
+                                     range.m_begin,
+                                     range.m_begin + range.m_length - 1, size);
+      writer.write_header("Content-Range",
+                          std::string_view(value, result.size));
+    }
+    _write_validators(writer, *file);
+    writer.end_header();
+    conn.queue_write(std::move(writer.buffer()));
+    if (!head) {
+      int fd = file->m_fd;
+      conn.queue_file({fd, static_cast<off_t>(range.m_begin), range.m_length,
+                       std::move(file)});
+    }
+  }
+
+  static void _write_validators(http_response_writer &writer,
+                                const cached_file &file) {
+    writer.write_header("ETag", file.m_etag);
+    writer.write_header("Last-Modified", file.m_last_modified);
+  }
+
+  static void _respond_error(http_response_writer &writer, async_file &conn,
+                             int status, std::string_view extra_key = {},
+                             std::string_view extra_value = {}) {
+    writer.begin_header(status);
+    writer.write_header("Server", "cpp_http");
+    if (!extra_key.empty()) {
+      writer.write_header(extra_key, extra_value);
+    }
+    writer.write_header("Content-Length", 0);
+    writer.end_header();
+    conn.queue_write(std::move(writer.buffer()));
+  }
+};
+
+#endif // STATIC_FILES_HPP
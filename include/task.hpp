@@ -0,0 +1,165 @@
+#ifndef TASK_HPP
+#define TASK_HPP
+
+#include "logger.hpp"
+#include "loop_allocator.hpp"
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <fmt/core.h>
+#include <optional>
+#include <utility>
+
+struct _task_promise_base {
+  std::coroutine_handle<> m_continuation;
+  std::exception_ptr m_exception;
+  bool m_detached = false;
+
+  // frames come from the allocator of the loop they were created on
+  static void *operator new(size_t n) {
+    return loop_allocator::allocate_here(n);
+  }
+
+  static void operator delete(void *ptr, size_t n) noexcept {
+    loop_allocator::deallocate_here(ptr, n);
+  }
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct _final_awaiter {
+    bool await_ready() const noexcept { return false; }
+
+    template <class P>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<P> h) const noexcept {
+      _task_promise_base &promise = h.promise();
+      if (promise.m_detached) {
+        h.destroy();
+        return std::noop_coroutine();
+      }
+      return promise.m_continuation ? promise.m_continuation
+                                    : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  _final_awaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept {
+    if (m_detached) { // nobody to rethrow to
+      try {
+        std::rethrow_exception(std::current_exception());
+      } catch (const std::exception &e) {
+        LOG_ERROR("Error in detached task: {}", e.what());
+      }
+      return;
+    }
+    m_exception = std::current_exception();
+  }
+};
+
+// Lazily started coroutine. `co_await` it from another task, or hand it to
+// co_spawn() to run it detached on the current loop.
+template <class T = void> struct [[nodiscard]] task {
+  struct promise_type : _task_promise_base {
+    std::optional<T> m_value;
+
+    task get_return_object() noexcept {
+      return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    template <class U> void return_value(U &&value) {
+      m_value.emplace(std::forward<U>(value));
+    }
+
+    T _result() {
+      if (m_exception) {
+        std::rethrow_exception(m_exception);
+      }
+      return std::move(*m_value);
+    }
+  };
+
+  std::coroutine_handle<promise_type> m_handle;
+
+  explicit task(std::coroutine_handle<promise_type> h) noexcept
+      : m_handle(h) {}
+
+  task(task &&that) noexcept : m_handle(std::exchange(that.m_handle, {})) {}
+
+  task &operator=(task that) noexcept {
+    std::swap(m_handle, that.m_handle);
+    return *this;
+  }
+
+  ~task() {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> caller) noexcept {
+    m_handle.promise().m_continuation = caller;
+    return m_handle; // symmetric transfer, no stack growth
+  }
+
+  T await_resume() { return m_handle.promise()._result(); }
+};
+
+template <> struct [[nodiscard]] task<void> {
+  struct promise_type : _task_promise_base {
+    task get_return_object() noexcept {
+      return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    void return_void() noexcept {}
+
+    void _result() {
+      if (m_exception) {
+        std::rethrow_exception(m_exception);
+      }
+    }
+  };
+
+  std::coroutine_handle<promise_type> m_handle;
+
+  explicit task(std::coroutine_handle<promise_type> h) noexcept
+      : m_handle(h) {}
+
+  task(task &&that) noexcept : m_handle(std::exchange(that.m_handle, {})) {}
+
+  task &operator=(task that) noexcept {
+    std::swap(m_handle, that.m_handle);
+    return *this;
+  }
+
+  ~task() {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> caller) noexcept {
+    m_handle.promise().m_continuation = caller;
+    return m_handle;
+  }
+
+  void await_resume() { m_handle.promise()._result(); }
+};
+
+// Starts `t` now; its frame frees itself when it finishes.
+inline void co_spawn(task<void> t) {
+  auto h = std::exchange(t.m_handle, {});
+  h.promise().m_detached = true;
+  h.resume();
+}
+
+#endif // TASK_HPP
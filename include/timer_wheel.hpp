@@ -0,0 +1,220 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+struct timer_wheel;
+
+// An intrusive timer entry. The wheel links it into a slot and calls m_fire
+// when it is due; a timer fires once per schedule(). It must not move while
+// armed and unlinks itself when destroyed.
+struct timer {
+  void (*m_fire)(timer *self) = nullptr;
+  timer *m_prev = nullptr;
+  timer *m_next = nullptr;
+  timer_wheel *m_wheel = nullptr;
+  uint64_t m_expiry = 0; // in ticks
+  unsigned m_slot = 0;   // level * k_slots + index, to clear m_occupied
+
+  timer() = default;
+
+  explicit timer(void (*fire)(timer *self)) noexcept : m_fire(fire) {}
+
+  timer(const timer &) = delete;
+  timer &operator=(const timer &) = delete;
+
+  inline ~timer();
+
+  [[nodiscard]] bool armed() const noexcept { return m_next != nullptr; }
+};
+
+// Hierarchical timing wheel with 1 ms ticks: 4 levels of 64 slots cover
+// 2^24 ms (about 4.6 hours) and anything later waits in the top level until
+// it comes into range. Scheduling and cancelling are O(1); a timer moves
+// down a level when its slot comes round. The loop asks next_timeout() how
+// long it may block and calls advance() after waking up.
+struct timer_wheel {
+  using clock = std::chrono::steady_clock;
+
+  static constexpr unsigned k_bits = 6;
+  static constexpr unsigned k_slots = 1u << k_bits;
+  static constexpr unsigned k_levels = 4;
+  static constexpr uint64_t k_range = uint64_t{1} << (k_bits * k_levels);
+
+  // each slot is a sentinel of a circular list
+  std::array<std::array<timer, k_slots>, k_levels> m_slots;
+  std::array<uint64_t, k_levels> m_occupied{}; // bit per non-empty slot
+  clock::time_point m_origin = clock::now();
+  uint64_t m_now = 0; // every tick up to here has been processed
+  size_t m_size = 0;
+
+  timer_wheel() {
+    for (auto &level : m_slots) {
+      for (timer &sentinel : level) {
+        sentinel.m_prev = sentinel.m_next = &sentinel;
+      }
+    }
+  }
+
+  timer_wheel(const timer_wheel &) = delete;
+  timer_wheel &operator=(const timer_wheel &) = delete;
+
+  ~timer_wheel() { // leave the timers disarmed rather than dangling
+    for (auto &level : m_slots) {
+      for (timer &sentinel : level) {
+        while (sentinel.m_next != &sentinel) {
+          _unlink(*sentinel.m_next);
+        }
+        sentinel.m_prev = sentinel.m_next = nullptr;
+      }
+    }
+  }
+
+  uint64_t _ticks() const noexcept {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() -
+                                                              m_origin)
+            .count());
+  }
+
+  size_t size() const noexcept { return m_size; }
+
+  [[nodiscard]] bool empty() const noexcept { return m_size == 0; }
+
+  // (re)arms `t` to fire `delay` from now; a zero delay fires on the next
+  // advance()
+  void schedule(timer &t, std::chrono::milliseconds delay) {
+    if (t.armed()) {
+      _unlink(t);
+    }
+    uint64_t expiry = _ticks() + static_cast<uint64_t>(
+                                     delay.count() > 0 ? delay.count() : 0);
+    t.m_expiry = expiry > m_now ? expiry : m_now + 1;
+    t.m_wheel = this;
+    _link(t);
+  }
+
+  void cancel(timer &t) noexcept {
+    if (t.armed()) {
+      _unlink(t);
+    }
+  }
+
+  void _link(timer &t) noexcept {
+    uint64_t delta = t.m_expiry > m_now ? t.m_expiry - m_now : 0;
+    uint64_t when = t.m_expiry > m_now ? t.m_expiry : m_now;
+    if (delta >= k_range) { // out of range: park in the farthest slot
+      delta = k_range - 1;
+      when = m_now + delta;
+    }
+    unsigned level = 0;
+    while (delta >= (uint64_t{1} << (k_bits * (level + 1)))) {
+      level++;
+    }
+    unsigned index = (when >> (k_bits * level)) & (k_slots - 1);
+    timer &sentinel = m_slots[level][index];
+    t.m_prev = sentinel.m_prev;
+    t.m_next = &sentinel;
+    sentinel.m_prev->m_next = &t;
+    sentinel.m_prev = &t;
+    t.m_slot = level * k_slots + index;
+    m_occupied[level] |= uint64_t{1} << index;
+    m_size++;
+  }
+
+  void _unlink(timer &t) noexcept {
+    t.m_prev->m_next = t.m_next;
+    t.m_next->m_prev = t.m_prev;
+    unsigned level = t.m_slot / k_slots;
+    unsigned index = t.m_slot % k_slots;
+    timer &sentinel = m_slots[level][index];
+    if (sentinel.m_next == &sentinel) {
+      m_occupied[level] &= ~(uint64_t{1} << index);
+    }
+    t.m_prev = t.m_next = nullptr;
+    m_size--;
+  }
+
+  // moves the timers of one higher-level slot down to where they belong
+  void _cascade(unsigned level, unsigned index) {
+    timer &sentinel = m_slots[level][index];
+    while (sentinel.m_next != &sentinel) {
+      timer &t = *sentinel.m_next;
+      _unlink(t);
+      _link(t);
+    }
+  }
+
+  // Fires every timer due by now. Callbacks may schedule and cancel timers,
+  // including the one being fired.
+  void advance() {
+    uint64_t target = _ticks();
+    if (m_size == 0) {
+      m_now = target > m_now ? target : m_now;
+      return;
+    }
+    while (m_now < target) {
+      m_now++;
+      unsigned index = m_now & (k_slots - 1);
+      if (index == 0) { // a lap is over: bring the next slots down
+        unsigned level = 1;
+        while (level < k_levels &&
+               (m_now & ((uint64_t{1} << (k_bits * level)) - 1)) == 0) {
+          level++;
+        }
+        while (--level > 0) { // highest first, they may land below
+          _cascade(level, (m_now >> (k_bits * level)) & (k_slots - 1));
+        }
+      }
+      timer &sentinel = m_slots[0][index];
+      while (sentinel.m_next != &sentinel) {
+        timer *t = sentinel.m_next;
+        _unlink(*t);
+        t->m_fire(t);
+      }
+      if (m_size == 0) {
+        m_now = target;
+        return;
+      }
+    }
+  }
+
+  // How long the loop may block, in ms; -1 with no timers. That is up to
+  // the next non-empty level 0 slot or the next cascade of a non-empty
+  // higher slot, whichever comes first.
+  int next_timeout() const noexcept {
+    if (m_size == 0) {
+      return -1;
+    }
+    uint64_t due = UINT64_MAX;
+    for (unsigned level = 0; level < k_levels; level++) {
+      if (m_occupied[level] == 0) {
+        continue;
+      }
+      uint64_t lap = m_now >> (k_bits * level);
+      unsigned index = lap & (k_slots - 1);
+      uint64_t rest = std::rotr(m_occupied[level], (index + 1) % k_slots);
+      uint64_t distance = static_cast<uint64_t>(std::countr_zero(rest)) + 1;
+      uint64_t when = (lap + distance) << (k_bits * level);
+      due = when < due ? when : due;
+    }
+    uint64_t now = _ticks();
+    if (due <= now) {
+      return 0;
+    }
+    uint64_t wait = due - now;
+    return wait < INT32_MAX ? static_cast<int>(wait) : INT32_MAX;
+  }
+};
+
+inline timer::~timer() {
+  if (armed() && m_wheel) {
+    m_wheel->cancel(*this);
+  }
+}
+
+#endif // TIMER_WHEEL_HPP
@@ -0,0 +1,829 @@
+#ifndef UPSTREAM_HPP
+#define UPSTREAM_HPP
+
+#include "async_file.hpp"
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#include "http_parser.hpp"
+#include "http_writer.hpp"
+#include "io_context.hpp"
+#include "logger.hpp"
+#include "task.hpp"
+#include "timer_wheel.hpp"
+#include "utils.hpp"
+#include <arpa/inet.h>
+#include <charconv>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <utility>
+#include <vector>
+
+enum class upstream_balance {
+  round_robin,
+  least_connections, // fewest exchanges in flight, counted per reactor
+};
+
+// A backend, resolved once at startup.
+struct upstream_backend {
+  std::string m_name; // "host:port", for logs
+  struct sockaddr_storage m_addr {};
+  socklen_t m_addrlen = 0;
+
+  address_resolver::address_ref address() const {
+    // connect() only reads it
+    return {const_cast<struct sockaddr *>(
+                reinterpret_cast<const struct sockaddr *>(&m_addr)),
+            m_addrlen};
+  }
+};
+
+// Where and how to proxy; shared by every reactor, read only.
+struct upstream_config {
+  std::vector<upstream_backend> m_backends;
+  upstream_balance m_balance = upstream_balance::round_robin;
+  std::chrono::milliseconds m_connect_timeout{2000};
+  // how long a backend may stay silent while a response is due
+  std::chrono::milliseconds m_timeout{30000};
+  // Idle connections kept per backend and reactor, and for how long.
+  // Backends time idle connections out too, and a request sent on one
+  // that was just closed is lost.
+  size_t m_max_idle = 32;
+  std::chrono::milliseconds m_idle_timeout{10000};
+  // A backend failing this many times in a row is left out for
+  // m_eject_time, and with all of them out requests get a 502 at once.
+  // After that one more failure ejects it again.
+  unsigned m_max_fails = 3;
+  std::chrono::milliseconds m_eject_time{10000};
+
+  static constexpr size_t k_max_backends = 64; // see proxy_exchange::m_tried
+
+  // "host:port" or "[v6 address]:port"; throws if it does not resolve
+  void add_backend(const std::string &spec) {
+    size_t colon = spec.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+      throw std::invalid_argument("upstream is not host:port: " + spec);
+    }
+    if (m_backends.size() == k_max_backends) {
+      throw std::invalid_argument("too many upstreams");
+    }
+    std::string host = spec.substr(0, colon);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+    address_resolver resolver;
+    auto addr = resolver.resolve(host, spec.substr(colon + 1)).get_address();
+    upstream_backend backend;
+    backend.m_name = spec;
+    std::memcpy(&backend.m_addr, addr.m_addr, addr.m_addrlen);
+    backend.m_addrlen = addr.m_addrlen;
+    m_backends.push_back(std::move(backend));
+  }
+};
+
+// A connection to a backend and the parser of its responses. Between
+// requests it waits in its reactor's pool.
+struct upstream_conn {
+  static constexpr size_t k_recv_buffer = 16384;
+
+  async_file m_conn;
+  // Under epoll, reads land here rather than in the loop's scratch buffer:
+  // an exchange starts from inside the client's do_consume, whose unparsed
+  // bytes are still in the scratch buffer, and a pooled connection reads
+  // without suspending first.
+  bytes_buffer m_recv_buffer;
+  http_response_parser<> m_parser;
+  size_t m_backend = 0;
+  bool m_reused = false; // it has carried a request before
+  std::chrono::steady_clock::time_point m_idle_since;
+};
+
+struct upstream_stats {
+  size_t m_requests = 0;
+  size_t m_connects = 0; // new connections
+  size_t m_reuses = 0;   // requests sent on a pooled connection
+  size_t m_failures = 0; // failed connects, timeouts, lost connections
+  size_t m_retries = 0;  // requests sent again after a stale connection
+  size_t m_ejections = 0;
+};
+
+// One reactor's side of the backends: its idle connections, the load it
+// puts on each backend, and their health as it has seen it. Nothing is
+// shared between reactors, so there are no locks, and balancing and
+// ejection only know this reactor's traffic.
+struct upstream_group {
+  using clock = std::chrono::steady_clock;
+
+  struct _backend_state {
+    std::vector<std::unique_ptr<upstream_conn>> m_idle; // oldest first
+    size_t m_active = 0;  // connections taken out of the pool or opened
+    unsigned m_fails = 0; // in a row
+    clock::time_point m_ejected_until;
+  };
+
+  static constexpr size_t k_none = SIZE_MAX;
+
+  const upstream_config *m_config;
+  io_context *m_ctx;
+  std::vector<_backend_state> m_backends;
+  size_t m_next = 0; // where the next scan starts
+  upstream_stats m_stats;
+
+  upstream_group(const upstream_config &config, io_context &ctx)
+      : m_config(&config), m_ctx(&ctx),
+        m_backends(config.m_backends.size()) {}
+
+  upstream_group(const upstream_group &) = delete;
+  upstream_group &operator=(const upstream_group &) = delete;
+
+  ~upstream_group() {
+    for (auto &backend : m_backends) {
+      for (auto &conn : backend.m_idle) {
+        conn->m_conn.close_file();
+      }
+    }
+  }
+
+  // A backend outside `exclude` (bit i for backend i) by the configured
+  // policy, scanning from after the last pick so that ties rotate. Ejected
+  // backends are passed over. k_none if nothing is left.
+  size_t pick(uint64_t exclude) {
+    auto now = clock::now();
+    size_t n = m_backends.size();
+    size_t best = k_none;
+    for (size_t k = 0; k < n; k++) {
+      size_t i = (m_next + k) % n;
+      const _backend_state &backend = m_backends[i];
+      if ((exclude & (uint64_t(1) << i)) || backend.m_ejected_until > now) {
+        continue;
+      }
+      if (m_config->m_balance == upstream_balance::round_robin) {
+        best = i;
+        break;
+      }
+      if (best == k_none || backend.m_active < m_backends[best].m_active) {
+        best = i;
+      }
+    }
+    if (best != k_none) {
+      m_next = (best + 1) % n;
+    }
+    return best;
+  }
+
+  size_t ejected() const {
+    auto now = clock::now();
+    size_t n = 0;
+    for (const _backend_state &backend : m_backends) {
+      n += backend.m_ejected_until > now;
+    }
+    return n;
+  }
+
+  void _expire(_backend_state &backend, clock::time_point now) {
+    auto &idle = backend.m_idle;
+    size_t n = 0;
+    while (n < idle.size() &&
+           now - idle[n]->m_idle_since >= m_config->m_idle_timeout) {
+      idle[n++]->m_conn.close_file();
+    }
+    idle.erase(idle.begin(), idle.begin() + static_cast<ptrdiff_t>(n));
+  }
+
+  // The most recently pooled connection to backend i that still looks
+  // alive, or nullptr. A peek tells whether the backend closed it.
+  std::unique_ptr<upstream_conn> take_idle(size_t i) {
+    _backend_state &backend = m_backends[i];
+    _expire(backend, clock::now());
+    while (!backend.m_idle.empty()) {
+      auto conn = std::move(backend.m_idle.back());
+      backend.m_idle.pop_back();
+      char c;
+      if (::recv(conn->m_conn.m_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+          errno == EAGAIN) {
+        m_stats.m_reuses++;
+        backend.m_active++;
+        return conn;
+      }
+      conn->m_conn.close_file(); // EOF, or bytes nobody asked for
+    }
+    return nullptr;
+  }
+
+  // a new socket for backend i, to be connected by the caller
+  std::unique_ptr<upstream_conn> open(size_t i) {
+    const upstream_backend &target = m_config->m_backends[i];
+    int fd = CHECK_CALL(socket, target.m_addr.ss_family,
+                        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    auto conn = std::make_unique<upstream_conn>();
+    conn->m_conn = async_file::async_warp_nonblocking(*m_ctx, fd);
+    if (!m_ctx->uses_uring()) { // io_uring picks a ring buffer per read
+      conn->m_recv_buffer.resize(upstream_conn::k_recv_buffer);
+      conn->m_conn.m_recv_buffer = &conn->m_recv_buffer;
+    }
+    conn->m_backend = i;
+    m_stats.m_connects++;
+    m_backends[i].m_active++;
+    return conn;
+  }
+
+  // Pools `conn` if it can carry another request, closes it otherwise.
+  // Nothing may be in flight on it.
+  void release(std::unique_ptr<upstream_conn> conn, bool reusable) {
+    _backend_state &backend = m_backends[conn->m_backend];
+    backend.m_active--;
+    auto now = clock::now();
+    _expire(backend, now);
+    if (!reusable || backend.m_idle.size() >= m_config->m_max_idle) {
+      conn->m_conn.close_file();
+      return;
+    }
+    conn->m_parser.reset();
+    conn->m_reused = true;
+    conn->m_idle_since = now;
+    backend.m_idle.push_back(std::move(conn));
+  }
+
+  void succeeded(size_t i) { m_backends[i].m_fails = 0; }
+
+  void failed(size_t i) {
+    m_stats.m_failures++;
+    _backend_state &backend = m_backends[i];
+    if (++backend.m_fails < m_config->m_max_fails) {
+      return;
+    }
+    backend.m_ejected_until = clock::now() + m_config->m_eject_time;
+    m_stats.m_ejections++;
+    LOG_WARN("Upstream {} ejected for {} ms after {} failures in a row",
+             m_config->m_backends[i].m_name,
+             static_cast<int64_t>(m_config->m_eject_time.count()),
+             backend.m_fails);
+  }
+};
+
+struct proxy_result {
+  int m_status = 0;    // as sent to the client
+  size_t m_bytes = 0;  // queued to the client
+  bool m_broken = false; // cut short: the client connection must close
+};
+
+// One request relayed to a backend and its response back, both streamed:
+// request body pieces go out as the client sends them, response pieces
+// are queued to the client as they arrive. A failure before the response
+// header went out becomes a 502, or a 504 after a timeout; after it, the
+// client can only be told by closing its connection.
+struct proxy_exchange {
+  using request_parser = http_request_parser<http11_zero_copy_parser>;
+
+  // Shuts the upstream socket down when it fires: the pending connect or
+  // recv fails and the exchange gives up the usual way. While the exchange
+  // waits for the client to take the response, it shuts the client down
+  // instead: m_timeout bounds a client that stopped reading as well.
+  struct _deadline_timer : timer {
+    proxy_exchange *m_self = nullptr;
+  };
+
+  // the upstream write queue drained, see wait_writable()
+  struct _drain_waiter : io_waiter {
+    proxy_exchange *m_self = nullptr;
+  };
+
+  // request bytes held while the connection is being set up
+  static constexpr size_t k_max_pending = 64 * 1024;
+
+  upstream_group *m_group = nullptr;
+  async_file *m_client = nullptr;
+  http_response_writer *m_writer = nullptr;
+  request_parser *m_request = nullptr;
+  callback<proxy_result> m_done;
+  std::unique_ptr<upstream_conn> m_upstream;
+  bytes_buffer m_pending;
+  uint64_t m_tried = 0; // backends that could not be reached
+  proxy_result m_result;
+  _deadline_timer m_deadline;
+  _drain_waiter m_drain_waiter{{&_on_drained}};
+  std::coroutine_handle<> m_sender; // the client side, see wait_writable()
+  bool m_connected = false;
+  bool m_chunked_request = false;  // the body goes out in chunks
+  bool m_request_done = false;     // the whole request is queued
+  bool m_replayable = false;       // see _run()
+  bool m_head = false;
+  bool m_header_sent = false;      // of the current response
+  bool m_chunked_response = false; // to the client
+  bool m_keep_alive = false;       // the backend may reuse the connection
+  bool m_received = false;         // any response byte on this connection
+  bool m_timed_out = false;
+  bool m_aborted = false;
+  bool m_draining_client = false;
+  bool m_stopped = false; // sending nothing more upstream
+
+  proxy_exchange() {
+    m_deadline.m_fire = &_on_deadline;
+    m_deadline.m_self = this;
+    m_drain_waiter.m_self = this;
+  }
+
+  proxy_exchange(const proxy_exchange &) = delete;
+  proxy_exchange &operator=(const proxy_exchange &) = delete;
+
+  // Starts relaying `req`, whose header is complete. A body still arriving
+  // is passed on with push_body() and end_body(). `done` runs once the
+  // response is queued to the client or has failed, maybe before start()
+  // returns; the exchange may be destroyed from it, and not before. The
+  // request header must stay put until then.
+  void start(upstream_group &group, async_file &client,
+             http_response_writer &writer, request_parser &req,
+             callback<proxy_result> done) {
+    m_group = &group;
+    m_client = &client;
+    m_writer = &writer;
+    m_request = &req;
+    m_done = std::move(done);
+    m_group->m_stats.m_requests++;
+    m_head = req.method() == "HEAD";
+    m_request_done = req.request_finished();
+    m_replayable = m_request_done && _idempotent(req.method());
+    m_pending = client.m_out.take_buffer();
+    _write_head(m_pending);
+    co_spawn(_run());
+  }
+
+  // The next piece of a body that was still arriving at start().
+  void push_body(std::string_view piece) {
+    if (m_stopped || piece.empty()) {
+      return;
+    }
+    _send([&](http_response_writer &w) {
+      if (m_chunked_request) {
+        w.write_chunk(piece);
+      } else {
+        w.buffer().append(piece);
+      }
+    });
+  }
+
+  void end_body() {
+    m_request_done = true;
+    if (!m_stopped && m_chunked_request) {
+      _send([](http_response_writer &w) { w.end_chunks(); });
+    }
+  }
+
+  // The client went away: stop as soon as possible. `done` still runs.
+  void abort() {
+    m_aborted = true;
+    if (m_upstream) {
+      shutdown(m_upstream->m_conn.m_fd, SHUT_RDWR);
+    }
+  }
+
+  [[nodiscard]] bool above_high_watermark() const noexcept {
+    if (m_stopped) {
+      return false;
+    }
+    return m_connected ? m_upstream->m_conn.m_out.above_high_watermark()
+                       : m_pending.size() >= k_max_pending;
+  }
+
+  // The client side stops reading while the backend takes a body slower
+  // than the client sends it. This resumes it once the backlog is down to
+  // the low watermark, or the exchange stopped sending.
+  struct _writable_awaiter {
+    proxy_exchange *m_self;
+
+    bool await_ready() const noexcept {
+      return !m_self->above_high_watermark();
+    }
+
+    bool await_suspend(std::coroutine_handle<> caller) {
+      if (!m_self->_watch_drain()) {
+        return false;
+      }
+      m_self->m_sender = caller;
+      return true;
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  _writable_awaiter wait_writable() { return {this}; }
+
+  // false if there is nothing to wait for; until connected, _run() calls
+  // it again
+  bool _watch_drain() {
+    if (!m_connected) {
+      return true;
+    }
+    async_file &conn = m_upstream->m_conn;
+    conn.send_queued();
+    if (conn._drained(conn.m_out.m_low_watermark)) {
+      return false;
+    }
+    conn.m_drain_target = conn.m_out.m_low_watermark;
+    conn.m_drainer = &m_drain_waiter;
+    return true;
+  }
+
+  static void _on_drained(io_waiter *self, int, uint32_t) {
+    static_cast<_drain_waiter *>(self)->m_self->_wake_sender();
+  }
+
+  void _wake_sender() {
+    if (m_sender) {
+      std::exchange(m_sender, nullptr).resume();
+    }
+  }
+
+  static void _on_deadline(timer *self) {
+    proxy_exchange *exchange = static_cast<_deadline_timer *>(self)->m_self;
+    if (exchange->m_draining_client) {
+      shutdown(exchange->m_client->m_fd, SHUT_RDWR);
+      return;
+    }
+    exchange->m_timed_out = true;
+    if (exchange->m_upstream) {
+      shutdown(exchange->m_upstream->m_conn.m_fd, SHUT_RDWR);
+    }
+  }
+
+  void _arm(std::chrono::milliseconds timeout) {
+    m_group->m_ctx->m_timers.schedule(m_deadline, timeout);
+  }
+
+  static bool _idempotent(std::string_view method) {
+    return method == "GET" || method == "HEAD" || method == "PUT" ||
+           method == "DELETE" || method == "OPTIONS" || method == "TRACE";
+  }
+
+  // fields that describe one connection, not the message
+  static bool _hop_by_hop(std::string_view key) {
+    switch (classify_field(key)) {
+    case http_field::connection:
+    case http_field::transfer_encoding:
+    case http_field::upgrade:
+      return true;
+    case http_field::unknown:
+      return iequals_lower(key, "keep-alive") ||
+             iequals_lower(key, "proxy-connection") ||
+             iequals_lower(key, "te") || iequals_lower(key, "trailer");
+    default:
+      return false;
+    }
+  }
+
+  // The request line and header as the backend gets them. The framing is
+  // our own: a body at hand goes out with its length, one still arriving
+  // keeps its Content-Length or is sent in chunks.
+  void _write_head(bytes_buffer &out) {
+    request_parser &req = *m_request;
+    out.append(req.method());
+    out.append_literal(" ");
+    out.append(req.url());
+    out.append_literal(" HTTP/1.1\r\n");
+    for (const auto &[key, value] : req.headers()) {
+      http_field field = classify_field(key);
+      if (_hop_by_hop(key) || field == http_field::content_length ||
+          field == http_field::expect) {
+        continue;
+      }
+      _append_field(out, key, value);
+    }
+    char peer[INET6_ADDRSTRLEN];
+    if (_peer_address(m_client->m_fd, peer)) {
+      // one more element of the list, after any the client sent
+      _append_field(out, "X-Forwarded-For", peer);
+    }
+    if (m_request_done) {
+      std::string_view body = req.body();
+      if (!body.empty() || req.content_length() != 0 || req.chunked()) {
+        _append_length(out, body.size());
+      }
+      out.append_literal("\r\n");
+      out.append(body);
+      return;
+    }
+    m_chunked_request = req.chunked();
+    if (m_chunked_request) {
+      out.append_literal("Transfer-Encoding: chunked\r\n");
+    } else {
+      _append_length(out, req.content_length());
+    }
+    out.append_literal("\r\n");
+  }
+
+  // The parser has already refused anything else; a field that would
+  // still let the backend frame the message its own way is dropped.
+  static void _append_field(bytes_buffer &out, std::string_view key,
+                            std::string_view value) {
+    if (!is_token(key) ||
+        value.find_first_of(std::string_view("\r\n\0", 3)) !=
+            std::string_view::npos) {
+      return;
+    }
+    out.append(key);
+    out.append_literal(": ");
+    out.append(value);
+    out.append_literal("\r\n");
+  }
+
+  static void _append_length(bytes_buffer &out, size_t length) {
+    char digits[24];
+    auto end = std::to_chars(digits, digits + sizeof(digits), length).ptr;
+    _append_field(out, "Content-Length",
+                  std::string_view(digits, static_cast<size_t>(end - digits)));
+  }
+
+  static bool _peer_address(int fd, char (&out)[INET6_ADDRSTRLEN]) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, reinterpret_cast<struct sockaddr *>(&addr), &len) ==
+        -1) {
+      return false;
+    }
+    const void *src = nullptr;
+    if (addr.ss_family == AF_INET) {
+      src = &reinterpret_cast<struct sockaddr_in *>(&addr)->sin_addr;
+    } else if (addr.ss_family == AF_INET6) {
+      src = &reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_addr;
+    }
+    return src && inet_ntop(addr.ss_family, src, out, sizeof(out));
+  }
+
+  // Request bytes go to m_pending until the connection is up, then
+  // straight to its write queue.
+  template <class Write> void _send(Write &&write) {
+    http_response_writer &w = *m_writer;
+    w.buffer() = m_connected ? m_upstream->m_conn.m_out.take_buffer()
+                             : std::move(m_pending);
+    write(w);
+    if (!m_connected) {
+      m_pending = std::move(w.buffer());
+      return;
+    }
+    m_upstream->m_conn.queue_write(std::move(w.buffer()));
+    m_upstream->m_conn.send_queued();
+  }
+
+  void _queue_client(bytes_buffer buf) {
+    m_result.m_bytes += buf.size();
+    m_client->queue_write(std::move(buf));
+  }
+
+  void _respond_error(int status) {
+    http_response_writer &w = *m_writer;
+    w.buffer() = m_client->m_out.take_buffer();
+    w.begin_header(status);
+    w.write_header("Server", "cpp_http");
+    w.write_header("Content-Length", 0);
+    w.end_header();
+    _queue_client(std::move(w.buffer()));
+    m_result.m_status = status;
+  }
+
+  task<void> _run() {
+    bool replayed = false;
+    while (true) {
+      if (!co_await _connect()) {
+        if (!m_aborted) {
+          _respond_error(m_timed_out ? 504 : 502);
+        }
+        break;
+      }
+      _on_connected();
+      size_t backend = m_upstream->m_backend;
+      if (co_await _relay()) {
+        m_group->succeeded(backend);
+        break;
+      }
+      if (m_aborted) {
+        break;
+      }
+      // A pooled connection the backend closed just as it was taken. The
+      // request never got an answer and is all at hand: send it again.
+      bool replay = m_replayable && !replayed && m_upstream->m_reused &&
+                    !m_received && !m_timed_out;
+      if (!replay) {
+        LOG_WARN("Upstream {}: {}",
+                 m_group->m_config->m_backends[backend].m_name,
+                 m_timed_out ? "timed out" : "response lost");
+        m_group->failed(backend);
+      }
+      co_await _drop_upstream();
+      if (!replay) {
+        if (m_header_sent) {
+          m_result.m_broken = true;
+        } else {
+          _respond_error(m_timed_out ? 504 : 502);
+        }
+        break;
+      }
+      replayed = true;
+      m_group->m_stats.m_retries++;
+      m_connected = false;
+      m_pending = m_client->m_out.take_buffer();
+      _write_head(m_pending);
+    }
+    m_group->m_ctx->cancel(m_deadline);
+    m_stopped = true;
+    if (m_upstream) {
+      async_file &conn = m_upstream->m_conn;
+      if (conn.m_drainer == &m_drain_waiter) {
+        conn.m_drainer = nullptr;
+      }
+      if (m_keep_alive && m_request_done && !m_aborted && conn._drained(0)) {
+        m_group->release(std::move(m_upstream), true);
+      } else {
+        co_await _drop_upstream();
+      }
+    }
+    _wake_sender();
+    auto done = std::move(m_done);
+    done(m_result); // may destroy this
+  }
+
+  // Takes a pooled connection or connects a new one, trying each backend
+  // at most once. False if none could be reached.
+  task<bool> _connect() {
+    while (!m_aborted) {
+      size_t i = m_group->pick(m_tried);
+      if (i == upstream_group::k_none) {
+        co_return false;
+      }
+      m_upstream = m_group->take_idle(i);
+      if (m_upstream) {
+        co_return true;
+      }
+      const upstream_backend &target = m_group->m_config->m_backends[i];
+      m_upstream = m_group->open(i);
+      _arm(m_group->m_config->m_connect_timeout);
+      int err = co_await m_upstream->m_conn.connect(target.address());
+      if (err == 0 && !m_aborted) {
+        int on = 1;
+        setsockopt(m_upstream->m_conn.m_fd, IPPROTO_TCP, TCP_NODELAY, &on,
+                   sizeof(on));
+        co_return true;
+      }
+      if (!m_aborted) {
+        LOG_WARN("Upstream {}: connect: {}", target.m_name,
+                 m_timed_out ? "timed out" : strerror(-err));
+        m_group->failed(i);
+      }
+      m_tried |= uint64_t(1) << i;
+      m_group->release(std::move(m_upstream), false);
+    }
+    co_return false;
+  }
+
+  void _on_connected() {
+    m_connected = true;
+    async_file &conn = m_upstream->m_conn;
+    conn.queue_write(std::move(m_pending));
+    conn.send_queued();
+    if (m_sender && !_watch_drain()) {
+      _wake_sender();
+    }
+  }
+
+  // Shuts the connection down and closes it once nothing is in flight.
+  task<void> _drop_upstream() {
+    async_file &conn = m_upstream->m_conn;
+    if (conn.m_drainer == &m_drain_waiter) {
+      conn.m_drainer = nullptr;
+    }
+    shutdown(conn.m_fd, SHUT_RDWR);
+    co_await conn.flush();
+    m_group->release(std::move(m_upstream), false);
+  }
+
+  // Forwards the response to the client as it arrives; interim (1xx)
+  // responses go ahead of it. False if the backend failed to deliver it or
+  // the client went away.
+  task<bool> _relay() {
+    upstream_conn &up = *m_upstream;
+    http_response_parser<> &res = up.m_parser;
+    m_received = false;
+    if (m_head) {
+      res.set_no_body();
+    }
+    while (true) {
+      _arm(m_group->m_config->m_timeout);
+      {
+        auto chunk = co_await up.m_conn.recv();
+        if (chunk.size() <= 0) {
+          if (chunk.size() == 0 && res.until_close()) {
+            res.push_eof();
+            _end_response();
+            co_return true;
+          }
+          co_return false;
+        }
+        m_received = true;
+        std::string_view data = chunk;
+        while (!data.empty()) {
+          data.remove_prefix(res.push_chunk(data));
+          if (res.failed()) {
+            co_return false;
+          }
+          if (!res.header_finished()) {
+            break;
+          }
+          if (!m_header_sent) {
+            _forward_header();
+          }
+          if (!res.request_finished()) {
+            break;
+          }
+          if (res.status() < 200) {
+            res.reset();
+            m_header_sent = false;
+            if (m_head) {
+              res.set_no_body();
+            }
+            continue;
+          }
+          _end_response();
+          m_keep_alive = m_keep_alive && data.empty();
+          co_return true;
+        }
+      }
+      m_client->send_queued();
+      if (m_client->m_out.above_high_watermark()) {
+        m_draining_client = true;
+        int drained = co_await m_client->drain();
+        m_draining_client = false;
+        if (drained == -1) {
+          m_aborted = true;
+          co_return false;
+        }
+      }
+    }
+  }
+
+  // Status line and end-to-end fields, our own Server and Date, and the
+  // framing of the body as it goes to the client.
+  void _forward_header() {
+    http_response_parser<> &res = m_upstream->m_parser;
+    int status = res.status();
+    bool interim = status < 200;
+    m_header_sent = true;
+    m_chunked_response = !interim && (res.chunked() || res.until_close());
+    if (!interim) {
+      auto connection = res.headers().find(http_field::connection);
+      m_keep_alive = res.http_version() == "HTTP/1.1" &&
+                     !res.until_close() &&
+                     (connection == res.headers().end() ||
+                      !iequals_lower(connection->second, "close"));
+    }
+    http_response_writer &w = *m_writer;
+    w.buffer() = m_client->m_out.take_buffer();
+    w.begin_header(status);
+    w.write_header("Server", "cpp_http");
+    for (const auto &[key, value] : res.headers()) {
+      if (_hop_by_hop(key) || iequals_lower(key, "server") ||
+          iequals_lower(key, "date") ||
+          (m_chunked_response &&
+           classify_field(key) == http_field::content_length)) {
+        continue;
+      }
+      w.write_header(key, value);
+    }
+    if (m_chunked_response) {
+      w.write_header("Transfer-Encoding", "chunked");
+    }
+    w.end_header();
+    _queue_client(std::move(w.buffer()));
+    if (interim) {
+      return;
+    }
+    m_result.m_status = status;
+    res.set_body_sink([this](std::string_view piece) {
+      http_response_writer &w = *m_writer;
+      w.buffer() = m_client->m_out.take_buffer();
+      if (m_chunked_response) {
+        w.write_chunk(piece);
+      } else {
+        w.buffer().append(piece);
+      }
+      _queue_client(std::move(w.buffer()));
+    });
+  }
+
+  void _end_response() {
+    if (m_chunked_response) {
+      http_response_writer &w = *m_writer;
+      w.buffer() = m_client->m_out.take_buffer();
+      w.end_chunks();
+      _queue_client(std::move(w.buffer()));
+    }
+  }
+};
+
+#endif // UPSTREAM_HPP
@@ -48,7 +48,7 @@ ssize_t check_error(const char *msg, ssize_t res);
   check_error(SOURCE_INFO() #func, func(__VA_ARGS__))
 #define CHECK_CALL_EXCEPT(Except, func, ...)                                   \
   check_error<Except>(SOURCE_INFO() #func, func(__VA_ARGS__))
-// #define CHECK_CALL_EXCEPT2(Except1, Except2, func, ...)                        \
+// #define CHECK_CALL_EXCEPT2(Except1, Except2, func, ...)
 //   check_error<Except1, Except2>(SOURCE_INFO() #func, func(__VA_ARGS__))
 
 #endif // UTILS_HPP
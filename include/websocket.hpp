@@ -0,0 +1,508 @@
+#ifndef WEBSOCKET_HPP
+#define WEBSOCKET_HPP
+
+#include "async_file.hpp"
+#include "base64.hpp"
+#include "bytes_buffer.hpp"
+#include "io_context.hpp"
+#include "sha1.hpp"
+#include "simd_scan.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <utility>
+#include <vector>
+
+// WebSocket (RFC 6455), server side: the handshake, a frame parser for
+// what clients send, frame serialization, and broadcasting one frame to
+// many connections.
+
+enum class ws_opcode : uint8_t {
+  continuation = 0,
+  text = 1,
+  binary = 2,
+  close = 8,
+  ping = 9,
+  pong = 10,
+};
+
+enum class ws_close : uint16_t {
+  none = 0, // no error
+  normal = 1000,
+  going_away = 1001,
+  protocol_error = 1002,
+  invalid_data = 1007, // text that is not UTF-8
+  too_big = 1009,
+};
+
+// Sec-WebSocket-Accept for a client's Sec-WebSocket-Key
+inline std::string ws_accept_key(std::string_view key) {
+  sha1 h;
+  h.update(key);
+  h.update("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+  auto digest = h.finish();
+  return base64_encode(std::string_view(
+      reinterpret_cast<const char *>(digest.data()), digest.size()));
+}
+
+// Unmasking: dst[i] = src[i] ^ key[i % 4], with the four key bytes packed
+// in memory order into `key`. Whole words at a time; since every width is
+// a multiple of 4 the key pattern lines up with each word. dst may be src.
+
+inline void ws_mask_scalar(char *dst, const char *src, size_t n,
+                           uint32_t key) noexcept {
+  uint64_t wide = uint64_t(key) << 32 | key;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, src + i, 8);
+    word ^= wide;
+    std::memcpy(dst + i, &word, 8);
+  }
+  unsigned char bytes[4];
+  std::memcpy(bytes, &key, 4);
+  for (; i < n; i++) {
+    dst[i] = static_cast<char>(src[i] ^ bytes[i % 4]);
+  }
+}
+
+#if CO_HTTP_SIMD_X86
+__attribute__((target("sse2"))) inline void
+ws_mask_sse2(char *dst, const char *src, size_t n, uint32_t key) noexcept {
+  const __m128i wide = _mm_set1_epi32(static_cast<int>(key));
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_xor_si128(block, wide));
+  }
+  ws_mask_scalar(dst + i, src + i, n - i, key);
+}
+
+__attribute__((target("avx2"))) inline void
+ws_mask_avx2(char *dst, const char *src, size_t n, uint32_t key) noexcept {
+  const __m256i wide = _mm256_set1_epi32(static_cast<int>(key));
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                        _mm256_xor_si256(block, wide));
+  }
+  ws_mask_sse2(dst + i, src + i, n - i, key);
+}
+#endif
+
+using ws_mask_fn = void (*)(char *, const char *, size_t, uint32_t);
+
+// picked once from what the CPU supports
+inline ws_mask_fn _resolve_ws_mask() noexcept {
+#if CO_HTTP_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &ws_mask_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &ws_mask_sse2;
+  }
+#endif
+  return &ws_mask_scalar;
+}
+
+// `offset`: payload bytes of the frame already unmasked before `src`
+inline void ws_mask(char *dst, const char *src, size_t n,
+                    const unsigned char (&key)[4], uint64_t offset) noexcept {
+  static const ws_mask_fn fn = _resolve_ws_mask();
+  unsigned char rotated[4];
+  for (size_t j = 0; j < 4; j++) {
+    rotated[j] = key[(offset + j) % 4];
+  }
+  uint32_t packed;
+  std::memcpy(&packed, rotated, 4);
+  fn(dst, src, n, packed);
+}
+
+// RFC 3629: no overlong forms, no surrogates, nothing above U+10FFFF
+inline bool utf8_valid(std::string_view s) noexcept {
+  auto p = reinterpret_cast<const unsigned char *>(s.data());
+  const unsigned char *end = p + s.size();
+  while (p != end) {
+    if (end - p >= 8) { // ASCII runs, a word at a time
+      uint64_t word;
+      std::memcpy(&word, p, 8);
+      if ((word & 0x8080808080808080ull) == 0) {
+        p += 8;
+        continue;
+      }
+    }
+    unsigned char c = *p;
+    if (c < 0x80) {
+      p++;
+      continue;
+    }
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xbf; // bounds of the second byte
+    if (c >= 0xc2 && c <= 0xdf) {
+      len = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      len = 3;
+      lo = c == 0xe0 ? 0xa0 : 0x80;
+      hi = c == 0xed ? 0x9f : 0xbf;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      len = 4;
+      lo = c == 0xf0 ? 0x90 : 0x80;
+      hi = c == 0xf4 ? 0x8f : 0xbf;
+    } else {
+      return false;
+    }
+    if (size_t(end - p) < len || p[1] < lo || p[1] > hi) {
+      return false;
+    }
+    for (size_t i = 2; i < len; i++) {
+      if ((p[i] & 0xc0) != 0x80) {
+        return false;
+      }
+    }
+    p += len;
+  }
+  return true;
+}
+
+// A server frame header; server frames are never masked.
+inline void ws_write_header(bytes_buffer &out, ws_opcode opcode,
+                            size_t length, bool fin = true) {
+  out.push_back(static_cast<char>((fin ? 0x80 : 0) |
+                                  static_cast<uint8_t>(opcode)));
+  if (length < 126) {
+    out.push_back(static_cast<char>(length));
+  } else if (length <= 0xffff) {
+    out.push_back(126);
+    out.push_back(static_cast<char>(length >> 8));
+    out.push_back(static_cast<char>(length));
+  } else {
+    out.push_back(127);
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      out.push_back(static_cast<char>(uint64_t(length) >> shift));
+    }
+  }
+}
+
+inline void ws_write_frame(bytes_buffer &out, ws_opcode opcode,
+                           std::string_view payload) {
+  ws_write_header(out, opcode, payload.size());
+  out.append(payload);
+}
+
+inline void ws_write_close(bytes_buffer &out, ws_close code) {
+  auto n = static_cast<uint16_t>(code);
+  char payload[2] = {static_cast<char>(n >> 8), static_cast<char>(n)};
+  ws_write_frame(out, ws_opcode::close, {payload, sizeof(payload)});
+}
+
+// Reads the frames a client sends, across reads. Fragmented messages are
+// joined, and control frames may come between their fragments. Payloads
+// are unmasked while they are copied out of the receive buffer.
+struct ws_frame_parser {
+  static constexpr size_t k_max_message = 16 << 20;
+
+  // the frame being read
+  unsigned char m_header[14];
+  size_t m_header_len = 0;
+  bool m_in_payload = false;
+  bool m_fin = false;
+  ws_opcode m_opcode = ws_opcode::continuation;
+  uint64_t m_length = 0;
+  uint64_t m_received = 0;
+  unsigned char m_key[4] = {};
+  // the message being assembled
+  bool m_fragmented = false;
+  ws_opcode m_message_opcode = ws_opcode::text;
+  std::string m_message;
+  std::string m_control;
+  ws_close m_error = ws_close::none;
+
+  [[nodiscard]] bool failed() const noexcept {
+    return m_error != ws_close::none;
+  }
+
+  // Calls on_message(opcode, payload) for each whole text or binary
+  // message and each control frame; close frames have been checked. False
+  // once the client broke the protocol: m_error is the code to close with.
+  template <class OnMessage>
+  bool push(std::string_view data, OnMessage &&on_message) {
+    while (!data.empty() && !failed()) {
+      if (!m_in_payload) {
+        data.remove_prefix(_push_header(data));
+        if (!m_in_payload || failed()) {
+          continue;
+        }
+      }
+      std::string &dest = _is_control() ? m_control : m_message;
+      size_t n = static_cast<size_t>(
+          std::min<uint64_t>(data.size(), m_length - m_received));
+      size_t at = dest.size();
+      dest.resize(at + n);
+      ws_mask(dest.data() + at, data.data(), n, m_key, m_received);
+      m_received += n;
+      data.remove_prefix(n);
+      if (m_received == m_length) {
+        _end_frame(on_message);
+      }
+    }
+    return !failed();
+  }
+
+  [[nodiscard]] bool _is_control() const noexcept {
+    return static_cast<uint8_t>(m_opcode) & 0x8;
+  }
+
+  // takes header bytes until the header is whole, returns how many
+  size_t _push_header(std::string_view data) {
+    size_t used = 0;
+    while (used < data.size()) {
+      m_header[m_header_len++] = static_cast<unsigned char>(data[used++]);
+      if (m_header_len < 2) {
+        continue;
+      }
+      uint8_t length7 = m_header[1] & 0x7f;
+      if ((m_header[1] & 0x80) == 0) { // clients must mask
+        m_error = ws_close::protocol_error;
+        break;
+      }
+      size_t need = 2 + (length7 == 126 ? 2 : length7 == 127 ? 8 : 0) + 4;
+      if (m_header_len == need) {
+        _begin_frame(length7);
+        break;
+      }
+    }
+    return used;
+  }
+
+  void _begin_frame(uint8_t length7) {
+    m_fin = m_header[0] & 0x80;
+    m_opcode = static_cast<ws_opcode>(m_header[0] & 0x0f);
+    size_t at = 2;
+    m_length = length7;
+    if (length7 >= 126) {
+      size_t bytes = length7 == 126 ? 2 : 8;
+      m_length = 0;
+      for (size_t i = 0; i < bytes; i++) {
+        m_length = m_length << 8 | m_header[at++];
+      }
+    }
+    std::memcpy(m_key, m_header + at, 4);
+    m_header_len = 0;
+    m_received = 0;
+    m_in_payload = true;
+    if ((m_header[0] & 0x70) != 0 || (m_length >> 63) != 0) {
+      m_error = ws_close::protocol_error; // no extensions were agreed on
+      return;
+    }
+    switch (m_opcode) {
+    case ws_opcode::close:
+    case ws_opcode::ping:
+    case ws_opcode::pong:
+      if (!m_fin || m_length > 125) {
+        m_error = ws_close::protocol_error;
+      }
+      m_control.clear();
+      return;
+    case ws_opcode::continuation:
+      if (!m_fragmented) {
+        m_error = ws_close::protocol_error;
+      }
+      break;
+    case ws_opcode::text:
+    case ws_opcode::binary:
+      if (m_fragmented) {
+        m_error = ws_close::protocol_error;
+      }
+      m_fragmented = true;
+      m_message_opcode = m_opcode;
+      m_message.clear();
+      break;
+    default:
+      m_error = ws_close::protocol_error;
+      return;
+    }
+    if (m_message.size() + m_length > k_max_message) {
+      m_error = ws_close::too_big;
+    }
+  }
+
+  template <class OnMessage> void _end_frame(OnMessage &on_message) {
+    m_in_payload = false;
+    if (_is_control()) {
+      if (m_opcode == ws_opcode::close && !_valid_close(m_control)) {
+        return;
+      }
+      on_message(m_opcode, std::string_view(m_control));
+      return;
+    }
+    if (!m_fin) {
+      return;
+    }
+    m_fragmented = false;
+    if (m_message_opcode == ws_opcode::text && !utf8_valid(m_message)) {
+      m_error = ws_close::invalid_data;
+      return;
+    }
+    on_message(m_message_opcode, std::string_view(m_message));
+  }
+
+  // a status code that may be sent (RFC 6455 7.4), then UTF-8
+  bool _valid_close(std::string_view payload) {
+    if (payload.empty()) {
+      return true;
+    }
+    if (payload.size() < 2) {
+      m_error = ws_close::protocol_error;
+      return false;
+    }
+    unsigned code = unsigned(static_cast<unsigned char>(payload[0])) << 8 |
+                    static_cast<unsigned char>(payload[1]);
+    bool sendable = (code >= 1000 && code <= 1003) ||
+                    (code >= 1007 && code <= 1011) ||
+                    (code >= 3000 && code <= 4999);
+    if (!sendable) {
+      m_error = ws_close::protocol_error;
+      return false;
+    }
+    if (!utf8_valid(payload.substr(2))) {
+      m_error = ws_close::invalid_data;
+      return false;
+    }
+    return true;
+  }
+};
+
+// A frame serialized once for many connections: each one's write queue
+// refers to the same bytes and holds a reference until they are sent.
+using ws_shared_frame = std::shared_ptr<const bytes_buffer>;
+
+inline ws_shared_frame make_ws_frame(ws_opcode opcode,
+                                     std::string_view payload) {
+  auto frame = std::make_shared<bytes_buffer>();
+  frame->reserve(payload.size() + 10);
+  ws_write_frame(*frame, opcode, payload);
+  return frame;
+}
+
+struct ws_hub_stats {
+  size_t m_delivered = 0; // frames queued on a member
+  size_t m_dropped = 0;   // members cut off for falling behind
+};
+
+// The WebSocket connections of one loop that take broadcasts. Delivering
+// a frame queues the shared bytes on every member, no copy, and starts
+// the write. A member with more than m_max_backlog bytes still queued is
+// shut down instead: a client that does not read must not make the
+// server hold every frame for it.
+struct ws_hub {
+  struct _member {
+    async_file *m_conn;
+    size_t *m_slot; // where the member keeps its index, see leave()
+    bool m_dropped;
+  };
+
+  std::vector<_member> m_members;
+  size_t m_max_backlog = 1 << 20;
+  ws_hub_stats m_stats;
+
+  // `slot` receives the member's index and must live until leave(slot)
+  void join(async_file &conn, size_t &slot) {
+    slot = m_members.size();
+    m_members.push_back({&conn, &slot, false});
+  }
+
+  void leave(size_t slot) {
+    m_members[slot] = m_members.back();
+    *m_members[slot].m_slot = slot;
+    m_members.pop_back();
+  }
+
+  size_t size() const noexcept { return m_members.size(); }
+
+  void deliver(const ws_shared_frame &frame) {
+    bytes_const_view bytes = *frame;
+    for (_member &member : m_members) {
+      async_file &conn = *member.m_conn;
+      if (member.m_dropped) {
+        continue;
+      }
+      if (conn.m_out.size() > m_max_backlog) {
+        member.m_dropped = true;
+        m_stats.m_dropped++;
+        shutdown(conn.m_fd, SHUT_RDWR); // its handler closes it
+        continue;
+      }
+      conn.queue_shared(bytes, frame);
+      conn.send_queued();
+      m_stats.m_delivered++;
+    }
+  }
+};
+
+// Every loop's hub. publish() hands a frame to the caller's hub at once
+// and to the others through io_context::post_remote, in publishing order
+// per caller. A frame posted to a loop that has stopped is neither
+// delivered nor freed, as with worker_pool.
+struct ws_broadcaster {
+  struct _delivery : remote_work {
+    ws_hub *m_hub = nullptr;
+    ws_shared_frame m_frame;
+
+    static void _run(remote_work *work) {
+      std::unique_ptr<_delivery> self(static_cast<_delivery *>(work));
+      self->m_hub->deliver(self->m_frame);
+    }
+  };
+
+  struct _entry {
+    io_context *m_ctx;
+    ws_hub *m_hub;
+  };
+
+  std::mutex m_mutex;
+  std::vector<_entry> m_hubs;
+
+  void add(io_context &ctx, ws_hub &hub) {
+    std::lock_guard guard(m_mutex);
+    m_hubs.push_back({&ctx, &hub});
+  }
+
+  void remove(ws_hub &hub) {
+    std::lock_guard guard(m_mutex);
+    std::erase_if(m_hubs, [&hub](const _entry &e) { return e.m_hub == &hub; });
+  }
+
+  // from the loop thread of `home`
+  void publish(io_context &home, const ws_shared_frame &frame) {
+    ws_hub *own = nullptr;
+    {
+      std::lock_guard guard(m_mutex);
+      for (const _entry &e : m_hubs) {
+        if (e.m_ctx == &home) {
+          own = e.m_hub;
+          continue;
+        }
+        auto delivery = new _delivery;
+        delivery->m_run = &_delivery::_run;
+        delivery->m_hub = e.m_hub;
+        delivery->m_frame = frame;
+        e.m_ctx->post_remote(delivery);
+      }
+    }
+    if (own) {
+      own->deliver(frame);
+    }
+  }
+};
+
+#endif // WEBSOCKET_HPP
@@ -0,0 +1,168 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include "io_context.hpp"
+#include "logger.hpp"
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A job offloaded from a loop: m_work runs on a worker thread, then the job
+// is posted back to m_home, where m_run delivers the result and frees it.
+struct offload_job : remote_work {
+  void (*m_work)(offload_job *self) = nullptr;
+  io_context *m_home = nullptr;
+};
+
+// `work` is called once on a worker; `done` gets its result on the loop
+// that submitted it, or nullopt if it threw. Both are destroyed on that
+// loop, so their captures may come from its allocator.
+template <class Work, class Done> struct _offload_task final : offload_job {
+  using result = std::invoke_result_t<Work &>;
+
+  Work m_work_fn;
+  Done m_done_fn;
+  std::optional<result> m_result;
+
+  _offload_task(Work work, Done done)
+      : m_work_fn(std::move(work)), m_done_fn(std::move(done)) {
+    m_work = &_work;
+    m_run = &_run;
+  }
+
+  static void _work(offload_job *job) {
+    auto self = static_cast<_offload_task *>(job);
+    try {
+      self->m_result.emplace(self->m_work_fn());
+    } catch (const std::exception &e) {
+      LOG_ERROR("Offloaded job failed: {}", e.what());
+    }
+  }
+
+  static void _run(remote_work *job) {
+    std::unique_ptr<_offload_task> self(static_cast<_offload_task *>(job));
+    self->m_done_fn(std::move(self->m_result));
+  }
+};
+
+struct worker_pool_stats {
+  std::atomic<uint64_t> m_submitted{0};
+  std::atomic<uint64_t> m_rejected{0}; // the pool was full
+  std::atomic<uint64_t> m_stolen{0};   // taken from another worker's queue
+};
+
+// Threads for work that must not run on a loop: CPU-heavy or blocking
+// handlers. Jobs are spread round-robin over one queue per worker, and an
+// idle worker steals from the others before sleeping. At most
+// m_max_pending jobs are queued or running; submit() refuses more, so the
+// caller can shed load instead of queueing without bound.
+struct worker_pool {
+  struct alignas(64) _queue {
+    std::mutex m_mutex;
+    std::deque<offload_job *> m_jobs;
+  };
+
+  std::vector<std::unique_ptr<_queue>> m_queues;
+  std::vector<std::thread> m_threads;
+  // one permit per queued job: a worker holding one is sure to find a job
+  std::counting_semaphore<> m_ready{0};
+  std::atomic<size_t> m_pending{0}; // queued or running
+  std::atomic<size_t> m_next{0};    // round-robin submission
+  std::atomic<bool> m_stopping{false};
+  size_t m_max_pending;
+  worker_pool_stats m_stats;
+
+  worker_pool(unsigned threads, size_t max_pending)
+      : m_max_pending(max_pending) {
+    for (unsigned i = 0; i < threads; i++) {
+      m_queues.push_back(std::make_unique<_queue>());
+    }
+    for (unsigned i = 0; i < threads; i++) {
+      m_threads.emplace_back([this, i] { _worker_main(i); });
+    }
+  }
+
+  worker_pool(const worker_pool &) = delete;
+  worker_pool &operator=(const worker_pool &) = delete;
+
+  // Destroy only after the loops that submitted jobs are gone; jobs still
+  // queued are neither run nor freed.
+  ~worker_pool() {
+    m_stopping.store(true);
+    m_ready.release(static_cast<ptrdiff_t>(m_threads.size()));
+    for (auto &t : m_threads) {
+      t.join();
+    }
+  }
+
+  size_t pending() const noexcept {
+    return m_pending.load(std::memory_order_relaxed);
+  }
+
+  // From a loop thread. False if the pool is full; nothing was queued
+  // then and `work` and `done` are dropped.
+  template <class Work, class Done>
+  [[nodiscard]] bool submit(io_context &home, Work work, Done done) {
+    if (m_pending.fetch_add(1, std::memory_order_relaxed) >= m_max_pending) {
+      m_pending.fetch_sub(1, std::memory_order_relaxed);
+      m_stats.m_rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    m_stats.m_submitted.fetch_add(1, std::memory_order_relaxed);
+    auto job = new _offload_task<Work, Done>(std::move(work), std::move(done));
+    job->m_home = &home;
+    size_t i = m_next.fetch_add(1, std::memory_order_relaxed) % m_queues.size();
+    {
+      std::lock_guard guard(m_queues[i]->m_mutex);
+      m_queues[i]->m_jobs.push_back(job);
+    }
+    m_ready.release();
+    return true;
+  }
+
+  // own queue first, then the others in order
+  offload_job *_take(unsigned self) {
+    size_t n = m_queues.size();
+    while (true) {
+      for (size_t k = 0; k < n; k++) {
+        _queue &queue = *m_queues[(self + k) % n];
+        std::lock_guard guard(queue.m_mutex);
+        if (!queue.m_jobs.empty()) {
+          offload_job *job = queue.m_jobs.front();
+          queue.m_jobs.pop_front();
+          if (k != 0) {
+            m_stats.m_stolen.fetch_add(1, std::memory_order_relaxed);
+          }
+          return job;
+        }
+      }
+      // our permit guarantees a queued job, but the scan is not atomic:
+      // others took jobs behind us while new ones went in ahead
+      std::this_thread::yield();
+    }
+  }
+
+  void _worker_main(unsigned self) {
+    while (true) {
+      m_ready.acquire();
+      if (m_stopping.load()) {
+        return;
+      }
+      offload_job *job = _take(self);
+      job->m_work(job);
+      m_pending.fetch_sub(1, std::memory_order_relaxed);
+      job->m_home->post_remote(job);
+    }
+  }
+};
+
+#endif // WORKER_POOL_HPP
@@ -0,0 +1,212 @@
+#ifndef WRITE_QUEUE_HPP
+#define WRITE_QUEUE_HPP
+
+#include "buffer_pool.hpp"
+#include "bytes_buffer.hpp"
+#include <cstddef>
+#include <memory>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <utility>
+#include <vector>
+
+// Position inside a list of borrowed buffers being written with writev.
+struct iov_cursor {
+  const bytes_const_view *m_bufs = nullptr;
+  size_t m_count = 0;
+  size_t m_index = 0;  // first buffer not fully written
+  size_t m_offset = 0; // bytes of m_bufs[m_index] already written
+
+  [[nodiscard]] bool done() const noexcept { return m_index == m_count; }
+
+  // fills up to `max` iovecs with what is left, returns how many
+  int gather(struct iovec *iov, int max) const noexcept {
+    int n = 0;
+    size_t offset = m_offset;
+    for (size_t i = m_index; i < m_count && n < max; i++, offset = 0) {
+      iov[n].iov_base = const_cast<char *>(m_bufs[i].data()) + offset;
+      iov[n].iov_len = m_bufs[i].size() - offset;
+      n++;
+    }
+    return n;
+  }
+
+  void advance(size_t n) noexcept {
+    while (m_index < m_count) {
+      size_t left = m_bufs[m_index].size() - m_offset;
+      if (n < left) {
+        m_offset += n;
+        return;
+      }
+      n -= left;
+      m_index++;
+      m_offset = 0;
+    }
+  }
+};
+
+// A byte range of an open file, sent with sendfile rather than copied
+// through a buffer. m_owner keeps m_fd open while the range is queued,
+// e.g. a file cache entry.
+struct file_range {
+  int m_fd = -1;
+  off_t m_offset = 0;
+  size_t m_length = 0;
+  std::shared_ptr<const void> m_owner;
+};
+
+// Bytes a connection still has to send. Handlers push owned buffers and the
+// connection flushes as many of them as fit in one writev/sendmsg. A queued
+// buffer keeps its heap storage when the queue grows, so iovecs pointing
+// into it stay valid while a send is in flight. Written buffers go back to
+// the loop's buffer pool, so an idle connection holds none. Shared bytes
+// (e.g. a cached response) are queued without a copy, and file ranges in
+// order with the buffers; gather() stops in front of a file range.
+struct write_queue {
+  struct _chunk {
+    bytes_buffer m_buf;
+    bytes_const_view m_shared{nullptr, 0}; // kept alive by m_file.m_owner
+    file_range m_file;                     // m_fd == -1 unless a file range
+
+    [[nodiscard]] bool is_file() const noexcept { return m_file.m_fd != -1; }
+
+    bytes_const_view bytes() const noexcept {
+      return m_shared.data() ? m_shared : bytes_const_view(m_buf);
+    }
+
+    size_t size() const noexcept {
+      return is_file() ? m_file.m_length : bytes().size();
+    }
+  };
+
+  std::vector<_chunk> m_chunks;
+  size_t m_head = 0;   // first chunk not fully written
+  size_t m_offset = 0; // bytes of m_chunks[m_head] already written
+  size_t m_bytes = 0;  // queued and not yet written
+  buffer_pool *m_pool = nullptr;
+  // above the high watermark a handler should stop reading until the
+  // queue drains below the low one
+  size_t m_high_watermark = 64 * 1024;
+  size_t m_low_watermark = 16 * 1024;
+
+  // an empty buffer, with capacity left over from an earlier response
+  bytes_buffer take_buffer() {
+    return m_pool ? m_pool->acquire() : bytes_buffer{};
+  }
+
+  void push(bytes_buffer buf) {
+    if (buf.size() == 0) {
+      _recycle(std::move(buf));
+      return;
+    }
+    m_bytes += buf.size();
+    m_chunks.push_back({std::move(buf), {nullptr, 0}, {}});
+  }
+
+  // `data` stays valid as long as `owner` is alive
+  void push(bytes_const_view data, std::shared_ptr<const void> owner) {
+    if (data.size() == 0) {
+      return;
+    }
+    m_bytes += data.size();
+    m_chunks.push_back({bytes_buffer{}, data, {-1, 0, 0, std::move(owner)}});
+  }
+
+  void push(bytes_const_view data) {
+    bytes_buffer buf = take_buffer();
+    buf.append(data);
+    push(std::move(buf));
+  }
+
+  void push(file_range file) {
+    if (file.m_length == 0) {
+      return;
+    }
+    m_bytes += file.m_length;
+    m_chunks.push_back({bytes_buffer{}, {nullptr, 0}, std::move(file)});
+  }
+
+  size_t size() const noexcept { return m_bytes; }
+
+  [[nodiscard]] bool empty() const noexcept { return m_bytes == 0; }
+
+  [[nodiscard]] bool above_high_watermark() const noexcept {
+    return m_bytes >= m_high_watermark;
+  }
+
+  [[nodiscard]] bool below_low_watermark() const noexcept {
+    return m_bytes <= m_low_watermark;
+  }
+
+  // the buffers up to the first file range; none if one comes first
+  int gather(struct iovec *iov, int max) const noexcept {
+    int n = 0;
+    size_t offset = m_offset;
+    for (size_t i = m_head; i < m_chunks.size() && n < max; i++, offset = 0) {
+      const _chunk &chunk = m_chunks[i];
+      if (chunk.is_file()) {
+        break;
+      }
+      bytes_const_view bytes = chunk.bytes();
+      iov[n].iov_base = const_cast<char *>(bytes.data()) + offset;
+      iov[n].iov_len = bytes.size() - offset;
+      n++;
+    }
+    return n;
+  }
+
+  // the unwritten part of the first chunk, if that is a file range
+  [[nodiscard]] bool front_file(int &fd, off_t &offset,
+                                size_t &length) const noexcept {
+    if (m_head == m_chunks.size() || !m_chunks[m_head].is_file()) {
+      return false;
+    }
+    const file_range &file = m_chunks[m_head].m_file;
+    fd = file.m_fd;
+    offset = file.m_offset + static_cast<off_t>(m_offset);
+    length = file.m_length - m_offset;
+    return true;
+  }
+
+  // drops the first `n` queued bytes after they were written
+  void consume(size_t n) {
+    m_bytes -= n;
+    while (m_head < m_chunks.size()) {
+      size_t left = m_chunks[m_head].size() - m_offset;
+      if (n < left) {
+        m_offset += n;
+        return;
+      }
+      n -= left;
+      _recycle(std::move(m_chunks[m_head].m_buf));
+      m_chunks[m_head].m_file = {}; // may close the file or free m_shared
+      m_head++;
+      m_offset = 0;
+    }
+    m_chunks.clear();
+    m_head = 0;
+  }
+
+  // Takes back the chunks from index `first` on, none of them written
+  // yet, e.g. to re-frame a response queued for another protocol.
+  std::vector<_chunk> take_back(size_t first) {
+    std::vector<_chunk> taken;
+    for (size_t i = first; i < m_chunks.size(); i++) {
+      m_bytes -= m_chunks[i].size();
+      taken.push_back(std::move(m_chunks[i]));
+    }
+    m_chunks.resize(first);
+    return taken;
+  }
+
+  // forgets everything queued, e.g. after the peer went away
+  void clear() { consume(m_bytes); }
+
+  void _recycle(bytes_buffer buf) {
+    if (m_pool) {
+      m_pool->release(std::move(buf));
+    }
+  }
+};
+
+#endif // WRITE_QUEUE_HPP
@@ -1,224 +1,1734 @@
+#include "async_file.hpp"
+#include "base64.hpp"
 #include "bytes_buffer.hpp"
 #include "callback.hpp"
+#include "http2.hpp"
 #include "http_parser.hpp"
 #include "http_writer.hpp"
 #include "io_context.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "object_pool.hpp"
+#include "response_cache.hpp"
+#include "router.hpp"
+#include "sha1.hpp"
+#include "static_files.hpp"
+#include "task.hpp"
+#include "upstream.hpp"
 #include "utils.hpp"
+#include "websocket.hpp"
+#include "worker_pool.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
 #include <cwchar>
 #include <fcntl.h>
 #include <fmt/core.h>
+#include <getopt.h>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
 #include <string>
 #include <string_view>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <thread>
 #include <typeinfo>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 
-int epollfd;
+struct http_timeouts {
+  std::chrono::milliseconds m_idle{60000};   // waiting for a request
+  std::chrono::milliseconds m_header{10000}; // first byte to end of header
+  std::chrono::milliseconds m_body{30000};   // end of header to end of body
+};
+
+// Per-reactor HTTP counters. The gauges at the end mirror the reactor's
+// pool and cache stats; the accepter copies them once a second, so that a
+// /metrics request on another reactor never reads them while they change.
+struct alignas(64) http_metrics {
+  metric_counter m_accepted;
+  metric_counter m_closed;
+  metric_counter m_requests;
+  metric_counter m_parse_errors;
+  metric_counter m_offloaded; // requests answered by the worker pool
+  metric_counter m_shed;      // 503s because the pool was full
+  log_histogram m_latency;
+
+  metric_counter m_live;
+  metric_counter m_resident_per_connection;
+  metric_counter m_pool_hits; // handlers, parsers and buffers
+  metric_counter m_pool_misses;
+  metric_counter m_file_hits;
+  metric_counter m_file_misses;
+  metric_counter m_cache_hits;
+  metric_counter m_cache_misses;
+  metric_counter m_cache_evictions;
+  metric_counter m_cache_bytes;
+  metric_counter m_upstream_requests;
+  metric_counter m_upstream_connects;
+  metric_counter m_upstream_reuses;
+  metric_counter m_upstream_failures;
+  metric_counter m_upstream_retries;
+  metric_counter m_upstream_ejections;
+  metric_counter m_upstream_ejected;
+  metric_counter m_websockets; // open
+  metric_counter m_ws_delivered;
+  metric_counter m_ws_dropped;
+};
+
+struct http_connection_accepter;
+struct http_connection_handler;
+
+using http_route = void (*)(http_connection_handler &self,
+                            const route_params &params);
+
+// An idle keep-alive connection holds no parser and no buffers: a parser
+// (about 3 KiB of field tables plus its buffer) is taken from the reactor's
+// pool when a request starts arriving and given back once no partial
+// request is left, and response buffers come from the loop's buffer_pool.
+struct http_connection_handler {
+  using request_parser = http_request_parser<http11_zero_copy_parser>;
+
+  enum class phase {
+    idle,
+    header,
+    body,
+  };
+
+  // Shuts the socket down when it fires: the pending recv (or drain) then
+  // fails and do_handle closes the connection the usual way.
+  struct _deadline_timer : timer {
+    int m_fd = -1;
+  };
+
+  async_file m_conn;
+  request_parser *m_req_parser = nullptr; // only while a request is in flight
+  object_pool<request_parser> *m_parsers = nullptr;
+  http_response_writer m_res_writer;
+  http_connection_accepter *m_accepter = nullptr;
+  const http_timeouts *m_timeouts = nullptr;
+  const router<http_route> *m_router = nullptr;
+  static_files *m_static = nullptr;
+  response_cache *m_cache = nullptr; // null: caching is off
+  http_metrics *m_metrics = nullptr;
+  _deadline_timer m_deadline;
+  phase m_phase = phase::idle;
+  bool m_streaming = false; // see maybe_stream
+  size_t m_stream_bytes = 0; // queued so far for a streamed response
+  int m_stream_status = 200;
+  std::chrono::steady_clock::time_point m_request_start;
+  // start times of the requests answered since the last send_queued(),
+  // whose latency is taken once their responses are sent
+  std::array<std::chrono::steady_clock::time_point, 4> m_answered;
+  size_t m_nanswered = 0;
+  worker_pool *m_workers = nullptr; // null: offloaded work runs inline
+  upstream_group *m_upstream = nullptr; // null: no reverse proxying
+  proxy_exchange *m_proxy = nullptr;    // while relaying to a backend
+  bool m_proxied = false; // the current request went to a backend
+  bool m_close_after = false; // a relayed response was cut short
+  // A request is with the worker pool or a backend. Requests pipelined
+  // behind it wait, their bytes copied to m_stash, so responses stay in
+  // order.
+  bool m_deferred = false;
+  std::coroutine_handle<> m_deferred_waiter;
+  std::string m_stash;
+  // HTTP/2, after the client preface or an h2c upgrade. Not offered with
+  // -U: the proxy relays HTTP/1.1 straight to the client.
+  std::unique_ptr<h2_session> m_h2;
+  uint32_t m_h2_stream = 0; // the stream being answered
+  // After a WebSocket handshake, see do_upgrade_ws.
+  struct _ws_state {
+    ws_frame_parser m_parser;
+    callback_timer m_ping;
+    bool m_broadcast = false; // in the reactor's hub, at m_slot
+    size_t m_slot = 0;
+    bool m_pong_due = false; // pinged, and nothing heard since
+    bool m_closing = false;  // our close frame is queued
+  };
+  std::unique_ptr<_ws_state> m_ws;
+  ws_hub *m_ws_hub = nullptr;
+  ws_broadcaster *m_broadcaster = nullptr;
+
+  inline void do_init(http_connection_accepter &accepter, int connfd);
+
+  static void on_deadline(timer *self) {
+    int fd = static_cast<_deadline_timer *>(self)->m_fd;
+    LOG_DEBUG("Connection timed out: {}", fd);
+    shutdown(fd, SHUT_RDWR);
+  }
+
+  // The idle deadline restarts whenever a read completes requests; the
+  // header and body deadlines are set once per request, so a client
+  // trickling bytes (slowloris) cannot extend them.
+  void update_deadline() {
+    phase next = phase::idle;
+    if (m_req_parser == nullptr) {
+      // idle
+    } else if (m_req_parser->header_finished()) {
+      next = phase::body;
+    } else if (m_req_parser->request_started()) {
+      next = phase::header;
+    }
+    if (next == m_phase && next != phase::idle) {
+      return;
+    }
+    m_phase = next;
+    std::chrono::milliseconds timeout = m_timeouts->m_idle;
+    if (next == phase::header) {
+      timeout = m_timeouts->m_header;
+    } else if (next == phase::body) {
+      timeout = m_timeouts->m_body;
+    }
+    m_conn.m_ctx->m_timers.schedule(m_deadline, timeout);
+  }
+
+  task<void> do_handle() {
+    bool bad_request = false;
+    while (true) {
+      LOG_TRACE("Start reading: {}", m_conn.m_fd);
+      {
+        auto chunk = co_await m_conn.recv();
+        if (chunk.size() <= 0) {
+          LOG_DEBUG("Connection terminated due to EOF: {}", m_conn.m_fd);
+          break;
+        }
+        LOG_TRACE("Read {} bytes", chunk.size());
+        if (m_req_parser == nullptr) {
+          if (m_upstream == nullptr &&
+              std::string_view(chunk).starts_with("PRI * HTTP/2.0\r\n")) {
+            start_h2(); // prior knowledge
+          } else {
+            m_req_parser = m_parsers->acquire();
+          }
+        }
+        bad_request = !do_consume(chunk);
+      } // under io_uring the receive buffer goes back to the ring here
+      while (!bad_request && m_deferred) {
+        // what was answered before goes out while the pool works
+        m_conn.send_queued();
+        record_latencies();
+        co_await _deferred_awaiter{this};
+        std::string stash = std::exchange(m_stash, {});
+        bad_request = !do_consume(stash);
+      }
+      if (bad_request || m_close_after || m_h2 || m_ws) {
+        break;
+      }
+      if (!m_req_parser->request_started()) {
+        release_parser(); // already reset, nothing partial to keep
+      }
+      update_deadline();
+      // all responses to this chunk leave in one writev (sendmsg)
+      m_conn.send_queued();
+      record_latencies();
+      if (m_proxy) {
+        // the exchange drains the client itself; here a backend that
+        // takes the body slower than the client sends it holds reading
+        co_await m_proxy->wait_writable();
+      } else if (m_conn.m_out.above_high_watermark()) {
+        // slow client: stop reading until it has caught up
+        if (co_await m_conn.drain() == -1) {
+          break;
+        }
+      }
+    } // keep-alive
+    if (m_h2 && !bad_request) {
+      co_await do_handle_h2();
+    }
+    if (m_ws && !bad_request) {
+      co_await do_handle_ws();
+    }
+    if (m_proxy) {
+      m_proxy->abort();
+      co_await _deferred_awaiter{this};
+    }
+    co_await m_conn.flush(); // nothing may be in flight when closing
+    do_close();
+  }
+
+  // Parses and answers the requests in `data`; false once the framing is
+  // lost (a 400 is queued). A pipelining client may send several requests
+  // in one chunk: each is answered, in order. If one is offloaded, the
+  // rest of `data` goes to m_stash.
+  bool do_consume(std::string_view data) {
+    if (m_h2) {
+      m_h2->consume(data);
+      return true;
+    }
+    if (m_ws) {
+      return do_consume_ws(data);
+    }
+    while (!data.empty()) {
+      if (!m_req_parser->request_started()) {
+        m_request_start = std::chrono::steady_clock::now();
+      }
+      data.remove_prefix(m_req_parser->push_chunk(data));
+      if (m_req_parser->failed()) { // framing lost, cannot go on
+        m_metrics->m_parse_errors.add();
+        if (m_proxied) { // the response may be on its way: just close
+          if (m_proxy) {
+            m_proxy->abort();
+          }
+          return false;
+        }
+        size_t first = m_conn.m_out.m_chunks.size();
+        do_respond_status(m_req_parser->header_too_large() ? 431 : 400,
+                          /*close=*/true);
+        if (access_log_enabled()) {
+          do_log_access(first, false);
+        }
+        return false;
+      }
+      if (!m_req_parser->request_finished()) {
+        if (!maybe_stream()) {
+          return false; // a 413 is queued
+        }
+        break; // the rest arrives with the next chunk
+      }
+      if (h2c_upgrade_requested()) {
+        do_upgrade_h2(data);
+        return true;
+      }
+      do_write();
+      if (m_deferred) { // the parser is reset once the response is in
+        m_stash.assign(data);
+        break;
+      }
+      next_request();
+      if (m_ws) { // the rest is frames
+        return do_consume_ws(data);
+      }
+    }
+    return true;
+  }
 
-struct async_file {
-  int m_fd;
+  void next_request() {
+    m_req_parser->reset();
+    m_proxied = false;
+  }
 
-  static async_file async_warp(int fd) {
-    int flags = CHECK_CALL(fcntl, fd, F_GETFL);
-    flags |= O_NONBLOCK; // set file to non-block
-    CHECK_CALL(fcntl, fd, F_SETFL, flags);
+  // HTTP/2 from here on; our SETTINGS go out first
+  void start_h2() {
+    m_h2 = std::make_unique<h2_session>(&m_conn.m_ctx->m_buffers);
+    m_conn.queue_write(m_h2->take_output());
+  }
 
-    struct epoll_event event;
-    event.events = EPOLLET;
-    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+  // "Upgrade: h2c" with valid HTTP2-Settings, on a request answered
+  // whole. One whose echo already started streaming stays HTTP/1.1.
+  bool h2c_upgrade_requested() {
+    request_parser &req = *m_req_parser;
+    if (m_upstream != nullptr || m_streaming ||
+        req.http_version() != "HTTP/1.1") {
+      return false;
+    }
+    auto upgrade = req.headers().find(http_field::upgrade);
+    auto settings = req.headers().find(http_field::http2_settings);
+    return upgrade != req.headers().end() &&
+           iequals_lower(upgrade->second, "h2c") &&
+           settings != req.headers().end();
+  }
 
-    return async_file{fd};
+  // Switches to HTTP/2 (RFC 7540 3.2): a 101, our SETTINGS, then the
+  // response to the upgraded request on stream 1. `rest`, what followed
+  // the request, is the client preface and its first frames.
+  void do_upgrade_h2(std::string_view rest) {
+    request_parser &req = *m_req_parser;
+    std::string settings;
+    auto field = req.headers().find(http_field::http2_settings);
+    auto session = std::make_unique<h2_session>(&m_conn.m_ctx->m_buffers);
+    if (!base64_decode(field->second, settings) ||
+        !session->upgrade(settings)) {
+      m_metrics->m_parse_errors.add();
+      do_respond_status(400, /*close=*/true);
+      m_close_after = true;
+      return;
+    }
+    http_response_writer &res_writer = m_res_writer;
+    res_writer.buffer() = m_conn.m_out.take_buffer();
+    res_writer.begin_header(101);
+    res_writer.write_header("Connection", "Upgrade");
+    res_writer.write_header("Upgrade", "h2c");
+    res_writer.end_header();
+    m_conn.queue_write(std::move(res_writer.buffer()));
+    m_h2 = std::move(session);
+    m_conn.queue_write(m_h2->take_output());
+    m_h2_stream = 1;
+    do_write();
+    if (!m_deferred) {
+      next_request();
+    }
+    m_h2->consume(rest);
   }
 
-  ssize_t sync_read(bytes_view buf) {
-    ssize_t ret;
-    do {
-      ret = CHECK_CALL_EXCEPT(EAGAIN, read, m_fd, buf.data(), buf.size());
-    } while (ret == -1);
-    return ret;
+  // Serves an HTTP/2 connection until either side ends it. Streams are
+  // answered one at a time, in the order their requests completed, by the
+  // handlers that serve HTTP/1.1: each request is replayed through the
+  // parser, and finish_request() hands the response to the session.
+  task<void> do_handle_h2() {
+    while (true) {
+      while (h2_stream *stream = m_h2->next_request()) {
+        serve_h2(*stream);
+        if (m_deferred) {
+          // what was answered before goes out while the pool works
+          m_conn.queue_write(m_h2->take_output());
+          m_conn.send_queued();
+          co_await _deferred_awaiter{this};
+        }
+      }
+      if (m_req_parser != nullptr) {
+        release_parser(); // reset by next_request()
+      }
+      // frames for all of them in as few writes as the windows allow;
+      // the session holds back data once a client falls behind
+      bool failed = false;
+      while (true) {
+        m_h2->flush_pending();
+        if (m_h2->m_out.size() == 0) {
+          break;
+        }
+        m_conn.queue_write(m_h2->take_output());
+        m_conn.send_queued();
+        if (m_conn.m_out.above_high_watermark() &&
+            co_await m_conn.drain() == -1) {
+          failed = true;
+          break;
+        }
+      }
+      record_latencies();
+      if (failed || m_h2->done()) {
+        break;
+      }
+      m_conn.m_ctx->m_timers.schedule(m_deadline, m_timeouts->m_idle);
+      auto chunk = co_await m_conn.recv();
+      if (chunk.size() <= 0) {
+        LOG_DEBUG("Connection terminated due to EOF: {}", m_conn.m_fd);
+        break;
+      }
+      m_h2->consume(chunk);
+    }
   }
 
-  void async_read(bytes_view buf, callback<ssize_t> cb) {
-    ssize_t ret;
-    ret = CHECK_CALL_EXCEPT(EAGAIN, read, m_fd, buf.data(), buf.size());
-    if (ret != -1) { // EAGAIN
-      cb(ret);
+  // RFC 6455 4.2: a GET with "Upgrade: websocket" gets a 101 and the
+  // connection carries frames from then on. Members of the broadcast
+  // channel join the reactor's hub.
+  inline void do_upgrade_ws(bool broadcast);
+
+  // Once per idle timeout: a ping, or the end if the last one went
+  // unanswered.
+  void on_ws_ping() {
+    if (m_ws->m_pong_due) {
+      LOG_DEBUG("WebSocket timed out: {}", m_conn.m_fd);
+      shutdown(m_conn.m_fd, SHUT_RDWR);
       return;
     }
+    m_ws->m_pong_due = true;
+    bytes_buffer frame = m_conn.m_out.take_buffer();
+    ws_write_frame(frame, ws_opcode::ping, {});
+    m_conn.queue_write(std::move(frame));
+    m_conn.send_queued();
+  }
 
-    callback<> resume = [this, buf, cb = std::move(cb)]() mutable {
-      async_read(buf, std::move(cb));
-    };
+  // Reads frames until either side closes. Like HTTP/1.1, reading stops
+  // while the client is behind on what it was sent.
+  task<void> do_handle_ws() {
+    if (m_req_parser != nullptr) {
+      release_parser(); // reset by next_request()
+    }
+    while (!m_ws->m_closing) {
+      m_conn.send_queued();
+      if (m_conn.m_out.above_high_watermark()) {
+        if (co_await m_conn.drain() == -1) {
+          break;
+        }
+        continue;
+      }
+      auto chunk = co_await m_conn.recv();
+      if (chunk.size() <= 0) {
+        LOG_DEBUG("Connection terminated due to EOF: {}", m_conn.m_fd);
+        break;
+      }
+      do_consume_ws(chunk);
+    }
+  }
 
-    struct epoll_event event;
-    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-    event.data.ptr = resume.leak_address();
-    CHECK_CALL(epoll_ctl, epollfd, EPOLL_CTL_MOD, m_fd, &event);
+  // Handles the frames in `data`; false once the connection is closing,
+  // its close frame queued.
+  bool do_consume_ws(std::string_view data) {
+    _ws_state &ws = *m_ws;
+    ws.m_pong_due = false;
+    bool valid = ws.m_parser.push(
+        data, [this](ws_opcode opcode, std::string_view payload) {
+          on_ws_message(opcode, payload);
+        });
+    if (!valid && !ws.m_closing) {
+      LOG_DEBUG("WebSocket protocol error: {}", m_conn.m_fd);
+      close_ws(ws.m_parser.m_error);
+    }
+    return !ws.m_closing;
   }
 
-  ssize_t sync_write(bytes_view buf) {
-    return CHECK_CALL_EXCEPT(EPIPE, write, m_fd, buf.data(), buf.size());
+  // Text and binary messages are echoed, or broadcast to the channel.
+  void on_ws_message(ws_opcode opcode, std::string_view payload) {
+    if (m_ws->m_closing) {
+      return;
+    }
+    switch (opcode) {
+    case ws_opcode::ping: {
+      bytes_buffer frame = m_conn.m_out.take_buffer();
+      ws_write_frame(frame, ws_opcode::pong, payload);
+      m_conn.queue_write(std::move(frame));
+      break;
+    }
+    case ws_opcode::pong:
+      break;
+    case ws_opcode::close: { // the same status back, then the end
+      ws_close code = ws_close::normal;
+      if (payload.size() >= 2) {
+        code = static_cast<ws_close>(
+            unsigned(static_cast<unsigned char>(payload[0])) << 8 |
+            static_cast<unsigned char>(payload[1]));
+      }
+      close_ws(code);
+      break;
+    }
+    default:
+      if (m_ws->m_broadcast) {
+        m_broadcaster->publish(*m_conn.m_ctx, make_ws_frame(opcode, payload));
+        break;
+      }
+      bytes_buffer frame = m_conn.m_out.take_buffer();
+      ws_write_frame(frame, opcode, payload);
+      m_conn.queue_write(std::move(frame));
+      break;
+    }
   }
 
-  size_t sync_write(std::string_view buf) {
-    return CHECK_CALL_EXCEPT(EPIPE, write, m_fd, buf.data(), buf.size());
+  // Queues our close frame. Nothing is sent after it, not even
+  // broadcasts; the TCP connection closes once it is out.
+  void close_ws(ws_close code) {
+    bytes_buffer frame = m_conn.m_out.take_buffer();
+    ws_write_close(frame, code);
+    m_conn.queue_write(std::move(frame));
+    leave_ws();
+    m_ws->m_closing = true;
   }
 
-  int sync_accept(struct sockaddr *addr, socklen_t *addrlen) {
-    int connid = CHECK_CALL(accept, m_fd, addr, addrlen);
-    fmt::print("Accept a conncetion: {}\n", connid);
-    return connid;
+  void leave_ws() {
+    if (m_ws->m_broadcast) {
+      m_ws_hub->leave(m_ws->m_slot);
+      m_ws->m_broadcast = false;
+    }
   }
 
-  void async_accept(address_resolver::address &addr, callback<int> cb) {
-    ssize_t ret =
-        CHECK_CALL_EXCEPT(EAGAIN, accept, m_fd, &addr.m_addr, &addr.m_addrlen);
-    if (ret == -1) {
-      cb(ret);
+  // Replays the request of `stream` through the parser and answers it.
+  void serve_h2(h2_stream &stream) {
+    if (m_req_parser == nullptr) {
+      m_req_parser = m_parsers->acquire();
+    }
+    request_parser &req = *m_req_parser;
+    m_h2_stream = stream.m_id;
+    m_request_start = stream.m_start;
+    // the stream may be gone once its response is in
+    std::string head = std::move(stream.m_head);
+    std::string body = std::move(stream.m_body);
+    req.push_chunk(head);
+    std::string_view data = body;
+    while (!data.empty() && !req.failed() && !req.request_finished()) {
+      data.remove_prefix(req.push_chunk(data));
+    }
+    if (req.failed() || !req.request_finished()) {
+      m_metrics->m_parse_errors.add();
+      m_h2->reset_stream(m_h2_stream, h2_error::protocol_error);
+      next_request();
       return;
     }
+    do_write();
+    if (!m_deferred) {
+      next_request();
+    }
+  }
 
-    callback<> resume = [this, &addr, cb = std::move(cb)]() mutable {
-      async_accept(addr, std::move(cb));
-    };
+  // resumes do_handle once the deferred request has been answered and no
+  // exchange with a backend is left
+  struct _deferred_awaiter {
+    http_connection_handler *m_self;
 
-    struct epoll_event event;
-    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-    event.data.ptr = resume.leak_address();
-    CHECK_CALL(epoll_ctl, epollfd, EPOLL_CTL_MOD, m_fd, &event);
+    bool await_ready() const noexcept {
+      return !m_self->m_deferred && !m_self->m_proxy;
+    }
+
+    void await_suspend(std::coroutine_handle<> caller) noexcept {
+      m_self->m_deferred_waiter = caller;
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  void resume_deferred() {
+    if (m_deferred_waiter) {
+      std::exchange(m_deferred_waiter, nullptr).resume();
+    }
   }
 
-  // void async_accept
+  // Runs `work` on the worker pool and answers with `respond(self,
+  // result)` back on this loop; `result` is empty if `work` threw. Both
+  // run inline without a pool. A full pool sheds the request with a 503.
+  // `work` runs while the loop goes on: it may read the request, which
+  // stays put until then, but nothing else of the connection.
+  template <class Work, class Respond>
+  void do_offload(Work work, Respond respond) {
+    using result = std::invoke_result_t<Work &>;
+    if (m_workers == nullptr) {
+      respond(*this, std::optional<result>(work()));
+      return;
+    }
+    bool queued = m_workers->submit(
+        *m_conn.m_ctx, std::move(work),
+        [this, respond = std::move(respond)](std::optional<result> value) {
+          size_t first = m_conn.m_out.m_chunks.size();
+          respond(*this, std::move(value));
+          m_metrics->m_offloaded.add();
+          finish_request(first, false);
+          next_request();
+          m_deferred = false;
+          resume_deferred();
+        });
+    if (!queued) {
+      m_metrics->m_shed.add();
+      http_response_writer &res_writer = m_res_writer;
+      res_writer.buffer() = m_conn.m_out.take_buffer();
+      res_writer.begin_header(503);
+      res_writer.write_header("Server", "cpp_http");
+      res_writer.write_header("Retry-After", "1");
+      res_writer.write_header("Content-Length", 0);
+      res_writer.end_header();
+      m_conn.queue_write(std::move(res_writer.buffer()));
+      return;
+    }
+    m_deferred = true;
+  }
 
-  void close_file() {
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, m_fd, nullptr);
-    close(m_fd);
+  void release_parser() {
+    m_parsers->release(std::exchange(m_req_parser, nullptr));
   }
-};
 
-struct http_connection_handler {
-  async_file m_conn;
-  bytes_buffer m_buf{1024};
-  http_request_parser<> m_req_parser;
+  // Request latency runs from the first byte received to the response
+  // being handed to the socket.
+  void record_latencies() {
+    if (m_nanswered == 0) {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < m_nanswered; i++) {
+      m_metrics->m_latency.record(now - m_answered[i]);
+    }
+    m_nanswered = 0;
+  }
+
+  // Answers the finished request and logs it; a deferred one once its
+  // response is in.
+  void do_write() {
+    m_metrics->m_requests.add();
+    size_t first = m_conn.m_out.m_chunks.size();
+    bool streamed = m_streaming;
+    if (streamed) {
+      finish_echo_stream();
+    } else {
+      do_write_response(first);
+    }
+    if (m_proxied) { // counted in m_stream_bytes
+      streamed = true;
+      first = m_conn.m_out.m_chunks.size();
+    }
+    if (!m_deferred) {
+      finish_request(first, streamed);
+    }
+  }
 
-  void do_init(int connfd) {
-    m_conn = async_file::async_warp(connfd);
-    do_read();
+  // The response is queued from chunk `first` on.
+  void finish_request(size_t first, bool streamed) {
+    if (m_nanswered == m_answered.size()) { // a long pipeline: count it now
+      record_latencies();
+    }
+    m_answered[m_nanswered++] = m_request_start;
+    if (access_log_enabled()) {
+      do_log_access(first, streamed);
+    }
+    if (m_h2) {
+      m_h2->respond(m_h2_stream, m_conn.m_out.take_back(first),
+                    m_req_parser->method() == "HEAD");
+    }
   }
 
-  void do_read() {
-    fmt::print("Start reading...\n");
-    // hard to manage the lifetime of captured this
-    m_conn.async_read(m_buf, [this](size_t n) {
-      if (n == 0) {
-        fmt::print("Connection terminated due to EOF: {}\n", m_conn.m_fd);
-        do_close();
+  // Answers from the response cache when it can; on a miss the response is
+  // built as usual and then stored.
+  void do_write_response(size_t first) {
+    std::string_view key;
+    if (m_cache && m_upstream == nullptr &&
+        m_cache->cacheable(*m_req_parser)) {
+      key = m_cache->make_key(*m_req_parser);
+      if (auto hit = m_cache->find(key)) {
+        bytes_const_view wire = hit->m_wire;
+        m_conn.queue_shared(wire, std::move(hit));
         return;
       }
-      // fmt::print("Read {} bytes: {}\n", n, std::string_view(m_buf.data(),
-      // n));
-      m_req_parser.push_chunk(m_buf.subspan(0, n));
-      // fmt::print("request_finished: {}\n", m_req_parser.request_finished());
-      // fmt::print("header_finished: {}\n", m_req_parser.header_finished());
-      // fmt::print("body: {}\n", m_req_parser.body());
-      if (!m_req_parser.request_finished()) {
-        do_read();
-      } else {
-        do_write();
+    }
+    do_respond();
+    if (!key.empty()) {
+      m_cache->store(key, m_conn.m_out, first);
+    }
+  }
+
+  // One JSON line per response, from the chunks queued since `first`. A
+  // streamed response was mostly queued earlier, see m_stream_bytes.
+  void do_log_access(size_t first, bool streamed) {
+    const auto &chunks = m_conn.m_out.m_chunks;
+    size_t bytes = streamed ? m_stream_bytes : 0;
+    int status = streamed ? m_stream_status : 0;
+    for (size_t i = first; i < chunks.size(); i++) {
+      bytes += chunks[i].size();
+    }
+    if (!streamed && first < chunks.size() && !chunks[first].is_file()) {
+      std::string_view line = chunks[first].bytes(); // "HTTP/1.1 200 OK"
+      if (line.size() > 12) {
+        std::from_chars(line.data() + 9, line.data() + 12, status);
       }
-    });
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - m_request_start);
+    LOG_ACCESS("\"fd\":{},\"method\":\"{}\",\"target\":\"{}\",\"status\":{},"
+               "\"bytes\":{},\"duration_us\":{}",
+               m_conn.m_fd, log_json{m_req_parser->method()},
+               log_json{m_req_parser->url()}, status, bytes,
+               static_cast<int64_t>(elapsed.count()));
   }
 
-  void do_write() {
-    std::string header = m_req_parser.headers_raw();
-    std::string body = m_req_parser.body();
-    if (body.empty()) {
-      body = "<font color=\"red\"><b>请求为空</b></font>";
+  void do_respond() {
+    std::string_view target = m_req_parser->url();
+    std::string_view path = target.substr(0, target.find('?'));
+    route_params params;
+    auto match = m_router->find(parse_http_method(m_req_parser->method()),
+                                path, params);
+    if (match.m_handler == nullptr) {
+      do_respond_status(match.m_path_found ? 405 : 404);
+      return;
+    }
+    (*match.m_handler)(*this, params);
+  }
+
+  void do_respond_status(int status, bool close = false) {
+    http_response_writer &res_writer = m_res_writer;
+    res_writer.buffer() = m_conn.m_out.take_buffer();
+    res_writer.begin_header(status);
+    res_writer.write_header("Server", "cpp_http");
+    if (close) {
+      res_writer.write_header("Connection", "close");
+    }
+    res_writer.write_header("Content-Length", 0);
+    res_writer.end_header();
+    m_conn.queue_write(std::move(res_writer.buffer()));
+  }
+
+  // routes
+
+  static void on_health(http_connection_handler &self, const route_params &) {
+    http_response_writer &res_writer = self.m_res_writer;
+    res_writer.buffer() = self.m_conn.m_out.take_buffer();
+    res_writer.begin_header(200);
+    res_writer.write_header("Server", "cpp_http");
+    res_writer.write_header("Content-Type", "text/plain");
+    res_writer.write_header("Content-Length", 3);
+    res_writer.end_header();
+    res_writer.buffer().append_literal("ok\n");
+    self.m_conn.queue_write(std::move(res_writer.buffer()));
+  }
+
+  static inline void on_metrics(http_connection_handler &self,
+                                const route_params &);
+
+  static void on_static(http_connection_handler &self, const route_params &) {
+    self.m_static->respond(*self.m_req_parser, self.m_res_writer, self.m_conn);
+  }
+
+  static void on_echo(http_connection_handler &self, const route_params &) {
+    self.do_echo();
+  }
+
+  static void on_proxy(http_connection_handler &self, const route_params &) {
+    self.do_proxy();
+  }
+
+  static void on_websocket(http_connection_handler &self,
+                           const route_params &) {
+    self.do_upgrade_ws(false);
+  }
+
+  static void on_websocket_broadcast(http_connection_handler &self,
+                                     const route_params &) {
+    self.do_upgrade_ws(true);
+  }
+
+  // the request body goes to every /ws/broadcast client, on all reactors
+  static inline void on_broadcast(http_connection_handler &self,
+                                  const route_params &);
+
+  // smaller bodies are hashed inline: cheaper than the trip to a worker
+  static constexpr size_t k_offload_threshold = 16 * 1024;
+
+  // the SHA-1 of the request body, in hex
+  static void on_digest(http_connection_handler &self, const route_params &) {
+    std::string_view body = self.m_req_parser->body();
+    auto respond = [](http_connection_handler &self,
+                      std::optional<std::string> digest) {
+      if (!digest) {
+        self.do_respond_status(500);
+        return;
+      }
+      digest->push_back('\n');
+      http_response_writer &res_writer = self.m_res_writer;
+      res_writer.buffer() = self.m_conn.m_out.take_buffer();
+      res_writer.begin_header(200);
+      res_writer.write_header("Server", "cpp_http");
+      res_writer.write_header("Content-Type", "text/plain");
+      res_writer.write_header("Content-Length", digest->size());
+      res_writer.end_header();
+      res_writer.buffer().append(*digest);
+      self.m_conn.queue_write(std::move(res_writer.buffer()));
+    };
+    if (body.size() < k_offload_threshold) {
+      respond(self, sha1_hex(body));
+      return;
+    }
+    self.do_offload([body] { return sha1_hex(body); }, respond);
+  }
+
+  static constexpr std::string_view k_echo_prefix =
+      "<font color=\"red\"><b>你的请求是: [";
+  static constexpr std::string_view k_echo_suffix = "]</b></font>";
+
+  void do_echo() {
+    std::string_view request = m_req_parser->body();
+    bytes_buffer body = m_conn.m_out.take_buffer();
+    if (request.empty()) {
+      body.append_literal("<font color=\"red\"><b>请求为空</b></font>");
     } else {
-      body = "<font color=\"red\"><b>你的请求是: [" + body + "]</b></font>";
+      body.append(k_echo_prefix);
+      body.append(request);
+      body.append(k_echo_suffix);
     }
-    http_response_writer res_writer;
+    http_response_writer &res_writer = m_res_writer;
+    res_writer.buffer() = m_conn.m_out.take_buffer(); // reuses capacity
     res_writer.begin_header(200);
     res_writer.write_header("Server", "cpp_http");
-    res_writer.write_header("Content-type", "text/html;charset=utf-8");
-    res_writer.write_header("Connecetion", "keep-alive");
-    res_writer.write_header("Content-length", std::to_string(body.size()));
+    res_writer.write_header("Content-Type", "text/html;charset=utf-8");
+    res_writer.write_header("Connection", "keep-alive");
+    res_writer.write_header("Content-Length", body.size());
     res_writer.end_header(); // "\r\n\r\n"
-    bytes_view out_buffer = res_writer.buffer();
-    m_conn.sync_write(out_buffer);
-    m_conn.sync_write(body);
-    fmt::print("Responding.\n");
-    do_read(); // keep-alive
+    m_conn.queue_write(std::move(res_writer.buffer()));
+    m_conn.queue_write(std::move(body));
+  }
+
+  // Uploads that are chunked or larger than this are echoed while they
+  // arrive, in a chunked response, instead of being buffered whole: memory
+  // stays flat and the first bytes go out at once.
+  static constexpr size_t k_stream_threshold = 64 * 1024;
+
+  // Once the header of a request is in, a proxied request starts going to
+  // its backend and a large echo starts coming back, both while the body
+  // is still arriving. Any other body is buffered whole, up to k_max_body:
+  // past that the request gets a 413 and, as the rest of its body is not
+  // read, the connection closes. False then.
+  bool maybe_stream() {
+    request_parser &req = *m_req_parser;
+    if (m_streaming || m_proxied || !req.header_finished()) {
+      return true;
+    }
+    if (m_upstream != nullptr || req.chunked() ||
+        req.content_length() > k_stream_threshold) {
+      std::string_view target = req.url();
+      route_params params;
+      auto match = m_router->find(parse_http_method(req.method()),
+                                  target.substr(0, target.find('?')), params);
+      if (match.m_handler != nullptr && *match.m_handler == &on_proxy) {
+        start_proxy();
+        return true;
+      }
+      if (match.m_handler != nullptr && *match.m_handler == &on_echo &&
+          (req.chunked() || req.content_length() > k_stream_threshold)) {
+        start_echo_stream();
+        return true;
+      }
+    }
+    if (req.content_length() <= request_parser::k_max_body &&
+        req.body().size() <= request_parser::k_max_body) {
+      return true;
+    }
+    size_t first = m_conn.m_out.m_chunks.size();
+    do_respond_status(413, /*close=*/true);
+    if (access_log_enabled()) {
+      do_log_access(first, false);
+    }
+    return false;
+  }
+
+  void start_echo_stream() {
+    request_parser &req = *m_req_parser;
+    m_streaming = true;
+    m_stream_status = 200;
+    http_response_writer &res_writer = m_res_writer;
+    res_writer.buffer() = m_conn.m_out.take_buffer();
+    res_writer.begin_header(200);
+    res_writer.write_header("Server", "cpp_http");
+    res_writer.write_header("Content-Type", "text/html;charset=utf-8");
+    res_writer.write_header("Transfer-Encoding", "chunked");
+    res_writer.end_header();
+    res_writer.write_chunk(k_echo_prefix);
+    m_stream_bytes = res_writer.buffer().size();
+    m_conn.queue_write(std::move(res_writer.buffer()));
+    req.set_body_sink([this](std::string_view piece) {
+      http_response_writer &res_writer = m_res_writer;
+      res_writer.buffer() = m_conn.m_out.take_buffer();
+      res_writer.write_chunk(piece);
+      m_stream_bytes += res_writer.buffer().size();
+      m_conn.queue_write(std::move(res_writer.buffer()));
+    });
+  }
+
+  void finish_echo_stream() {
+    http_response_writer &res_writer = m_res_writer;
+    res_writer.buffer() = m_conn.m_out.take_buffer();
+    res_writer.write_chunk(k_echo_suffix);
+    res_writer.end_chunks();
+    m_conn.queue_write(std::move(res_writer.buffer()));
+    m_streaming = false;
+  }
+
+  // The request goes to a backend, see proxy_exchange. Its body, if still
+  // arriving, follows piece by piece; the exchange queues the response.
+  inline void start_proxy();
+
+  // The request is complete: relayed whole, or the end of a body already
+  // on its way. Requests pipelined behind it wait for the response.
+  void do_proxy() {
+    if (!m_proxied) {
+      start_proxy();
+    } else if (m_proxy) {
+      m_proxy->end_body();
+    }
+    if (m_proxy) {
+      m_deferred = true;
+      // the exchange bounds both sides with the upstream timeout
+      m_conn.m_ctx->cancel(m_deadline);
+      m_phase = phase::idle;
+    }
+  }
+
+  inline void on_proxy_done(const proxy_result &result);
+
+  inline void do_close();
+};
+
+// Per-reactor accept counters.
+struct accept_stats {
+  size_t m_accepted = 0;
+  size_t m_errors = 0; // e.g. EMFILE; accepting pauses for a moment
+  size_t m_pauses = 0; // times the connection limit was reached
+  size_t m_live = 0;
+  double m_rate = 0; // accepts per second, over the last second
+  size_t m_rate_base = 0;
+  size_t m_websockets = 0; // upgraded connections open
+};
+
+// Per-reactor connection memory: handlers live in slabs, parsers and
+// response buffers are shared by the connections that have a request in
+// flight.
+struct connection_pools {
+  object_pool<http_connection_handler> m_handlers;
+  object_pool<http_connection_handler::request_parser> m_parsers;
+  object_pool<proxy_exchange> m_exchanges;
+
+  // slabs, parked parsers and pooled buffers, over the open connections;
+  // parked parsers are counted by their size only, not their buffers
+  size_t resident_bytes_per_connection(const buffer_pool &buffers) const {
+    size_t resident = m_handlers.m_stats.m_resident_bytes +
+                      m_parsers.m_stats.m_resident_bytes +
+                      buffers.m_stats.m_resident_bytes;
+    size_t live = m_handlers.m_stats.m_live;
+    return resident / (live ? live : 1);
+  }
+};
+
+// Every reactor's metrics, for /metrics. Reactors add theirs when they
+// start and remove them before their io_context goes away.
+struct metrics_registry {
+  struct entry {
+    const loop_metrics *m_loop;
+    const http_metrics *m_http;
+  };
+
+  std::mutex m_mutex;
+  std::vector<entry> m_reactors;
+  const worker_pool *m_workers = nullptr;
+
+  void add(const loop_metrics *loop, const http_metrics *http) {
+    std::lock_guard guard(m_mutex);
+    m_reactors.push_back({loop, http});
   }
 
-  void do_close() {
-    m_conn.close_file();
-    delete this; // the other way of managing lifetime is shared_ptr
+  void remove(const http_metrics *http) {
+    std::lock_guard guard(m_mutex);
+    std::erase_if(m_reactors,
+                  [http](const entry &e) { return e.m_http == http; });
+  }
+
+  // sums over the reactors, in Prometheus text format
+  void render(bytes_buffer &out) {
+    std::lock_guard guard(m_mutex);
+    auto sum_loop = [this](metric_counter loop_metrics::*member) {
+      uint64_t total = 0;
+      for (const entry &e : m_reactors) {
+        total += (e.m_loop->*member).get();
+      }
+      return total;
+    };
+    auto sum_http = [this](metric_counter http_metrics::*member) {
+      uint64_t total = 0;
+      for (const entry &e : m_reactors) {
+        total += (e.m_http->*member).get();
+      }
+      return total;
+    };
+    log_histogram latency, iteration;
+    for (const entry &e : m_reactors) {
+      latency.merge(e.m_http->m_latency);
+      iteration.merge(e.m_loop->m_iteration);
+    }
+    prometheus_writer w{out};
+    w.gauge("co_http_reactors", "Reactor threads", double(m_reactors.size()));
+    w.counter("co_http_connections_accepted_total", "Accepted connections",
+              sum_http(&http_metrics::m_accepted));
+    w.counter("co_http_connections_closed_total", "Closed connections",
+              sum_http(&http_metrics::m_closed));
+    w.gauge("co_http_connections_open", "Open connections",
+            double(sum_http(&http_metrics::m_live)));
+    w.counter("co_http_requests_total", "Answered requests",
+              sum_http(&http_metrics::m_requests));
+    w.counter("co_http_parse_errors_total",
+              "Requests rejected with 400 for malformed framing",
+              sum_http(&http_metrics::m_parse_errors));
+    w.counter("co_http_offloaded_total",
+              "Requests answered through the worker pool",
+              sum_http(&http_metrics::m_offloaded));
+    w.counter("co_http_shed_total", "Requests shed with 503, pool full",
+              sum_http(&http_metrics::m_shed));
+    if (m_workers) {
+      w.gauge("co_http_worker_jobs_pending", "Jobs queued or running",
+              double(m_workers->pending()));
+      w.counter("co_http_worker_jobs_stolen_total",
+                "Jobs a worker took from another's queue",
+                m_workers->m_stats.m_stolen.load());
+    }
+    w.counter("co_http_received_bytes_total", "Bytes read from sockets",
+              sum_loop(&loop_metrics::m_bytes_in));
+    w.counter("co_http_sent_bytes_total", "Bytes written to sockets",
+              sum_loop(&loop_metrics::m_bytes_out));
+    w.counter("co_http_rearms_total",
+              "Waits for readiness after EAGAIN (POLL_ADDs under io_uring)",
+              sum_loop(&loop_metrics::m_rearms));
+    uint64_t waits = sum_loop(&loop_metrics::m_waits);
+    uint64_t events = sum_loop(&loop_metrics::m_events);
+    w.counter("co_http_loop_waits_total",
+              "Loop iterations: blocking waits and spins that found work",
+              waits);
+    w.counter("co_http_loop_events_total",
+              "Events or completions handled by those iterations", events);
+    w.gauge("co_http_loop_events_per_wait", "Events per loop iteration",
+            waits ? double(events) / double(waits) : 0.0);
+    w.gauge("co_http_loop_batch_size",
+            "Adaptive epoll batch size, averaged over reactors",
+            m_reactors.empty() ? 0.0
+                               : double(sum_loop(&loop_metrics::m_batch)) /
+                                     double(m_reactors.size()));
+    uint64_t spins = sum_loop(&loop_metrics::m_spins);
+    uint64_t spin_hits = sum_loop(&loop_metrics::m_spin_hits);
+    w.counter("co_http_loop_spins_total",
+              "Busy polls before a blocking wait", spins);
+    w.counter("co_http_loop_spin_hits_total",
+              "Busy polls that found work before giving up", spin_hits);
+    w.counter("co_http_loop_spin_polls_total",
+              "Non-blocking waits made while busy polling",
+              sum_loop(&loop_metrics::m_polls));
+    w.gauge("co_http_loop_spin_hit_ratio", "Spin hits over spins",
+            spins ? double(spin_hits) / double(spins) : 0.0);
+    w.histogram("co_http_loop_iteration_seconds",
+                "Time from a wakeup to the next wait", iteration);
+    w.histogram("co_http_request_duration_seconds",
+                "First request byte to response handed to the socket",
+                latency);
+    w.gauge("co_http_resident_bytes_per_connection",
+            "Pooled memory over open connections, averaged over reactors",
+            m_reactors.empty()
+                ? 0.0
+                : double(sum_http(&http_metrics::m_resident_per_connection)) /
+                      double(m_reactors.size()));
+    w.counter("co_http_pool_hits_total", "Pooled object and buffer reuses",
+              sum_http(&http_metrics::m_pool_hits));
+    w.counter("co_http_pool_misses_total", "Pool allocations",
+              sum_http(&http_metrics::m_pool_misses));
+    w.counter("co_http_file_cache_hits_total", "Open file cache hits",
+              sum_http(&http_metrics::m_file_hits));
+    w.counter("co_http_file_cache_misses_total", "Open file cache misses",
+              sum_http(&http_metrics::m_file_misses));
+    w.counter("co_http_response_cache_hits_total", "Response cache hits",
+              sum_http(&http_metrics::m_cache_hits));
+    w.counter("co_http_response_cache_misses_total", "Response cache misses",
+              sum_http(&http_metrics::m_cache_misses));
+    w.counter("co_http_response_cache_evictions_total",
+              "Responses evicted for the memory budget",
+              sum_http(&http_metrics::m_cache_evictions));
+    w.gauge("co_http_response_cache_bytes", "Memory held by cached responses",
+            double(sum_http(&http_metrics::m_cache_bytes)));
+    w.counter("co_http_upstream_requests_total", "Requests sent to backends",
+              sum_http(&http_metrics::m_upstream_requests));
+    w.counter("co_http_upstream_connects_total",
+              "Connections opened to backends",
+              sum_http(&http_metrics::m_upstream_connects));
+    w.counter("co_http_upstream_reuses_total",
+              "Requests sent on a pooled keep-alive connection",
+              sum_http(&http_metrics::m_upstream_reuses));
+    w.counter("co_http_upstream_failures_total",
+              "Failed connects, timeouts and lost responses",
+              sum_http(&http_metrics::m_upstream_failures));
+    w.counter("co_http_upstream_retries_total",
+              "Requests sent again after a stale pooled connection",
+              sum_http(&http_metrics::m_upstream_retries));
+    w.counter("co_http_upstream_ejections_total",
+              "Backends taken out of rotation after repeated failures",
+              sum_http(&http_metrics::m_upstream_ejections));
+    w.gauge("co_http_upstream_ejected",
+            "Ejected backends, summed over reactors",
+            double(sum_http(&http_metrics::m_upstream_ejected)));
+    w.gauge("co_http_websockets_open", "Open WebSocket connections",
+            double(sum_http(&http_metrics::m_websockets)));
+    w.counter("co_http_websocket_broadcast_frames_total",
+              "Broadcast frames queued on WebSocket clients",
+              sum_http(&http_metrics::m_ws_delivered));
+    w.counter("co_http_websocket_dropped_total",
+              "Broadcast clients cut off for falling behind",
+              sum_http(&http_metrics::m_ws_dropped));
   }
 };
 
 struct http_connection_accepter {
+  io_context *m_ctx = nullptr;
+  const http_timeouts *m_timeouts = nullptr;
   async_file m_listen;
-  address_resolver::address m_addr;
+  accept_stats m_stats;
+  connection_pools m_pools;
+  const router<http_route> *m_router = nullptr; // shared, read only
+  std::unique_ptr<static_files> m_static; // one file cache per reactor
+  std::unique_ptr<response_cache> m_cache;
+  std::unique_ptr<upstream_group> m_upstream; // null: no backends
+  // 0: no limit. Accepting pauses at m_max_connections live connections
+  // and resumes once they drop to m_resume_below.
+  size_t m_max_connections = 0;
+  size_t m_resume_below = 0;
+  callback_timer m_retry; // after accept errors
+  callback_timer m_rate_timer;
+  http_date m_date; // shared by the connections' response writers
+  http_metrics m_metrics;
+  metrics_registry *m_registry = nullptr;
+  worker_pool *m_workers = nullptr; // shared by all reactors
+  int m_busy_poll_us = 0; // SO_BUSY_POLL on accepted sockets, 0: off
+  ws_hub m_ws_hub; // this reactor's /ws/broadcast clients
+  ws_broadcaster *m_broadcaster = nullptr; // shared by all reactors
 
-  void do_start(const std::string name, const std::string port) {
-    fmt::print("Listening {}:{}\n", name, port);
+  // one SO_REUSEPORT socket per reactor
+  void do_start(io_context &ctx, const std::string name,
+                const std::string port) {
+    LOG_INFO("Listening {}:{}", name, port);
     address_resolver resolver;
     auto entry = resolver.resolve(name, port);
-    int listenfd = entry.create_socket_and_bind();
-    while (CHECK_CALL_EXCEPT(EAGAIN, listen, listenfd, SOMAXCONN) != -1)
-      ;
+    int listenfd = entry.create_socket_and_bind(/*reuse_port=*/true);
+    CHECK_CALL(listen, listenfd, SOMAXCONN);
 
-    m_listen = async_file::async_warp(listenfd);
+    m_ctx = &ctx;
+    m_listen = async_file::async_warp(ctx, listenfd);
+    do_accept();
+  }
+
+  // fallback: a single listening socket registered in every reactor
+  void do_start_shared(io_context &ctx, int listenfd) {
+    m_ctx = &ctx;
+    // under io_uring every ring arms its own multishot accept
+    m_listen = async_file::async_warp_exclusive(ctx, listenfd);
     do_accept();
   }
 
   void do_accept() {
-    m_listen.async_accept(m_addr, [this](int connfd) {
-      fmt::print("Connection accepted: {}\n", connfd);
+    using namespace std::chrono_literals;
+    m_ctx->run_every(m_rate_timer, 1s, [this] {
+      m_stats.m_rate = static_cast<double>(m_stats.m_accepted -
+                                           m_stats.m_rate_base);
+      m_stats.m_rate_base = m_stats.m_accepted;
+      m_date.refresh();
+      publish_metrics();
+    });
+    m_listen.m_accept_single = m_max_connections != 0;
+    m_listen.async_accept_multishot([this](int connfd) { on_accept(connfd); });
+  }
+
+  void publish_metrics() {
+    const buffer_pool &buffers = m_ctx->m_buffers;
+    const pool_stats *pools[] = {&m_pools.m_handlers.m_stats,
+                                 &m_pools.m_parsers.m_stats, &buffers.m_stats};
+    uint64_t hits = 0, misses = 0;
+    for (const pool_stats *stats : pools) {
+      hits += stats->m_hits;
+      misses += stats->m_misses;
+    }
+    m_metrics.m_live.set(m_stats.m_live);
+    m_metrics.m_resident_per_connection.set(
+        m_pools.resident_bytes_per_connection(buffers));
+    m_metrics.m_pool_hits.set(hits);
+    m_metrics.m_pool_misses.set(misses);
+    if (m_static) {
+      m_metrics.m_file_hits.set(m_static->m_cache.m_stats.m_hits);
+      m_metrics.m_file_misses.set(m_static->m_cache.m_stats.m_misses);
+    }
+    if (m_cache) {
+      m_metrics.m_cache_hits.set(m_cache->m_stats.m_hits);
+      m_metrics.m_cache_misses.set(m_cache->m_stats.m_misses);
+      m_metrics.m_cache_evictions.set(m_cache->m_stats.m_evictions);
+      m_metrics.m_cache_bytes.set(m_cache->m_stats.m_bytes);
+    }
+    if (m_upstream) {
+      const upstream_stats &stats = m_upstream->m_stats;
+      m_metrics.m_upstream_requests.set(stats.m_requests);
+      m_metrics.m_upstream_connects.set(stats.m_connects);
+      m_metrics.m_upstream_reuses.set(stats.m_reuses);
+      m_metrics.m_upstream_failures.set(stats.m_failures);
+      m_metrics.m_upstream_retries.set(stats.m_retries);
+      m_metrics.m_upstream_ejections.set(stats.m_ejections);
+      m_metrics.m_upstream_ejected.set(m_upstream->ejected());
+    }
+    m_metrics.m_websockets.set(m_stats.m_websockets);
+    m_metrics.m_ws_delivered.set(m_ws_hub.m_stats.m_delivered);
+    m_metrics.m_ws_dropped.set(m_ws_hub.m_stats.m_dropped);
+  }
+
+  void on_accept(int connfd) {
+    if (connfd == -1) {
+      // the listener paused itself; retry once some fds may be free
+      m_stats.m_errors++;
+      LOG_WARN("accept: {}", strerror(errno));
+      using namespace std::chrono_literals;
+      m_ctx->run_after(m_retry, 100ms, [this] { maybe_resume(); });
+      return;
+    }
+    LOG_DEBUG("Connection accepted: {}", connfd);
+    m_stats.m_accepted++;
+    m_stats.m_live++;
+    m_metrics.m_accepted.add();
+    int on = 1; // small responses must not wait for delayed ACKs
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (m_busy_poll_us != 0 &&
+        setsockopt(connfd, SOL_SOCKET, SO_BUSY_POLL, &m_busy_poll_us,
+                   sizeof(m_busy_poll_us)) != 0) {
+      // above net.core.busy_read this needs CAP_NET_ADMIN; the loop still
+      // spins, the driver just is not polled for this socket
+      LOG_WARN("SO_BUSY_POLL: {}, not setting it", strerror(errno));
+      m_busy_poll_us = 0;
+    }
+
+    auto conn_handler = m_pools.m_handlers.create();
+    conn_handler->do_init(*this, connfd);
 
-      auto conn_handler = new http_connection_handler{};
-      conn_handler->do_init(connfd);
+    if (m_max_connections != 0 && m_stats.m_live >= m_max_connections &&
+        !m_listen.accept_paused()) {
+      LOG_WARN("Connection limit reached ({}), pausing accept",
+               m_stats.m_live);
+      m_stats.m_pauses++;
+      m_listen.pause_accepting();
+    }
+  }
+
+  void on_close(http_connection_handler *handler) {
+    m_pools.m_handlers.destroy(handler);
+    m_stats.m_live--;
+    m_metrics.m_closed.add();
+    if (m_listen.accept_paused()) {
+      maybe_resume();
+    }
+  }
+
+  void maybe_resume() {
+    if (m_retry.armed() ||
+        (m_max_connections != 0 && m_stats.m_live > m_resume_below)) {
+      return;
+    }
+    m_listen.resume_accepting();
+  }
+};
+
+void http_connection_handler::do_init(http_connection_accepter &accepter,
+                                      int connfd) {
+  io_context &ctx = *accepter.m_ctx;
+  m_conn = async_file::async_warp_nonblocking(ctx, connfd);
+  m_accepter = &accepter;
+  m_parsers = &accepter.m_pools.m_parsers;
+  m_timeouts = accepter.m_timeouts;
+  m_router = accepter.m_router;
+  m_static = accepter.m_static.get();
+  m_cache = accepter.m_cache.get();
+  m_res_writer.m_date = &accepter.m_date;
+  m_metrics = &accepter.m_metrics;
+  m_workers = accepter.m_workers;
+  m_upstream = accepter.m_upstream.get();
+  m_ws_hub = &accepter.m_ws_hub;
+  m_broadcaster = accepter.m_broadcaster;
+  m_deadline.m_fd = connfd;
+  m_deadline.m_fire = &on_deadline;
+  ctx.m_timers.schedule(m_deadline, m_timeouts->m_idle);
+  co_spawn(do_handle());
+}
+
+void http_connection_handler::on_metrics(http_connection_handler &self,
+                                         const route_params &) {
+  self.m_accepter->publish_metrics(); // this reactor's gauges up to date
+  bytes_buffer body = self.m_conn.m_out.take_buffer();
+  self.m_accepter->m_registry->render(body);
+  http_response_writer &res_writer = self.m_res_writer;
+  res_writer.buffer() = self.m_conn.m_out.take_buffer();
+  res_writer.begin_header(200);
+  res_writer.write_header("Server", "cpp_http");
+  res_writer.write_header("Content-Type", "text/plain; version=0.0.4");
+  res_writer.write_header("Cache-Control", "no-store");
+  res_writer.write_header("Content-Length", body.size());
+  res_writer.end_header();
+  self.m_conn.queue_write(std::move(res_writer.buffer()));
+  self.m_conn.queue_write(std::move(body));
+}
 
-      do_accept();
+void http_connection_handler::do_upgrade_ws(bool broadcast) {
+  request_parser &req = *m_req_parser;
+  const auto &headers = req.headers();
+  auto upgrade = headers.find(http_field::upgrade);
+  auto connection = headers.find(http_field::connection);
+  auto key = headers.find(http_field::sec_websocket_key);
+  auto version = headers.find(http_field::sec_websocket_version);
+  std::string nonce;
+  if (req.http_version() != "HTTP/1.1" || upgrade == headers.end() ||
+      !has_token_lower(upgrade->second, "websocket") ||
+      connection == headers.end() ||
+      !has_token_lower(connection->second, "upgrade") ||
+      key == headers.end() || !base64_decode(key->second, nonce) ||
+      nonce.size() != 16) {
+    do_respond_status(400);
+    return;
+  }
+  http_response_writer &res_writer = m_res_writer;
+  res_writer.buffer() = m_conn.m_out.take_buffer();
+  if (version == headers.end() || version->second != "13") {
+    res_writer.begin_header(426);
+    res_writer.write_header("Server", "cpp_http");
+    res_writer.write_header("Sec-WebSocket-Version", "13");
+    res_writer.write_header("Content-Length", 0);
+    res_writer.end_header();
+    m_conn.queue_write(std::move(res_writer.buffer()));
+    return;
+  }
+  res_writer.begin_header(101);
+  res_writer.write_header("Upgrade", "websocket");
+  res_writer.write_header("Connection", "Upgrade");
+  res_writer.write_header("Sec-WebSocket-Accept", ws_accept_key(key->second));
+  res_writer.end_header();
+  m_conn.queue_write(std::move(res_writer.buffer()));
+  m_ws = std::make_unique<_ws_state>();
+  if (broadcast) {
+    m_ws->m_broadcast = true;
+    m_ws_hub->join(m_conn, m_ws->m_slot);
+  }
+  m_accepter->m_stats.m_websockets++;
+  // no request deadlines from here on; idle clients are pinged instead
+  m_conn.m_ctx->cancel(m_deadline);
+  m_phase = phase::idle;
+  m_conn.m_ctx->run_every(m_ws->m_ping, m_timeouts->m_idle,
+                          [this] { on_ws_ping(); });
+}
+
+// maybe_stream() has capped the body at what a member would take as one
+// message itself
+static_assert(http_connection_handler::request_parser::k_max_body <=
+              ws_frame_parser::k_max_message);
+
+void http_connection_handler::on_broadcast(http_connection_handler &self,
+                                           const route_params &) {
+  std::string_view body = self.m_req_parser->body();
+  ws_opcode opcode = utf8_valid(body) ? ws_opcode::text : ws_opcode::binary;
+  self.m_broadcaster->publish(*self.m_conn.m_ctx, make_ws_frame(opcode, body));
+  self.do_respond_status(202);
+}
+
+void http_connection_handler::start_proxy() {
+  m_proxied = true;
+  m_proxy = m_accepter->m_pools.m_exchanges.create();
+  request_parser &req = *m_req_parser;
+  m_proxy->start(*m_upstream, m_conn, m_res_writer, req,
+                 [this](proxy_result result) { on_proxy_done(result); });
+  if (!req.request_finished()) { // m_proxy is null if it is already over
+    req.set_body_sink([this](std::string_view piece) {
+      if (m_proxy) {
+        m_proxy->push_body(piece);
+      }
     });
   }
+}
+
+void http_connection_handler::on_proxy_done(const proxy_result &result) {
+  m_accepter->m_pools.m_exchanges.destroy(std::exchange(m_proxy, nullptr));
+  m_stream_bytes = result.m_bytes;
+  m_stream_status = result.m_status;
+  m_close_after = m_close_after || result.m_broken;
+  if (m_deferred) {
+    finish_request(m_conn.m_out.m_chunks.size(), true);
+    next_request();
+    m_deferred = false;
+  }
+  resume_deferred();
+}
+
+void http_connection_handler::do_close() {
+  m_conn.m_ctx->cancel(m_deadline);
+  if (m_ws) {
+    leave_ws();
+    m_conn.m_ctx->cancel(m_ws->m_ping);
+    m_ws.reset();
+    m_accepter->m_stats.m_websockets--;
+  }
+  m_conn.close_file();
+  if (m_req_parser != nullptr) {
+    m_req_parser->reset();
+    release_parser();
+  }
+  m_accepter->on_close(this); // destroys this
+}
+
+struct server_options {
+  std::string m_host = "127.0.0.1";
+  std::string m_port = "8080";
+  unsigned m_threads = 1; // 0: one reactor per core
+  bool m_pin_cpu = false;
+  bool m_shared_listener = false;
+  io_backend m_backend = io_backend::epoll;
+  http_timeouts m_timeouts;
+  size_t m_max_connections = 0; // 0: no limit, split evenly over reactors
+  std::string m_root;           // serve files from here instead of echoing
+  size_t m_cache_size = 0;      // response cache bytes per reactor, 0: off
+  std::chrono::milliseconds m_cache_ttl{1000};
+  std::string m_access_log; // path, "-" for stdout, empty: off
+  unsigned m_workers = 2;   // offload threads, 0: heavy handlers run inline
+  size_t m_worker_queue = 256; // jobs queued or running before shedding
+  loop_options m_loop;         // epoll batch and busy polling
+  upstream_config m_upstream;  // no backends: no reverse proxying
 };
 
-void server() {
-  epollfd = epoll_create1(0);
+[[nodiscard]] bool reuse_port_supported() {
+  int fd = CHECK_CALL(socket, AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  int ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+  close(fd);
+  return ret == 0;
+}
+
+void pin_to_cpu(unsigned cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0) {
+    LOG_WARN("pthread_setaffinity_np: {}", strerror(err));
+  }
+}
 
-  auto accepter = new http_connection_accepter;
-  accepter->do_start("127.0.0.1", "8080");
+// Fixed routes, resolved by a hash table built at compile time. The others
+// are added to the radix tree in server().
+constexpr auto k_static_routes = make_static_routes<http_route>({
+    {http_method::get, "/health", &http_connection_handler::on_health},
+    {http_method::get, "/metrics", &http_connection_handler::on_metrics},
+    {http_method::post, "/digest", &http_connection_handler::on_digest},
+    {http_method::get, "/ws", &http_connection_handler::on_websocket},
+    {http_method::get, "/ws/broadcast",
+     &http_connection_handler::on_websocket_broadcast},
+    {http_method::post, "/broadcast", &http_connection_handler::on_broadcast},
+});
 
-  struct epoll_event events[10];
-  while (true) {
-    int ret = epoll_wait(epollfd, events, 10, -1);
-    if (ret < 0) {
-      throw;
-    }
-    for (int i = 0; i < ret; i++) {
-      auto cb = callback<>::from_address(events[i].data.ptr);
-      cb();
+void reactor_main(const server_options &opts, const router<http_route> &routes,
+                  metrics_registry &registry, ws_broadcaster &broadcaster,
+                  worker_pool *workers, unsigned index, int shared_fd) {
+  if (opts.m_pin_cpu) {
+    pin_to_cpu(index % std::thread::hardware_concurrency());
+  }
+  io_context ctx(opts.m_backend, opts.m_loop);
+  http_connection_accepter accepter;
+  accepter.m_registry = &registry;
+  accepter.m_workers = workers;
+  accepter.m_busy_poll_us = static_cast<int>(opts.m_loop.m_busy_poll.count());
+  accepter.m_broadcaster = &broadcaster;
+  registry.add(&ctx.m_metrics, &accepter.m_metrics);
+  broadcaster.add(ctx, accepter.m_ws_hub);
+  struct unregister { // before ctx and accepter go away, even on errors
+    metrics_registry &m_registry;
+    ws_broadcaster &m_broadcaster;
+    http_connection_accepter &m_accepter;
+    ~unregister() {
+      m_registry.remove(&m_accepter.m_metrics);
+      m_broadcaster.remove(m_accepter.m_ws_hub);
     }
+  } unregister{registry, broadcaster, accepter};
+  accepter.m_timeouts = &opts.m_timeouts;
+  accepter.m_router = &routes;
+  if (!opts.m_root.empty()) {
+    accepter.m_static = std::make_unique<static_files>(opts.m_root);
+  }
+  if (opts.m_cache_size != 0) {
+    accepter.m_cache = std::make_unique<response_cache>();
+    accepter.m_cache->m_budget = opts.m_cache_size;
+    accepter.m_cache->m_ttl = opts.m_cache_ttl;
   }
-  fmt::print("All tasks are done.\n");
-  close(epollfd);
+  if (!opts.m_upstream.m_backends.empty()) {
+    accepter.m_upstream =
+        std::make_unique<upstream_group>(opts.m_upstream, ctx);
+  }
+  if (opts.m_max_connections != 0) {
+    unsigned nthreads = opts.m_threads;
+    size_t share = (opts.m_max_connections + nthreads - 1) / nthreads;
+    accepter.m_max_connections = share;
+    accepter.m_resume_below = share - share / 10; // low watermark at 90%
+  }
+  if (shared_fd != -1) {
+    accepter.do_start_shared(ctx, shared_fd);
+  } else {
+    accepter.do_start(ctx, opts.m_host, opts.m_port);
+  }
+  ctx.run();
 }
 
-int main() {
+void server(server_options opts) {
+  if (opts.m_threads == 0) {
+    opts.m_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  unsigned nthreads = opts.m_threads;
+
+  router<http_route> routes;
+  routes.set_static_routes(k_static_routes);
+  if (!opts.m_upstream.m_backends.empty()) {
+    routes.add_any("/*path", &http_connection_handler::on_proxy);
+  } else if (!opts.m_root.empty()) {
+    routes.add(http_method::get, "/*path", &http_connection_handler::on_static);
+    routes.add(http_method::head, "/*path",
+               &http_connection_handler::on_static);
+  } else {
+    routes.add_any("/*path", &http_connection_handler::on_echo);
+  }
+
+  int shared_fd = -1;
+  if (opts.m_shared_listener || !reuse_port_supported()) {
+    LOG_INFO("Listening {}:{} (shared)", opts.m_host, opts.m_port);
+    address_resolver resolver;
+    auto entry = resolver.resolve(opts.m_host, opts.m_port);
+    shared_fd = entry.create_socket_and_bind();
+    CHECK_CALL(listen, shared_fd, SOMAXCONN);
+  }
+
+  // outlives the reactors, which may still have jobs queued
+  std::unique_ptr<worker_pool> workers;
+  if (opts.m_workers != 0) {
+    workers =
+        std::make_unique<worker_pool>(opts.m_workers, opts.m_worker_queue);
+  }
+  metrics_registry registry;
+  registry.m_workers = workers.get();
+  ws_broadcaster broadcaster;
+  std::vector<std::thread> reactors;
+  for (unsigned i = 1; i < nthreads; i++) {
+    reactors.emplace_back([&opts, &routes, &registry, &broadcaster, &workers,
+                           i, shared_fd] {
+      try {
+        reactor_main(opts, routes, registry, broadcaster, workers.get(), i,
+                     shared_fd);
+      } catch (const std::exception &e) {
+        LOG_ERROR("Error in reactor {}: {}", i, e.what());
+      }
+    });
+  }
+  reactor_main(opts, routes, registry, broadcaster, workers.get(), 0,
+               shared_fd); // the main thread is reactor 0
+  for (auto &t : reactors) {
+    t.join();
+  }
+  LOG_INFO("All tasks are done.");
+}
+
+int main(int argc, char **argv) {
+  server_options opts;
+  static const struct option long_opts[] = {
+      {"threads", required_argument, nullptr, 't'},
+      {"pin-cpu", no_argument, nullptr, 'a'},
+      {"shared-listener", no_argument, nullptr, 's'},
+      {"io-uring", no_argument, nullptr, 'u'},
+      {"idle-timeout", required_argument, nullptr, 'k'},
+      {"header-timeout", required_argument, nullptr, 'H'},
+      {"body-timeout", required_argument, nullptr, 'B'},
+      {"max-connections", required_argument, nullptr, 'c'},
+      {"root", required_argument, nullptr, 'r'},
+      {"cache-size", required_argument, nullptr, 'C'},
+      {"cache-ttl", required_argument, nullptr, 'T'},
+      {"log-level", required_argument, nullptr, 'l'},
+      {"access-log", required_argument, nullptr, 'L'},
+      {"workers", required_argument, nullptr, 'w'},
+      {"worker-queue", required_argument, nullptr, 'W'},
+      {"max-events", required_argument, nullptr, 'E'},
+      {"busy-poll", required_argument, nullptr, 'P'},
+      {"upstream", required_argument, nullptr, 'U'},
+      {"balance", required_argument, nullptr, 'b'},
+      {"upstream-timeout", required_argument, nullptr, 'o'},
+      {"upstream-connect-timeout", required_argument, nullptr, 'n'},
+      {"upstream-keepalive", required_argument, nullptr, 'K'},
+      {nullptr, 0, nullptr, 0},
+  };
+  auto seconds = [](const char *arg) {
+    return std::chrono::milliseconds(
+        static_cast<long>(std::stod(arg) * 1000));
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "t:asuk:c:r:C:l:L:w:U:", long_opts,
+                            nullptr)) != -1) {
+    switch (opt) {
+    case 't': opts.m_threads = std::stoul(optarg); break;
+    case 'a': opts.m_pin_cpu = true; break;
+    case 's': opts.m_shared_listener = true; break;
+    case 'u': opts.m_backend = io_backend::io_uring; break;
+    case 'k': opts.m_timeouts.m_idle = seconds(optarg); break;
+    case 'H': opts.m_timeouts.m_header = seconds(optarg); break;
+    case 'B': opts.m_timeouts.m_body = seconds(optarg); break;
+    case 'c': opts.m_max_connections = std::stoul(optarg); break;
+    case 'r': opts.m_root = optarg; break;
+    case 'C': opts.m_cache_size = std::stoul(optarg) << 20; break;
+    case 'T': opts.m_cache_ttl = seconds(optarg); break;
+    case 'l': {
+      log_level level;
+      if (!parse_log_level(optarg, level)) {
+        fmt::print(stderr, "unknown log level: {}\n", optarg);
+        return 1;
+      }
+      g_log_level.store(level);
+      break;
+    }
+    case 'L': opts.m_access_log = optarg; break;
+    case 'w': opts.m_workers = std::stoul(optarg); break;
+    case 'W': opts.m_worker_queue = std::stoul(optarg); break;
+    case 'E': opts.m_loop.m_max_events = std::stoul(optarg); break;
+    case 'P':
+      opts.m_loop.m_busy_poll = std::chrono::microseconds(std::stoul(optarg));
+      break;
+    case 'U':
+      try {
+        opts.m_upstream.add_backend(optarg);
+      } catch (const std::exception &e) {
+        fmt::print(stderr, "{}\n", e.what());
+        return 1;
+      }
+      break;
+    case 'b':
+      if (std::string_view(optarg) == "round-robin") {
+        opts.m_upstream.m_balance = upstream_balance::round_robin;
+      } else if (std::string_view(optarg) == "least-conn") {
+        opts.m_upstream.m_balance = upstream_balance::least_connections;
+      } else {
+        fmt::print(stderr, "unknown balancing: {}\n", optarg);
+        return 1;
+      }
+      break;
+    case 'o': opts.m_upstream.m_timeout = seconds(optarg); break;
+    case 'n': opts.m_upstream.m_connect_timeout = seconds(optarg); break;
+    case 'K': opts.m_upstream.m_max_idle = std::stoul(optarg); break;
+    default:
+      fmt::print(stderr,
+                 "usage: {} [-t threads] [-a] [-s] [-u] [-k secs] [-c max] "
+                 "[-r dir] [-C mb] [-l level] [-L file] [-w n] "
+                 "[-U host:port]... [host] [port]\n"
+                 "  -t, --threads N        number of reactors, 0 = one per "
+                 "core\n"
+                 "  -a, --pin-cpu          pin each reactor to a core\n"
+                 "  -s, --shared-listener  share one EPOLLEXCLUSIVE listener "
+                 "instead of SO_REUSEPORT\n"
+                 "  -u, --io-uring         use the io_uring backend\n"
+                 "  -k, --idle-timeout S   close keep-alive connections idle "
+                 "for S seconds (60)\n"
+                 "      --header-timeout S time to send a request header "
+                 "(10)\n"
+                 "      --body-timeout S   time to send a request body (30)\n"
+                 "  -c, --max-connections N  stop accepting at N open "
+                 "connections, resume at 90%\n"
+                 "  -r, --root DIR         serve static files from DIR\n"
+                 "  -C, --cache-size MB    cache GET/HEAD responses, MB per "
+                 "reactor\n"
+                 "      --cache-ttl S      keep cached responses S seconds "
+                 "(1)\n"
+                 "  -l, --log-level L      trace, debug, info (default), warn, "
+                 "error or off\n"
+                 "  -L, --access-log FILE  append one JSON line per response, "
+                 "- for stdout\n"
+                 "  -w, --workers N        threads for CPU-heavy handlers "
+                 "(2), 0 = run them inline\n"
+                 "      --worker-queue N   jobs queued or running before "
+                 "answering 503 (256)\n"
+                 "      --max-events N     most events per epoll_wait, the "
+                 "batch adapts below it (512)\n"
+                 "      --busy-poll US     poll for US microseconds before "
+                 "blocking, 0 = off\n"
+                 "  -U, --upstream HOST:PORT  proxy to this backend; "
+                 "repeat for more\n"
+                 "      --balance B        round-robin (default) or "
+                 "least-conn\n"
+                 "      --upstream-timeout S  wait S seconds for a backend "
+                 "to answer (30)\n"
+                 "      --upstream-connect-timeout S  connect timeout (2)\n"
+                 "      --upstream-keepalive N  idle backend connections "
+                 "kept per backend and reactor (32)\n",
+                 argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc) {
+    opts.m_host = argv[optind++];
+  }
+  if (optind < argc) {
+    opts.m_port = argv[optind++];
+  }
+
+  signal(SIGPIPE, SIG_IGN); // peers may close before we respond
   try {
-    server();
+    if (!opts.m_access_log.empty()) {
+      log_backend::instance().open_access_log(opts.m_access_log);
+    }
+    server(opts);
   } catch (const std::exception &e) {
-    fmt::print("Error: {}\n", e.what());
+    LOG_ERROR("Error: {}", e.what());
   };
   return 0;
 }
@@ -0,0 +1,68 @@
+#ifndef TEST_HPP
+#define TEST_HPP
+
+// Shared by the unit tests. Each test program is one translation unit that
+// defines its cases with TEST_CASE and calls run_tests() from main(); the
+// exit status is what ctest looks at.
+
+#include <fmt/core.h>
+#include <string_view>
+#include <vector>
+
+struct test_case {
+  std::string_view m_name;
+  void (*m_run)();
+};
+
+inline std::vector<test_case> &test_registry() {
+  static std::vector<test_case> cases;
+  return cases;
+}
+
+inline size_t g_test_failures = 0;
+
+inline bool test_register(std::string_view name, void (*run)()) {
+  test_registry().push_back({name, run});
+  return true;
+}
+
+#define TEST_CASE(name)                                                        \
+  static void name();                                                          \
+  [[maybe_unused]] static const bool name##_registered =                      \
+      test_register(#name, &name);                                             \
+  static void name()
+
+// reports a failure and carries on with the case
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fmt::print(stderr, "{}:{}: CHECK({}) failed\n", __FILE__, __LINE__,      \
+                 #cond);                                                       \
+      g_test_failures++;                                                       \
+    }                                                                          \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                         \
+  do {                                                                         \
+    auto &&_a = (a);                                                           \
+    auto &&_b = (b);                                                           \
+    if (!(_a == _b)) {                                                         \
+      fmt::print(stderr, "{}:{}: CHECK_EQ({}, {}) failed\n", __FILE__,         \
+                 __LINE__, #a, #b);                                            \
+      g_test_failures++;                                                       \
+    }                                                                          \
+  } while (0)
+
+inline int run_tests() {
+  for (const test_case &c : test_registry()) {
+    size_t before = g_test_failures;
+    c.m_run();
+    fmt::print("{} {}\n", g_test_failures == before ? "ok  " : "FAIL",
+               c.m_name);
+  }
+  fmt::print("{} cases, {} failed checks\n", test_registry().size(),
+             g_test_failures);
+  return g_test_failures == 0 ? 0 : 1;
+}
+
+#endif // TEST_HPP
@@ -0,0 +1,130 @@
+#include "hpack.hpp"
+#include "test.hpp"
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using field_list = std::vector<std::pair<std::string, std::string>>;
+
+static bool decode_block(hpack_decoder &dec, std::string_view block,
+                         field_list &out) {
+  out.clear();
+  return dec.decode(block, [&](std::string_view name, std::string_view value) {
+    out.emplace_back(name, value);
+  });
+}
+
+static std::string huffman(std::string_view s) {
+  bytes_buffer out;
+  huffman_encode(s, out);
+  return std::string(std::string_view(out));
+}
+
+TEST_CASE(huffman_rfc_example) {
+  // RFC 7541 C.4.1
+  std::string_view coded = "\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff";
+  CHECK_EQ(huffman("www.example.com"), std::string(coded));
+  std::string decoded;
+  CHECK(huffman_decode(coded, decoded));
+  CHECK_EQ(decoded, std::string("www.example.com"));
+}
+
+TEST_CASE(huffman_round_trip) {
+  std::string all;
+  for (int c = 0; c < 256; c++) {
+    all.push_back(static_cast<char>(c));
+  }
+  for (size_t len = 0; len <= all.size(); len += 17) {
+    std::string s = all.substr(all.size() - len);
+    std::string decoded;
+    CHECK(huffman_decode(huffman(s), decoded));
+    CHECK_EQ(decoded, s);
+  }
+}
+
+TEST_CASE(huffman_decode_errors) {
+  std::string out;
+  CHECK(huffman_decode("\x1f", out)); // 'a' and 3 bits of padding
+  CHECK_EQ(out, std::string("a"));
+  out.clear();
+  CHECK(!huffman_decode("\x18", out)); // padding not all ones
+  out.clear();
+  CHECK(!huffman_decode("\xff", out)); // 8 bits of padding
+  out.clear();
+  CHECK(!huffman_decode("\x1f\xff", out)); // 11 bits of padding
+  out.clear();
+  CHECK(!huffman_decode("\xff\xff\xff\xff", out)); // EOS
+}
+
+TEST_CASE(decode_rfc_requests) {
+  // RFC 7541 C.3.1 and C.4.1: the same request, plain and Huffman coded
+  hpack_decoder plain, coded;
+  field_list fields;
+  CHECK(decode_block(plain,
+                     "\x82\x86\x84\x41\x0f"
+                     "www.example.com",
+                     fields));
+  field_list expected = {{":method", "GET"},
+                         {":scheme", "http"},
+                         {":path", "/"},
+                         {":authority", "www.example.com"}};
+  CHECK(fields == expected);
+  CHECK(decode_block(coded,
+                     "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0"
+                     "\xab\x90\xf4\xff",
+                     fields));
+  CHECK(fields == expected);
+  // C.3.2: the authority now comes from the dynamic table
+  CHECK(decode_block(plain,
+                     "\x82\x86\x84\xbe\x58\x08"
+                     "no-cache",
+                     fields));
+  CHECK_EQ(fields.size(), size_t{5});
+  CHECK(fields[3] == field_list::value_type(":authority", "www.example.com"));
+  CHECK(fields[4] == field_list::value_type("cache-control", "no-cache"));
+}
+
+TEST_CASE(decode_errors) {
+  hpack_decoder dec;
+  field_list fields;
+  CHECK(!decode_block(dec, "\x80", fields));     // index 0
+  CHECK(!decode_block(dec, "\xff\x00", fields)); // past both tables
+  CHECK(!decode_block(dec, "\x41\x85", fields)); // string cut short
+  CHECK(!decode_block(dec, "\x41\x81\x18", fields)); // bad Huffman
+  CHECK(!decode_block(dec, "\x82\x20", fields)); // size update after a field
+  CHECK(!decode_block(dec, "\x3f\xe2\x1f", fields)); // over our setting
+  CHECK(!decode_block(dec, "\xff\xff\xff\xff\xff\xff\x7f", fields));
+}
+
+TEST_CASE(encoder_round_trip) {
+  hpack_encoder enc;
+  hpack_decoder dec;
+  field_list response = {{":status", "200"},
+                         {"server", "cpp_http"},
+                         {"content-type", "text/html;charset=utf-8"},
+                         {"content-length", "56"},
+                         {"date", "Fri, 16 Oct 2026 20:46:07 GMT"}};
+  size_t first_size = 0;
+  for (int round = 0; round < 3; round++) {
+    if (round == 2) { // the peer shrinks our table: a size update leads
+      enc.set_max_table_size(64);
+    }
+    bytes_buffer block;
+    enc.begin_block(block);
+    for (const auto &[name, value] : response) {
+      enc.encode(block, name, value, name != "content-length");
+    }
+    field_list fields;
+    CHECK(decode_block(dec, block, fields));
+    CHECK(fields == response);
+    if (round == 0) {
+      first_size = block.size();
+    } else if (round == 1) {
+      CHECK(block.size() < first_size / 2); // indexed the second time
+    }
+  }
+  CHECK(dec.m_table.m_max_size == 64);
+}
+
+int main() { return run_tests(); }
@@ -0,0 +1,113 @@
+#include "http2.hpp"
+#include "test.hpp"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+static std::string frame(h2_frame type, uint8_t flags, uint32_t id,
+                         std::string_view payload) {
+  std::string out;
+  for (int shift = 16; shift >= 0; shift -= 8) {
+    out.push_back(static_cast<char>(payload.size() >> shift));
+  }
+  out.push_back(static_cast<char>(type));
+  out.push_back(static_cast<char>(flags));
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(static_cast<char>(id >> shift));
+  }
+  out.append(payload);
+  return out;
+}
+
+// a client that has sent its preface and opened `streams` uploads
+static void open_uploads(h2_session &session, hpack_encoder &encoder,
+                         const std::vector<uint32_t> &streams) {
+  session.consume(k_h2_preface);
+  session.consume(frame(h2_frame::settings, 0, 0, {}));
+  for (uint32_t id : streams) {
+    bytes_buffer block;
+    encoder.begin_block(block);
+    encoder.encode(block, ":method", "POST");
+    encoder.encode(block, ":scheme", "http");
+    encoder.encode(block, ":path", "/upload");
+    encoder.encode(block, ":authority", "x");
+    session.consume(frame(h2_frame::headers, k_h2_end_headers, id,
+                          std::string_view(block)));
+  }
+}
+
+TEST_CASE(one_upload_fills_its_body) {
+  buffer_pool pool;
+  h2_session session(&pool);
+  hpack_encoder encoder;
+  open_uploads(session, encoder, {1});
+  // as a client would: only as much as both windows allow
+  std::string piece(h2_session::k_max_frame, 'u');
+  size_t sent = 0;
+  size_t total = 3 * h2_session::k_window;
+  while (sent < total) {
+    h2_stream *stream = session._find(1);
+    CHECK(stream != nullptr);
+    if (stream == nullptr ||
+        session.m_recv_window < int64_t(piece.size()) ||
+        stream->m_recv_window < int64_t(piece.size())) {
+      break;
+    }
+    sent += piece.size();
+    session.consume(frame(h2_frame::data, sent == total ? k_h2_end_stream : 0,
+                          1, piece));
+  }
+  CHECK_EQ(sent, total);
+  CHECK_EQ(session.m_buffered, total);
+  h2_stream *stream = session.next_request();
+  CHECK(stream != nullptr);
+  if (stream != nullptr) {
+    CHECK_EQ(stream->m_body.size(), total);
+  }
+  CHECK_EQ(session.m_buffered, size_t{0});
+}
+
+TEST_CASE(buffered_bodies_are_capped) {
+  buffer_pool pool;
+  h2_session session(&pool);
+  hpack_encoder encoder;
+  // each under k_max_body, together well over k_max_buffered
+  std::vector<uint32_t> streams = {1, 3, 5, 7};
+  open_uploads(session, encoder, streams);
+  std::string piece(h2_session::k_max_frame, 'u');
+  size_t each = h2_session::k_max_body - piece.size();
+  std::vector<size_t> sent(streams.size());
+  size_t peak = 0;
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (size_t i = 0; i < streams.size(); i++) {
+      h2_stream *stream = session._find(streams[i]);
+      if (stream == nullptr || sent[i] == each ||
+          session.m_recv_window < int64_t(piece.size()) ||
+          stream->m_recv_window < int64_t(piece.size())) {
+        continue;
+      }
+      sent[i] += piece.size();
+      session.consume(frame(h2_frame::data,
+                            sent[i] == each ? k_h2_end_stream : 0,
+                            streams[i], piece));
+      peak = std::max(peak, session.m_buffered);
+      progress = true;
+    }
+    while (h2_stream *stream = session.next_request()) {
+      stream->m_body.clear();
+    }
+  }
+  CHECK(!session.m_goaway_sent);
+  CHECK(peak <= h2_session::k_max_buffered);
+  // some were refused rather than every stream left without window
+  CHECK(session.m_streams.size() < streams.size());
+  for (auto &stream : session.m_streams) {
+    CHECK(stream->m_remote_closed);
+  }
+  CHECK_EQ(session.m_buffered, size_t{0});
+}
+
+int main() { return run_tests(); }
@@ -0,0 +1,277 @@
+#include "http_parser.hpp"
+#include "test.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+
+using request_parser = http_request_parser<>;
+
+struct parsed_request {
+  std::string m_method;
+  std::string m_url;
+  std::string m_body;
+};
+
+// Feeds `data` the way do_consume does: each finished request is recorded
+// and the rest of `data` starts the next one. False once framing is lost.
+static bool feed(request_parser &req, std::string_view data,
+                 std::vector<parsed_request> &out) {
+  while (!data.empty()) {
+    data.remove_prefix(req.push_chunk(data));
+    if (req.failed()) {
+      return false;
+    }
+    if (!req.request_finished()) {
+      break;
+    }
+    out.push_back({std::string(req.method()), std::string(req.url()),
+                   req.body()});
+    req.reset();
+  }
+  return true;
+}
+
+static std::string filler_fields(size_t n) {
+  std::string fields;
+  for (size_t i = 0; i < n; i++) {
+    fields += fmt::format("X-Filler-{}: a\r\n", i);
+  }
+  return fields;
+}
+
+TEST_CASE(header_field_limit) {
+  constexpr size_t max = header_view_table::k_max_headers;
+  request_parser req;
+  std::vector<parsed_request> out;
+  CHECK(feed(req, "GET / HTTP/1.1\r\n" + filler_fields(max) + "\r\n", out));
+  CHECK_EQ(out.size(), size_t{1});
+
+  // the field past the table must not be dropped: it frames the body
+  req.reset();
+  out.clear();
+  std::string smuggled = "POST / HTTP/1.1\r\n" + filler_fields(max) +
+                         "Content-Length: 5\r\n\r\nGET /";
+  CHECK(!feed(req, smuggled, out));
+  CHECK(req.failed());
+  CHECK(req.header_too_large());
+  CHECK(out.empty());
+}
+
+TEST_CASE(header_size_limit) {
+  constexpr size_t max = http11_zero_copy_parser::k_max_header_bytes;
+  request_parser req;
+  std::vector<parsed_request> out;
+  // never ends: fails once past the cap instead of buffering on
+  std::string endless = "GET / HTTP/1.1\r\nX-Big: " + std::string(2 * max, 'a');
+  std::string_view rest = endless;
+  while (!rest.empty() && !req.failed()) {
+    std::string_view piece = rest.substr(0, 1000);
+    rest.remove_prefix(piece.size());
+    feed(req, piece, out);
+  }
+  CHECK(req.failed());
+  CHECK(req.header_too_large());
+  CHECK(req.m_header_parser.m_buffer.size() <= max + 1000);
+
+  req.reset();
+  std::string big = "GET / HTTP/1.1\r\nX-Big: " + std::string(max, 'a') +
+                    "\r\n\r\n";
+  CHECK(!feed(req, big, out));
+  CHECK(req.header_too_large());
+
+  req.reset();
+  std::string fits = "GET / HTTP/1.1\r\nX-Big: " + std::string(max - 100, 'a') +
+                     "\r\n\r\n";
+  CHECK(feed(req, fits, out));
+  CHECK_EQ(out.size(), size_t{1});
+}
+
+TEST_CASE(content_length_invalid) {
+  for (std::string_view value : {"abc", "5abc", "-1", "+5", "", "5, 5",
+                                 "0x5", "99999999999999999999999"}) {
+    request_parser req;
+    std::vector<parsed_request> out;
+    std::string request = fmt::format(
+        "POST / HTTP/1.1\r\nContent-Length: {}\r\n\r\nhello", value);
+    CHECK(!feed(req, request, out));
+    CHECK(req.failed());
+    CHECK(!req.header_too_large());
+    CHECK(out.empty());
+  }
+}
+
+TEST_CASE(content_length_duplicates) {
+  request_parser req;
+  std::vector<parsed_request> out;
+  CHECK(!feed(req,
+              "POST / HTTP/1.1\r\nContent-Length: 5\r\n"
+              "content-length: 6\r\n\r\nhello!",
+              out));
+  CHECK(out.empty());
+
+  req.reset();
+  CHECK(feed(req,
+             "POST / HTTP/1.1\r\nContent-Length: 5\r\n"
+             "content-length: 5\r\n\r\nhello",
+             out));
+  CHECK_EQ(out.size(), size_t{1});
+  CHECK_EQ(out[0].m_body, std::string("hello"));
+
+  req.reset();
+  out.clear();
+  CHECK(feed(req, "POST / HTTP/1.1\r\nContent-Length: \t5 \r\n\r\nhello",
+             out));
+  CHECK_EQ(out.size(), size_t{1});
+  CHECK_EQ(out[0].m_body, std::string("hello"));
+}
+
+TEST_CASE(chunked_split_anywhere) {
+  std::string_view stream = "POST /up HTTP/1.1\r\n"
+                            "Transfer-Encoding: gzip, chunked\r\n\r\n"
+                            "5;name=value\r\nhello\r\n"
+                            "6\r\n world\r\n"
+                            "0\r\nX-Trailer: 1\r\nX-Other: 2\r\n\r\n"
+                            "GET /next HTTP/1.1\r\n\r\n";
+  for (size_t split = 1; split < stream.size(); split++) {
+    request_parser req;
+    std::vector<parsed_request> out;
+    CHECK(feed(req, stream.substr(0, split), out));
+    CHECK(feed(req, stream.substr(split), out));
+    CHECK_EQ(out.size(), size_t{2});
+    if (out.size() == 2) {
+      CHECK_EQ(out[0].m_body, std::string("hello world"));
+      CHECK_EQ(out[1].m_url, std::string("/next"));
+    }
+  }
+}
+
+TEST_CASE(chunked_trailers) {
+  auto ignore = [](std::string_view) {};
+  chunked_decoder dec;
+  std::string_view input = "0\r\nX-A: 1\r\nX-B: 2\r\n\r\nNEXT";
+  CHECK_EQ(dec.decode(input, ignore), input.size() - 4);
+  CHECK(dec.done());
+
+  dec.reset();
+  input = "0\n\nNEXT"; // bare LFs are tolerated
+  CHECK_EQ(dec.decode(input, ignore), input.size() - 4);
+  CHECK(dec.done());
+
+  dec.reset();
+  std::string long_trailer =
+      "0\r\nX-Long: " + std::string(chunked_decoder::k_max_trailer, 'a') +
+      "\r\n\r\n";
+  dec.decode(long_trailer, ignore);
+  CHECK(dec.failed());
+}
+
+TEST_CASE(chunked_limits) {
+  auto ignore = [](std::string_view) {};
+  for (std::string_view bad : {
+           "10000000001\r\n",       // over k_max_chunk
+           "zz\r\n",                // not hex
+           ";ext\r\n",              // no size
+           "5\r\nhelloX\r\n",       // no CRLF after the data
+           "5\rX",                  // CR without LF
+           "0\r\n\rX",              // bad final CRLF
+       }) {
+    chunked_decoder dec;
+    dec.decode(bad, ignore);
+    CHECK(dec.failed());
+  }
+
+  request_parser req;
+  std::vector<parsed_request> out;
+  CHECK(!feed(req,
+              "POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n",
+              out));
+}
+
+TEST_CASE(invalid_field_lines) {
+  using namespace std::string_view_literals;
+  for (std::string_view field : {
+           "Transfer-Encoding : chunked"sv, // whitespace before the colon
+           "Content-Length\t: 5"sv,
+           " Content-Length: 5"sv,         // obs-fold
+           "\tchunked"sv,
+           "X-Bad\"Name: 1"sv,             // not a token
+           ": empty name"sv,
+           "no colon at all"sv,
+           "X-Value: a\rb"sv,              // bare CR
+           "X-Value: a\0b"sv,              // NUL
+       }) {
+    request_parser req;
+    std::vector<parsed_request> out;
+    std::string request = "POST / HTTP/1.1\r\nX-Before: 1\r\n" +
+                          std::string(field) +
+                          "\r\nContent-Length: 0\r\n\r\n";
+    CHECK(!feed(req, request, out));
+    CHECK(req.failed());
+    CHECK(!req.header_too_large());
+    CHECK(out.empty());
+  }
+
+  // what tokens and values may hold
+  request_parser req;
+  std::vector<parsed_request> out;
+  CHECK(feed(req,
+             "GET / HTTP/1.1\r\nX-Ok_1.2~!#$%&'*+^`|: a \t\"b\" \x80\r\n\r\n",
+             out));
+  CHECK_EQ(out.size(), size_t{1});
+}
+
+TEST_CASE(pipelining_residual) {
+  std::string_view first = "GET /a HTTP/1.1\r\nHost: x\r\n\r\n";
+  std::string_view second = "POST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\n";
+  std::string_view partial = "GET /c HTTP/1.1\r\nHo";
+  std::string read = std::string(first) + std::string(second) + "abc" +
+                     std::string(partial);
+
+  request_parser req;
+  std::vector<parsed_request> out;
+  CHECK(feed(req, read, out));
+  CHECK_EQ(out.size(), size_t{2});
+  // only the unfinished request stays behind, nothing before it
+  CHECK(req.request_started());
+  CHECK_EQ(req.m_header_parser.m_buffer.size(), partial.size());
+
+  CHECK(feed(req, "st: x\r\n\r\n", out));
+  CHECK_EQ(out.size(), size_t{3});
+  if (out.size() == 3) {
+    CHECK_EQ(out[0].m_url, std::string("/a"));
+    CHECK_EQ(out[1].m_method, std::string("POST"));
+    CHECK_EQ(out[1].m_body, std::string("abc"));
+    CHECK_EQ(out[2].m_url, std::string("/c"));
+  }
+}
+
+TEST_CASE(header_only_copied) {
+  // the body and the next request are left to the caller
+  std::string_view head = "POST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\n";
+  std::string read = std::string(head) + "abcGET /c HTTP/1.1\r\n\r\n";
+  request_parser req;
+  CHECK_EQ(req.push_chunk(read), head.size() + 3);
+  CHECK(req.request_finished());
+  CHECK_EQ(req.m_header_parser.m_buffer.size(), head.size());
+  CHECK_EQ(req.body(), std::string("abc"));
+}
+
+TEST_CASE(pipelining_byte_by_byte) {
+  std::string_view stream = "\r\nGET /a HTTP/1.1\r\nHost: x\r\n\r\n"
+                            "POST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"
+                            "GET /c HTTP/1.1\nHost: x\n\n";
+  request_parser req;
+  std::vector<parsed_request> out;
+  for (char c : stream) {
+    CHECK(feed(req, std::string_view(&c, 1), out));
+  }
+  CHECK_EQ(out.size(), size_t{3});
+  if (out.size() == 3) {
+    CHECK_EQ(out[0].m_url, std::string("/a"));
+    CHECK_EQ(out[1].m_body, std::string("abc"));
+    CHECK_EQ(out[2].m_url, std::string("/c"));
+  }
+  CHECK(!req.request_started());
+}
+
+int main() { return run_tests(); }
@@ -0,0 +1,147 @@
+#include "test.hpp"
+#include "timer_wheel.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+// The wheel reads the steady clock; moving its origin back makes time pass
+// without sleeping.
+static void elapse(timer_wheel &wheel, uint64_t ms) {
+  wheel.m_origin -= std::chrono::milliseconds(ms);
+  wheel.advance();
+}
+
+struct probe : timer {
+  timer_wheel *m_owner = nullptr;
+  std::vector<uint64_t> *m_log = nullptr;
+  uint64_t m_fired_at = 0; // the wheel's tick when it fired
+  size_t m_fired = 0;
+  size_t m_repeat = 0; // times to schedule itself again
+
+  probe() : timer(&probe::_fire) {}
+
+  static void _fire(timer *self) {
+    auto p = static_cast<probe *>(self);
+    p->m_fired_at = p->m_owner->m_now;
+    p->m_fired++;
+    if (p->m_log) {
+      p->m_log->push_back(p->m_expiry);
+    }
+    if (p->m_repeat > 0) {
+      p->m_repeat--;
+      p->m_owner->schedule(*p, 10ms);
+    }
+  }
+};
+
+TEST_CASE(next_timeout_bounds) {
+  timer_wheel wheel;
+  CHECK_EQ(wheel.next_timeout(), -1);
+  probe a;
+  a.m_owner = &wheel;
+  wheel.schedule(a, 100ms);
+  int wait = wheel.next_timeout();
+  CHECK(wait > 0 && wait <= 100);
+  probe b;
+  b.m_owner = &wheel;
+  wheel.schedule(b, 10ms);
+  wait = wheel.next_timeout();
+  CHECK(wait > 0 && wait <= 10);
+  wheel.cancel(b);
+  CHECK(wheel.next_timeout() > 0);
+  wheel.cancel(a);
+  CHECK_EQ(wheel.next_timeout(), -1);
+  CHECK(wheel.empty());
+}
+
+// Every timer fires on its expiry tick, never early or late, whichever
+// levels it cascades through. The loop sleeps as long as next_timeout()
+// says, as io_context does.
+TEST_CASE(cascade_fires_on_time) {
+  const uint64_t delays[] = {1,     2,      63,     64,      65,
+                             127,   4095,   4096,   4097,    5000,
+                             65536, 262143, 262144, 262145,  300000,
+                             1u << 20};
+  timer_wheel wheel;
+  std::vector<std::unique_ptr<probe>> probes;
+  for (uint64_t delay : delays) {
+    auto p = std::make_unique<probe>();
+    p->m_owner = &wheel;
+    wheel.schedule(*p, std::chrono::milliseconds(delay));
+    probes.push_back(std::move(p));
+  }
+  size_t wakeups = 0;
+  while (!wheel.empty()) {
+    int wait = wheel.next_timeout();
+    CHECK(wait >= 0);
+    elapse(wheel, static_cast<uint64_t>(wait > 0 ? wait : 1));
+    wakeups++;
+  }
+  for (const auto &p : probes) {
+    CHECK_EQ(p->m_fired, size_t{1});
+    CHECK_EQ(p->m_fired_at, p->m_expiry);
+  }
+  // far fewer wake-ups than milliseconds: the levels above 0 are skipped
+  CHECK(wakeups < 1000);
+}
+
+TEST_CASE(beyond_range) {
+  timer_wheel wheel;
+  probe p;
+  p.m_owner = &wheel;
+  wheel.schedule(p, std::chrono::milliseconds(timer_wheel::k_range + 5));
+  elapse(wheel, timer_wheel::k_range - 10);
+  CHECK_EQ(p.m_fired, size_t{0});
+  elapse(wheel, 100);
+  CHECK_EQ(p.m_fired, size_t{1});
+  CHECK_EQ(p.m_fired_at, p.m_expiry);
+}
+
+TEST_CASE(late_wakeup_fires_in_order) {
+  timer_wheel wheel;
+  std::vector<uint64_t> log;
+  std::vector<std::unique_ptr<probe>> probes;
+  for (uint64_t delay : {700u, 5u, 300u, 64u, 4100u, 70u}) {
+    auto p = std::make_unique<probe>();
+    p->m_owner = &wheel;
+    p->m_log = &log;
+    wheel.schedule(*p, std::chrono::milliseconds(delay));
+    probes.push_back(std::move(p));
+  }
+  elapse(wheel, 10000);
+  CHECK_EQ(log.size(), probes.size());
+  for (size_t i = 1; i < log.size(); i++) {
+    CHECK(log[i - 1] <= log[i]);
+  }
+}
+
+TEST_CASE(reschedule_and_cancel) {
+  timer_wheel wheel;
+  probe periodic;
+  periodic.m_owner = &wheel;
+  periodic.m_repeat = 4;
+  wheel.schedule(periodic, 10ms);
+  probe cancelled;
+  cancelled.m_owner = &wheel;
+  wheel.schedule(cancelled, 20ms);
+  wheel.cancel(cancelled);
+  for (int i = 0; i < 10; i++) {
+    elapse(wheel, 10);
+  }
+  CHECK_EQ(periodic.m_fired, size_t{5});
+  CHECK_EQ(cancelled.m_fired, size_t{0});
+  CHECK(wheel.empty());
+
+  {
+    probe scoped; // unlinks itself when destroyed
+    scoped.m_owner = &wheel;
+    wheel.schedule(scoped, 5ms);
+    CHECK_EQ(wheel.size(), size_t{1});
+  }
+  CHECK(wheel.empty());
+}
+
+int main() { return run_tests(); }
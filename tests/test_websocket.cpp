@@ -0,0 +1,211 @@
+#include "test.hpp"
+#include "websocket.hpp"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+static const unsigned char k_key[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+static std::string mask_bytewise(std::string_view in, uint64_t offset) {
+  std::string out(in);
+  for (size_t i = 0; i < out.size(); i++) {
+    out[i] = static_cast<char>(out[i] ^ k_key[(offset + i) % 4]);
+  }
+  return out;
+}
+
+// a frame as a client sends it: masked with k_key
+static std::string client_frame(ws_opcode opcode, std::string_view payload,
+                                bool fin = true, uint8_t rsv = 0) {
+  std::string frame;
+  frame.push_back(static_cast<char>((fin ? 0x80 : 0) | rsv |
+                                    static_cast<uint8_t>(opcode)));
+  if (payload.size() < 126) {
+    frame.push_back(static_cast<char>(0x80 | payload.size()));
+  } else if (payload.size() <= 0xffff) {
+    frame.push_back(static_cast<char>(0x80 | 126));
+    frame.push_back(static_cast<char>(payload.size() >> 8));
+    frame.push_back(static_cast<char>(payload.size()));
+  } else {
+    frame.push_back(static_cast<char>(0x80 | 127));
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      frame.push_back(static_cast<char>(uint64_t(payload.size()) >> shift));
+    }
+  }
+  frame.append(reinterpret_cast<const char *>(k_key), 4);
+  frame += mask_bytewise(payload, 0);
+  return frame;
+}
+
+using message_list = std::vector<std::pair<ws_opcode, std::string>>;
+
+static bool push(ws_frame_parser &parser, std::string_view data,
+                 message_list &out) {
+  return parser.push(data, [&](ws_opcode opcode, std::string_view payload) {
+    out.emplace_back(opcode, payload);
+  });
+}
+
+TEST_CASE(accept_key) {
+  // RFC 6455 1.3
+  CHECK_EQ(ws_accept_key("dGhlIHNhbXBsZSBub25jZQ=="),
+           std::string("s3pPLMBiTxaQ9kYGzzhZRbK+xOo="));
+}
+
+TEST_CASE(mask_matches_bytewise) {
+  std::string data;
+  for (size_t i = 0; i < 300; i++) {
+    data.push_back(static_cast<char>(i * 7 + 3));
+  }
+  std::vector<ws_mask_fn> variants = {&ws_mask_scalar, _resolve_ws_mask()};
+#if CO_HTTP_SIMD_X86
+  variants.push_back(&ws_mask_sse2);
+#endif
+  for (size_t len = 0; len <= 130; len++) {
+    // odd starts leave the loads unaligned
+    for (size_t start : {size_t{0}, size_t{1}, size_t{3}}) {
+      std::string_view in = std::string_view(data).substr(start, len);
+      for (uint64_t offset = 0; offset < 4; offset++) {
+        std::string expected = mask_bytewise(in, offset);
+        std::string out(len, '\0');
+        ws_mask(out.data(), in.data(), len, k_key, offset);
+        CHECK_EQ(out, expected);
+        unsigned char rotated[4];
+        for (size_t j = 0; j < 4; j++) {
+          rotated[j] = k_key[(offset + j) % 4];
+        }
+        uint32_t packed;
+        std::memcpy(&packed, rotated, 4);
+        for (ws_mask_fn fn : variants) {
+          std::string each(len, '\0');
+          fn(each.data(), in.data(), len, packed);
+          CHECK_EQ(each, expected);
+        }
+      }
+    }
+  }
+  // in place
+  std::string buffer(data);
+  ws_mask(buffer.data(), buffer.data(), buffer.size(), k_key, 0);
+  CHECK_EQ(buffer, mask_bytewise(data, 0));
+}
+
+TEST_CASE(utf8) {
+  CHECK(utf8_valid(""));
+  CHECK(utf8_valid("plain ascii, longer than one word"));
+  CHECK(utf8_valid("\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80"));
+  CHECK(!utf8_valid("\xc0\xaf"));         // overlong
+  CHECK(!utf8_valid("\xed\xa0\x80"));     // surrogate
+  CHECK(!utf8_valid("\xf4\x90\x80\x80")); // above U+10FFFF
+  CHECK(!utf8_valid("\xe2\x82"));         // cut short
+  CHECK(!utf8_valid("abcdefgh\x80"));     // stray continuation
+}
+
+TEST_CASE(fragmented_with_control_between) {
+  std::string stream = client_frame(ws_opcode::text, "hello", false) +
+                       client_frame(ws_opcode::ping, "p") +
+                       client_frame(ws_opcode::continuation, " wor", false) +
+                       client_frame(ws_opcode::continuation, "ld") +
+                       client_frame(ws_opcode::binary, std::string(70000, 'b'));
+  message_list expected = {{ws_opcode::ping, "p"},
+                           {ws_opcode::text, "hello world"},
+                           {ws_opcode::binary, std::string(70000, 'b')}};
+  // whole, then split at every byte of the first frames
+  for (size_t split = 0; split < 60; split++) {
+    ws_frame_parser parser;
+    message_list out;
+    CHECK(push(parser, std::string_view(stream).substr(0, split), out));
+    CHECK(push(parser, std::string_view(stream).substr(split), out));
+    CHECK(out == expected);
+  }
+  ws_frame_parser parser;
+  message_list out;
+  for (char c : stream) {
+    CHECK(push(parser, std::string_view(&c, 1), out));
+  }
+  CHECK(out == expected);
+}
+
+TEST_CASE(text_checked_after_joining) {
+  // a code point split between fragments is fine
+  ws_frame_parser parser;
+  message_list out;
+  CHECK(push(parser,
+             client_frame(ws_opcode::text, "\xe2\x82", false) +
+                 client_frame(ws_opcode::continuation, "\xac"),
+             out));
+  CHECK_EQ(out.size(), size_t{1});
+
+  ws_frame_parser bad;
+  CHECK(!push(bad, client_frame(ws_opcode::text, "ok\xff"), out));
+  CHECK(bad.m_error == ws_close::invalid_data);
+}
+
+TEST_CASE(protocol_errors) {
+  auto fails_with = [](std::string_view stream, ws_close code) {
+    ws_frame_parser parser;
+    message_list out;
+    return !push(parser, stream, out) && parser.m_error == code;
+  };
+  // continuation with nothing to continue
+  CHECK(fails_with(client_frame(ws_opcode::continuation, "x"),
+                   ws_close::protocol_error));
+  // a new message before the last one ended
+  CHECK(fails_with(client_frame(ws_opcode::text, "a", false) +
+                       client_frame(ws_opcode::text, "b"),
+                   ws_close::protocol_error));
+  // fragmented or oversized control frames
+  CHECK(fails_with(client_frame(ws_opcode::ping, "x", false),
+                   ws_close::protocol_error));
+  CHECK(fails_with(client_frame(ws_opcode::ping, std::string(126, 'x')),
+                   ws_close::protocol_error));
+  // RSV bits without an extension, unknown opcode
+  CHECK(fails_with(client_frame(ws_opcode::text, "x", true, 0x40),
+                   ws_close::protocol_error));
+  CHECK(fails_with(client_frame(static_cast<ws_opcode>(3), "x"),
+                   ws_close::protocol_error));
+  // unmasked: fails on the second byte, without waiting for a key
+  CHECK(fails_with("\x81\x05", ws_close::protocol_error));
+  // close codes that may not be sent, and a cut-short one
+  CHECK(fails_with(client_frame(ws_opcode::close, "\x03\xed"), // 1005
+                   ws_close::protocol_error));
+  CHECK(fails_with(client_frame(ws_opcode::close, "\x03"),
+                   ws_close::protocol_error));
+  CHECK(fails_with(client_frame(ws_opcode::close, "\x03\xe8\xff"),
+                   ws_close::invalid_data));
+  // over k_max_message, known from the header alone
+  std::string huge = "\x82\xff";
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    huge.push_back(static_cast<char>(
+        uint64_t(ws_frame_parser::k_max_message + 1) >> shift));
+  }
+  huge.append(reinterpret_cast<const char *>(k_key), 4);
+  CHECK(fails_with(huge, ws_close::too_big));
+}
+
+TEST_CASE(close_frames) {
+  ws_frame_parser parser;
+  message_list out;
+  CHECK(push(parser, client_frame(ws_opcode::close, ""), out));
+  CHECK(push(parser, client_frame(ws_opcode::close, "\x03\xe8" "bye"), out));
+  CHECK_EQ(out.size(), size_t{2});
+}
+
+TEST_CASE(server_frames) {
+  for (size_t len : {size_t{0}, size_t{125}, size_t{126}, size_t{65535},
+                     size_t{65536}}) {
+    bytes_buffer out;
+    ws_write_frame(out, ws_opcode::binary, std::string(len, 'z'));
+    size_t header = len < 126 ? 2 : len <= 0xffff ? 4 : 10;
+    CHECK_EQ(out.size(), header + len);
+    CHECK_EQ(static_cast<uint8_t>(out.data()[0]), 0x82);
+    CHECK((static_cast<uint8_t>(out.data()[1]) & 0x80) == 0); // unmasked
+  }
+  ws_shared_frame frame = make_ws_frame(ws_opcode::text, "hi");
+  CHECK_EQ(std::string_view(*frame), std::string_view("\x81\x02hi"));
+}
+
+int main() { return run_tests(); }